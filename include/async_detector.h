@@ -0,0 +1,103 @@
+#pragma once
+
+#ifndef __ASYNC_DETECTOR_H__
+#define __ASYNC_DETECTOR_H__
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "mtcnn.h"
+
+// Runs MTCNN for many concurrent callers. P-Net runs per frame on its own
+// threads, while the R-Net and O-Net crops of every frame in flight are pooled
+// and processed in batches, so one pass over a stage's weights serves many
+// frames and small frames don't each pay a full thread hand-off per stage.
+//
+// ncnn has no batch dimension, so a batch is a run of single-crop extractions
+// on one batch thread; batch threads run side by side.
+class AsyncDetector {
+public:
+    struct Options
+    {
+        Options();
+
+        int pnet_threads;   // Frames in P-Net at once, one detector each
+        int batch_threads;  // Threads running R-Net and O-Net batches
+        int max_batch;      // Most crops in one batch
+        int max_wait_us;    // Longest a crop waits for its batch to fill
+        int ncnn_threads;   // Threads of each ncnn extractor, 0 for the ncnn default
+        int min_face;
+        DetectMode mode;
+        std::vector<int> pnet_cpus;     // CPUs of the P-Net threads, empty for any
+        std::vector<int> batch_cpus;    // CPUs of the batch threads, empty for any
+    };
+
+    struct Statistics
+    {
+        uint64_t frames;
+        uint64_t batches;
+        uint64_t crops;
+        uint64_t max_batch;
+    };
+
+    AsyncDetector(const string &model_path, const Options &options = Options());
+    ~AsyncDetector();
+
+    // Queues an RGB frame for detection. Like MTCNN::detect(), the frame is
+    // normalized in place, so the caller must not reuse its data.
+    std::future<std::vector<Bbox>> submit(ncnn::Mat frame);
+
+    Statistics GetStatistics() const;
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    struct Job
+    {
+        ncnn::Mat img;
+        std::promise<std::vector<Bbox>> promise;
+        std::vector<Bbox> boxes;       // Candidates of the current stage
+        std::vector<char> accepted;
+        std::atomic<size_t> pending;
+    };
+
+    struct Task
+    {
+        std::shared_ptr<Job> job;
+        size_t index;
+        Clock::time_point queued;
+    };
+
+    void RunPNet(MTCNN &detector);
+    void RunBatches();
+    void Enqueue(const std::shared_ptr<Job> &job, int stage);
+    void FinishStage(const std::shared_ptr<Job> &job, int stage);
+
+    const Options options_;
+    std::vector<std::unique_ptr<MTCNN>> detectors_;
+
+    std::mutex frame_mutex_;
+    std::condition_variable frame_cv_;
+    std::deque<std::shared_ptr<Job>> frames_;
+    bool stop_frames_;
+
+    std::mutex task_mutex_;
+    std::condition_variable task_cv_;
+    std::deque<Task> tasks_[2];        // R-Net and O-Net crops
+    int active_batches_;
+    bool stop_tasks_;
+
+    std::atomic<uint64_t> frame_count_, batch_count_, crop_count_, max_batch_;
+
+    std::vector<std::thread> pnet_threads_, batch_threads_;
+};
+
+#endif //__ASYNC_DETECTOR_H__
@@ -0,0 +1,55 @@
+#pragma once
+
+#ifndef __CPU_TOPOLOGY_H__
+#define __CPU_TOPOLOGY_H__
+
+#include <string>
+#include <vector>
+
+// The CPU clusters of the machine, read from Linux cpufreq. On big.LITTLE SoCs
+// such as the RK3399 (2x A72 + 4x A53) every cluster has its own maximum
+// frequency, which is how the clusters are told apart; CPUs without cpufreq
+// fall back to cpu_capacity, and failing that form a single cluster.
+class CpuTopology {
+public:
+    struct Cluster
+    {
+        std::vector<int> cpus;
+        long max_freq_khz;      // 0 if unknown
+        long capacity;          // Relative to 1024 for the fastest CPU, 0 if unknown
+    };
+
+    static CpuTopology Detect(const std::string &sysfs = "/sys/devices/system/cpu");
+
+    // Fastest first
+    const std::vector<Cluster>& GetClusters() const { return clusters; }
+    bool IsHeterogeneous() const { return clusters.size() > 1; }
+
+    std::vector<int> Big() const;
+    std::vector<int> Little() const;
+    std::vector<int> All() const;
+
+    // Parses "big", "little", "all" or a list such as "0-1,4" into CPU numbers
+    bool Parse(const std::string &spec, std::vector<int> &cpus) const;
+
+    // For example "2x 1800MHz (4-5), 4x 1416MHz (0-3)"
+    std::string Describe() const;
+
+private:
+    std::vector<Cluster> clusters;
+};
+
+// Formats CPU numbers as a list such as "0-1,4"
+std::string FormatCpuList(const std::vector<int> &cpus);
+
+// Restricts the calling thread to cpus, or lets it run anywhere if cpus is
+// empty. Threads it starts afterwards inherit the restriction.
+bool SetThreadAffinity(const std::vector<int> &cpus);
+std::vector<int> GetThreadAffinity();
+
+// Restricts the calling thread and the OpenMP threads it runs ncnn layers on,
+// a team of the given size, to cpus. OpenMP keeps its threads between parallel
+// regions, so they stay in place until this is called again.
+bool SetOpenMpAffinity(const std::vector<int> &cpus, int threads);
+
+#endif //__CPU_TOPOLOGY_H__
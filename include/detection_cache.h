@@ -0,0 +1,77 @@
+#pragma once
+
+#ifndef __DETECTION_CACHE_H__
+#define __DETECTION_CACHE_H__
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "mtcnn.h"
+
+// Least recently used cache of detection results keyed on image content, for
+// duplicate stills and frozen video frames.
+//
+// Images are matched on an exact 64-bit hash of their pixels and size, and
+// optionally on a 64-bit difference hash of a 9x8 luma thumbnail, which also
+// matches re-encoded copies of the same size; that match scans every entry.
+// Results depend on the detector settings, so the cache must be cleared when
+// they change. All methods are thread-safe.
+class DetectionCache {
+public:
+    struct Key
+    {
+        uint64_t exact;
+        uint64_t perceptual;
+        int width;
+        int height;
+    };
+
+    struct Statistics
+    {
+        uint64_t hits;
+        uint64_t perceptual_hits;
+        uint64_t misses;
+        uint64_t evictions;
+        size_t entries;
+        size_t bytes;
+    };
+
+    // maxPerceptualDistance is the largest number of differing difference
+    // hash bits still treated as the same image, or -1 to match exactly only
+    explicit DetectionCache(size_t maxBytes, int maxPerceptualDistance = -1);
+
+    // Hashes an image of 1 (luma) or 3 (RGB or BGR) interleaved channels
+    Key MakeKey(const unsigned char *pixels, int width, int height, int stride, int channels) const;
+
+    bool Lookup(const Key &key, std::vector<Bbox> &boxes);
+    void Insert(const Key &key, const std::vector<Bbox> &boxes);
+    void Clear();
+
+    Statistics GetStatistics() const;
+
+private:
+    struct Entry
+    {
+        Key key;
+        std::vector<Bbox> boxes;
+        size_t bytes;
+    };
+    typedef std::list<Entry> EntryList;
+
+    void Evict();
+
+    const size_t max_bytes;
+    const int max_distance;
+
+    mutable std::mutex mutex;
+    EntryList entries;                  // Most recently used first
+    std::unordered_map<uint64_t, EntryList::iterator> index;
+    size_t bytes;
+    uint64_t hits, perceptual_hits, misses, evictions;
+};
+
+#endif //__DETECTION_CACHE_H__
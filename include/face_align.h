@@ -0,0 +1,60 @@
+#pragma once
+
+#ifndef __FACE_ALIGN_H__
+#define __FACE_ALIGN_H__
+
+#include <cstddef>
+#include <vector>
+
+#include "mtcnn.h"
+
+// Similarity transform from aligned crop coordinates to source image coordinates:
+//   x_src = a * x - b * y + tx
+//   y_src = b * x + a * y + ty
+struct AlignTransform
+{
+    float a;
+    float b;
+    float tx;
+    float ty;
+};
+
+// Warps detected faces to the canonical ArcFace 112x112 landmark template, or
+// to the same template scaled to another crop size.
+//
+// All faces of a frame are sampled in one call, straight from the source image,
+// into a contiguous batch of count * size * size * 3 bytes of packed RGB (or
+// BGR) crops, ready to be wrapped by ncnn::Mat::from_pixels for a recognition
+// net. Samples outside the source image replicate its edge pixels.
+class FaceAligner {
+public:
+    enum SourceFormat {
+        SOURCE_RGB,
+        SOURCE_BGR,
+        SOURCE_NV12
+    };
+
+    explicit FaceAligner(int size = 112, bool bgr_output = false);
+
+    int GetSize() const { return size; }
+    size_t GetCropBytes() const { return static_cast<size_t>(size) * size * 3; }
+
+    // Least squares similarity fit of the template to the five landmarks
+    AlignTransform Estimate(const face_landmark &landmark) const;
+
+    // Aligns faces from a packed RGB or BGR image; batch holds faces.size() crops
+    void Align(const unsigned char *pixels, int width, int height, int stride, SourceFormat format,
+               const std::vector<Bbox> &faces, unsigned char *batch) const;
+
+    // Aligns faces from an NV12 image, converting BT.601 limited range to RGB
+    void AlignNv12(const unsigned char *y_plane, int y_stride, const unsigned char *uv_plane, int uv_stride,
+                   int width, int height, const std::vector<Bbox> &faces, unsigned char *batch) const;
+
+private:
+    int size;
+    bool bgr_output;
+    float template_x[5];
+    float template_y[5];
+};
+
+#endif //__FACE_ALIGN_H__
@@ -0,0 +1,220 @@
+#pragma once
+
+#ifndef __FIXED_KERNELS_H__
+#define __FIXED_KERNELS_H__
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "mat.h"
+#include "mtcnn.h"
+
+// Kernels specialised for the fixed geometry of the cascade: P-Net's stride
+// and cell size, and the 24x24 and 48x48 inputs of R-Net and O-Net. The sizes
+// are template arguments, so coefficient tables live on the stack and the
+// inner loops have constant trip counts the compiler can unroll.
+
+static const int PNET_STRIDE = 2;
+static const int PNET_CELL = 12;
+static const int RNET_SIZE = 24;
+static const int ONET_SIZE = 48;
+
+// Resamples the w x h crop at (x, y) of src to OUT_W x OUT_H, giving the same
+// result as copy_cut_border followed by ncnn's resize_bilinear without
+// copying the crop first. The crop must lie inside src and be at least 2x2.
+template <int OUT_W, int OUT_H>
+void ResizeCropBilinear(const ncnn::Mat &src, int x, int y, int w, int h, ncnn::Mat &dst)
+{
+    dst.create(OUT_W, OUT_H, src.c);
+
+    // The same coefficients resize_bilinear computes, in the same precision
+    int xofs[OUT_W], yofs[OUT_H];
+    float alpha[OUT_W * 2], beta[OUT_H * 2];
+    const double scale_x = (double)w / OUT_W;
+    const double scale_y = (double)h / OUT_H;
+    for (int dx = 0; dx < OUT_W; dx++) {
+        float fx = (float)((dx + 0.5) * scale_x - 0.5);
+        int sx = (int)floor(fx);
+        fx -= sx;
+        if (sx < 0) {
+            sx = 0;
+            fx = 0.f;
+        }
+        if (sx >= w - 1) {
+            sx = w - 2;
+            fx = 1.f;
+        }
+        xofs[dx] = sx;
+        alpha[dx * 2] = 1.f - fx;
+        alpha[dx * 2 + 1] = fx;
+    }
+    for (int dy = 0; dy < OUT_H; dy++) {
+        float fy = (float)((dy + 0.5) * scale_y - 0.5);
+        int sy = (int)floor(fy);
+        fy -= sy;
+        if (sy < 0) {
+            sy = 0;
+            fy = 0.f;
+        }
+        if (sy >= h - 1) {
+            sy = h - 2;
+            fy = 1.f;
+        }
+        yofs[dy] = sy;
+        beta[dy * 2] = 1.f - fy;
+        beta[dy * 2 + 1] = fy;
+    }
+
+    float rows0[OUT_W], rows1[OUT_W];
+    for (int q = 0; q < src.c; q++) {
+        const float *plane = (const float*)src.data + src.cstep * q + (size_t)y * src.w + x;
+        float *out = (float*)dst.data + dst.cstep * q;
+
+        // Horizontally resampled source rows are kept while consecutive output
+        // rows share them
+        int prev_sy = -2;
+        for (int dy = 0; dy < OUT_H; dy++) {
+            const int sy = yofs[dy];
+            if (sy != prev_sy) {
+                const float *s0 = plane + (size_t)sy * src.w;
+                const float *s1 = s0 + src.w;
+                if (sy == prev_sy + 1) {
+                    for (int dx = 0; dx < OUT_W; dx++)
+                        rows0[dx] = rows1[dx];
+                } else {
+                    for (int dx = 0; dx < OUT_W; dx++)
+                        rows0[dx] = s0[xofs[dx]] * alpha[dx * 2] + s0[xofs[dx] + 1] * alpha[dx * 2 + 1];
+                }
+                for (int dx = 0; dx < OUT_W; dx++)
+                    rows1[dx] = s1[xofs[dx]] * alpha[dx * 2] + s1[xofs[dx] + 1] * alpha[dx * 2 + 1];
+                prev_sy = sy;
+            }
+
+            const float b0 = beta[dy * 2];
+            const float b1 = beta[dy * 2 + 1];
+            for (int dx = 0; dx < OUT_W; dx++)
+                out[dx] = rows0[dx] * b0 + rows1[dx] * b1;
+            out += OUT_W;
+        }
+    }
+}
+
+// Source taps and weight of the second one for sampling position f of a line
+// of size samples, repeating the edge samples beyond it
+static inline void LinearTaps(float f, int size, int &i0, int &i1, float &weight)
+{
+    int i = (int)floor(f);
+    weight = f - i;
+    if (i < 0) {
+        i = 0;
+        weight = 0.f;
+    }
+    if (i >= size - 1) {
+        i = size - 1;
+        weight = 0.f;
+    }
+    i0 = i;
+    i1 = std::min(i + 1, size - 1);
+}
+
+// Resamples the w x h crop at (x, y) of a YUV 4:2:0 image to an OUT_W x OUT_H
+// RGB image with values 0-255, as from_pixels would give for the converted
+// crop. Chroma is sampled at its own resolution and the colours converted
+// after resampling, with the BT.601 video-range coefficients OpenCV uses for
+// the analytics image. Parts of the crop outside the image repeat its edge.
+template <int OUT_W, int OUT_H>
+void ResizeCropYuv420(const Yuv420Image &src, int x, int y, int w, int h, ncnn::Mat &dst)
+{
+    dst.create(OUT_W, OUT_H, 3);
+    w = std::max(w, 1);
+    h = std::max(h, 1);
+
+    const int chroma_w = (src.width + 1) / 2;
+    const int chroma_h = (src.height + 1) / 2;
+    int yx0[OUT_W], yx1[OUT_W], cx0[OUT_W], cx1[OUT_W];
+    float ya[OUT_W], ca[OUT_W];
+    const double scale_x = (double)w / OUT_W;
+    const double scale_y = (double)h / OUT_H;
+    for (int dx = 0; dx < OUT_W; dx++) {
+        const float fx = (float)(x + (dx + 0.5) * scale_x - 0.5);
+        LinearTaps(fx, src.width, yx0[dx], yx1[dx], ya[dx]);
+        LinearTaps((fx + 0.5f) * 0.5f - 0.5f, chroma_w, cx0[dx], cx1[dx], ca[dx]);
+    }
+
+    float *r = dst.channel(0);
+    float *g = dst.channel(1);
+    float *b = dst.channel(2);
+    for (int dy = 0; dy < OUT_H; dy++) {
+        const float fy = (float)(y + (dy + 0.5) * scale_y - 0.5);
+        int y0, y1, c0, c1;
+        float yb, cb;
+        LinearTaps(fy, src.height, y0, y1, yb);
+        LinearTaps((fy + 0.5f) * 0.5f - 0.5f, chroma_h, c0, c1, cb);
+        const unsigned char *l0 = src.y + (size_t)y0 * src.y_stride;
+        const unsigned char *l1 = src.y + (size_t)y1 * src.y_stride;
+        const unsigned char *u0 = src.u + (size_t)c0 * src.uv_stride;
+        const unsigned char *u1 = src.u + (size_t)c1 * src.uv_stride;
+        const unsigned char *v0 = src.v + (size_t)c0 * src.uv_stride;
+        const unsigned char *v1 = src.v + (size_t)c1 * src.uv_stride;
+
+        for (int dx = 0; dx < OUT_W; dx++) {
+            const float luma0 = l0[yx0[dx]] + (l0[yx1[dx]] - l0[yx0[dx]]) * ya[dx];
+            const float luma1 = l1[yx0[dx]] + (l1[yx1[dx]] - l1[yx0[dx]]) * ya[dx];
+            const float u_0 = u0[cx0[dx]] + (u0[cx1[dx]] - u0[cx0[dx]]) * ca[dx];
+            const float u_1 = u1[cx0[dx]] + (u1[cx1[dx]] - u1[cx0[dx]]) * ca[dx];
+            const float v_0 = v0[cx0[dx]] + (v0[cx1[dx]] - v0[cx0[dx]]) * ca[dx];
+            const float v_1 = v1[cx0[dx]] + (v1[cx1[dx]] - v1[cx0[dx]]) * ca[dx];
+            const float luma = 1.164f * (luma0 + (luma1 - luma0) * yb - 16.f);
+            const float u = u_0 + (u_1 - u_0) * cb - 128.f;
+            const float v = v_0 + (v_1 - v_0) * cb - 128.f;
+            r[dx] = std::min(std::max(luma + 1.596f * v, 0.f), 255.f);
+            g[dx] = std::min(std::max(luma - 0.813f * v - 0.391f * u, 0.f), 255.f);
+            b[dx] = std::min(std::max(luma + 2.018f * u, 0.f), 255.f);
+        }
+        r += OUT_W;
+        g += OUT_W;
+        b += OUT_W;
+    }
+}
+
+// Turns the P-Net score and regression maps into candidates in image
+// coordinates. Each output cell covers a CELL x CELL window STRIDE pixels from
+// its neighbours at the given pyramid scale.
+template <int STRIDE, int CELL>
+void GenerateCandidates(const ncnn::Mat &score, const ncnn::Mat &location, float threshold, float scale,
+                        int offset_x, int offset_y, std::vector<Bbox> &boxes)
+{
+    const float *p = (const float*)score.data + score.cstep;
+    const float *regression[4];
+    for (int channel = 0; channel < 4; channel++)
+        regression[channel] = (const float*)location.data + location.cstep * channel;
+
+    // Locals, since the compiler can't tell push_back leaves the maps alone
+    const int w = score.w;
+    const int h = score.h;
+    const float inv_scale = 1.0f / scale;
+    Bbox bbox;
+    for (int row = 0; row < h; row++) {
+        const int y1 = (int)round((STRIDE * row + 1) * inv_scale) + offset_y;
+        const int y2 = (int)round((STRIDE * row + 1 + CELL) * inv_scale) + offset_y;
+        for (int col = 0; col < w; col++, p++) {
+            if (*p > threshold) {
+                bbox.score = *p;
+                bbox.x1 = (int)round((STRIDE * col + 1) * inv_scale) + offset_x;
+                bbox.y1 = y1;
+                bbox.x2 = (int)round((STRIDE * col + 1 + CELL) * inv_scale) + offset_x;
+                bbox.y2 = y2;
+                bbox.area = (bbox.x2 - bbox.x1) * (bbox.y2 - bbox.y1);
+                const int index = row * w + col;
+                bbox.regreCoord[0] = regression[0][index];
+                bbox.regreCoord[1] = regression[1][index];
+                bbox.regreCoord[2] = regression[2][index];
+                bbox.regreCoord[3] = regression[3][index];
+                boxes.push_back(bbox);
+            }
+        }
+    }
+}
+
+#endif //__FIXED_KERNELS_H__
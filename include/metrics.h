@@ -0,0 +1,162 @@
+#pragma once
+
+#ifndef __METRICS_H__
+#define __METRICS_H__
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// Process-wide counters, gauges and latency histograms for long running
+// deployments, exported in the Prometheus text format.
+//
+// Recording never locks or allocates: counters and histograms are split into
+// cache line sized shards, and each thread updates the shard it was assigned
+// with relaxed atomics, so threads don't contend. Reading sums the shards.
+// Metrics are registered once, typically into function-local statics, and live
+// as long as the registry.
+//
+// Before C++17 a plain new only aligns to 16 bytes, so the metric classes
+// allocate themselves through posix_memalign to keep each shard on its own
+// cache line.
+
+static const int METRIC_SHARDS = 8;
+
+class MetricCounter {
+public:
+    MetricCounter();
+
+    static void* operator new(size_t size);
+    static void operator delete(void *p);
+
+    void Add(uint64_t n = 1);
+    uint64_t Value() const;
+
+private:
+    struct alignas(64) Shard
+    {
+        std::atomic<uint64_t> value;
+    };
+
+    Shard shards[METRIC_SHARDS];
+};
+
+class MetricGauge {
+public:
+    MetricGauge() : value(0) {}
+
+    void Set(int64_t v) { value.store(v, std::memory_order_relaxed); }
+    void Add(int64_t n) { value.fetch_add(n, std::memory_order_relaxed); }
+    int64_t Value() const { return value.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<int64_t> value;
+};
+
+// HDR-style histogram of non-negative integers, such as nanoseconds or
+// candidate counts. Values below 8 are exact; above, each power of two is split
+// into 8 linear buckets, a relative error under 12.5%, up to 2^40.
+class MetricHistogram {
+public:
+    static const int SUB_BUCKETS = 8;
+    static const int BUCKETS = 39 * SUB_BUCKETS;
+
+    struct Snapshot
+    {
+        uint64_t count;
+        uint64_t sum;
+        uint64_t max;
+        std::vector<uint64_t> buckets;
+
+        // The midpoint of the bucket holding quantile q, at most max
+        uint64_t Quantile(double q) const;
+    };
+
+    MetricHistogram();
+
+    static void* operator new(size_t size);
+    static void operator delete(void *p);
+
+    void Record(uint64_t value);
+    void Record(std::chrono::steady_clock::duration duration)
+    {
+        Record(static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count()));
+    }
+
+    Snapshot Read() const;
+
+    static int BucketOf(uint64_t value);
+    static uint64_t BucketLower(int bucket);
+    static uint64_t BucketUpper(int bucket);
+
+private:
+    struct alignas(64) Shard
+    {
+        std::atomic<uint64_t> sum;
+        std::atomic<uint64_t> max;
+        std::atomic<uint64_t> buckets[BUCKETS];
+    };
+
+    Shard shards[METRIC_SHARDS];
+};
+
+class MetricsRegistry {
+public:
+    static MetricsRegistry& Global();
+
+    // Returns the metric with this name and labels, registering it on first
+    // use. labels are Prometheus label pairs such as stage="pnet", or empty.
+    MetricCounter& Counter(const std::string &name, const std::string &help, const std::string &labels = "");
+    MetricGauge& Gauge(const std::string &name, const std::string &help, const std::string &labels = "");
+    // Exported as a summary, with values multiplied by scale: 1e-9 turns
+    // nanoseconds into the seconds Prometheus expects
+    MetricHistogram& Histogram(const std::string &name, const std::string &help, const std::string &labels = "",
+        double scale = 1e-9);
+
+    // Writes every metric in the Prometheus text exposition format 0.0.4
+    void WritePrometheus(std::ostream &os) const;
+
+private:
+    enum Type { COUNTER, GAUGE, HISTOGRAM };
+
+    struct Entry
+    {
+        std::string name;
+        std::string help;
+        std::string labels;
+        Type type;
+        double scale;
+        std::unique_ptr<MetricCounter> counter;
+        std::unique_ptr<MetricGauge> gauge;
+        std::unique_ptr<MetricHistogram> histogram;
+    };
+
+    Entry& Find(const std::string &name, const std::string &help, const std::string &labels, Type type);
+
+    mutable std::mutex mutex;
+    std::deque<Entry> entries;
+};
+
+// Records the time from construction to destruction into a histogram
+class MetricTimer {
+public:
+    explicit MetricTimer(MetricHistogram &histogram)
+        : histogram(histogram), begin(std::chrono::steady_clock::now()) {}
+    ~MetricTimer() { histogram.Record(std::chrono::steady_clock::now() - begin); }
+
+private:
+    MetricTimer(const MetricTimer&);
+    MetricTimer& operator=(const MetricTimer&);
+
+    MetricHistogram &histogram;
+    const std::chrono::steady_clock::time_point begin;
+};
+
+#endif //__METRICS_H__
@@ -11,6 +11,8 @@
 #include <vector>
 #include <time.h>
 #include <algorithm>
+#include <chrono>
+#include <cstdint>
 #include <map>
 #include <iostream>
 using namespace std;
@@ -37,8 +39,53 @@ struct Bbox
     float regreCoord[4];
 };
 
+// Face sizes plausible inside a rectangle of the image, for cameras where the
+// perspective ties face size to position. A face belongs to the region holding
+// its centre.
+struct FaceSizeRegion
+{
+    int x1;
+    int y1;
+    int x2;
+    int y2;
+    int min_size;
+    int max_size;
+};
+
+// How far down the cascade detect() runs. Stopping early skips the costlier
+// stages for callers that only count faces; boxes from P-Net or R-Net alone
+// are coarser and carry no landmarks (all zero).
+enum DetectMode
+{
+    DETECT_PNET,    // Candidate boxes straight from the image pyramid
+    DETECT_RNET,    // Boxes refined by R-Net
+    DETECT_FULL     // Boxes refined by O-Net, with landmarks
+};
+
+// Pyramid levels run and skipped by scale pruning, see SetScalePruning
+struct ScalePruningStats
+{
+    uint64_t frames;            // Frames detected with pruning enabled
+    uint64_t probe_frames;      // Of those, frames that ran every level
+    uint64_t levels_run;
+    uint64_t levels_skipped;
+};
+
+// A planar YUV 4:2:0 image, such as a decoded video frame, that O-Net crops
+// from when the rest of the cascade runs on a smaller copy of it
+struct Yuv420Image
+{
+    const unsigned char *y;
+    const unsigned char *u;
+    const unsigned char *v;
+    int y_stride;
+    int uv_stride;
+    int width;
+    int height;
+};
 
 class MTCNN {
+    friend class AsyncDetector;
 
 public:
 	MTCNN(const string &model_path);
@@ -46,11 +93,73 @@ public:
     ~MTCNN();
 	
 	void SetMinFace(int minSize);
+	// Ratio between pyramid levels, in (0, 1); lower is faster but may miss
+	// faces whose size falls between levels. Throws std::invalid_argument for
+	// a factor outside (0, 1).
+	void SetScaleFactor(float factor);
+	// Largest face to detect, 0 for no limit
+	void SetMaxFace(int maxSize);
+	// Restricts each pyramid level to the regions where its face size is
+	// plausible; an empty list searches every size in [minsize, maxsize] everywhere.
+	// SetMinFace and SetMaxFace still bound the sizes searched. Throws
+	// std::invalid_argument for a region with min_size < 1 or max_size < min_size.
+	void SetFaceSizeRegions(const std::vector<FaceSizeRegion> &regions);
+	// Threads used by each ncnn extractor, 0 keeps the ncnn default
+	void SetNumThreads(int numThreads);
+	// Runs a stage of detect() (0 P-Net, 1 R-Net, 2 O-Net) on the given CPUs
+	// with numThreads ncnn threads, 0 for one per CPU. The calling thread and
+	// its OpenMP threads move when the next stage's CPUs differ; an empty set
+	// lets the stage run anywhere.
+	void SetStagePlacement(int stage, const std::vector<int> &cpus, int numThreads);
+	void SetDetectMode(DetectMode mode);
+	// Keeps only the best scoring candidates passed on to R-Net and O-Net,
+	// 0 for no limit
+	void SetCandidateLimits(int maxRNetInputs, int maxONetInputs);
+	// Skips the pyramid levels that haven't led to a face detect() returned in
+	// the last window frames, as the face sizes a fixed camera sees change
+	// slowly. Every probeInterval-th frame runs all levels so faces of new sizes
+	// are still found (0 never probes). A window of 0 runs every level.
+	void SetScalePruning(int window, int probeInterval);
+	ScalePruningStats GetScalePruningStats() const;
     void detect(ncnn::Mat& img_, std::vector<Bbox>& finalBbox);
+	// Stops once budgetMs has passed, returning the faces found so far, and sets
+	// partial if any work was skipped. Pyramid levels run from the largest faces
+	// down and candidates from the highest score down, so the most likely faces
+	// are found first. A partial result only holds boxes R-Net confirmed: those
+	// O-Net also confirmed, and those O-Net didn't reach, which have R-Net's
+	// score and no landmarks (all zero). A deadline before R-Net confirmed any
+	// box gives no faces. A budget of 0 means no deadline.
+	void detect(ncnn::Mat& img_, std::vector<Bbox>& finalBbox, float budgetMs, bool &partial);
+	// Runs P-Net and R-Net on img_, a scaled copy of fullImage, and O-Net on
+	// crops of fullImage, for landmarks at the full resolution without running
+	// the pyramid there. The faces are in fullImage's coordinates.
+	void detect(ncnn::Mat& img_, const Yuv420Image &fullImage, std::vector<Bbox>& finalBbox, float budgetMs,
+	            bool &partial);
 	void detectMaxFace(ncnn::Mat& img_, std::vector<Bbox>& finalBbox);
   //  void detection(const cv::Mat& img, std::vector<cv::Rect>& rectangles);
 private:
-    void generateBbox(ncnn::Mat score, ncnn::Mat location, vector<Bbox>& boundingBox_, float scale);
+    // One pyramid level: the scale and the image area it is run over
+    struct PyramidLevel
+    {
+        float scale;
+        int x1, y1, x2, y2;
+    };
+
+    void prepare(ncnn::Mat& img_);
+    void propose(ncnn::Mat& img_, std::vector<Bbox>& candidates);
+    bool scoreRNet(const ncnn::Mat &image, Bbox &box) const;
+    bool scoreONet(const ncnn::Mat &image, Bbox &box) const;
+    bool scoreONet(const Yuv420Image &image, Bbox &box) const;
+    bool runONet(const ncnn::Mat &in, Bbox &box) const;
+    void planScales();
+    void recordLevelHits(const std::vector<Bbox> &faces, float sizeScale = 1.0f);
+    void keepTopK(vector<Bbox> &boxes, int k);
+    bool pastDeadline();
+    void enterStage(int stage);
+    static void clearLandmarks(vector<Bbox> &boxes, size_t first = 0);
+    static void scaleBoxes(vector<Bbox> &boxes, float scaleX, float scaleY, int width, int height);
+    void generateBbox(ncnn::Mat score, ncnn::Mat location, vector<Bbox>& boundingBox_, float scale,
+                      int offset_x = 0, int offset_y = 0);
 	void nmsTwoBoxs(vector<Bbox> &boundingBox_, vector<Bbox> &previousBox_, const float overlap_threshold, string modelname = "Union");
     void nms(vector<Bbox> &boundingBox_, const float overlap_threshold, string modelname="Union");
     void refine(vector<Bbox> &vecBbox, const int &height, const int &width, bool square);
@@ -58,7 +167,13 @@ private:
 	void PNet(float scale);
     void PNet();
     void RNet();
-    void ONet();
+    void ONet(const Yuv420Image *fullImage = NULL);
+    // Records the metrics and scale pruning around detectCascade
+    void detectImage(ncnn::Mat& img_, const Yuv420Image *fullImage, std::vector<Bbox>& finalBbox,
+                     float budgetMs, bool &partial);
+    // The cascade behind detect, which records its metrics
+    void detectCascade(ncnn::Mat& img_, const Yuv420Image *fullImage, std::vector<Bbox>& finalBbox,
+                       float budgetMs, bool &partial);
 
     ncnn::Net Pnet, Rnet, Onet;
     ncnn::Mat img;
@@ -71,10 +186,29 @@ private:
     std::vector<Bbox> firstBbox_, secondBbox_,thirdBbox_;
     int img_w, img_h;
 
-private://ֿɵ
+private://²¿·Ö¿Éµ÷²ÎÊý
 	const float threshold[3] = { 0.8f, 0.8f, 0.6f };
 	int minsize = 40;
-	const float pre_facetor = 0.709f;
+	int maxsize = 0;
+	std::vector<FaceSizeRegion> face_size_regions;
+	std::vector<PyramidLevel> scale_plan;
+	int plan_w = 0, plan_h = 0;
+	int stage_threads[3] = {0, 0, 0};
+	std::vector<int> stage_cpus[3];
+	std::vector<int> placed_cpus;	// Where the calling thread was last moved to
+	int placed_threads = 0;
+	int max_candidates[2] = {0, 0};
+	DetectMode detect_mode = DETECT_FULL;
+	bool has_deadline = false;
+	bool partial_ = false;
+	size_t onet_inputs = 0;
+	int pruning_window = 0;
+	int pruning_probe = 0;
+	long pruning_frame = 0;
+	std::vector<long> level_last_hit;	// Frame each pyramid level last led to a face
+	ScalePruningStats pruning_stats = {0, 0, 0, 0};
+	std::chrono::steady_clock::time_point deadline;
+	float pre_facetor = 0.709f;
 	
 };
 
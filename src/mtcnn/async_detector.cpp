@@ -0,0 +1,227 @@
+#include <algorithm>
+
+#include "async_detector.h"
+#include "cpu_topology.h"
+
+AsyncDetector::Options::Options() :
+    pnet_threads(2),
+    batch_threads(2),
+    max_batch(64),
+    max_wait_us(2000),
+    ncnn_threads(1),
+    min_face(40),
+    mode(DETECT_FULL)
+{
+}
+
+AsyncDetector::AsyncDetector(const string &model_path, const Options &options) :
+    options_(options),
+    stop_frames_(false),
+    active_batches_(0),
+    stop_tasks_(false),
+    frame_count_(0),
+    batch_count_(0),
+    crop_count_(0),
+    max_batch_(0)
+{
+    const int pnet_threads = std::max(options_.pnet_threads, 1);
+    for (int i = 0; i < pnet_threads; i++) {
+        detectors_.emplace_back(new MTCNN(model_path));
+        detectors_.back()->SetMinFace(options_.min_face);
+        detectors_.back()->SetNumThreads(options_.ncnn_threads);
+        detectors_.back()->SetDetectMode(options_.mode);
+    }
+
+    for (int i = 0; i < pnet_threads; i++)
+        pnet_threads_.emplace_back(&AsyncDetector::RunPNet, this, std::ref(*detectors_[i]));
+    for (int i = 0; i < std::max(options_.batch_threads, 1); i++)
+        batch_threads_.emplace_back(&AsyncDetector::RunBatches, this);
+}
+
+AsyncDetector::~AsyncDetector()
+{
+    // P-Net threads drain the frame queue first, since they feed the batches
+    {
+        std::lock_guard<std::mutex> lock(frame_mutex_);
+        stop_frames_ = true;
+    }
+    frame_cv_.notify_all();
+    for (size_t i = 0; i < pnet_threads_.size(); i++)
+        pnet_threads_[i].join();
+
+    {
+        std::lock_guard<std::mutex> lock(task_mutex_);
+        stop_tasks_ = true;
+    }
+    task_cv_.notify_all();
+    for (size_t i = 0; i < batch_threads_.size(); i++)
+        batch_threads_[i].join();
+}
+
+std::future<std::vector<Bbox>> AsyncDetector::submit(ncnn::Mat frame)
+{
+    std::shared_ptr<Job> job = std::make_shared<Job>();
+    job->img = frame;
+    std::future<std::vector<Bbox>> result = job->promise.get_future();
+    {
+        std::lock_guard<std::mutex> lock(frame_mutex_);
+        frames_.push_back(job);
+    }
+    frame_cv_.notify_one();
+    frame_count_++;
+    return result;
+}
+
+AsyncDetector::Statistics AsyncDetector::GetStatistics() const
+{
+    Statistics statistics;
+    statistics.frames = frame_count_;
+    statistics.batches = batch_count_;
+    statistics.crops = crop_count_;
+    statistics.max_batch = max_batch_;
+    return statistics;
+}
+
+void AsyncDetector::RunPNet(MTCNN &detector)
+{
+    if (!options_.pnet_cpus.empty())
+        SetOpenMpAffinity(options_.pnet_cpus, options_.ncnn_threads);
+
+    while (true) {
+        std::shared_ptr<Job> job;
+        {
+            std::unique_lock<std::mutex> lock(frame_mutex_);
+            frame_cv_.wait(lock, [this]{ return !frames_.empty() || stop_frames_; });
+            if (frames_.empty())
+                return;
+            job = frames_.front();
+            frames_.pop_front();
+        }
+
+        detector.propose(job->img, job->boxes);
+        if (job->boxes.empty()) {
+            job->promise.set_value(std::vector<Bbox>());
+        } else if (options_.mode == DETECT_PNET) {
+            MTCNN::clearLandmarks(job->boxes);
+            job->promise.set_value(job->boxes);
+        } else {
+            Enqueue(job, 0);
+        }
+    }
+}
+
+void AsyncDetector::Enqueue(const std::shared_ptr<Job> &job, int stage)
+{
+    const Clock::time_point now = Clock::now();
+    job->accepted.assign(job->boxes.size(), 0);
+    job->pending = job->boxes.size();
+    {
+        std::lock_guard<std::mutex> lock(task_mutex_);
+        for (size_t i = 0; i < job->boxes.size(); i++) {
+            Task task = {job, i, now};
+            tasks_[stage].push_back(task);
+        }
+    }
+    task_cv_.notify_all();
+}
+
+void AsyncDetector::RunBatches()
+{
+    const MTCNN &detector = *detectors_[0];
+    const Clock::duration max_wait = std::chrono::microseconds(options_.max_wait_us);
+    const size_t max_batch = static_cast<size_t>(std::max(options_.max_batch, 1));
+    std::vector<Task> batch;
+
+    if (!options_.batch_cpus.empty())
+        SetOpenMpAffinity(options_.batch_cpus, options_.ncnn_threads);
+
+    while (true) {
+        int stage;
+        {
+            std::unique_lock<std::mutex> lock(task_mutex_);
+            while (true) {
+                // O-Net crops go first, as they are the last step before a frame completes
+                stage = !tasks_[1].empty() ? 1 : (!tasks_[0].empty() ? 0 : -1);
+                if (stage < 0) {
+                    // A running batch may still queue the next stage of its frames
+                    if (stop_tasks_ && active_batches_ == 0)
+                        return;
+                    task_cv_.wait(lock);
+                    continue;
+                }
+                const std::deque<Task> &queue = tasks_[stage];
+                if (queue.size() >= max_batch || stop_tasks_)
+                    break;
+                const Clock::time_point due = queue.front().queued + max_wait;
+                if (Clock::now() >= due)
+                    break;
+                task_cv_.wait_until(lock, due);
+            }
+
+            std::deque<Task> &queue = tasks_[stage];
+            const size_t count = std::min(queue.size(), max_batch);
+            batch.assign(queue.begin(), queue.begin() + count);
+            queue.erase(queue.begin(), queue.begin() + count);
+            active_batches_++;
+        }
+
+        batch_count_++;
+        crop_count_ += batch.size();
+        uint64_t largest = max_batch_;
+        while (batch.size() > largest && !max_batch_.compare_exchange_weak(largest, batch.size()))
+            ;
+
+        for (size_t i = 0; i < batch.size(); i++) {
+            Job &job = *batch[i].job;
+            Bbox &box = job.boxes[batch[i].index];
+            job.accepted[batch[i].index] = stage == 0 ? detector.scoreRNet(job.img, box) :
+                detector.scoreONet(job.img, box);
+        }
+        for (size_t i = 0; i < batch.size(); i++) {
+            if (--batch[i].job->pending == 0)
+                FinishStage(batch[i].job, stage);
+        }
+        batch.clear();
+
+        {
+            std::lock_guard<std::mutex> lock(task_mutex_);
+            active_batches_--;
+        }
+        task_cv_.notify_all();
+    }
+}
+
+void AsyncDetector::FinishStage(const std::shared_ptr<Job> &job, int stage)
+{
+    // Only the detector's thread-safe helpers are used here
+    MTCNN &detector = *detectors_[0];
+    std::vector<Bbox> kept;
+    for (size_t i = 0; i < job->boxes.size(); i++) {
+        if (job->accepted[i])
+            kept.push_back(job->boxes[i]);
+    }
+    if (kept.empty()) {
+        job->promise.set_value(std::vector<Bbox>());
+        return;
+    }
+
+    if (stage == 0) {
+        detector.nms(kept, detector.nms_threshold[1]);
+        detector.refine(kept, job->img.h, job->img.w, true);
+        detector.keepTopK(kept, detector.max_candidates[1]);
+        if (options_.mode == DETECT_RNET) {
+            detector.nms(kept, detector.nms_threshold[2], "Min");
+            MTCNN::clearLandmarks(kept);
+            job->img = ncnn::Mat();
+            job->promise.set_value(kept);
+            return;
+        }
+        job->boxes.swap(kept);
+        Enqueue(job, 1);
+    } else {
+        detector.refine(kept, job->img.h, job->img.w, true);
+        detector.nms(kept, detector.nms_threshold[2], "Min");
+        job->img = ncnn::Mat();
+        job->promise.set_value(kept);
+    }
+}
@@ -0,0 +1,194 @@
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <map>
+#include <sstream>
+
+#include <sched.h>
+#include <unistd.h>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "cpu_topology.h"
+
+// Parses a kernel CPU list such as "0-3,5"
+static bool ParseCpuList(const std::string &list, std::vector<int> &cpus)
+{
+    std::vector<int> parsed;
+    std::istringstream ss(list);
+    std::string range;
+    while (std::getline(ss, range, ',')) {
+        if (range.empty() || range == "\n")
+            continue;
+        int first, last;
+        char dash;
+        std::istringstream rs(range);
+        if (!(rs >> first))
+            return false;
+        if (rs >> dash) {
+            if (dash != '-' || !(rs >> last) || last < first)
+                return false;
+        } else {
+            last = first;
+        }
+        if (first < 0 || last >= CPU_SETSIZE)
+            return false;
+        for (int cpu = first; cpu <= last; cpu++)
+            parsed.push_back(cpu);
+    }
+    if (parsed.empty())
+        return false;
+    std::sort(parsed.begin(), parsed.end());
+    parsed.erase(std::unique(parsed.begin(), parsed.end()), parsed.end());
+    cpus.swap(parsed);
+    return true;
+}
+
+static bool ReadLong(const std::string &path, long &value)
+{
+    std::ifstream file(path.c_str());
+    return static_cast<bool>(file >> value);
+}
+
+CpuTopology CpuTopology::Detect(const std::string &sysfs)
+{
+    std::vector<int> online;
+    std::ifstream online_file((sysfs + "/online").c_str());
+    std::string online_list;
+    if (!std::getline(online_file, online_list) || !ParseCpuList(online_list, online)) {
+        const long count = sysconf(_SC_NPROCESSORS_ONLN);
+        for (int cpu = 0; cpu < std::max(count, 1L); cpu++)
+            online.push_back(cpu);
+    }
+
+    // Group by maximum frequency, then by capacity for kernels without cpufreq
+    typedef std::map<std::pair<long, long>, std::vector<int> > Groups;
+    Groups groups;
+    for (size_t i = 0; i < online.size(); i++) {
+        const std::string cpu_path = sysfs + "/cpu" + std::to_string(online[i]);
+        long freq, capacity;
+        if (!ReadLong(cpu_path + "/cpufreq/cpuinfo_max_freq", freq))
+            freq = 0;
+        if (!ReadLong(cpu_path + "/cpu_capacity", capacity))
+            capacity = 0;
+        groups[std::make_pair(freq, capacity)].push_back(online[i]);
+    }
+
+    CpuTopology topology;
+    for (Groups::reverse_iterator it = groups.rbegin(); it != groups.rend(); ++it) {
+        Cluster cluster;
+        cluster.cpus = it->second;
+        cluster.max_freq_khz = it->first.first;
+        cluster.capacity = it->first.second;
+        topology.clusters.push_back(cluster);
+    }
+    return topology;
+}
+
+std::vector<int> CpuTopology::Big() const
+{
+    return clusters.empty() ? std::vector<int>() : clusters.front().cpus;
+}
+
+std::vector<int> CpuTopology::Little() const
+{
+    return clusters.empty() ? std::vector<int>() : clusters.back().cpus;
+}
+
+std::vector<int> CpuTopology::All() const
+{
+    std::vector<int> cpus;
+    for (size_t i = 0; i < clusters.size(); i++)
+        cpus.insert(cpus.end(), clusters[i].cpus.begin(), clusters[i].cpus.end());
+    std::sort(cpus.begin(), cpus.end());
+    return cpus;
+}
+
+bool CpuTopology::Parse(const std::string &spec, std::vector<int> &cpus) const
+{
+    if (spec == "big")
+        cpus = Big();
+    else if (spec == "little")
+        cpus = Little();
+    else if (spec == "all")
+        cpus = All();
+    else
+        return ParseCpuList(spec, cpus);
+    return true;
+}
+
+std::string CpuTopology::Describe() const
+{
+    std::ostringstream ss;
+    for (size_t i = 0; i < clusters.size(); i++) {
+        ss << (i ? ", " : "") << clusters[i].cpus.size() << "x ";
+        if (clusters[i].max_freq_khz)
+            ss << clusters[i].max_freq_khz / 1000 << "MHz ";
+        else if (clusters[i].capacity)
+            ss << "capacity " << clusters[i].capacity << ' ';
+        ss << '(' << FormatCpuList(clusters[i].cpus) << ')';
+    }
+    return ss.str();
+}
+
+std::string FormatCpuList(const std::vector<int> &cpus)
+{
+    std::ostringstream ss;
+    for (size_t i = 0; i < cpus.size(); ) {
+        size_t j = i;
+        while (j + 1 < cpus.size() && cpus[j + 1] == cpus[j] + 1)
+            j++;
+        ss << (i ? "," : "") << cpus[i];
+        if (j > i)
+            ss << '-' << cpus[j];
+        i = j + 1;
+    }
+    return ss.str();
+}
+
+bool SetThreadAffinity(const std::vector<int> &cpus)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (cpus.empty()) {
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+            CPU_SET(cpu, &set);
+    } else {
+        for (size_t i = 0; i < cpus.size(); i++)
+            CPU_SET(cpus[i], &set);
+    }
+    // On Linux, pid 0 is the calling thread rather than the whole process
+    return sched_setaffinity(0, sizeof(set), &set) == 0;
+}
+
+std::vector<int> GetThreadAffinity()
+{
+    std::vector<int> cpus;
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof(set), &set) != 0)
+        return cpus;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &set))
+            cpus.push_back(cpu);
+    }
+    return cpus;
+}
+
+bool SetOpenMpAffinity(const std::vector<int> &cpus, int threads)
+{
+#ifdef _OPENMP
+    if (threads <= 0)
+        threads = omp_get_max_threads();
+    // One iteration per thread of the team, as ncnn starts it
+    int failures = 0;
+    #pragma omp parallel for num_threads(threads) schedule(static, 1) reduction(+:failures)
+    for (int i = 0; i < threads; i++)
+        failures += !SetThreadAffinity(cpus);
+    return failures == 0;
+#else
+    (void)threads;
+    return SetThreadAffinity(cpus);
+#endif
+}
@@ -0,0 +1,209 @@
+#include <algorithm>
+#include <cstring>
+
+#include "detection_cache.h"
+
+// xxHash64 primes; each lane runs the xxHash64 round over 8 bytes at a time
+static const uint64_t PRIME1 = 0x9E3779B185EBCA87ULL;
+static const uint64_t PRIME2 = 0xC2B2AE3D27D4EB4FULL;
+static const uint64_t PRIME3 = 0x165667B19E3779F9ULL;
+
+// Rough per entry overhead of the list node and the index
+static const size_t ENTRY_OVERHEAD = 64;
+
+static inline uint64_t Rotl(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t Round(uint64_t acc, uint64_t v)
+{
+    return Rotl(acc + v * PRIME2, 31) * PRIME1;
+}
+
+static inline uint64_t Load64(const unsigned char *p)
+{
+    uint64_t v;
+    std::memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t Mix(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= PRIME2;
+    h ^= h >> 29;
+    h *= PRIME3;
+    h ^= h >> 32;
+    return h;
+}
+
+static uint64_t HashBytes(const unsigned char *p, size_t n, uint64_t seed)
+{
+    uint64_t v1 = seed + PRIME1 + PRIME2, v2 = seed + PRIME2, v3 = seed, v4 = seed - PRIME1;
+    const unsigned char *const end = p + n;
+    for (; p + 32 <= end; p += 32) {
+        v1 = Round(v1, Load64(p));
+        v2 = Round(v2, Load64(p + 8));
+        v3 = Round(v3, Load64(p + 16));
+        v4 = Round(v4, Load64(p + 24));
+    }
+    uint64_t h = Rotl(v1, 1) + Rotl(v2, 7) + Rotl(v3, 12) + Rotl(v4, 18) + n;
+    for (; p + 8 <= end; p += 8)
+        h = Rotl(h ^ Round(0, Load64(p)), 27) * PRIME1;
+    for (; p < end; p++)
+        h = Rotl(h ^ (*p * PRIME3), 11) * PRIME1;
+    return Mix(h);
+}
+
+static inline int Popcount64(uint64_t x)
+{
+    int n = 0;
+    for (; x; n++)
+        x &= x - 1;
+    return n;
+}
+
+DetectionCache::DetectionCache(size_t maxBytes, int maxPerceptualDistance) :
+    max_bytes(maxBytes),
+    max_distance(maxPerceptualDistance),
+    bytes(0),
+    hits(0),
+    perceptual_hits(0),
+    misses(0),
+    evictions(0)
+{
+}
+
+DetectionCache::Key DetectionCache::MakeKey(const unsigned char *pixels, int width, int height, int stride,
+                                            int channels) const
+{
+    Key key;
+    key.width = width;
+    key.height = height;
+    const size_t row_bytes = (size_t)width * channels;
+    if ((size_t)stride == row_bytes) {
+        key.exact = HashBytes(pixels, row_bytes * height, (uint64_t)width << 32 | (uint32_t)height);
+    } else {
+        uint64_t h = (uint64_t)width << 32 | (uint32_t)height;
+        for (int y = 0; y < height; y++)
+            h = HashBytes(pixels + (size_t)y * stride, row_bytes, h);
+        key.exact = h;
+    }
+
+    key.perceptual = 0;
+    if (max_distance < 0 || width < 9 || height < 8)
+        return key;
+
+    // Difference hash: average luma over a 9x8 grid of cells, sampling at most
+    // 8x8 points per cell, then one bit per horizontally adjacent pair
+    int thumbnail[8][9];
+    for (int ty = 0; ty < 8; ty++) {
+        const int y0 = height * ty / 8, y1 = height * (ty + 1) / 8;
+        const int ystep = std::max((y1 - y0) / 8, 1);
+        for (int tx = 0; tx < 9; tx++) {
+            const int x0 = width * tx / 9, x1 = width * (tx + 1) / 9;
+            const int xstep = std::max((x1 - x0) / 8, 1);
+            int sum = 0, count = 0;
+            for (int y = y0; y < y1; y += ystep) {
+                const unsigned char *row = pixels + (size_t)y * stride;
+                for (int x = x0; x < x1; x += xstep, count++) {
+                    const unsigned char *p = row + x * channels;
+                    sum += channels >= 3 ? (p[0] + 2 * p[1] + p[2]) >> 2 : p[0];
+                }
+            }
+            thumbnail[ty][tx] = count ? sum / count : 0;
+        }
+    }
+    for (int ty = 0; ty < 8; ty++) {
+        for (int tx = 0; tx < 8; tx++)
+            key.perceptual = key.perceptual << 1 | (thumbnail[ty][tx] < thumbnail[ty][tx + 1]);
+    }
+    return key;
+}
+
+bool DetectionCache::Lookup(const Key &key, std::vector<Bbox> &boxes)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+
+    EntryList::iterator it = entries.end();
+    const std::unordered_map<uint64_t, EntryList::iterator>::const_iterator found = index.find(key.exact);
+    if (found != index.end()) {
+        it = found->second;
+        hits++;
+    } else if (max_distance >= 0) {
+        for (EntryList::iterator e = entries.begin(); e != entries.end(); ++e) {
+            if (e->key.width == key.width && e->key.height == key.height &&
+                Popcount64(e->key.perceptual ^ key.perceptual) <= max_distance) {
+                it = e;
+                perceptual_hits++;
+                break;
+            }
+        }
+    }
+
+    if (it == entries.end()) {
+        misses++;
+        return false;
+    }
+
+    entries.splice(entries.begin(), entries, it);
+    boxes = it->boxes;
+    return true;
+}
+
+void DetectionCache::Insert(const Key &key, const std::vector<Bbox> &boxes)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+
+    const std::unordered_map<uint64_t, EntryList::iterator>::iterator found = index.find(key.exact);
+    if (found != index.end()) {
+        bytes -= found->second->bytes;
+        entries.erase(found->second);
+        index.erase(found);
+    }
+
+    Entry entry;
+    entry.key = key;
+    entry.boxes = boxes;
+    entry.bytes = sizeof(Entry) + ENTRY_OVERHEAD + boxes.size() * sizeof(Bbox);
+    if (entry.bytes > max_bytes)
+        return;
+
+    entries.push_front(entry);
+    index[key.exact] = entries.begin();
+    bytes += entry.bytes;
+    Evict();
+}
+
+void DetectionCache::Evict()
+{
+    while (bytes > max_bytes && !entries.empty()) {
+        const Entry &last = entries.back();
+        bytes -= last.bytes;
+        index.erase(last.key.exact);
+        entries.pop_back();
+        evictions++;
+    }
+}
+
+void DetectionCache::Clear()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    entries.clear();
+    index.clear();
+    bytes = 0;
+}
+
+DetectionCache::Statistics DetectionCache::GetStatistics() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    Statistics statistics;
+    statistics.hits = hits;
+    statistics.perceptual_hits = perceptual_hits;
+    statistics.misses = misses;
+    statistics.evictions = evictions;
+    statistics.entries = entries.size();
+    statistics.bytes = bytes;
+    return statistics;
+}
@@ -0,0 +1,216 @@
+#include <algorithm>
+#include <cmath>
+#include <stdint.h>
+
+#include "face_align.h"
+
+// ArcFace reference landmarks for a 112x112 crop: eyes, nose tip, mouth corners
+static const float arcface_x[5] = {38.2946f, 73.5318f, 56.0252f, 41.5493f, 70.7299f};
+static const float arcface_y[5] = {51.6963f, 51.5014f, 71.7366f, 92.3655f, 92.2041f};
+
+// Coordinates are stepped in 16.16 fixed point, bilinear weights use 8 bits
+static const int FIXED_SHIFT = 16;
+static const int FIXED_ONE = 1 << FIXED_SHIFT;
+
+static inline int ToFixed(float v)
+{
+    return static_cast<int>(std::floor(v * FIXED_ONE + 0.5f));
+}
+
+static inline unsigned char ClampToByte(int v)
+{
+    return static_cast<unsigned char>(v < 0 ? 0 : (v > 255 ? 255 : v));
+}
+
+static inline int Bilinear(int p00, int p01, int p10, int p11, int fx, int fy)
+{
+    const int top = (p00 << 8) + (p01 - p00) * fx;
+    const int bottom = (p10 << 8) + (p11 - p10) * fx;
+    return ((top << 8) + (bottom - top) * fy + (1 << 15)) >> 16;
+}
+
+// Source taps of one sample; without clamping the caller guarantees the 2x2
+// neighbourhood lies inside the image
+struct Taps
+{
+    int x0, x1, y0, y1, fx, fy;
+};
+
+template <bool Clamp>
+static inline Taps GetTaps(int X, int Y, int width, int height)
+{
+    Taps t;
+    const int ix = X >> FIXED_SHIFT;
+    const int iy = Y >> FIXED_SHIFT;
+    t.fx = (X >> (FIXED_SHIFT - 8)) & 0xff;
+    t.fy = (Y >> (FIXED_SHIFT - 8)) & 0xff;
+    if (Clamp) {
+        t.x0 = std::min(std::max(ix, 0), width - 1);
+        t.x1 = std::min(std::max(ix + 1, 0), width - 1);
+        t.y0 = std::min(std::max(iy, 0), height - 1);
+        t.y1 = std::min(std::max(iy + 1, 0), height - 1);
+    } else {
+        t.x0 = ix;
+        t.x1 = ix + 1;
+        t.y0 = iy;
+        t.y1 = iy + 1;
+    }
+    return t;
+}
+
+// Whether the 2x2 neighbourhood of every sample of a size x size crop whose
+// origin maps to (x0, y0), stepped by (dx_x, dx_y) per column and (dy_x, dy_y)
+// per row, stays inside a width x height image
+static bool CropInside(float x0, float y0, float dx_x, float dx_y, float dy_x, float dy_y,
+                       int size, int width, int height)
+{
+    // Slack for the fixed point rounding accumulated along a row
+    const float margin = 0.01f;
+    const float n = static_cast<float>(size - 1);
+    const float xs[4] = {x0, x0 + dx_x * n, x0 + dy_x * n, x0 + (dx_x + dy_x) * n};
+    const float ys[4] = {y0, y0 + dx_y * n, y0 + dy_y * n, y0 + (dx_y + dy_y) * n};
+    for (int i = 0; i < 4; i++) {
+        if (xs[i] < margin || xs[i] >= width - 1 - margin ||
+            ys[i] < margin || ys[i] >= height - 1 - margin)
+            return false;
+    }
+    return true;
+}
+
+template <bool Clamp>
+static void WarpPacked(const unsigned char *pixels, int width, int height, int stride, const int channel[3],
+                       const AlignTransform &t, int size, unsigned char *dst)
+{
+    const int step_x = ToFixed(t.a);
+    const int step_y = ToFixed(t.b);
+    for (int y = 0; y < size; y++) {
+        int X = ToFixed(t.tx - t.b * y);
+        int Y = ToFixed(t.ty + t.a * y);
+        for (int x = 0; x < size; x++, X += step_x, Y += step_y, dst += 3) {
+            const Taps s = GetTaps<Clamp>(X, Y, width, height);
+            const unsigned char *r0 = pixels + s.y0 * stride;
+            const unsigned char *r1 = pixels + s.y1 * stride;
+            const int o0 = s.x0 * 3, o1 = s.x1 * 3;
+            for (int c = 0; c < 3; c++) {
+                const int k = channel[c];
+                dst[c] = static_cast<unsigned char>(
+                    Bilinear(r0[o0 + k], r0[o1 + k], r1[o0 + k], r1[o1 + k], s.fx, s.fy));
+            }
+        }
+    }
+}
+
+template <bool Clamp>
+static void WarpNv12(const unsigned char *y_plane, int y_stride, const unsigned char *uv_plane, int uv_stride,
+                     int width, int height, int r, int b, const AlignTransform &t, int size, unsigned char *dst)
+{
+    const int chroma_width = width / 2, chroma_height = height / 2;
+    const int step_x = ToFixed(t.a);
+    const int step_y = ToFixed(t.b);
+    for (int y = 0; y < size; y++) {
+        int X = ToFixed(t.tx - t.b * y);
+        int Y = ToFixed(t.ty + t.a * y);
+        for (int x = 0; x < size; x++, X += step_x, Y += step_y, dst += 3) {
+            const Taps l = GetTaps<Clamp>(X, Y, width, height);
+            const unsigned char *l0 = y_plane + l.y0 * y_stride;
+            const unsigned char *l1 = y_plane + l.y1 * y_stride;
+            const int luma = Bilinear(l0[l.x0], l0[l.x1], l1[l.x0], l1[l.x1], l.fx, l.fy);
+
+            // Chroma samples are centred between each 2x2 block of luma samples
+            const Taps c = GetTaps<Clamp>((X >> 1) - FIXED_ONE / 4, (Y >> 1) - FIXED_ONE / 4,
+                                          chroma_width, chroma_height);
+            const unsigned char *c0 = uv_plane + c.y0 * uv_stride;
+            const unsigned char *c1 = uv_plane + c.y1 * uv_stride;
+            const int u = Bilinear(c0[2 * c.x0], c0[2 * c.x1], c1[2 * c.x0], c1[2 * c.x1], c.fx, c.fy);
+            const int v = Bilinear(c0[2 * c.x0 + 1], c0[2 * c.x1 + 1], c1[2 * c.x0 + 1], c1[2 * c.x1 + 1],
+                                   c.fx, c.fy);
+
+            const int cy = 298 * (luma - 16) + 128;
+            const int d = u - 128, e = v - 128;
+            dst[r] = ClampToByte((cy + 409 * e) >> 8);
+            dst[1] = ClampToByte((cy - 100 * d - 208 * e) >> 8);
+            dst[b] = ClampToByte((cy + 516 * d) >> 8);
+        }
+    }
+}
+
+FaceAligner::FaceAligner(int size_, bool bgr_output_) :
+    size(size_),
+    bgr_output(bgr_output_)
+{
+    const float scale = size / 112.0f;
+    for (int i = 0; i < 5; i++) {
+        template_x[i] = arcface_x[i] * scale;
+        template_y[i] = arcface_y[i] * scale;
+    }
+}
+
+AlignTransform FaceAligner::Estimate(const face_landmark &landmark) const
+{
+    // Closed form Umeyama fit restricted to rotation, uniform scale and
+    // translation, mapping template points onto the detected landmarks
+    float tmx = 0, tmy = 0, lmx = 0, lmy = 0;
+    for (int i = 0; i < 5; i++) {
+        tmx += template_x[i];
+        tmy += template_y[i];
+        lmx += landmark.x[i];
+        lmy += landmark.y[i];
+    }
+    tmx /= 5;
+    tmy /= 5;
+    lmx /= 5;
+    lmy /= 5;
+
+    float dot = 0, cross = 0, norm = 0;
+    for (int i = 0; i < 5; i++) {
+        const float tx = template_x[i] - tmx, ty = template_y[i] - tmy;
+        const float lx = landmark.x[i] - lmx, ly = landmark.y[i] - lmy;
+        dot += tx * lx + ty * ly;
+        cross += tx * ly - ty * lx;
+        norm += tx * tx + ty * ty;
+    }
+
+    AlignTransform t;
+    t.a = dot / norm;
+    t.b = cross / norm;
+    t.tx = lmx - (t.a * tmx - t.b * tmy);
+    t.ty = lmy - (t.b * tmx + t.a * tmy);
+    return t;
+}
+
+void FaceAligner::Align(const unsigned char *pixels, int width, int height, int stride, SourceFormat format,
+                        const std::vector<Bbox> &faces, unsigned char *batch) const
+{
+    // Source channel read for each output channel
+    const bool swap = (format == SOURCE_BGR) != bgr_output;
+    const int channel[3] = {swap ? 2 : 0, 1, swap ? 0 : 2};
+
+    for (size_t i = 0; i < faces.size(); i++) {
+        const AlignTransform t = Estimate(faces[i].landmark);
+        unsigned char *dst = batch + i * GetCropBytes();
+        if (CropInside(t.tx, t.ty, t.a, t.b, -t.b, t.a, size, width, height))
+            WarpPacked<false>(pixels, width, height, stride, channel, t, size, dst);
+        else
+            WarpPacked<true>(pixels, width, height, stride, channel, t, size, dst);
+    }
+}
+
+void FaceAligner::AlignNv12(const unsigned char *y_plane, int y_stride, const unsigned char *uv_plane, int uv_stride,
+                            int width, int height, const std::vector<Bbox> &faces, unsigned char *batch) const
+{
+    const int r = bgr_output ? 2 : 0;
+    const int b = bgr_output ? 0 : 2;
+
+    for (size_t i = 0; i < faces.size(); i++) {
+        const AlignTransform t = Estimate(faces[i].landmark);
+        unsigned char *dst = batch + i * GetCropBytes();
+        const bool inside =
+            CropInside(t.tx, t.ty, t.a, t.b, -t.b, t.a, size, width, height) &&
+            CropInside(t.tx / 2 - 0.25f, t.ty / 2 - 0.25f, t.a / 2, t.b / 2, -t.b / 2, t.a / 2, size,
+                       width / 2, height / 2);
+        if (inside)
+            WarpNv12<false>(y_plane, y_stride, uv_plane, uv_stride, width, height, r, b, t, size, dst);
+        else
+            WarpNv12<true>(y_plane, y_stride, uv_plane, uv_stride, width, height, r, b, t, size, dst);
+    }
+}
@@ -0,0 +1,258 @@
+#include <algorithm>
+#include <cstdlib>
+#include <iomanip>
+#include <map>
+#include <new>
+#include <sstream>
+#include <stdexcept>
+
+#include "metrics.h"
+
+// Threads take shards round robin as they first record, which spreads the
+// detector, decoder and writer threads over different cache lines
+static int ThreadShard()
+{
+    static std::atomic<unsigned int> next(0);
+    static thread_local const int shard = static_cast<int>(next.fetch_add(1) % METRIC_SHARDS);
+    return shard;
+}
+
+static void* AlignedNew(size_t size, size_t alignment)
+{
+    void *p = NULL;
+    if (posix_memalign(&p, alignment, size) != 0)
+        throw std::bad_alloc();
+    return p;
+}
+
+MetricCounter::MetricCounter()
+{
+    for (int i = 0; i < METRIC_SHARDS; i++)
+        shards[i].value.store(0, std::memory_order_relaxed);
+}
+
+void* MetricCounter::operator new(size_t size)
+{
+    return AlignedNew(size, alignof(MetricCounter));
+}
+
+void MetricCounter::operator delete(void *p)
+{
+    free(p);
+}
+
+void MetricCounter::Add(uint64_t n)
+{
+    shards[ThreadShard()].value.fetch_add(n, std::memory_order_relaxed);
+}
+
+uint64_t MetricCounter::Value() const
+{
+    uint64_t total = 0;
+    for (int i = 0; i < METRIC_SHARDS; i++)
+        total += shards[i].value.load(std::memory_order_relaxed);
+    return total;
+}
+
+MetricHistogram::MetricHistogram()
+{
+    for (int i = 0; i < METRIC_SHARDS; i++) {
+        shards[i].sum.store(0, std::memory_order_relaxed);
+        shards[i].max.store(0, std::memory_order_relaxed);
+        for (int b = 0; b < BUCKETS; b++)
+            shards[i].buckets[b].store(0, std::memory_order_relaxed);
+    }
+}
+
+void* MetricHistogram::operator new(size_t size)
+{
+    return AlignedNew(size, alignof(MetricHistogram));
+}
+
+void MetricHistogram::operator delete(void *p)
+{
+    free(p);
+}
+
+int MetricHistogram::BucketOf(uint64_t value)
+{
+    if (value < SUB_BUCKETS)
+        return static_cast<int>(value);
+    const int exponent = 63 - __builtin_clzll(value);
+    const int sub = static_cast<int>(value >> (exponent - 3)) & (SUB_BUCKETS - 1);
+    return std::min((exponent - 2) * SUB_BUCKETS + sub, BUCKETS - 1);
+}
+
+uint64_t MetricHistogram::BucketLower(int bucket)
+{
+    if (bucket < SUB_BUCKETS)
+        return static_cast<uint64_t>(bucket);
+    const int exponent = bucket / SUB_BUCKETS + 2;
+    return static_cast<uint64_t>(SUB_BUCKETS + bucket % SUB_BUCKETS) << (exponent - 3);
+}
+
+uint64_t MetricHistogram::BucketUpper(int bucket)
+{
+    if (bucket < SUB_BUCKETS)
+        return static_cast<uint64_t>(bucket) + 1;
+    const int exponent = bucket / SUB_BUCKETS + 2;
+    return static_cast<uint64_t>(SUB_BUCKETS + bucket % SUB_BUCKETS + 1) << (exponent - 3);
+}
+
+void MetricHistogram::Record(uint64_t value)
+{
+    Shard &shard = shards[ThreadShard()];
+    shard.buckets[BucketOf(value)].fetch_add(1, std::memory_order_relaxed);
+    shard.sum.fetch_add(value, std::memory_order_relaxed);
+    // Only one thread normally writes a shard, so this rarely retries
+    uint64_t max = shard.max.load(std::memory_order_relaxed);
+    while (value > max && !shard.max.compare_exchange_weak(max, value, std::memory_order_relaxed)) {
+    }
+}
+
+MetricHistogram::Snapshot MetricHistogram::Read() const
+{
+    Snapshot snapshot;
+    snapshot.count = 0;
+    snapshot.sum = 0;
+    snapshot.max = 0;
+    snapshot.buckets.assign(BUCKETS, 0);
+    for (int i = 0; i < METRIC_SHARDS; i++) {
+        const Shard &shard = shards[i];
+        snapshot.sum += shard.sum.load(std::memory_order_relaxed);
+        snapshot.max = std::max(snapshot.max, shard.max.load(std::memory_order_relaxed));
+        for (int b = 0; b < BUCKETS; b++) {
+            const uint64_t n = shard.buckets[b].load(std::memory_order_relaxed);
+            snapshot.buckets[b] += n;
+            snapshot.count += n;
+        }
+    }
+    return snapshot;
+}
+
+uint64_t MetricHistogram::Snapshot::Quantile(double q) const
+{
+    if (count == 0)
+        return 0;
+    const uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(q * count + 0.5));
+    uint64_t seen = 0;
+    for (int b = 0; b < BUCKETS; b++) {
+        seen += buckets[b];
+        if (seen >= rank)
+            return std::min(max, (BucketLower(b) + BucketUpper(b) - 1) / 2);
+    }
+    return max;
+}
+
+MetricsRegistry& MetricsRegistry::Global()
+{
+    static MetricsRegistry registry;
+    return registry;
+}
+
+MetricsRegistry::Entry& MetricsRegistry::Find(const std::string &name, const std::string &help,
+    const std::string &labels, Type type)
+{
+    for (size_t i = 0; i < entries.size(); i++) {
+        Entry &entry = entries[i];
+        if (entry.name == name && entry.labels == labels) {
+            if (entry.type != type)
+                throw std::logic_error("Metric " + name + " registered with another type");
+            return entry;
+        }
+    }
+    entries.push_back(Entry());
+    Entry &entry = entries.back();
+    entry.name = name;
+    entry.help = help;
+    entry.labels = labels;
+    entry.type = type;
+    entry.scale = 1.0;
+    return entry;
+}
+
+MetricCounter& MetricsRegistry::Counter(const std::string &name, const std::string &help,
+    const std::string &labels)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    Entry &entry = Find(name, help, labels, COUNTER);
+    if (!entry.counter)
+        entry.counter.reset(new MetricCounter());
+    return *entry.counter;
+}
+
+MetricGauge& MetricsRegistry::Gauge(const std::string &name, const std::string &help, const std::string &labels)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    Entry &entry = Find(name, help, labels, GAUGE);
+    if (!entry.gauge)
+        entry.gauge.reset(new MetricGauge());
+    return *entry.gauge;
+}
+
+MetricHistogram& MetricsRegistry::Histogram(const std::string &name, const std::string &help,
+    const std::string &labels, double scale)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    Entry &entry = Find(name, help, labels, HISTOGRAM);
+    if (!entry.histogram) {
+        entry.histogram.reset(new MetricHistogram());
+        entry.scale = scale;
+    }
+    return *entry.histogram;
+}
+
+// name{labels,extra} with the braces left out when both are empty
+static std::string Series(const std::string &name, const std::string &labels, const std::string &extra = "")
+{
+    std::string joined = labels;
+    if (!extra.empty())
+        joined += (joined.empty() ? "" : ",") + extra;
+    return joined.empty() ? name : name + "{" + joined + "}";
+}
+
+void MetricsRegistry::WritePrometheus(std::ostream &os) const
+{
+    static const double QUANTILES[] = {0.5, 0.9, 0.99, 0.999};
+
+    std::lock_guard<std::mutex> lock(mutex);
+
+    // Every series of a metric goes under one HELP and TYPE header
+    std::map<std::string, std::vector<const Entry*> > families;
+    for (size_t i = 0; i < entries.size(); i++)
+        families[entries[i].name].push_back(&entries[i]);
+
+    std::ostringstream ss;
+    ss << std::setprecision(9);
+    for (std::map<std::string, std::vector<const Entry*> >::const_iterator it = families.begin();
+            it != families.end(); ++it) {
+        const Entry &first = *it->second.front();
+        static const char *const TYPES[] = {"counter", "gauge", "summary"};
+        ss << "# HELP " << first.name << ' ' << first.help << '\n' <<
+            "# TYPE " << first.name << ' ' << TYPES[first.type] << '\n';
+        for (size_t i = 0; i < it->second.size(); i++) {
+            const Entry &entry = *it->second[i];
+            switch (entry.type) {
+            case COUNTER:
+                ss << Series(entry.name, entry.labels) << ' ' << entry.counter->Value() << '\n';
+                break;
+            case GAUGE:
+                ss << Series(entry.name, entry.labels) << ' ' << entry.gauge->Value() << '\n';
+                break;
+            case HISTOGRAM: {
+                    const MetricHistogram::Snapshot snapshot = entry.histogram->Read();
+                    for (size_t q = 0; q < sizeof(QUANTILES) / sizeof(QUANTILES[0]); q++) {
+                        std::ostringstream quantile;
+                        quantile << "quantile=\"" << QUANTILES[q] << '"';
+                        ss << Series(entry.name, entry.labels, quantile.str()) << ' ' <<
+                            snapshot.Quantile(QUANTILES[q]) * entry.scale << '\n';
+                    }
+                    ss << Series(entry.name + "_sum", entry.labels) << ' ' << snapshot.sum * entry.scale << '\n' <<
+                        Series(entry.name + "_count", entry.labels) << ' ' << snapshot.count << '\n';
+                    break;
+                }
+            }
+        }
+    }
+    os << ss.str();
+}
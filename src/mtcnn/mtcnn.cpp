@@ -6,9 +6,44 @@
  * TO DO : change the P-net and update the generat box
  */
 
+#include <climits>
 #include <cmath>
+#include <stdexcept>
+#include "cpu_topology.h"
+#include "fixed_kernels.h"
+#include "metrics.h"
 #include "mtcnn.h"
 
+// Registered on first use; recording costs a few relaxed atomics per stage
+struct DetectMetrics {
+    MetricHistogram *detect;
+    MetricHistogram *stage[3];
+    MetricHistogram *candidates[2];  // Inputs to R-Net and O-Net
+    MetricCounter *frames;
+    MetricCounter *partial;
+    MetricCounter *levels_run;
+    MetricCounter *levels_skipped;
+};
+
+static DetectMetrics& GetDetectMetrics() {
+    static MetricsRegistry &r = MetricsRegistry::Global();
+    static DetectMetrics metrics = {
+        &r.Histogram("mtcnn_detect_seconds", "Time taken by MTCNN::detect"),
+        {&r.Histogram("mtcnn_stage_seconds", "Time taken by each cascade stage", "stage=\"pnet\""),
+         &r.Histogram("mtcnn_stage_seconds", "Time taken by each cascade stage", "stage=\"rnet\""),
+         &r.Histogram("mtcnn_stage_seconds", "Time taken by each cascade stage", "stage=\"onet\"")},
+        {&r.Histogram("mtcnn_stage_candidates", "Candidates entering each refinement stage", "stage=\"rnet\"", 1.0),
+         &r.Histogram("mtcnn_stage_candidates", "Candidates entering each refinement stage", "stage=\"onet\"", 1.0)},
+        &r.Counter("mtcnn_detections_total", "Images passed to MTCNN::detect"),
+        &r.Counter("mtcnn_partial_detections_total", "Detections cut short by their deadline"),
+        &r.Counter("mtcnn_pyramid_levels_total", "Pyramid levels P-Net ran or scale pruning skipped",
+                   "state=\"run\""),
+        &r.Counter("mtcnn_pyramid_levels_total", "Pyramid levels P-Net ran or scale pruning skipped",
+                   "state=\"skipped\""),
+    };
+    return metrics;
+}
+
 bool cmpScore(Bbox lsh, Bbox rsh) {
 	if (lsh.score < rsh.score)
 		return true;
@@ -63,35 +98,85 @@ MTCNN::~MTCNN(){
 }
 void MTCNN::SetMinFace(int minSize){
 	minsize = minSize;
+	plan_w = plan_h = 0;
 }
-void MTCNN::generateBbox(ncnn::Mat score, ncnn::Mat location, std::vector<Bbox>& boundingBox_, float scale){
-    const int stride = 2;
-    const int cellsize = 12;
-    //score p
-    float *p = score.channel(1);//score.data + score.cstep;
-    //float *plocal = location.data;
-    Bbox bbox;
-    float inv_scale = 1.0f/scale;
-    for(int row=0;row<score.h;row++){
-        for(int col=0;col<score.w;col++){
-            if(*p>threshold[0]){
-                bbox.score = *p;
-                bbox.x1 = round((stride*col+1)*inv_scale);
-                bbox.y1 = round((stride*row+1)*inv_scale);
-                bbox.x2 = round((stride*col+1+cellsize)*inv_scale);
-                bbox.y2 = round((stride*row+1+cellsize)*inv_scale);
-                bbox.area = (bbox.x2 - bbox.x1) * (bbox.y2 - bbox.y1);
-                const int index = row * score.w + col;
-                for(int channel=0;channel<4;channel++){
-                    bbox.regreCoord[channel]=location.channel(channel)[index];
-                }
-                boundingBox_.push_back(bbox);
-            }
-            p++;
-            //plocal++;
-        }
+void MTCNN::SetScaleFactor(float factor){
+	// Outside (0, 1) the pyramid never shrinks to the P-Net input size
+	if (!(factor > 0.0f && factor < 1.0f))
+		throw std::invalid_argument("Scale factor needs 0 < factor < 1");
+	pre_facetor = factor;
+	plan_w = plan_h = 0;
+}
+void MTCNN::SetMaxFace(int maxSize){
+	maxsize = maxSize;
+	plan_w = plan_h = 0;
+}
+void MTCNN::SetFaceSizeRegions(const std::vector<FaceSizeRegion> &regions){
+	for (size_t i = 0; i < regions.size(); i++) {
+		if (regions[i].min_size < 1 || regions[i].max_size < regions[i].min_size)
+			throw std::invalid_argument("Face size region needs 1 <= min_size <= max_size");
+	}
+	face_size_regions = regions;
+	plan_w = plan_h = 0;
+}
+void MTCNN::SetNumThreads(int numThreads){
+	std::fill(stage_threads, stage_threads + 3, numThreads);
+}
+void MTCNN::SetStagePlacement(int stage, const std::vector<int> &cpus, int numThreads){
+	stage_cpus[stage] = cpus;
+	stage_threads[stage] = numThreads > 0 ? numThreads : (int)cpus.size();
+}
+void MTCNN::SetDetectMode(DetectMode mode){
+	detect_mode = mode;
+}
+void MTCNN::SetCandidateLimits(int maxRNetInputs, int maxONetInputs){
+	max_candidates[0] = maxRNetInputs;
+	max_candidates[1] = maxONetInputs;
+}
+void MTCNN::SetScalePruning(int window, int probeInterval){
+	pruning_window = window;
+	pruning_probe = probeInterval;
+	std::fill(level_last_hit.begin(), level_last_hit.end(), pruning_frame);
+}
+ScalePruningStats MTCNN::GetScalePruningStats() const{
+	return pruning_stats;
+}
+// Orders boxes by descending score, keeping at most k of them when k > 0
+void MTCNN::keepTopK(vector<Bbox> &boxes, int k){
+    const auto higher = [](const Bbox &a, const Bbox &b) { return a.score > b.score; };
+    if (k > 0 && boxes.size() > (size_t)k) {
+        std::partial_sort(boxes.begin(), boxes.begin() + k, boxes.end(), higher);
+        boxes.resize(k);
+    } else {
+        std::sort(boxes.begin(), boxes.end(), higher);
+    }
+}
+void MTCNN::clearLandmarks(vector<Bbox> &boxes, size_t first){
+    for (size_t i = first; i < boxes.size(); i++) {
+        std::fill(boxes[i].landmark.x, boxes[i].landmark.x + 5, 0.0f);
+        std::fill(boxes[i].landmark.y, boxes[i].landmark.y + 5, 0.0f);
     }
 }
+void MTCNN::enterStage(int stage){
+    const std::vector<int> &cpus = stage_cpus[stage];
+    if (cpus.empty() && placed_cpus.empty())
+        return;
+    if (cpus == placed_cpus && stage_threads[stage] == placed_threads)
+        return;
+    SetOpenMpAffinity(cpus, stage_threads[stage]);
+    placed_cpus = cpus;
+    placed_threads = stage_threads[stage];
+}
+bool MTCNN::pastDeadline(){
+    if (has_deadline && std::chrono::steady_clock::now() >= deadline)
+        partial_ = true;
+    return partial_;
+}
+void MTCNN::generateBbox(ncnn::Mat score, ncnn::Mat location, std::vector<Bbox>& boundingBox_, float scale,
+                         int offset_x, int offset_y){
+    GenerateCandidates<PNET_STRIDE, PNET_CELL>(score, location, threshold[0], scale, offset_x, offset_y,
+                                               boundingBox_);
+}
 
 void MTCNN::nmsTwoBoxs(vector<Bbox>& boundingBox_, vector<Bbox>& previousBox_, const float overlap_threshold, string modelname)
 {
@@ -239,7 +324,8 @@ void MTCNN::PNet(float scale)
 	resize_bilinear(img, in, ws, hs);
 	ncnn::Extractor ex = Pnet.create_extractor();
 	ex.set_light_mode(true);
-	//sex.set_num_threads(4);
+	if (stage_threads[0] > 0)
+		ex.set_num_threads(stage_threads[0]);
 	ex.input("data", in);
 	ncnn::Mat score_, location_;
 	ex.extract("prob1", score_);
@@ -253,126 +339,368 @@ void MTCNN::PNet(float scale)
 	boundingBox_.clear();
 }
 
-void MTCNN::PNet(){
-    firstBbox_.clear();
+// Builds the pyramid for the current image size. Each level finds faces from
+// MIN_DET_SIZE / scale up to the next level's size; with face size regions a
+// level only covers the regions where those sizes are plausible, widened by
+// half its largest face so that faces centred near a region's edge fit.
+void MTCNN::planScales(){
+    scale_plan.clear();
+    plan_w = img_w;
+    plan_h = img_h;
+
+    int min_face = minsize, max_face = maxsize;
+    if (!face_size_regions.empty()) {
+        int region_min = INT_MAX, region_max = 0;
+        for (size_t i = 0; i < face_size_regions.size(); i++) {
+            region_min = std::min(region_min, face_size_regions[i].min_size);
+            region_max = std::max(region_max, face_size_regions[i].max_size);
+        }
+        // The minimum face still applies, so the quality controller can raise it
+        min_face = std::max(minsize, region_min);
+        max_face = maxsize > 0 ? std::min(maxsize, region_max) : region_max;
+    }
+    if (min_face < 1 || (max_face > 0 && max_face < min_face)) {
+        level_last_hit.clear();
+        return;
+    }
+
     float minl = img_w < img_h? img_w: img_h;
-    float m = (float)MIN_DET_SIZE/minsize;
+    float m = (float)MIN_DET_SIZE/min_face;
     minl *= m;
-    float factor = pre_facetor;
-    vector<float> scales_;
-    while(minl>MIN_DET_SIZE){
-        scales_.push_back(m);
-        minl *= factor;
-        m = m*factor;
+    for (; minl > MIN_DET_SIZE; minl *= pre_facetor, m *= pre_facetor) {
+        const float smallest = MIN_DET_SIZE / m;
+        const float largest = smallest / pre_facetor;
+        if (max_face > 0 && smallest > max_face)
+            break;
+
+        PyramidLevel level = {m, 0, 0, img_w, img_h};
+        if (!face_size_regions.empty()) {
+            const int margin = (int)ceil(largest * 0.5f);
+            int x1 = img_w, y1 = img_h, x2 = 0, y2 = 0;
+            for (size_t i = 0; i < face_size_regions.size(); i++) {
+                const FaceSizeRegion &r = face_size_regions[i];
+                if (smallest > r.max_size || largest <= r.min_size)
+                    continue;
+                x1 = std::min(x1, r.x1 - margin);
+                y1 = std::min(y1, r.y1 - margin);
+                x2 = std::max(x2, r.x2 + 1 + margin);
+                y2 = std::max(y2, r.y2 + 1 + margin);
+            }
+            level.x1 = std::max(x1, 0);
+            level.y1 = std::max(y1, 0);
+            level.x2 = std::min(x2, img_w);
+            level.y2 = std::min(y2, img_h);
+            if ((level.x2 - level.x1) * m < MIN_DET_SIZE || (level.y2 - level.y1) * m < MIN_DET_SIZE)
+                continue;
+        }
+        scale_plan.push_back(level);
+    }
+    // New levels get a full window before they can be pruned
+    level_last_hit.assign(scale_plan.size(), pruning_frame);
+}
+
+// Credits each face to the levels that can propose it: the level whose cell
+// size is just below the face's and its neighbours, since the regression
+// moves boxes by up to about one pyramid step
+void MTCNN::recordLevelHits(const std::vector<Bbox> &faces, float sizeScale){
+    for (size_t f = 0; f < faces.size(); f++) {
+        const float size = sizeScale * std::max(faces[f].x2 - faces[f].x1, faces[f].y2 - faces[f].y1);
+        for (size_t i = 0; i < scale_plan.size(); i++) {
+            const float cell = MIN_DET_SIZE / scale_plan[i].scale;
+            if (cell > size * pre_facetor * pre_facetor && cell <= size / pre_facetor)
+                level_last_hit[i] = pruning_frame;
+        }
     }
-    for (size_t i = 0; i < scales_.size(); i++) {
-        int hs = (int)ceil(img_h*scales_[i]);
-        int ws = (int)ceil(img_w*scales_[i]);
+}
+
+void MTCNN::PNet(){
+    DetectMetrics &metrics = GetDetectMetrics();
+    MetricTimer timer(*metrics.stage[0]);
+    firstBbox_.clear();
+    enterStage(0);
+    if (img_w != plan_w || img_h != plan_h)
+        planScales();
+    const bool pruning = pruning_window > 0 && !(pruning_probe > 0 && pruning_frame % pruning_probe == 0);
+    // Coarse levels are cheapest and find the largest faces, so they go first
+    for (size_t i = scale_plan.size(); i-- > 0; ) {
+        if (pastDeadline())
+            break;
+        if (pruning && pruning_frame - level_last_hit[i] >= pruning_window) {
+            pruning_stats.levels_skipped++;
+            metrics.levels_skipped->Add();
+            continue;
+        }
+        if (pruning_window > 0)
+            pruning_stats.levels_run++;
+        metrics.levels_run->Add();
+        const PyramidLevel &level = scale_plan[i];
+        const int w = level.x2 - level.x1;
+        const int h = level.y2 - level.y1;
+        int hs = (int)ceil(h*level.scale);
+        int ws = (int)ceil(w*level.scale);
         ncnn::Mat in;
-        resize_bilinear(img, in, ws, hs);
+        if (w == img_w && h == img_h) {
+            resize_bilinear(img, in, ws, hs);
+        } else {
+            ncnn::Mat band;
+            copy_cut_border(img, band, level.y1, img_h - level.y2, level.x1, img_w - level.x2);
+            resize_bilinear(band, in, ws, hs);
+        }
         ncnn::Extractor ex = Pnet.create_extractor();
-        //ex.set_num_threads(2);
+        if (stage_threads[0] > 0)
+            ex.set_num_threads(stage_threads[0]);
         ex.set_light_mode(true);
         ex.input("data", in);
         ncnn::Mat score_, location_;
         ex.extract("prob1", score_);
         ex.extract("conv4-2", location_);
         std::vector<Bbox> boundingBox_;
-        generateBbox(score_, location_, boundingBox_, scales_[i]);
+        generateBbox(score_, location_, boundingBox_, level.scale, level.x1, level.y1);
         nms(boundingBox_, nms_threshold[0]);
         firstBbox_.insert(firstBbox_.end(), boundingBox_.begin(), boundingBox_.end());
         boundingBox_.clear();
     }
 }
+// Crops a candidate and scales it to a SIZE x SIZE network input, in one pass
+// unless the box reaches outside the image
+template <int SIZE>
+static void cropInput(const ncnn::Mat &image, const Bbox &box, ncnn::Mat &in){
+    const int w = box.x2 - box.x1;
+    const int h = box.y2 - box.y1;
+    if (box.x1 >= 0 && box.y1 >= 0 && box.x2 <= image.w && box.y2 <= image.h && w >= 2 && h >= 2) {
+        ResizeCropBilinear<SIZE, SIZE>(image, box.x1, box.y1, w, h, in);
+        return;
+    }
+    ncnn::Mat tempIm;
+    copy_cut_border(image, tempIm, box.y1, image.h-box.y2, box.x1, image.w-box.x2);
+    resize_bilinear(tempIm, in, SIZE, SIZE);
+}
+// Scores one candidate with R-Net, updating its score and regression. Only
+// reads the image and the nets, so concurrent calls are safe.
+bool MTCNN::scoreRNet(const ncnn::Mat &image, Bbox &box) const{
+    ncnn::Mat in;
+    cropInput<RNET_SIZE>(image, box, in);
+    ncnn::Extractor ex = Rnet.create_extractor();
+    if (stage_threads[1] > 0)
+        ex.set_num_threads(stage_threads[1]);
+    ex.set_light_mode(true);
+    ex.input("data", in);
+    ncnn::Mat score, bbox;
+    ex.extract("prob1", score);
+    ex.extract("conv5-2", bbox);
+	if ((float)score[1] <= threshold[1])
+		return false;
+	for (int channel = 0; channel<4; channel++) {
+		box.regreCoord[channel] = (float)bbox[channel];//*(bbox.data+channel*bbox.cstep);
+	}
+	box.area = (box.x2 - box.x1)*(box.y2 - box.y1);
+	box.score = score.channel(1)[0];//*(score.data+score.cstep);
+	return true;
+}
+// Scores one candidate with O-Net, also filling in its landmarks
+bool MTCNN::scoreONet(const ncnn::Mat &image, Bbox &box) const{
+    ncnn::Mat in;
+    cropInput<ONET_SIZE>(image, box, in);
+    return runONet(in, box);
+}
+// The same from a full-resolution frame, which isn't normalized in advance
+bool MTCNN::scoreONet(const Yuv420Image &image, Bbox &box) const{
+    ncnn::Mat in;
+    ResizeCropYuv420<ONET_SIZE, ONET_SIZE>(image, box.x1, box.y1, box.x2 - box.x1, box.y2 - box.y1, in);
+    in.substract_mean_normalize(mean_vals, norm_vals);
+    return runONet(in, box);
+}
+bool MTCNN::runONet(const ncnn::Mat &in, Bbox &box) const{
+    ncnn::Extractor ex = Onet.create_extractor();
+    if (stage_threads[2] > 0)
+        ex.set_num_threads(stage_threads[2]);
+    ex.set_light_mode(true);
+    ex.input("data", in);
+    ncnn::Mat score, bbox, keyPoint;
+    ex.extract("prob1", score);
+    ex.extract("conv6-2", bbox);
+    ex.extract("conv6-3", keyPoint);
+	if ((float)score[1] <= threshold[2])
+		return false;
+	for (int channel = 0; channel < 4; channel++) {
+		box.regreCoord[channel] = (float)bbox[channel];
+	}
+	box.area = (box.x2 - box.x1) * (box.y2 - box.y1);
+	box.score = score.channel(1)[0];
+	for (int num = 0; num<5; num++) {
+		box.landmark.x[num] = box.x1 + (box.x2 - box.x1) * keyPoint[num];
+		box.landmark.y[num] = box.y1 + (box.y2 - box.y1) * keyPoint[num + 5];
+	}
+	return true;
+}
 void MTCNN::RNet(){
+    DetectMetrics &metrics = GetDetectMetrics();
+    MetricTimer timer(*metrics.stage[1]);
+    metrics.candidates[0]->Record(static_cast<uint64_t>(firstBbox_.size()));
     secondBbox_.clear();
-    int count = 0;
+    enterStage(1);
     for(vector<Bbox>::iterator it=firstBbox_.begin(); it!=firstBbox_.end();it++){
-        ncnn::Mat tempIm;
-        copy_cut_border(img, tempIm, (*it).y1, img_h-(*it).y2, (*it).x1, img_w-(*it).x2);
-        ncnn::Mat in;
-        resize_bilinear(tempIm, in, 24, 24);
-        ncnn::Extractor ex = Rnet.create_extractor();
-		//ex.set_num_threads(2);
-        ex.set_light_mode(true);
-        ex.input("data", in);
-        ncnn::Mat score, bbox;
-        ex.extract("prob1", score);
-        ex.extract("conv5-2", bbox);
-		if ((float)score[1] > threshold[1]) {
-			for (int channel = 0; channel<4; channel++) {
-				it->regreCoord[channel] = (float)bbox[channel];//*(bbox.data+channel*bbox.cstep);
-			}
-			it->area = (it->x2 - it->x1)*(it->y2 - it->y1);
-			it->score = score.channel(1)[0];//*(score.data+score.cstep);
-			secondBbox_.push_back(*it);
-		}
+        if (pastDeadline())
+            break;
+        if (scoreRNet(img, *it))
+            secondBbox_.push_back(*it);
     }
 }
-void MTCNN::ONet(){
+void MTCNN::ONet(const Yuv420Image *fullImage){
+    DetectMetrics &metrics = GetDetectMetrics();
+    MetricTimer timer(*metrics.stage[2]);
+    metrics.candidates[1]->Record(static_cast<uint64_t>(secondBbox_.size()));
     thirdBbox_.clear();
-    for(vector<Bbox>::iterator it=secondBbox_.begin(); it!=secondBbox_.end();it++){
-        ncnn::Mat tempIm;
-        copy_cut_border(img, tempIm, (*it).y1, img_h-(*it).y2, (*it).x1, img_w-(*it).x2);
-        ncnn::Mat in;
-        resize_bilinear(tempIm, in, 48, 48);
-        ncnn::Extractor ex = Onet.create_extractor();
-		//ex.set_num_threads(2);
-        ex.set_light_mode(true);
-        ex.input("data", in);
-        ncnn::Mat score, bbox, keyPoint;
-        ex.extract("prob1", score);
-        ex.extract("conv6-2", bbox);
-        ex.extract("conv6-3", keyPoint);
-		if ((float)score[1] > threshold[2]) {
-			for (int channel = 0; channel < 4; channel++) {
-				it->regreCoord[channel] = (float)bbox[channel];
-			}
-			it->area = (it->x2 - it->x1) * (it->y2 - it->y1);
-			it->score = score.channel(1)[0];
-			for (int num = 0; num<5; num++) {
-				//(it->ppoint)[num] = it->x1 + (it->x2 - it->x1) * keyPoint[num];
-				it->landmark.x[num] = it->x1 + (it->x2 - it->x1) * keyPoint[num];
-				//(it->ppoint)[num + 5] = it->y1 + (it->y2 - it->y1) * keyPoint[num + 5];
-				it->landmark.y[num] = it->y1 + (it->y2 - it->y1) * keyPoint[num + 5];
-			}
-
-			thirdBbox_.push_back(*it);
-		}
+    onet_inputs = 0;
+    enterStage(2);
+    for(vector<Bbox>::iterator it=secondBbox_.begin(); it!=secondBbox_.end();it++, onet_inputs++){
+        if (pastDeadline())
+            break;
+        if (fullImage ? scoreONet(*fullImage, *it) : scoreONet(img, *it))
+            thirdBbox_.push_back(*it);
     }
 }
-void MTCNN::detect(ncnn::Mat& img_, std::vector<Bbox>& finalBbox_){
+void MTCNN::prepare(ncnn::Mat& img_){
     img = img_;
     img_w = img.w;
     img_h = img.h;
     img.substract_mean_normalize(mean_vals, norm_vals);
+}
+void MTCNN::propose(ncnn::Mat& img_, std::vector<Bbox>& candidates){
+    has_deadline = false;
+    partial_ = false;
+    prepare(img_);
+    PNet();
+    if (!firstBbox_.empty()) {
+        nms(firstBbox_, nms_threshold[0]);
+        refine(firstBbox_, img_h, img_w, true);
+        keepTopK(firstBbox_, max_candidates[0]);
+    }
+    candidates.swap(firstBbox_);
+}
+void MTCNN::detect(ncnn::Mat& img_, std::vector<Bbox>& finalBbox_){
+    bool partial;
+    detect(img_, finalBbox_, 0.0f, partial);
+}
+void MTCNN::detect(ncnn::Mat& img_, std::vector<Bbox>& finalBbox_, float budgetMs, bool &partial){
+    detectImage(img_, NULL, finalBbox_, budgetMs, partial);
+}
+void MTCNN::detect(ncnn::Mat& img_, const Yuv420Image &fullImage, std::vector<Bbox>& finalBbox_, float budgetMs,
+                   bool &partial){
+    detectImage(img_, &fullImage, finalBbox_, budgetMs, partial);
+}
+void MTCNN::detectImage(ncnn::Mat& img_, const Yuv420Image *fullImage, std::vector<Bbox>& finalBbox_,
+                        float budgetMs, bool &partial){
+    DetectMetrics &metrics = GetDetectMetrics();
+    MetricTimer timer(*metrics.detect);
+    metrics.frames->Add();
+    if (pruning_window <= 0) {
+        detectCascade(img_, fullImage, finalBbox_, budgetMs, partial);
+    } else {
+        pruning_frame++;
+        pruning_stats.frames++;
+        if (pruning_probe > 0 && pruning_frame % pruning_probe == 0)
+            pruning_stats.probe_frames++;
+        // The cascade leaves finalBbox_ alone when it finds nothing
+        std::vector<Bbox> faces;
+        detectCascade(img_, fullImage, faces, budgetMs, partial);
+        // The pyramid levels are those of img_
+        recordLevelHits(faces, fullImage ? (float)img_w / fullImage->width : 1.0f);
+        if (!faces.empty())
+            finalBbox_.swap(faces);
+    }
+    if (partial)
+        metrics.partial->Add();
+}
+// Maps boxes and their landmarks to an image scaleX by scaleY times the size,
+// keeping them inside its width x height
+void MTCNN::scaleBoxes(vector<Bbox> &boxes, float scaleX, float scaleY, int width, int height){
+    for (size_t i = 0; i < boxes.size(); i++) {
+        Bbox &box = boxes[i];
+        box.x1 = std::max((int)round(box.x1 * scaleX), 0);
+        box.y1 = std::max((int)round(box.y1 * scaleY), 0);
+        box.x2 = std::min((int)round(box.x2 * scaleX), width - 1);
+        box.y2 = std::min((int)round(box.y2 * scaleY), height - 1);
+        box.area = (box.x2 - box.x1) * (box.y2 - box.y1);
+        for (int j = 0; j < 5; j++) {
+            box.landmark.x[j] *= scaleX;
+            box.landmark.y[j] *= scaleY;
+        }
+    }
+}
+void MTCNN::detectCascade(ncnn::Mat& img_, const Yuv420Image *fullImage, std::vector<Bbox>& finalBbox_,
+                          float budgetMs, bool &partial){
+    has_deadline = budgetMs > 0;
+    if (has_deadline)
+        deadline = std::chrono::steady_clock::now() +
+            std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                std::chrono::duration<float, std::milli>(budgetMs));
+    partial_ = false;
+    partial = false;
+
+    prepare(img_);
 
     PNet();
     //the first stage's nms
-    if(firstBbox_.size() < 1) return;
+    if(firstBbox_.size() < 1) { partial = partial_; return; }
     nms(firstBbox_, nms_threshold[0]);
     refine(firstBbox_, img_h, img_w, true);
+    keepTopK(firstBbox_, max_candidates[0]);
     //printf("firstBbox_.size()=%d\n", firstBbox_.size());
+    if (detect_mode == DETECT_PNET) {
+        clearLandmarks(firstBbox_);
+        if (fullImage)
+            scaleBoxes(firstBbox_, (float)fullImage->width / img_w, (float)fullImage->height / img_h,
+                       fullImage->width, fullImage->height);
+        finalBbox_ = firstBbox_;
+        partial = partial_;
+        return;
+    }
 
 
     //second stage
     RNet();
     //printf("secondBbox_.size()=%d\n", secondBbox_.size());
-    if(secondBbox_.size() < 1) return;
+    // P-Net's boxes that R-Net didn't reach are left out even when the
+    // deadline cut it short; at P-Net's threshold most aren't faces
+    if(secondBbox_.size() < 1) { partial = partial_; return; }
     nms(secondBbox_, nms_threshold[1]);
     refine(secondBbox_, img_h, img_w, true);
+    keepTopK(secondBbox_, max_candidates[1]);
+    if (detect_mode == DETECT_RNET) {
+        // The same final suppression as O-Net's, without its extra refinement
+        nms(secondBbox_, nms_threshold[2], "Min");
+        clearLandmarks(secondBbox_);
+        if (fullImage)
+            scaleBoxes(secondBbox_, (float)fullImage->width / img_w, (float)fullImage->height / img_h,
+                       fullImage->width, fullImage->height);
+        finalBbox_ = secondBbox_;
+        partial = partial_;
+        return;
+    }
+    // O-Net refines the boxes R-Net left at the full resolution
+    if (fullImage)
+        scaleBoxes(secondBbox_, (float)fullImage->width / img_w, (float)fullImage->height / img_h,
+                   fullImage->width, fullImage->height);
 
     //third stage 
-    ONet();
+    ONet(fullImage);
     //printf("thirdBbox_.size()=%d\n", thirdBbox_.size());
+    partial = partial_;
+    if (partial) {
+        // The boxes O-Net didn't reach are R-Net's best guesses; their
+        // regression has already been applied
+        const size_t first = thirdBbox_.size();
+        thirdBbox_.insert(thirdBbox_.end(), secondBbox_.begin() + onet_inputs, secondBbox_.end());
+        for (size_t i = first; i < thirdBbox_.size(); i++)
+            std::fill(thirdBbox_[i].regreCoord, thirdBbox_[i].regreCoord + 4, 0.0f);
+        clearLandmarks(thirdBbox_, first);
+    }
     if(thirdBbox_.size() < 1) return;
-    refine(thirdBbox_, img_h, img_w, true);
+    if (fullImage)
+        refine(thirdBbox_, fullImage->height, fullImage->width, true);
+    else
+        refine(thirdBbox_, img_h, img_w, true);
     nms(thirdBbox_, nms_threshold[2], "Min");
     finalBbox_ = thirdBbox_;
 }
-
-
-
-
-
-
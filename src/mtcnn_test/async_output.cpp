@@ -0,0 +1,190 @@
+/**
+ * @internal
+ * @file       async_output.cpp
+ * @copyright  VCA Technology
+ * @~english
+ * @brief      Implementation of the @c AsyncOutput class.
+ */
+
+#include <cstring>
+#include <stdexcept>
+
+#include "async_output.hpp"
+#include "metrics.h"
+
+struct OutputMetrics {
+  MetricGauge *queue_depth;
+  MetricHistogram *write;
+  MetricCounter *pushed, *written, *dropped;
+};
+
+static OutputMetrics& GetOutputMetrics() {
+  static MetricsRegistry &r = MetricsRegistry::Global();
+  static const char *const help = "Frames by what the video output did with them";
+  static OutputMetrics metrics = {
+    &r.Gauge("mtcnn_output_queue_depth", "Frames queued for the video output writer thread"),
+    &r.Histogram("mtcnn_output_write_seconds", "Time taken by each write to the video output"),
+    &r.Counter("mtcnn_output_frames_total", help, "state=\"pushed\""),
+    &r.Counter("mtcnn_output_frames_total", help, "state=\"written\""),
+    &r.Counter("mtcnn_output_frames_total", help, "state=\"dropped\""),
+  };
+  return metrics;
+}
+
+AsyncOutput::AsyncOutput(unsigned int width, unsigned int height, std::unique_ptr<VideoOutput> output,
+    unsigned int slot_count, DropPolicy policy, std::chrono::milliseconds stall_threshold) :
+  VideoOutput(width, height),
+  output_(std::move(output)),
+  slot_count_(slot_count),
+  policy_(policy),
+  stall_threshold_(stall_threshold),
+  slots_(),
+  free_slots_(),
+  queue_(slot_count),
+  queue_head_(0),
+  queue_count_(0),
+  stopping_(false),
+  error_(),
+  statistics_{0, 0, 0, 0, 0},
+  thread_() {
+  if (!output_ || slot_count_ == 0)
+    throw std::invalid_argument("Asynchronous output needs an output and at least one slot");
+
+  slots_.reset(new uint8_t[buffer_size_ * slot_count_]);
+  free_slots_.reserve(slot_count_);
+  for (unsigned int i = 0; i != slot_count_; i++)
+    free_slots_.push_back(i);
+
+  thread_ = std::thread(&AsyncOutput::Run, this);
+}
+
+AsyncOutput::~AsyncOutput() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  queued_condition_.notify_one();
+  thread_.join();
+}
+
+void AsyncOutput::PushFrame(const uint8_t *buffer_data) {
+  OutputMetrics &metrics = GetOutputMetrics();
+  metrics.pushed->Add();
+  unsigned int slot;
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (error_)
+      std::rethrow_exception(error_);
+
+    statistics_.pushed_frames++;
+
+    if (free_slots_.empty()) {
+      switch (policy_) {
+       case DropPolicy::DropNewest:
+        statistics_.dropped_frames++;
+        metrics.dropped->Add();
+        return;
+       case DropPolicy::DropOldest:
+        // Slots already handed to the writer can't be reclaimed
+        if (queue_count_ == 0) {
+          statistics_.dropped_frames++;
+          metrics.dropped->Add();
+          return;
+        }
+        free_slots_.push_back(queue_[queue_head_]);
+        queue_head_ = (queue_head_ + 1) % slot_count_;
+        queue_count_--;
+        statistics_.dropped_frames++;
+        metrics.dropped->Add();
+        break;
+       case DropPolicy::Block:
+        statistics_.blocked_pushes++;
+        free_condition_.wait(lock, [this]() { return !free_slots_.empty() || error_; });
+        if (error_)
+          std::rethrow_exception(error_);
+        break;
+      }
+    }
+
+    slot = free_slots_.back();
+    free_slots_.pop_back();
+  }
+
+  // The slot belongs to this thread until it is queued
+  std::memcpy(slots_.get() + slot * buffer_size_, buffer_data, buffer_size_);
+
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    queue_[(queue_head_ + queue_count_) % slot_count_] = slot;
+    queue_count_++;
+    metrics.queue_depth->Set(queue_count_);
+  }
+  queued_condition_.notify_one();
+}
+
+void AsyncOutput::Flush() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  // Every slot is free again once the writer is idle
+  free_condition_.wait(lock, [this]() { return free_slots_.size() == slot_count_ || error_; });
+}
+
+AsyncOutput::Statistics AsyncOutput::GetStatistics() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return statistics_;
+}
+
+void AsyncOutput::Run() {
+  OutputMetrics &metrics = GetOutputMetrics();
+  std::vector<unsigned int> batch;
+  std::vector<const uint8_t*> buffers;
+  batch.reserve(slot_count_);
+  buffers.reserve(slot_count_);
+
+  for (;;) {
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      queued_condition_.wait(lock, [this]() { return queue_count_ != 0 || stopping_; });
+      if (queue_count_ == 0)
+        return;
+
+      // Take everything queued so the output can write it in one call
+      batch.clear();
+      for (; queue_count_ != 0; queue_count_--) {
+        batch.push_back(queue_[queue_head_]);
+        queue_head_ = (queue_head_ + 1) % slot_count_;
+      }
+      metrics.queue_depth->Set(0);
+    }
+
+    buffers.clear();
+    for (const unsigned int slot : batch)
+      buffers.push_back(slots_.get() + slot * buffer_size_);
+
+    bool failed = false;
+    const auto begin = std::chrono::steady_clock::now();
+    try {
+      output_->PushFrames(buffers.data(), buffers.size());
+    } catch (...) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      error_ = std::current_exception();
+      failed = true;
+    }
+    const auto elapsed = std::chrono::steady_clock::now() - begin;
+    metrics.write->Record(elapsed);
+    if (!failed)
+      metrics.written->Add(batch.size());
+
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (!failed)
+        statistics_.written_frames += batch.size();
+      if (elapsed > stall_threshold_ * batch.size())
+        statistics_.write_stalls++;
+      free_slots_.insert(free_slots_.end(), batch.begin(), batch.end());
+    }
+    free_condition_.notify_all();
+
+    if (failed)
+      return;
+  }
+}
@@ -0,0 +1,78 @@
+#pragma once
+/**
+ * @internal
+ * @file       async_output.hpp
+ * @copyright  VCA Technology
+ * @~english
+ * @brief      Declaration of the @c AsyncOutput class.
+ */
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "video_output.hpp"
+
+/**
+ * Decouples a @c VideoOutput from the caller. Frames are copied into a fixed
+ * ring of preallocated slots and written by a dedicated thread, so a stalled
+ * viewer only costs the caller a memcpy, or a drop, depending on the policy.
+ */
+class AsyncOutput final : public VideoOutput {
+ public:
+  enum class DropPolicy {
+    DropNewest,  ///< Discard the frame being pushed when the ring is full
+    DropOldest,  ///< Discard the oldest frame not yet being written
+    Block,       ///< Wait for the writer to free a slot
+  };
+
+  struct Statistics {
+    uint64_t pushed_frames;
+    uint64_t written_frames;
+    uint64_t dropped_frames;
+    uint64_t blocked_pushes;  ///< Pushes that waited for a free slot
+    uint64_t write_stalls;    ///< Writes to the output slower than the stall threshold
+  };
+
+ public:
+  AsyncOutput(unsigned int width, unsigned int height, std::unique_ptr<VideoOutput> output,
+      unsigned int slot_count, DropPolicy policy,
+      std::chrono::milliseconds stall_threshold = std::chrono::milliseconds(100));
+
+  /// Writes out any frames still queued, then stops the writer thread.
+  ~AsyncOutput();
+
+  /// Rethrows the error if a previous write on the writer thread failed.
+  void PushFrame(const uint8_t *buffer_data);
+
+  /// Waits until every queued frame has been written, or a write failed.
+  void Flush();
+
+  Statistics GetStatistics() const;
+
+ private:
+  void Run();
+
+ private:
+  const std::unique_ptr<VideoOutput> output_;
+  const unsigned int slot_count_;
+  const DropPolicy policy_;
+  const std::chrono::milliseconds stall_threshold_;
+  std::unique_ptr<uint8_t[]> slots_;
+
+  mutable std::mutex mutex_;
+  std::condition_variable queued_condition_, free_condition_;
+  std::vector<unsigned int> free_slots_;
+  std::vector<unsigned int> queue_;  // ring of queued slot indices
+  unsigned int queue_head_, queue_count_;
+  bool stopping_;
+  std::exception_ptr error_;
+  Statistics statistics_;
+
+  std::thread thread_;
+};
@@ -0,0 +1,760 @@
+/**
+ * @file      batch_face.cpp
+ * @copyright UDP Technology Ltd.
+ * @~english
+ * @brief     Batch face detection over stored images
+ *
+ * Images are decoded by one pool of threads and handed through a bounded queue
+ * to a second pool, where every thread owns its own @c MTCNN detector. The two
+ * pools are sized separately so that decode-bound and detect-bound workloads
+ * can both keep every core busy.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <dirent.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/highgui/highgui.hpp>
+
+#include "async_detector.h"
+#include "detection_cache.h"
+#include "face_align.h"
+#include "mtcnn.h"
+#include "placement.hpp"
+
+using Clock = std::chrono::steady_clock;
+
+static const char *const ImageExtensions[] = {
+  ".jpg", ".jpeg", ".png", ".bmp", ".tif", ".tiff", ".webp"
+};
+
+struct DecodedImage {
+  size_t index;
+  ncnn::Mat image;
+  cv::Mat bgr;  // Kept only when exporting aligned crops
+  DetectionCache::Key cache_key;
+  Clock::time_point start;
+  Clock::time_point decoded;
+};
+
+/**
+ * @brief Bounded hand-over of decoded images from the decode to the detect pool
+ *
+ * The capacity bounds the memory held by decoded but not yet detected images.
+ */
+class ImageQueue {
+ public:
+  explicit ImageQueue(size_t capacity) : capacity_(capacity) {}
+
+  void Push(DecodedImage &&image) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    not_full_.wait(lock, [this]{ return images_.size() < capacity_; });
+    images_.push_back(std::move(image));
+    not_empty_.notify_one();
+  }
+
+  // Returns false once the queue is closed and drained
+  bool Pop(DecodedImage &image) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    not_empty_.wait(lock, [this]{ return !images_.empty() || closed_; });
+    if (images_.empty())
+      return false;
+    image = std::move(images_.front());
+    images_.pop_front();
+    not_full_.notify_one();
+    return true;
+  }
+
+  void Close() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    closed_ = true;
+    not_empty_.notify_all();
+  }
+
+ private:
+  const size_t capacity_;
+  std::mutex mutex_;
+  std::condition_variable not_full_, not_empty_;
+  std::deque<DecodedImage> images_;
+  bool closed_ = false;
+};
+
+struct Sample {
+  double decode_ms;
+  double queue_ms;
+  double detect_ms;
+  double total_ms;
+};
+
+struct PassSummary {
+  double images_per_second;
+  double detect_p50;
+  double detect_p99;
+  double total_p99;
+};
+
+struct WorkerResult {
+  std::vector<Sample> samples;
+  std::chrono::nanoseconds cpu_time{0};
+  size_t faces = 0;
+};
+
+static std::chrono::nanoseconds GetCpuTime(clockid_t clock) {
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+  return std::chrono::seconds(ts.tv_sec) + std::chrono::nanoseconds(ts.tv_nsec);
+}
+
+static double ToMilliseconds(Clock::duration duration) {
+  return std::chrono::duration<double, std::milli>(duration).count();
+}
+
+static bool HasImageExtension(const std::string &path) {
+  const size_t dot = path.rfind('.');
+  if (dot == std::string::npos)
+    return false;
+  std::string extension = path.substr(dot);
+  std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+  for (const char *e : ImageExtensions)
+    if (extension == e)
+      return true;
+  return false;
+}
+
+static void ListImages(const std::string &path, std::vector<std::string> &paths) {
+  DIR *const dir = opendir(path.c_str());
+  if (!dir) {
+    std::ostringstream ss;
+    ss << "Failed to open directory " << path << ": " << std::strerror(errno);
+    throw std::runtime_error(ss.str());
+  }
+
+  std::vector<std::string> entries;
+  while (const struct dirent *entry = readdir(dir)) {
+    if (std::strcmp(entry->d_name, ".") != 0 && std::strcmp(entry->d_name, "..") != 0)
+      entries.push_back(path + '/' + entry->d_name);
+  }
+  closedir(dir);
+
+  // Sorted, so that runs over the same tree produce the same order
+  std::sort(entries.begin(), entries.end());
+  for (const auto &entry : entries) {
+    struct stat st;
+    if (stat(entry.c_str(), &st) != 0)
+      continue;
+    if (S_ISDIR(st.st_mode))
+      ListImages(entry, paths);
+    else if (S_ISREG(st.st_mode) && HasImageExtension(entry))
+      paths.push_back(entry);
+  }
+}
+
+static void AddPath(const std::string &path, std::vector<std::string> &paths) {
+  struct stat st;
+  if (stat(path.c_str(), &st) == 0 && S_ISDIR(st.st_mode))
+    ListImages(path, paths);
+  else
+    paths.push_back(path);
+}
+
+static void ReadList(std::istream &list, std::vector<std::string> &paths) {
+  std::string line;
+  while (std::getline(list, line)) {
+    if (!line.empty() && line.back() == '\r')
+      line.pop_back();
+    if (!line.empty() && line[0] != '#')
+      AddPath(line, paths);
+  }
+}
+
+static void AppendJsonString(std::string &out, const std::string &s) {
+  static const char hex[] = "0123456789abcdef";
+  out += '"';
+  for (const char c : s) {
+    switch (c) {
+      case '"': out += "\\\""; break;
+      case '\\': out += "\\\\"; break;
+      case '\n': out += "\\n"; break;
+      case '\r': out += "\\r"; break;
+      case '\t': out += "\\t"; break;
+      default:
+        if (static_cast<unsigned char>(c) < 0x20) {
+          out += "\\u00";
+          out += hex[(c >> 4) & 0xf];
+          out += hex[c & 0xf];
+        } else {
+          out += c;
+        }
+    }
+  }
+  out += '"';
+}
+
+static std::string FormatResult(const std::string &path, const ncnn::Mat &image,
+    const std::vector<Bbox> &boxes) {
+  std::ostringstream ss;
+  ss << std::fixed << std::setprecision(1);
+  for (size_t i = 0; i != boxes.size(); i++) {
+    const Bbox &box = boxes[i];
+    ss << (i ? ",{" : "{") << "\"x1\":" << box.x1 << ",\"y1\":" << box.y1 << ",\"x2\":" << box.x2 <<
+        ",\"y2\":" << box.y2 << ",\"score\":" << std::setprecision(4) << box.score << std::setprecision(1) <<
+        ",\"landmarks\":[";
+    for (int j = 0; j != 5; j++)
+      ss << (j ? "," : "") << box.landmark.x[j] << ',' << box.landmark.y[j];
+    ss << "]}";
+  }
+
+  std::string line = "{\"file\":";
+  AppendJsonString(line, path);
+  line += ",\"width\":" + std::to_string(image.w) + ",\"height\":" + std::to_string(image.h) +
+      ",\"faces\":[" + ss.str() + "]}\n";
+  return line;
+}
+
+static std::string FormatFailure(const std::string &path) {
+  std::string line = "{\"file\":";
+  AppendJsonString(line, path);
+  line += ",\"error\":\"decode failed\"}\n";
+  return line;
+}
+
+// Returns the nearest-rank percentile of sorted values
+static double Percentile(const std::vector<double> &sorted, double p) {
+  if (sorted.empty())
+    return 0.0;
+  const size_t rank = static_cast<size_t>(std::ceil(p / 100.0 * sorted.size()));
+  return sorted[std::min(std::max<size_t>(rank, 1), sorted.size()) - 1];
+}
+
+static void PrintLatency(const char *name, std::vector<double> values) {
+  std::sort(values.begin(), values.end());
+  std::cerr << "  " << std::left << std::setw(8) << name << std::right << std::fixed << std::setprecision(2) <<
+      std::setw(10) << Percentile(values, 50) << std::setw(10) << Percentile(values, 90) <<
+      std::setw(10) << Percentile(values, 99) << std::setw(10) << (values.empty() ? 0.0 : values.back()) <<
+      std::endl;
+}
+
+static void PrintCpuTime(const char *name, std::chrono::nanoseconds time, std::chrono::nanoseconds total) {
+  const double seconds = std::chrono::duration<double>(time).count();
+  std::cerr << "  " << std::left << std::setw(8) << name << std::right << std::fixed << std::setprecision(2) <<
+      std::setw(10) << seconds << "s" << std::setw(8) << std::setprecision(1) <<
+      (total.count() ? 100.0 * time.count() / total.count() : 0.0) << '%' << std::endl;
+}
+
+static void Usage(std::ostream &o, const char *argv0) {
+  o << "Usage: " << argv0 << " [OPTIONS...] PATH...\n"
+    "\n"
+    "Detects faces in stored images\n"
+    "\n"
+    "  PATH               An image file, or a directory searched recursively for\n"
+    "                     images\n"
+    "\n"
+    "Options:\n"
+    "  -l,--list FILE     Reads image paths or directories from FILE, one per\n"
+    "                     line, or from stdin if FILE is -\n"
+    "  -o,--output FILE   Writes one JSON object per image to FILE, or to stdout\n"
+    "                     if FILE is - (default: -)\n"
+    "  -m,--models DIR    Directory holding the MTCNN models (default: ../models)\n"
+    "  --decode-threads N Number of image decoding threads (default: 2)\n"
+    "  --detect-threads N Number of detection threads, each with its own\n"
+    "                     detector (default: one per core)\n"
+    "  --ncnn-threads N   Threads used by each detector, 0 for the ncnn default\n"
+    "                     (default: 1)\n"
+    "  --queue N          Number of decoded images waiting for detection\n"
+    "                     (default: twice the detection threads)\n"
+    "  --min-face SIZE    Smallest face to detect in pixels (default: 40)\n"
+    "  --detect-mode {pnet,rnet,full}\n"
+    "                     Stops the cascade after P-Net or R-Net, giving coarser\n"
+    "                     boxes without landmarks (default: full)\n"
+    "  --async            Detection threads submit to one shared asynchronous\n"
+    "                     detector that batches R-Net and O-Net crops across\n"
+    "                     images, instead of each owning a detector\n"
+    "  --pnet-threads N   P-Net threads of the asynchronous detector (default: 2)\n"
+    "  --batch-threads N  R-Net and O-Net batch threads of the asynchronous\n"
+    "                     detector (default: 2)\n"
+    "  --batch-size N     Most crops in one batch (default: 64)\n"
+    "  --batch-wait US    Longest a crop waits for its batch to fill\n"
+    "                     (default: 2000)\n"
+    "  --placement POLICY[,POLICY...]\n"
+    "                     Pins the pipeline to the detected CPU clusters: none,\n"
+    "                     big, little, or split with P-Net on the big cluster\n"
+    "                     and the rest on the LITTLE. Several policies run the\n"
+    "                     list once each and compare them; only the first pass\n"
+    "                     writes results and reads the images cold, so repeat\n"
+    "                     it to warm the cache (default: none)\n"
+    "  --pnet-cpus CPUS   CPUs running P-Net, as big, little, all or a list such\n"
+    "                     as 0-1,4; overrides the policy\n"
+    "  --refine-cpus CPUS CPUs running R-Net and O-Net\n"
+    "  --decode-cpus CPUS CPUs running the decode threads\n"
+    "  --output-cpus CPUS CPUs running the threads that wait for the\n"
+    "                     asynchronous detector and write results\n"
+    "  --cache KB         Reuses the detections of images whose pixels are\n"
+    "                     identical to a recent image, keeping at most KB\n"
+    "                     kilobytes of results (default: 0, disabled)\n"
+    "  --cache-distance N Also reuses the detections of images of the same size\n"
+    "                     whose difference hash is within N bits\n"
+    "  --crops DIR        Writes every face aligned to a 112x112 crop as\n"
+    "                     DIR/IMAGE_FACE.png, numbered in input order; needs the\n"
+    "                     landmarks of --detect-mode full\n"
+    "\n"
+    "\n";
+}
+
+static bool ParseDetectMode(const std::string &name, DetectMode &mode) {
+  if (name == "pnet")
+    mode = DETECT_PNET;
+  else if (name == "rnet")
+    mode = DETECT_RNET;
+  else if (name == "full")
+    mode = DETECT_FULL;
+  else
+    return false;
+  return true;
+}
+
+static bool ParseCount(const char *name, int argc, const char *const *argv, int &arg, unsigned int &value) {
+  if (arg + 1 == argc) {
+    std::cerr << "No " << name << " specified" << std::endl;
+    return false;
+  }
+  const char *s = argv[++arg];
+  if (std::sscanf(s, "%u", &value) != 1) {
+    std::cerr << "Failed to parse " << name << ": " << s << std::endl;
+    return false;
+  }
+  return true;
+}
+
+int main(int argc, const char *const *const argv) {
+  std::vector<std::string> paths;
+  std::string output_path = "-";
+  std::string model_path = "../models";
+  unsigned int decode_threads = 2;
+  unsigned int detect_threads = std::max(1u, std::thread::hardware_concurrency());
+  unsigned int ncnn_threads = 1;
+  unsigned int queue_size = 0;
+  unsigned int min_face = 40;
+  std::string crops_path;
+  bool use_async = false;
+  DetectMode detect_mode = DETECT_FULL;
+  unsigned int cache_size_kb = 0;
+  unsigned int cache_distance = 0;
+  bool perceptual_cache = false;
+  AsyncDetector::Options async_options;
+  unsigned int pnet_threads = async_options.pnet_threads;
+  unsigned int batch_threads = async_options.batch_threads;
+  unsigned int batch_size = async_options.max_batch;
+  unsigned int batch_wait = async_options.max_wait_us;
+  std::string placement_policies = "none";
+  std::string pnet_cpus, refine_cpus, decode_cpus, output_cpus;
+
+  if (argc == 2 && (std::strcmp(argv[1], "-h") == 0 || std::strcmp(argv[1], "--help") == 0)) {
+    Usage(std::cout, argv[0]);
+    return EXIT_SUCCESS;
+  }
+
+  try {
+    for (int arg = 1; arg != argc; arg++) {
+      if (std::strcmp(argv[arg], "-l") == 0 || std::strcmp(argv[arg], "--list") == 0) {
+        if (arg + 1 == argc) {
+          std::cerr << "No list file specified" << std::endl;
+          return EXIT_FAILURE;
+        }
+        const std::string list_path = argv[++arg];
+        if (list_path == "-") {
+          ReadList(std::cin, paths);
+        } else {
+          std::ifstream list(list_path);
+          if (!list) {
+            std::cerr << "Failed to open list file: " << list_path << std::endl;
+            return EXIT_FAILURE;
+          }
+          ReadList(list, paths);
+        }
+      } else if (std::strcmp(argv[arg], "-o") == 0 || std::strcmp(argv[arg], "--output") == 0) {
+        if (arg + 1 == argc) {
+          std::cerr << "No output file specified" << std::endl;
+          return EXIT_FAILURE;
+        }
+        output_path = argv[++arg];
+      } else if (std::strcmp(argv[arg], "-m") == 0 || std::strcmp(argv[arg], "--models") == 0) {
+        if (arg + 1 == argc) {
+          std::cerr << "No model directory specified" << std::endl;
+          return EXIT_FAILURE;
+        }
+        model_path = argv[++arg];
+      } else if (std::strcmp(argv[arg], "--decode-threads") == 0) {
+        if (!ParseCount("decode thread count", argc, argv, arg, decode_threads))
+          return EXIT_FAILURE;
+      } else if (std::strcmp(argv[arg], "--detect-threads") == 0) {
+        if (!ParseCount("detect thread count", argc, argv, arg, detect_threads))
+          return EXIT_FAILURE;
+      } else if (std::strcmp(argv[arg], "--ncnn-threads") == 0) {
+        if (!ParseCount("ncnn thread count", argc, argv, arg, ncnn_threads))
+          return EXIT_FAILURE;
+      } else if (std::strcmp(argv[arg], "--queue") == 0) {
+        if (!ParseCount("queue size", argc, argv, arg, queue_size))
+          return EXIT_FAILURE;
+      } else if (std::strcmp(argv[arg], "--min-face") == 0) {
+        if (!ParseCount("minimum face size", argc, argv, arg, min_face))
+          return EXIT_FAILURE;
+      } else if (std::strcmp(argv[arg], "--detect-mode") == 0) {
+        if (arg + 1 == argc) {
+          std::cerr << "No detection mode specified" << std::endl;
+          return EXIT_FAILURE;
+        } else if (!ParseDetectMode(argv[++arg], detect_mode)) {
+          std::cerr << "Unsupported detection mode: " << argv[arg] << std::endl;
+          return EXIT_FAILURE;
+        }
+      } else if (std::strcmp(argv[arg], "--async") == 0) {
+        use_async = true;
+      } else if (std::strcmp(argv[arg], "--pnet-threads") == 0) {
+        if (!ParseCount("P-Net thread count", argc, argv, arg, pnet_threads))
+          return EXIT_FAILURE;
+      } else if (std::strcmp(argv[arg], "--batch-threads") == 0) {
+        if (!ParseCount("batch thread count", argc, argv, arg, batch_threads))
+          return EXIT_FAILURE;
+      } else if (std::strcmp(argv[arg], "--batch-size") == 0) {
+        if (!ParseCount("batch size", argc, argv, arg, batch_size))
+          return EXIT_FAILURE;
+      } else if (std::strcmp(argv[arg], "--batch-wait") == 0) {
+        if (!ParseCount("batch wait", argc, argv, arg, batch_wait))
+          return EXIT_FAILURE;
+      } else if (std::strcmp(argv[arg], "--placement") == 0) {
+        if (arg + 1 == argc) {
+          std::cerr << "No placement policy specified" << std::endl;
+          return EXIT_FAILURE;
+        }
+        placement_policies = argv[++arg];
+      } else if (std::strcmp(argv[arg], "--pnet-cpus") == 0 || std::strcmp(argv[arg], "--refine-cpus") == 0 ||
+          std::strcmp(argv[arg], "--decode-cpus") == 0 || std::strcmp(argv[arg], "--output-cpus") == 0) {
+        if (arg + 1 == argc) {
+          std::cerr << "No CPUs specified" << std::endl;
+          return EXIT_FAILURE;
+        }
+        std::string &cpus = argv[arg][2] == 'p' ? pnet_cpus : argv[arg][2] == 'r' ? refine_cpus :
+            argv[arg][2] == 'd' ? decode_cpus : output_cpus;
+        cpus = argv[++arg];
+      } else if (std::strcmp(argv[arg], "--cache") == 0) {
+        if (!ParseCount("cache size", argc, argv, arg, cache_size_kb))
+          return EXIT_FAILURE;
+      } else if (std::strcmp(argv[arg], "--cache-distance") == 0) {
+        if (!ParseCount("cache distance", argc, argv, arg, cache_distance))
+          return EXIT_FAILURE;
+        perceptual_cache = true;
+      } else if (std::strcmp(argv[arg], "--crops") == 0) {
+        if (arg + 1 == argc) {
+          std::cerr << "No crop directory specified" << std::endl;
+          return EXIT_FAILURE;
+        }
+        crops_path = argv[++arg];
+      } else if (argv[arg][0] == '-' && argv[arg][1]) {
+        std::cerr << "Unexpected option: " << argv[arg] << std::endl;
+        Usage(std::cerr, argv[0]);
+        return EXIT_FAILURE;
+      } else {
+        AddPath(argv[arg], paths);
+      }
+    }
+  } catch (const std::exception &e) {
+    std::cerr << e.what() << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  if (paths.empty()) {
+    std::cerr << "No images to process" << std::endl;
+    Usage(std::cerr, argv[0]);
+    return EXIT_FAILURE;
+  }
+  if (!decode_threads || !detect_threads) {
+    std::cerr << "Thread counts must be at least 1" << std::endl;
+    return EXIT_FAILURE;
+  }
+  if (!queue_size)
+    queue_size = 2 * detect_threads;
+  if (!crops_path.empty() && detect_mode != DETECT_FULL) {
+    // Crops are aligned on the landmarks, which only O-Net gives
+    std::cerr << "--crops needs --detect-mode full" << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  std::ofstream output_file;
+  if (output_path != "-") {
+    output_file.open(output_path);
+    if (!output_file) {
+      std::cerr << "Failed to open output file: " << output_path << std::endl;
+      return EXIT_FAILURE;
+    }
+  }
+  std::ostream &results = output_path == "-" ? std::cout : output_file;
+
+  // Every pass runs the whole list with one placement, so policies can be compared
+  // Results go to output, or nowhere for a pass that is only timed
+  const auto run_pass = [&](const Placement &placement, std::ostream *output) {
+    // Load every detector up front so that model loading isn't measured
+    std::vector<std::unique_ptr<MTCNN>> detectors;
+    std::unique_ptr<AsyncDetector> async_detector;
+    if (use_async) {
+      async_options.pnet_threads = static_cast<int>(pnet_threads);
+      async_options.batch_threads = static_cast<int>(batch_threads);
+      async_options.max_batch = static_cast<int>(batch_size);
+      async_options.max_wait_us = static_cast<int>(batch_wait);
+      async_options.ncnn_threads = static_cast<int>(ncnn_threads);
+      async_options.min_face = static_cast<int>(min_face);
+      async_options.mode = detect_mode;
+      async_options.pnet_cpus = placement.pnet;
+      async_options.batch_cpus = placement.refine;
+      async_detector.reset(new AsyncDetector(model_path, async_options));
+    } else {
+      for (unsigned int i = 0; i != detect_threads; i++) {
+        detectors.emplace_back(new MTCNN(model_path));
+        detectors.back()->SetMinFace(static_cast<int>(min_face));
+        detectors.back()->SetNumThreads(static_cast<int>(ncnn_threads));
+        detectors.back()->SetDetectMode(detect_mode);
+        detectors.back()->SetStagePlacement(0, placement.pnet, static_cast<int>(ncnn_threads));
+        detectors.back()->SetStagePlacement(1, placement.refine, static_cast<int>(ncnn_threads));
+        detectors.back()->SetStagePlacement(2, placement.refine, static_cast<int>(ncnn_threads));
+      }
+    }
+
+    std::unique_ptr<DetectionCache> cache;
+    if (cache_size_kb)
+      cache.reset(new DetectionCache(size_t(cache_size_kb) * 1024,
+          perceptual_cache ? static_cast<int>(std::min(cache_distance, 64u)) : -1));
+
+    ImageQueue queue(queue_size);
+    std::atomic<size_t> next_image(0);
+    std::atomic<size_t> failed_images(0);
+    std::atomic<unsigned int> running_decoders(decode_threads);
+    std::mutex output_mutex;
+    std::vector<std::chrono::nanoseconds> decode_cpu_times(decode_threads);
+    std::vector<WorkerResult> detect_results(detect_threads);
+
+    const auto process_cpu_start = GetCpuTime(CLOCK_PROCESS_CPUTIME_ID);
+    const auto start = Clock::now();
+
+    std::vector<std::thread> threads;
+    for (unsigned int i = 0; i != decode_threads; i++) {
+      threads.emplace_back([&, i]() {
+        if (!placement.decode.empty())
+          SetThreadAffinity(placement.decode);
+
+        for (size_t index; (index = next_image++) < paths.size(); ) {
+          DecodedImage decoded;
+          decoded.index = index;
+          decoded.start = Clock::now();
+
+          const cv::Mat image = cv::imread(paths[index]);
+          if (image.empty()) {
+            failed_images++;
+            if (output) {
+              const std::string line = FormatFailure(paths[index]);
+              std::lock_guard<std::mutex> lock(output_mutex);
+              *output << line;
+            }
+            continue;
+          }
+
+          decoded.image = ncnn::Mat::from_pixels(image.data, ncnn::Mat::PIXEL_BGR2RGB, image.cols, image.rows);
+          if (!crops_path.empty())
+            decoded.bgr = image;
+          // Hashed before detection normalizes the pixels in place
+          if (cache)
+            decoded.cache_key = cache->MakeKey(image.data, image.cols, image.rows, static_cast<int>(image.step), 3);
+          decoded.decoded = Clock::now();
+          queue.Push(std::move(decoded));
+        }
+
+        decode_cpu_times[i] = GetCpuTime(CLOCK_THREAD_CPUTIME_ID);
+        if (--running_decoders == 0)
+          queue.Close();
+      });
+    }
+
+    for (unsigned int i = 0; i != detect_threads; i++) {
+      threads.emplace_back([&, i]() {
+        MTCNN *const mtcnn = detectors.empty() ? nullptr : detectors[i].get();
+        // With the asynchronous detector these threads only wait and write results
+        if (!mtcnn && !placement.output.empty())
+          SetThreadAffinity(placement.output);
+        WorkerResult &result = detect_results[i];
+        const FaceAligner aligner(112, true);  // BGR crops for cv::imwrite
+        std::vector<unsigned char> crops;
+        std::vector<Bbox> boxes;
+        DecodedImage decoded;
+
+        while (queue.Pop(decoded)) {
+          const auto detect_start = Clock::now();
+          boxes.clear();
+          if (!cache || !cache->Lookup(decoded.cache_key, boxes)) {
+            if (mtcnn)
+              mtcnn->detect(decoded.image, boxes);
+            else
+              boxes = async_detector->submit(decoded.image).get();
+            if (cache)
+              cache->Insert(decoded.cache_key, boxes);
+          }
+          const auto detect_end = Clock::now();
+
+          result.faces += boxes.size();
+          result.samples.push_back({
+            ToMilliseconds(decoded.decoded - decoded.start),
+            ToMilliseconds(detect_start - decoded.decoded),
+            ToMilliseconds(detect_end - detect_start),
+            ToMilliseconds(detect_end - decoded.start)
+          });
+
+          if (!crops_path.empty() && !boxes.empty()) {
+            const cv::Mat &bgr = decoded.bgr;
+            crops.resize(boxes.size() * aligner.GetCropBytes());
+            aligner.Align(bgr.data, bgr.cols, bgr.rows, static_cast<int>(bgr.step), FaceAligner::SOURCE_BGR,
+                boxes, crops.data());
+            for (size_t face = 0; face != boxes.size(); face++) {
+              const cv::Mat crop(aligner.GetSize(), aligner.GetSize(), CV_8UC3,
+                  crops.data() + face * aligner.GetCropBytes());
+              cv::imwrite(crops_path + '/' + std::to_string(decoded.index) + '_' + std::to_string(face) + ".png",
+                  crop);
+            }
+            decoded.bgr = cv::Mat();
+          }
+
+          if (output) {
+            const std::string line = FormatResult(paths[decoded.index], decoded.image, boxes);
+            std::lock_guard<std::mutex> lock(output_mutex);
+            *output << line;
+          }
+        }
+
+        result.cpu_time = GetCpuTime(CLOCK_THREAD_CPUTIME_ID);
+      });
+    }
+
+    for (auto &thread : threads)
+      thread.join();
+
+    const auto elapsed = Clock::now() - start;
+    const auto process_cpu_time = GetCpuTime(CLOCK_PROCESS_CPUTIME_ID) - process_cpu_start;
+    if (output)
+      output->flush();
+
+    std::vector<double> decode_ms, queue_ms, detect_ms, total_ms;
+    std::chrono::nanoseconds decode_cpu_time(0), detect_cpu_time(0);
+    size_t faces = 0;
+    for (const auto &time : decode_cpu_times)
+      decode_cpu_time += time;
+    for (const auto &result : detect_results) {
+      for (const auto &sample : result.samples) {
+        decode_ms.push_back(sample.decode_ms);
+        queue_ms.push_back(sample.queue_ms);
+        detect_ms.push_back(sample.detect_ms);
+        total_ms.push_back(sample.total_ms);
+      }
+      detect_cpu_time += result.cpu_time;
+      faces += result.faces;
+    }
+
+    // Includes ncnn's OpenMP workers, which run outside the pools' own threads
+    const auto other_cpu_time = std::max(std::chrono::nanoseconds(0),
+        process_cpu_time - decode_cpu_time - detect_cpu_time);
+    const double seconds = std::chrono::duration<double>(elapsed).count();
+
+    std::cerr << "Images:    " << decode_ms.size() << " detected, " << failed_images << " failed, " <<
+        faces << " faces" << std::endl <<
+        "Elapsed:   " << std::fixed << std::setprecision(2) << seconds << "s, " <<
+        (seconds > 0 ? decode_ms.size() / seconds : 0.0) << " images/s" << std::endl <<
+        "Threads:   " << decode_threads << " decode, " << detect_threads << " detect" << std::endl <<
+        "Latency (ms)     p50       p90       p99       max" << std::endl;
+    PrintLatency("decode", decode_ms);
+    PrintLatency("queue", queue_ms);
+    PrintLatency("detect", detect_ms);
+    PrintLatency("total", total_ms);
+    std::cerr << "CPU time" << std::endl;
+    PrintCpuTime("decode", decode_cpu_time, process_cpu_time);
+    PrintCpuTime("detect", detect_cpu_time, process_cpu_time);
+    PrintCpuTime("other", other_cpu_time, process_cpu_time);
+    if (cache) {
+      const auto statistics = cache->GetStatistics();
+      std::cerr << "Cache:     " << statistics.hits << " exact hits, " << statistics.perceptual_hits <<
+          " perceptual hits, " << statistics.misses << " misses, " << statistics.entries << " entries" << std::endl;
+    }
+    if (async_detector) {
+      // The asynchronous detector's own threads count as other CPU time
+      const auto statistics = async_detector->GetStatistics();
+      std::cerr << "Batches:   " << statistics.batches << ", " << statistics.crops << " crops, " <<
+          std::setprecision(1) << (statistics.batches ? double(statistics.crops) / statistics.batches : 0.0) <<
+          " mean, " << statistics.max_batch << " max" << std::endl;
+    }
+
+    PassSummary summary;
+    std::sort(detect_ms.begin(), detect_ms.end());
+    std::sort(total_ms.begin(), total_ms.end());
+    summary.images_per_second = seconds > 0 ? decode_ms.size() / seconds : 0.0;
+    summary.detect_p50 = Percentile(detect_ms, 50);
+    summary.detect_p99 = Percentile(detect_ms, 99);
+    summary.total_p99 = Percentile(total_ms, 99);
+    return summary;
+  };
+
+  const CpuTopology topology = CpuTopology::Detect();
+  std::cerr << "CPU topology: " << topology.Describe() << std::endl;
+
+  std::vector<std::string> policies;
+  std::vector<PassSummary> summaries;
+  std::istringstream policy_list(placement_policies);
+  for (std::string policy; std::getline(policy_list, policy, ','); )
+    policies.push_back(policy);
+
+  // Only the first pass writes results; the others are for timing
+  for (size_t i = 0; i != policies.size(); i++) {
+    Placement placement;
+    if (!Placement::FromPolicy(policies[i], topology, placement)) {
+      std::cerr << "Unsupported placement policy: " << policies[i] << std::endl;
+      return EXIT_FAILURE;
+    }
+    const std::pair<const std::string*, std::vector<int>*> cpu_options[] = {
+      {&pnet_cpus, &placement.pnet}, {&refine_cpus, &placement.refine},
+      {&decode_cpus, &placement.decode}, {&output_cpus, &placement.output}
+    };
+    for (const auto &option : cpu_options) {
+      if (!option.first->empty() && !topology.Parse(*option.first, *option.second)) {
+        std::cerr << "Failed to parse CPUs: " << *option.first << std::endl;
+        return EXIT_FAILURE;
+      }
+    }
+
+    std::cerr << std::endl << "Placement: " << policies[i] << " (" << placement.Describe() << ')' << std::endl;
+    summaries.push_back(run_pass(placement, i == 0 ? &results : nullptr));
+  }
+
+  if (summaries.size() > 1) {
+    std::cerr << std::endl << "Placement   images/s  detect p50  detect p99   total p99" << std::endl;
+    for (size_t i = 0; i != summaries.size(); i++) {
+      std::cerr << std::left << std::setw(10) << policies[i] << std::right << std::fixed << std::setprecision(2) <<
+          std::setw(10) << summaries[i].images_per_second << std::setw(12) << summaries[i].detect_p50 <<
+          std::setw(12) << summaries[i].detect_p99 << std::setw(12) << summaries[i].total_p99 << std::endl;
+    }
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,77 @@
+/**
+ * @internal
+ * @file       buffer_pool.cpp
+ * @copyright  VCA Technology
+ * @~english
+ * @brief      Implementation of the @c BufferPool class.
+ */
+
+#include <cassert>
+
+#include "buffer_pool.hpp"
+
+BufferPool::BufferPool(size_t buffer_size, unsigned int capacity) :
+  buffer_size_(buffer_size),
+  capacity_(capacity),
+  storage_(new uint8_t[buffer_size * capacity]),
+  reference_counts_(new std::atomic<unsigned int>[capacity]),
+  free_slots_() {
+  free_slots_.reserve(capacity_);
+  for (unsigned int i = capacity_; i != 0; i--) {
+    reference_counts_[i - 1] = 0;
+    free_slots_.push_back(i - 1);
+  }
+}
+
+BufferPool::~BufferPool() {
+  assert(free_slots_.size() == capacity_);
+}
+
+size_t BufferPool::GetBufferSize() const {
+  return buffer_size_;
+}
+
+unsigned int BufferPool::GetCapacity() const {
+  return capacity_;
+}
+
+unsigned int BufferPool::GetAvailable() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return static_cast<unsigned int>(free_slots_.size());
+}
+
+uint8_t* BufferPool::Acquire() {
+  unsigned int slot;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (free_slots_.empty())
+      return nullptr;
+    slot = free_slots_.back();
+    free_slots_.pop_back();
+  }
+
+  reference_counts_[slot].store(1, std::memory_order_relaxed);
+  return storage_.get() + slot * buffer_size_;
+}
+
+void BufferPool::Unreference(const uint8_t *data) {
+  const unsigned int slot = SlotOf(data);
+  if (reference_counts_[slot].fetch_sub(1, std::memory_order_acq_rel) != 1)
+    return;
+
+  // The vector never grows past its reserved capacity, so this doesn't allocate
+  std::lock_guard<std::mutex> lock(mutex_);
+  free_slots_.push_back(slot);
+}
+
+vca::core::video::Buffer BufferPool::MakeBuffer(uint8_t *data, size_t plane_count,
+    const vca::core::video::Buffer::Planes &planes) {
+  // Two words of capture keep the callback inside std::function's local storage
+  return vca::core::video::Buffer{buffer_size_, data, plane_count, planes,
+      [this, data]() { Unreference(data); }};
+}
+
+unsigned int BufferPool::SlotOf(const uint8_t *data) const {
+  assert(data >= storage_.get() && data < storage_.get() + buffer_size_ * capacity_);
+  return static_cast<unsigned int>((data - storage_.get()) / buffer_size_);
+}
@@ -0,0 +1,63 @@
+#pragma once
+/**
+ * @internal
+ * @file       buffer_pool.hpp
+ * @copyright  VCA Technology
+ * @~english
+ * @brief      Declaration of the @c BufferPool class.
+ */
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <vca/core_sdk/video/buffers.hpp>
+
+/**
+ * A fixed number of equally sized buffers allocated up front. Each buffer
+ * carries a reference count and goes back to the pool when the last reference
+ * is dropped, which may happen on any thread. The pool must outlive every
+ * buffer taken from it.
+ */
+class BufferPool {
+ public:
+  BufferPool(size_t buffer_size, unsigned int capacity);
+
+  ~BufferPool();
+
+  size_t GetBufferSize() const;
+
+  unsigned int GetCapacity() const;
+
+  unsigned int GetAvailable() const;
+
+  /// Takes a free buffer holding one reference, or returns nullptr if every
+  /// buffer is in use.
+  uint8_t* Acquire();
+
+  /// Drops a reference to a buffer returned by @c Acquire.
+  void Unreference(const uint8_t *data);
+
+  /// Wraps a buffer returned by @c Acquire, handing its reference over to the
+  /// buffer's @c unreference callback.
+  vca::core::video::Buffer MakeBuffer(uint8_t *data, size_t plane_count,
+      const vca::core::video::Buffer::Planes &planes);
+
+ private:
+  BufferPool(const BufferPool&) = delete;
+  BufferPool& operator=(const BufferPool&) = delete;
+
+  unsigned int SlotOf(const uint8_t *data) const;
+
+ private:
+  const size_t buffer_size_;
+  const unsigned int capacity_;
+  std::unique_ptr<uint8_t[]> storage_;
+  std::unique_ptr<std::atomic<unsigned int>[]> reference_counts_;
+
+  mutable std::mutex mutex_;
+  std::vector<unsigned int> free_slots_;
+};
@@ -0,0 +1,114 @@
+#pragma once
+/**
+ * @internal
+ * @file       detection_log.hpp
+ * @copyright  VCA Technology
+ * @~english
+ * @brief      Layout and encoding of the columnar detection log.
+ */
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/*
+ * An append-only log of detections written by @c DetectionLogWriter and read
+ * by @c DetectionLogReader. It is made of two files:
+ *
+ *  - The log, a @c DetectionLogHeader followed by blocks. Each block is a
+ *    @c DetectionLogBlockHeader and then one column per field, in the order of
+ *    @c DetectionLogColumn, holding one value per detection.
+ *  - The index, at the log's path with ".idx" appended: a
+ *    @c DetectionLogIndexHeader followed by one @c DetectionLogIndexEntry per
+ *    block, with the ranges of its time, streams, boxes and scores, so queries
+ *    read only the blocks that can match.
+ *
+ * A block is written before its index entry, so a block without one is the
+ * tail of an interrupted write and is dropped when the log is reopened.
+ *
+ * Columns are sequences of LEB128 varints, signed values zigzag-encoded:
+ *  - Timestamp: difference from the previous row's timestamp, or from the
+ *    block's @c base_timestamp for the first row (signed).
+ *  - Stream: stream id.
+ *  - Score: 65535 minus the score scaled to 0-65535, which is small for the
+ *    confident detections that make up most of the log.
+ *  - Box: x1 and y1 (signed), then the width and height.
+ *  - Landmarks: x[5] then y[5], rounded to pixels, relative to x1 and y1 (signed).
+ *
+ * Fields are little-endian.
+ */
+
+static constexpr uint32_t DetectionLogMagic = 0x4c44544d;       // "MTDL"
+static constexpr uint32_t DetectionLogBlockMagic = 0x4244544d;  // "MTDB"
+static constexpr uint32_t DetectionLogIndexMagic = 0x4944544d;  // "MTDI"
+static constexpr uint32_t DetectionLogVersion = 1;
+
+enum DetectionLogColumn {
+  DetectionLogTimestamps,
+  DetectionLogStreams,
+  DetectionLogScores,
+  DetectionLogBoxes,
+  DetectionLogLandmarks,
+  DetectionLogColumnCount
+};
+
+struct DetectionLogHeader {
+  uint32_t magic;
+  uint32_t version;
+};
+
+struct DetectionLogBlockHeader {
+  uint32_t magic;
+  uint32_t row_count;
+  uint64_t base_timestamp;    ///< Nanoseconds
+  uint32_t column_size[DetectionLogColumnCount];
+  uint32_t reserved;
+};
+
+struct DetectionLogIndexHeader {
+  uint32_t magic;
+  uint32_t version;
+};
+
+struct DetectionLogIndexEntry {
+  uint64_t offset;            ///< Of the block header in the log
+  uint32_t size;              ///< Of the block, header included
+  uint32_t row_count;
+  uint64_t min_timestamp;
+  uint64_t max_timestamp;
+  uint32_t min_stream;
+  uint32_t max_stream;
+  int32_t min_x, min_y;       ///< Bounds of the boxes in the block
+  int32_t max_x, max_y;
+  uint16_t max_score;         ///< Scaled to 0-65535
+  uint16_t reserved0;
+  uint32_t reserved1;
+};
+
+static inline uint64_t ZigZagEncode(int64_t value) {
+  return (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63);
+}
+
+static inline int64_t ZigZagDecode(uint64_t value) {
+  return static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1);
+}
+
+static inline void AppendVarint(std::vector<uint8_t> &column, uint64_t value) {
+  while (value >= 0x80) {
+    column.push_back(static_cast<uint8_t>(value | 0x80));
+    value >>= 7;
+  }
+  column.push_back(static_cast<uint8_t>(value));
+}
+
+/// Reads a varint at p, advancing p, or returns false if it runs past end.
+static inline bool ReadVarint(const uint8_t *&p, const uint8_t *end, uint64_t &value) {
+  value = 0;
+  for (unsigned int shift = 0; p != end && shift < 64; shift += 7) {
+    const uint8_t byte = *p++;
+    value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+    if (!(byte & 0x80))
+      return true;
+  }
+  return false;
+}
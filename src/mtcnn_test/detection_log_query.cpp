@@ -0,0 +1,200 @@
+/**
+ * @file      detection_log_query.cpp
+ * @copyright UDP Technology Ltd.
+ * @~english
+ * @brief     Queries a detection log written with --detection-log
+ *
+ * Prints the detections of a time range, optionally only those of one stream,
+ * overlapping a region or above a score, reading only the blocks whose index
+ * entry can match.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <string>
+
+#include <time.h>
+
+#include "detection_log_reader.hpp"
+
+using Clock = std::chrono::steady_clock;
+
+// Nanoseconds since the epoch, or a UTC time such as 2024-05-01T13:45:00.5
+static bool ParseTime(const char *text, uint64_t &time) {
+  struct tm tm = {};
+  const char *const rest = strptime(text, "%Y-%m-%dT%H:%M:%S", &tm);
+  if (!rest) {
+    unsigned long long nanoseconds;
+    char end;
+    if (std::sscanf(text, "%llu%c", &nanoseconds, &end) != 1)
+      return false;
+    time = nanoseconds;
+    return true;
+  }
+
+  double fraction = 0.0;
+  if (*rest == '.' && std::sscanf(rest, "%lf", &fraction) != 1)
+    return false;
+  const time_t seconds = timegm(&tm);
+  if (seconds < 0)
+    return false;
+  time = static_cast<uint64_t>(seconds) * UINT64_C(1000000000) + static_cast<uint64_t>(fraction * 1e9 + 0.5);
+  return true;
+}
+
+static std::string FormatTime(uint64_t time) {
+  const time_t seconds = static_cast<time_t>(time / UINT64_C(1000000000));
+  struct tm tm;
+  char text[64];
+  gmtime_r(&seconds, &tm);
+  const size_t length = strftime(text, sizeof(text), "%Y-%m-%dT%H:%M:%S", &tm);
+  std::snprintf(text + length, sizeof(text) - length, ".%03uZ",
+      static_cast<unsigned int>(time % UINT64_C(1000000000) / 1000000));
+  return text;
+}
+
+static void PrintInfo(const DetectionLogReader &reader) {
+  uint64_t rows = 0, first = UINT64_MAX, last = 0;
+  for (size_t i = 0; i != reader.GetBlockCount(); i++) {
+    const DetectionLogIndexEntry &entry = reader.GetBlock(i);
+    rows += entry.row_count;
+    first = std::min(first, entry.min_timestamp);
+    last = std::max(last, entry.max_timestamp);
+  }
+
+  std::cout << "Blocks:           " << reader.GetBlockCount() << std::endl <<
+      "Detections:       " << rows << std::endl <<
+      "Size:             " << reader.GetSize() << " bytes";
+  if (rows)
+    std::cout << ", " << std::fixed << std::setprecision(1) << static_cast<double>(reader.GetSize()) / rows <<
+        " per detection";
+  std::cout << std::endl;
+  if (rows)
+    std::cout << "Time:             " << FormatTime(first) << " to " << FormatTime(last) << std::endl;
+}
+
+static void Usage(std::ostream &o, const char *argv0) {
+  o << "Usage: " << argv0 << " [OPTIONS...] LOG\n"
+    "\n"
+    "Prints the detections in LOG, written with --detection-log, as lines of\n"
+    "timestamp (ns), stream, score, x1, y1, x2, y2 and, with --landmarks, the\n"
+    "five landmark x and y pairs\n"
+    "\n"
+    "TIME is nanoseconds since the epoch or a UTC time such as\n"
+    "2024-05-01T13:45:00.5\n"
+    "\n"
+    "Options:\n"
+    "  --from TIME        Detections at or after TIME\n"
+    "  --to TIME          Detections before TIME\n"
+    "  --stream ID        Detections of stream ID\n"
+    "  --region X,Y,W,H   Detections overlapping the rectangle\n"
+    "  --min-score S      Detections scoring at least S\n"
+    "  --landmarks        Prints the landmarks too\n"
+    "  --count            Prints the number of detections only\n"
+    "  --info             Prints the size and time span of the log\n"
+    "\n";
+}
+
+int main(int argc, const char *const *const argv) {
+  DetectionLogReader::Query query;
+  bool count_only = false, info = false;
+  const char *path = nullptr;
+  for (int arg = 1; arg != argc; arg++) {
+    if (std::strcmp(argv[arg], "-h") == 0 || std::strcmp(argv[arg], "--help") == 0) {
+      Usage(std::cout, argv[0]);
+      return EXIT_SUCCESS;
+    } else if (std::strcmp(argv[arg], "--from") == 0 && arg + 1 != argc) {
+      if (!ParseTime(argv[++arg], query.from)) {
+        std::cerr << "Failed to parse time: " << argv[arg] << std::endl;
+        return EXIT_FAILURE;
+      }
+    } else if (std::strcmp(argv[arg], "--to") == 0 && arg + 1 != argc) {
+      if (!ParseTime(argv[++arg], query.to)) {
+        std::cerr << "Failed to parse time: " << argv[arg] << std::endl;
+        return EXIT_FAILURE;
+      }
+    } else if (std::strcmp(argv[arg], "--stream") == 0 && arg + 1 != argc) {
+      if (std::sscanf(argv[++arg], "%u", &query.stream_id) != 1) {
+        std::cerr << "Failed to parse stream id: " << argv[arg] << std::endl;
+        return EXIT_FAILURE;
+      }
+      query.any_stream = false;
+    } else if (std::strcmp(argv[arg], "--region") == 0 && arg + 1 != argc) {
+      int x, y, w, h;
+      if (std::sscanf(argv[++arg], "%d,%d,%d,%d", &x, &y, &w, &h) != 4 || w <= 0 || h <= 0) {
+        std::cerr << "Failed to parse region: " << argv[arg] << std::endl;
+        return EXIT_FAILURE;
+      }
+      query.any_region = false;
+      query.x1 = x;
+      query.y1 = y;
+      query.x2 = x + w;
+      query.y2 = y + h;
+    } else if (std::strcmp(argv[arg], "--min-score") == 0 && arg + 1 != argc) {
+      if (std::sscanf(argv[++arg], "%f", &query.min_score) != 1) {
+        std::cerr << "Failed to parse score: " << argv[arg] << std::endl;
+        return EXIT_FAILURE;
+      }
+    } else if (std::strcmp(argv[arg], "--landmarks") == 0) {
+      query.landmarks = true;
+    } else if (std::strcmp(argv[arg], "--count") == 0) {
+      count_only = true;
+    } else if (std::strcmp(argv[arg], "--info") == 0) {
+      info = true;
+    } else if (argv[arg][0] != '-' && !path) {
+      path = argv[arg];
+    } else {
+      std::cerr << "Unexpected option: " << argv[arg] << std::endl;
+      Usage(std::cerr, argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+  if (!path) {
+    Usage(std::cerr, argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  try {
+    const DetectionLogReader reader(path);
+    if (info) {
+      PrintInfo(reader);
+      return EXIT_SUCCESS;
+    }
+
+    // Lines are built in a buffer; printing millions of them through iostreams is slow
+    char line[256];
+    const auto begin = Clock::now();
+    const DetectionLogReader::Statistics statistics = reader.Run(query,
+        [&](const DetectionLogReader::Detection &d) {
+      if (count_only)
+        return;
+      int length = std::snprintf(line, sizeof(line), "%llu %u %.4f %d %d %d %d",
+          static_cast<unsigned long long>(d.timestamp), d.stream_id, d.score, d.x1, d.y1, d.x2, d.y2);
+      if (query.landmarks) {
+        for (int j = 0; j != 5; j++)
+          length += std::snprintf(line + length, sizeof(line) - length, " %d %d", d.landmark_x[j], d.landmark_y[j]);
+      }
+      line[length++] = '\n';
+      std::fwrite(line, 1, length, stdout);
+    });
+    const double elapsed = std::chrono::duration<double>(Clock::now() - begin).count();
+
+    if (count_only)
+      std::cout << statistics.matches << std::endl;
+    std::fflush(stdout);
+    std::cerr << "Blocks:           " << statistics.blocks_scanned << '/' << statistics.blocks << " scanned" <<
+        std::endl << "Detections:       " << statistics.matches << " of " << statistics.rows_scanned <<
+        " scanned" << std::endl << "Decoded:          " << statistics.bytes_scanned << " of " <<
+        reader.GetSize() << " bytes" << std::endl << "Elapsed:          " << std::fixed <<
+        std::setprecision(3) << elapsed << 's' << std::endl;
+  } catch (const std::exception &e) {
+    std::cerr << e.what() << std::endl;
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
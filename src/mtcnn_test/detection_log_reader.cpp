@@ -0,0 +1,208 @@
+/**
+ * @internal
+ * @file       detection_log_reader.cpp
+ * @copyright  VCA Technology
+ * @~english
+ * @brief      Implementation of the @c DetectionLogReader class.
+ */
+
+#include <cerrno>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "detection_log_reader.hpp"
+
+static uint8_t* MapFile(const std::string &path, size_t &size) {
+  const int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    std::ostringstream ss;
+    ss << "Could not open '" << path << "': " << std::strerror(errno);
+    throw std::runtime_error(ss.str());
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size == 0) {
+    close(fd);
+    throw std::runtime_error("'" + path + "' is empty");
+  }
+  size = static_cast<size_t>(st.st_size);
+
+  void *const mapping = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED)
+    throw std::runtime_error("Failed to map '" + path + "'");
+  return static_cast<uint8_t*>(mapping);
+}
+
+static void CorruptBlock(const std::string &path, uint64_t offset) {
+  std::ostringstream ss;
+  ss << "Corrupt block at offset " << offset << " of '" << path << "'";
+  throw std::runtime_error(ss.str());
+}
+
+DetectionLogReader::DetectionLogReader(const std::string &path) :
+  path_(path),
+  mapping_size_(0),
+  index_mapping_size_(0),
+  mapping_(nullptr),
+  index_mapping_(nullptr),
+  entries_(nullptr),
+  entry_count_(0) {
+  mapping_ = MapFile(path_, mapping_size_);
+  try {
+    index_mapping_ = MapFile(path_ + ".idx", index_mapping_size_);
+  } catch (const std::exception&) {
+    munmap(mapping_, mapping_size_);
+    throw;
+  }
+
+  const DetectionLogHeader *const header = reinterpret_cast<const DetectionLogHeader*>(mapping_);
+  const DetectionLogIndexHeader *const index_header =
+      reinterpret_cast<const DetectionLogIndexHeader*>(index_mapping_);
+  const bool valid = mapping_size_ >= sizeof(DetectionLogHeader) &&
+      header->magic == DetectionLogMagic && header->version == DetectionLogVersion &&
+      index_mapping_size_ >= sizeof(DetectionLogIndexHeader) &&
+      index_header->magic == DetectionLogIndexMagic && index_header->version == DetectionLogVersion;
+  if (!valid) {
+    munmap(mapping_, mapping_size_);
+    munmap(index_mapping_, index_mapping_size_);
+    throw std::runtime_error("'" + path_ + "' is not a detection log of this version");
+  }
+
+  // Entries being appended, or for blocks past the mapped end, are left out
+  entries_ = reinterpret_cast<const DetectionLogIndexEntry*>(index_mapping_ + sizeof(DetectionLogIndexHeader));
+  entry_count_ = (index_mapping_size_ - sizeof(DetectionLogIndexHeader)) / sizeof(DetectionLogIndexEntry);
+  while (entry_count_ && entries_[entry_count_ - 1].offset + entries_[entry_count_ - 1].size > mapping_size_)
+    entry_count_--;
+
+  // Queries touch a few blocks here and there; readahead would bring in the others
+  madvise(mapping_, mapping_size_, MADV_RANDOM);
+}
+
+DetectionLogReader::~DetectionLogReader() {
+  munmap(mapping_, mapping_size_);
+  munmap(index_mapping_, index_mapping_size_);
+}
+
+DetectionLogReader::Statistics DetectionLogReader::Run(const Query &query,
+    const DetectionCallback &on_detection) const {
+  Statistics statistics = {};
+  statistics.blocks = entry_count_;
+  for (size_t i = 0; i != entry_count_; i++) {
+    if (MayMatch(entries_[i], query))
+      ScanBlock(entries_[i], query, on_detection, statistics);
+  }
+  return statistics;
+}
+
+bool DetectionLogReader::MayMatch(const DetectionLogIndexEntry &entry, const Query &query) {
+  return entry.max_timestamp >= query.from && entry.min_timestamp < query.to &&
+      (query.any_stream || (entry.min_stream <= query.stream_id && query.stream_id <= entry.max_stream)) &&
+      (query.any_region || (entry.min_x < query.x2 && entry.max_x > query.x1 &&
+                            entry.min_y < query.y2 && entry.max_y > query.y1)) &&
+      entry.max_score / 65535.0f >= query.min_score;
+}
+
+void DetectionLogReader::ScanBlock(const DetectionLogIndexEntry &entry, const Query &query,
+    const DetectionCallback &on_detection, Statistics &statistics) const {
+  const uint8_t *const block = mapping_ + entry.offset;
+  const DetectionLogBlockHeader *const header = reinterpret_cast<const DetectionLogBlockHeader*>(block);
+  if (entry.size < sizeof(DetectionLogBlockHeader) || header->magic != DetectionLogBlockMagic ||
+      header->row_count != entry.row_count)
+    CorruptBlock(path_, entry.offset);
+
+  const uint8_t *columns[DetectionLogColumnCount + 1];
+  columns[0] = block + sizeof(DetectionLogBlockHeader);
+  for (int column = 0; column != DetectionLogColumnCount; column++)
+    columns[column + 1] = columns[column] + header->column_size[column];
+  if (columns[DetectionLogColumnCount] != block + entry.size)
+    CorruptBlock(path_, entry.offset);
+
+  // Pages of the block are read together rather than faulted in one by one
+  const uintptr_t page_mask = static_cast<uintptr_t>(sysconf(_SC_PAGESIZE)) - 1;
+  uint8_t *const first_page = reinterpret_cast<uint8_t*>(reinterpret_cast<uintptr_t>(block) & ~page_mask);
+  madvise(first_page, block + entry.size - first_page, MADV_WILLNEED);
+
+  const uint32_t rows = header->row_count;
+  std::vector<Detection> detections(rows);
+  std::vector<uint8_t> match(rows);
+  statistics.blocks_scanned++;
+  statistics.rows_scanned += rows;
+
+  // Time, stream and score first, as they are the cheapest to decode
+  const uint8_t *timestamps = columns[DetectionLogTimestamps];
+  const uint8_t *streams = columns[DetectionLogStreams];
+  const uint8_t *scores = columns[DetectionLogScores];
+  uint64_t timestamp = header->base_timestamp;
+  bool any_match = false;
+  for (uint32_t i = 0; i != rows; i++) {
+    uint64_t delta, stream_id, score;
+    if (!ReadVarint(timestamps, columns[DetectionLogTimestamps + 1], delta) ||
+        !ReadVarint(streams, columns[DetectionLogStreams + 1], stream_id) ||
+        !ReadVarint(scores, columns[DetectionLogScores + 1], score) || score > 65535)
+      CorruptBlock(path_, entry.offset);
+    timestamp += static_cast<uint64_t>(ZigZagDecode(delta));
+
+    Detection &detection = detections[i];
+    detection.timestamp = timestamp;
+    detection.stream_id = static_cast<uint32_t>(stream_id);
+    detection.score = (65535 - score) / 65535.0f;
+    match[i] = timestamp >= query.from && timestamp < query.to &&
+        (query.any_stream || detection.stream_id == query.stream_id) && detection.score >= query.min_score;
+    any_match |= match[i] != 0;
+  }
+  statistics.bytes_scanned += columns[DetectionLogBoxes] - columns[DetectionLogTimestamps];
+  if (!any_match)
+    return;
+
+  const uint8_t *boxes = columns[DetectionLogBoxes];
+  for (uint32_t i = 0; i != rows; i++) {
+    uint64_t x1, y1, width, height;
+    if (!ReadVarint(boxes, columns[DetectionLogBoxes + 1], x1) ||
+        !ReadVarint(boxes, columns[DetectionLogBoxes + 1], y1) ||
+        !ReadVarint(boxes, columns[DetectionLogBoxes + 1], width) ||
+        !ReadVarint(boxes, columns[DetectionLogBoxes + 1], height))
+      CorruptBlock(path_, entry.offset);
+
+    Detection &detection = detections[i];
+    detection.x1 = static_cast<int>(ZigZagDecode(x1));
+    detection.y1 = static_cast<int>(ZigZagDecode(y1));
+    detection.x2 = detection.x1 + static_cast<int>(width);
+    detection.y2 = detection.y1 + static_cast<int>(height);
+    if (!query.any_region)
+      match[i] &= detection.x1 < query.x2 && detection.x2 > query.x1 && detection.y1 < query.y2 &&
+          detection.y2 > query.y1;
+  }
+  statistics.bytes_scanned += columns[DetectionLogLandmarks] - columns[DetectionLogBoxes];
+
+  if (query.landmarks) {
+    const uint8_t *landmarks = columns[DetectionLogLandmarks];
+    for (uint32_t i = 0; i != rows; i++) {
+      Detection &detection = detections[i];
+      for (int j = 0; j != 10; j++) {
+        uint64_t value;
+        if (!ReadVarint(landmarks, columns[DetectionLogLandmarks + 1], value))
+          CorruptBlock(path_, entry.offset);
+        if (j < 5)
+          detection.landmark_x[j] = detection.x1 + static_cast<int>(ZigZagDecode(value));
+        else
+          detection.landmark_y[j - 5] = detection.y1 + static_cast<int>(ZigZagDecode(value));
+      }
+    }
+    statistics.bytes_scanned += columns[DetectionLogColumnCount] - columns[DetectionLogLandmarks];
+  }
+
+  for (uint32_t i = 0; i != rows; i++) {
+    if (match[i]) {
+      on_detection(detections[i]);
+      statistics.matches++;
+    }
+  }
+}
@@ -0,0 +1,88 @@
+#pragma once
+/**
+ * @internal
+ * @file       detection_log_reader.hpp
+ * @copyright  VCA Technology
+ * @~english
+ * @brief      Declaration of the @c DetectionLogReader class.
+ */
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <string>
+
+#include "detection_log.hpp"
+
+/**
+ * Maps a detection log and its index and answers queries by decoding only
+ * the blocks whose index entry can match. Within a block the time, stream and
+ * score columns are decoded first; the boxes only if a row passed them, and the
+ * landmarks only if they are asked for.
+ *
+ * The log may still be written to; blocks written after it was opened are not
+ * seen.
+ */
+class DetectionLogReader final {
+ public:
+  struct Detection {
+    uint64_t timestamp;       ///< Nanoseconds
+    uint32_t stream_id;
+    float score;
+    int x1, y1, x2, y2;
+    int landmark_x[5], landmark_y[5];
+  };
+
+  struct Query {
+    uint64_t from = 0;        ///< First timestamp included
+    uint64_t to = std::numeric_limits<uint64_t>::max();  ///< First timestamp excluded
+    bool any_stream = true;
+    uint32_t stream_id = 0;
+    bool any_region = true;
+    int x1 = 0, y1 = 0, x2 = 0, y2 = 0;  ///< Boxes overlapping this region match
+    float min_score = 0.0f;
+    bool landmarks = false;   ///< Decodes the landmarks, which are left 0 otherwise
+  };
+
+  struct Statistics {
+    uint64_t blocks;
+    uint64_t blocks_scanned;
+    uint64_t rows_scanned;
+    uint64_t matches;
+    uint64_t bytes_scanned;   ///< Of the columns decoded
+  };
+
+  typedef std::function<void(const Detection&)> DetectionCallback;
+
+ public:
+  explicit DetectionLogReader(const std::string &path);
+
+  ~DetectionLogReader();
+
+  /// Calls on_detection for each matching detection, in log order.
+  Statistics Run(const Query &query, const DetectionCallback &on_detection) const;
+
+  size_t GetBlockCount() const { return entry_count_; }
+
+  const DetectionLogIndexEntry& GetBlock(size_t i) const { return entries_[i]; }
+
+  /// Total size of the log and its index.
+  uint64_t GetSize() const { return mapping_size_ + index_mapping_size_; }
+
+ private:
+  DetectionLogReader(const DetectionLogReader&) = delete;
+  DetectionLogReader& operator=(const DetectionLogReader&) = delete;
+
+  static bool MayMatch(const DetectionLogIndexEntry &entry, const Query &query);
+
+  void ScanBlock(const DetectionLogIndexEntry &entry, const Query &query, const DetectionCallback &on_detection,
+      Statistics &statistics) const;
+
+ private:
+  const std::string path_;
+  size_t mapping_size_, index_mapping_size_;
+  uint8_t *mapping_, *index_mapping_;
+  const DetectionLogIndexEntry *entries_;
+  size_t entry_count_;
+};
@@ -0,0 +1,210 @@
+/**
+ * @internal
+ * @file       detection_log_writer.cpp
+ * @copyright  VCA Technology
+ * @~english
+ * @brief      Implementation of the @c DetectionLogWriter class.
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <stdexcept>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "detection_log_writer.hpp"
+
+DetectionLogWriter::DetectionLogWriter(const std::string &path, unsigned int block_rows,
+    uint64_t block_duration) :
+  path_(path),
+  index_path_(path + ".idx"),
+  block_rows_(std::max(block_rows, 1u)),
+  block_duration_(block_duration),
+  file_(),
+  index_file_(),
+  file_size_(0),
+  entry_(),
+  base_timestamp_(0),
+  previous_timestamp_(0),
+  statistics_() {
+  struct stat st;
+  if (stat(path_.c_str(), &st) == 0)
+    Open();
+  else
+    Create();
+}
+
+DetectionLogWriter::~DetectionLogWriter() {
+  try {
+    Close();
+  } catch (const std::exception&) {
+    // The current block is lost
+  }
+}
+
+void DetectionLogWriter::Append(uint32_t stream_id, uint64_t timestamp, const std::vector<Bbox> &faces) {
+  if (!file_.is_open())
+    throw std::logic_error("Detections appended after the detection log was closed");
+  if (faces.empty())
+    return;
+
+  if (entry_.row_count && (entry_.row_count >= block_rows_ ||
+      (timestamp > entry_.min_timestamp && timestamp - entry_.min_timestamp >= block_duration_)))
+    Flush();
+  if (!entry_.row_count)
+    StartBlock(timestamp);
+
+  for (const Bbox &face : faces) {
+    AppendVarint(columns_[DetectionLogTimestamps],
+        ZigZagEncode(static_cast<int64_t>(timestamp - previous_timestamp_)));
+    previous_timestamp_ = timestamp;
+
+    AppendVarint(columns_[DetectionLogStreams], stream_id);
+
+    const float score = std::max(0.0f, std::min(1.0f, face.score));
+    const uint16_t scaled_score = static_cast<uint16_t>(score * 65535.0f + 0.5f);
+    AppendVarint(columns_[DetectionLogScores], 65535 - scaled_score);
+
+    std::vector<uint8_t> &boxes = columns_[DetectionLogBoxes];
+    AppendVarint(boxes, ZigZagEncode(face.x1));
+    AppendVarint(boxes, ZigZagEncode(face.y1));
+    AppendVarint(boxes, static_cast<uint64_t>(std::max(face.x2 - face.x1, 0)));
+    AppendVarint(boxes, static_cast<uint64_t>(std::max(face.y2 - face.y1, 0)));
+
+    std::vector<uint8_t> &landmarks = columns_[DetectionLogLandmarks];
+    for (int j = 0; j != 5; j++)
+      AppendVarint(landmarks, ZigZagEncode(std::lround(face.landmark.x[j]) - face.x1));
+    for (int j = 0; j != 5; j++)
+      AppendVarint(landmarks, ZigZagEncode(std::lround(face.landmark.y[j]) - face.y1));
+
+    entry_.row_count++;
+    entry_.min_timestamp = std::min(entry_.min_timestamp, timestamp);
+    entry_.max_timestamp = std::max(entry_.max_timestamp, timestamp);
+    entry_.min_stream = std::min(entry_.min_stream, stream_id);
+    entry_.max_stream = std::max(entry_.max_stream, stream_id);
+    entry_.min_x = std::min(entry_.min_x, face.x1);
+    entry_.min_y = std::min(entry_.min_y, face.y1);
+    entry_.max_x = std::max(entry_.max_x, std::max(face.x1, face.x2));
+    entry_.max_y = std::max(entry_.max_y, std::max(face.y1, face.y2));
+    entry_.max_score = std::max(entry_.max_score, scaled_score);
+  }
+}
+
+void DetectionLogWriter::Flush() {
+  if (!entry_.row_count)
+    return;
+
+  DetectionLogBlockHeader header = {};
+  header.magic = DetectionLogBlockMagic;
+  header.row_count = entry_.row_count;
+  header.base_timestamp = base_timestamp_;
+  uint64_t size = sizeof(header);
+  for (int column = 0; column != DetectionLogColumnCount; column++) {
+    header.column_size[column] = static_cast<uint32_t>(columns_[column].size());
+    size += columns_[column].size();
+  }
+
+  file_.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  for (int column = 0; column != DetectionLogColumnCount; column++)
+    file_.write(reinterpret_cast<const char*>(columns_[column].data()), columns_[column].size());
+  // The block must be complete before the index refers to it
+  file_.flush();
+  if (!file_)
+    throw std::runtime_error("Failed to write " + path_);
+
+  entry_.offset = file_size_;
+  entry_.size = static_cast<uint32_t>(size);
+  index_file_.write(reinterpret_cast<const char*>(&entry_), sizeof(entry_));
+  index_file_.flush();
+  if (!index_file_)
+    throw std::runtime_error("Failed to write " + index_path_);
+
+  file_size_ += size;
+  statistics_.rows += entry_.row_count;
+  statistics_.blocks++;
+  statistics_.bytes_written += size + sizeof(entry_);
+  entry_.row_count = 0;
+}
+
+void DetectionLogWriter::Close() {
+  if (!file_.is_open())
+    return;
+
+  Flush();
+  file_.close();
+  index_file_.close();
+}
+
+DetectionLogWriter::Statistics DetectionLogWriter::GetStatistics() const {
+  return statistics_;
+}
+
+void DetectionLogWriter::Open() {
+  std::ifstream file(path_, std::ios::binary);
+  DetectionLogHeader header = {};
+  if (!file.read(reinterpret_cast<char*>(&header), sizeof(header)) || header.magic != DetectionLogMagic ||
+      header.version != DetectionLogVersion)
+    throw std::runtime_error("'" + path_ + "' is not a detection log of this version");
+  file.seekg(0, std::ios::end);
+  const uint64_t log_size = static_cast<uint64_t>(file.tellg());
+  file.close();
+
+  std::ifstream index_file(index_path_, std::ios::binary);
+  DetectionLogIndexHeader index_header = {};
+  if (!index_file.read(reinterpret_cast<char*>(&index_header), sizeof(index_header)) ||
+      index_header.magic != DetectionLogIndexMagic || index_header.version != DetectionLogVersion)
+    throw std::runtime_error("'" + index_path_ + "' is not a detection log index of this version");
+
+  // Keep the blocks that were written completely, in order
+  uint64_t end = sizeof(DetectionLogHeader), entry_count = 0;
+  DetectionLogIndexEntry entry;
+  while (index_file.read(reinterpret_cast<char*>(&entry), sizeof(entry)) && entry.offset == end &&
+      entry.offset + entry.size <= log_size) {
+    end += entry.size;
+    entry_count++;
+  }
+  index_file.close();
+
+  if (truncate(path_.c_str(), static_cast<off_t>(end)) != 0 ||
+      truncate(index_path_.c_str(), static_cast<off_t>(sizeof(index_header) + entry_count * sizeof(entry))) != 0)
+    throw std::runtime_error("Failed to drop the unfinished block of " + path_);
+
+  file_.open(path_, std::ios::binary | std::ios::app);
+  index_file_.open(index_path_, std::ios::binary | std::ios::app);
+  if (!file_ || !index_file_)
+    throw std::runtime_error("Failed to open " + path_ + " for appending");
+  file_size_ = end;
+}
+
+void DetectionLogWriter::Create() {
+  file_.open(path_, std::ios::binary | std::ios::trunc);
+  index_file_.open(index_path_, std::ios::binary | std::ios::trunc);
+  if (!file_ || !index_file_)
+    throw std::runtime_error("Failed to create " + path_);
+
+  const DetectionLogHeader header = {DetectionLogMagic, DetectionLogVersion};
+  const DetectionLogIndexHeader index_header = {DetectionLogIndexMagic, DetectionLogVersion};
+  file_.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  index_file_.write(reinterpret_cast<const char*>(&index_header), sizeof(index_header));
+  file_.flush();
+  index_file_.flush();
+  if (!file_ || !index_file_)
+    throw std::runtime_error("Failed to write " + path_);
+  file_size_ = sizeof(header);
+  statistics_.bytes_written += sizeof(header) + sizeof(index_header);
+}
+
+void DetectionLogWriter::StartBlock(uint64_t timestamp) {
+  for (int column = 0; column != DetectionLogColumnCount; column++)
+    columns_[column].clear();
+
+  entry_ = DetectionLogIndexEntry();
+  entry_.min_timestamp = std::numeric_limits<uint64_t>::max();
+  entry_.min_stream = std::numeric_limits<uint32_t>::max();
+  entry_.min_x = entry_.min_y = std::numeric_limits<int32_t>::max();
+  entry_.max_x = entry_.max_y = std::numeric_limits<int32_t>::min();
+  base_timestamp_ = timestamp;
+  previous_timestamp_ = timestamp;
+}
@@ -0,0 +1,75 @@
+#pragma once
+/**
+ * @internal
+ * @file       detection_log_writer.hpp
+ * @copyright  VCA Technology
+ * @~english
+ * @brief      Declaration of the @c DetectionLogWriter class.
+ */
+
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "detection_log.hpp"
+#include "mtcnn.h"
+
+/**
+ * Appends detections to a detection log. Detections are encoded into the
+ * columns of the current block as they arrive, and the block is written out
+ * with its index entry once it holds enough rows or spans enough time.
+ *
+ * An existing log is continued, after dropping any block whose write was
+ * interrupted.
+ */
+class DetectionLogWriter final {
+ public:
+  struct Statistics {
+    uint64_t rows;
+    uint64_t blocks;
+    uint64_t bytes_written;   ///< Log and index
+  };
+
+ public:
+  /// Writes a block once it has block_rows rows or spans block_duration nanoseconds.
+  DetectionLogWriter(const std::string &path, unsigned int block_rows = 4096,
+      uint64_t block_duration = UINT64_C(60000000000));
+
+  /// Calls @c Close if it hasn't been called.
+  ~DetectionLogWriter();
+
+  /// Adds the faces detected on one frame of a stream at timestamp (ns).
+  void Append(uint32_t stream_id, uint64_t timestamp, const std::vector<Bbox> &faces);
+
+  /// Writes out the current block, if it has any rows.
+  void Flush();
+
+  /// Flushes and closes the files.
+  void Close();
+
+  Statistics GetStatistics() const;
+
+ private:
+  DetectionLogWriter(const DetectionLogWriter&) = delete;
+  DetectionLogWriter& operator=(const DetectionLogWriter&) = delete;
+
+  void Open();
+
+  void Create();
+
+  void StartBlock(uint64_t timestamp);
+
+ private:
+  const std::string path_, index_path_;
+  const unsigned int block_rows_;
+  const uint64_t block_duration_;
+  std::ofstream file_, index_file_;
+  uint64_t file_size_;
+
+  std::vector<uint8_t> columns_[DetectionLogColumnCount];
+  DetectionLogIndexEntry entry_;
+  uint64_t base_timestamp_, previous_timestamp_;
+
+  Statistics statistics_;
+};
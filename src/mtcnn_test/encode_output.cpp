@@ -0,0 +1,260 @@
+/**
+ * @internal
+ * @file       encode_output.cpp
+ * @copyright  VCA Technology
+ * @~english
+ * @brief      Implementation of the @c EncodeOutput class.
+ */
+
+#include <algorithm>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+
+extern "C" {
+#include <libavutil/opt.h>
+}
+
+#include "encode_output.hpp"
+#include "ffmpeg_common.hpp"
+
+static void ThrowAvError(const std::string &message, int err) {
+  std::ostringstream ss;
+  ss << message << ": " << AvErrorAsString(err);
+  throw std::runtime_error(ss.str());
+}
+
+static bool SupportsPixelFormat(const AVCodec *codec, AVPixelFormat format) {
+  if (!codec->pix_fmts)
+    return false;
+  for (const AVPixelFormat *f = codec->pix_fmts; *f != AV_PIX_FMT_NONE; f++)
+    if (*f == format)
+      return true;
+  return false;
+}
+
+EncodeOutput::EncodeOutput(unsigned int width, unsigned int height, const std::string &path,
+    const Options &options) :
+  VideoOutput(width, height),
+  width_(width),
+  height_(height),
+  format_context_(nullptr),
+  codec_context_(nullptr),
+  stream_(nullptr),
+  frame_(nullptr),
+  packet_(nullptr),
+  planar_(false),
+  planar_buffer_(),
+  quality_(0),
+  next_pts_(0),
+  finished_(false),
+  mutex_(),
+  statistics_{0, 0, 0, std::chrono::nanoseconds(0), std::chrono::nanoseconds(0)} {
+  int ret;
+
+  // Prefer libx264, whose presets are what the speed option selects
+  const AVCodec *codec = nullptr;
+  if (options.codec == Codec::H264) {
+    codec = avcodec_find_encoder_by_name("libx264");
+    if (!codec)
+      codec = avcodec_find_encoder(AV_CODEC_ID_H264);
+  } else {
+    codec = avcodec_find_encoder(AV_CODEC_ID_MJPEG);
+  }
+  if (!codec)
+    throw std::runtime_error("Encoder not found");
+
+  if ((ret = avformat_alloc_output_context2(&format_context_, nullptr, nullptr, path.c_str())) < 0 ||
+      !format_context_)
+    ThrowAvError("Could not choose a container for '" + path + "'", ret);
+
+  try {
+    codec_context_ = avcodec_alloc_context3(codec);
+    if (!codec_context_)
+      throw std::runtime_error("Failed to allocate video codec context");
+
+    // MJPEG wants full-range planar input; x264 takes NV12 as decoded
+    planar_ = !SupportsPixelFormat(codec, AV_PIX_FMT_NV12);
+    if (!planar_)
+      codec_context_->pix_fmt = AV_PIX_FMT_NV12;
+    else if (SupportsPixelFormat(codec, AV_PIX_FMT_YUVJ420P))
+      codec_context_->pix_fmt = AV_PIX_FMT_YUVJ420P;
+    else
+      codec_context_->pix_fmt = AV_PIX_FMT_YUV420P;
+
+    codec_context_->width = static_cast<int>(width_);
+    codec_context_->height = static_cast<int>(height_);
+    codec_context_->framerate = options.frame_rate;
+    codec_context_->time_base = av_inv_q(options.frame_rate);
+    codec_context_->gop_size = options.gop_size ? options.gop_size :
+        std::max(1, options.frame_rate.num / std::max(1, options.frame_rate.den));
+    // B-frames would hold back every frame until a later one arrives
+    codec_context_->max_b_frames = 0;
+    codec_context_->thread_count = options.thread_count;
+    codec_context_->thread_type = FF_THREAD_SLICE;
+    if (options.bit_rate)
+      codec_context_->bit_rate = options.bit_rate;
+
+    if (options.codec == Codec::H264) {
+      if (!options.preset.empty() && av_opt_set(codec_context_->priv_data, "preset", options.preset.c_str(), 0) < 0)
+        throw std::runtime_error("Unsupported encoder preset: " + options.preset);
+      av_opt_set(codec_context_->priv_data, "tune", "zerolatency", 0);
+      if (options.quality && !options.bit_rate)
+        av_opt_set(codec_context_->priv_data, "crf", std::to_string(options.quality).c_str(), 0);
+    } else if (options.quality && !options.bit_rate) {
+      quality_ = options.quality * FF_QP2LAMBDA;
+      codec_context_->flags |= AV_CODEC_FLAG_QSCALE;
+      codec_context_->global_quality = quality_;
+    }
+
+    if (format_context_->oformat->flags & AVFMT_GLOBALHEADER)
+      codec_context_->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+
+    if ((ret = avcodec_open2(codec_context_, codec, nullptr)) < 0)
+      ThrowAvError("Failed to open encoder", ret);
+
+    stream_ = avformat_new_stream(format_context_, nullptr);
+    if (!stream_)
+      throw std::runtime_error("Failed to create output stream");
+    stream_->time_base = codec_context_->time_base;
+    if (avcodec_parameters_from_context(stream_->codecpar, codec_context_) < 0)
+      throw std::runtime_error("Failed to copy encoder parameters to the output stream");
+
+    if (!(format_context_->oformat->flags & AVFMT_NOFILE) &&
+        (ret = avio_open(&format_context_->pb, path.c_str(), AVIO_FLAG_WRITE)) < 0)
+      ThrowAvError("Could not open '" + path + "'", ret);
+
+    if ((ret = avformat_write_header(format_context_, nullptr)) < 0)
+      ThrowAvError("Failed to write the container header", ret);
+
+    frame_ = av_frame_alloc();
+    packet_ = av_packet_alloc();
+    if (!frame_ || !packet_)
+      throw std::runtime_error("Failed to allocate video frame");
+    frame_->width = codec_context_->width;
+    frame_->height = codec_context_->height;
+    frame_->format = codec_context_->pix_fmt;
+
+    if (planar_)
+      planar_buffer_.reset(new uint8_t[buffer_size_]);
+  } catch (...) {
+    av_packet_free(&packet_);
+    av_frame_free(&frame_);
+    avcodec_free_context(&codec_context_);
+    if (format_context_->pb)
+      avio_closep(&format_context_->pb);
+    avformat_free_context(format_context_);
+    throw;
+  }
+}
+
+EncodeOutput::~EncodeOutput() {
+  try {
+    Finish();
+  } catch (const std::exception&) {
+    // The file is left without a trailer
+  }
+
+  av_packet_free(&packet_);
+  av_frame_free(&frame_);
+  avcodec_free_context(&codec_context_);
+  if (format_context_->pb)
+    avio_closep(&format_context_->pb);
+  avformat_free_context(format_context_);
+}
+
+void EncodeOutput::PushFrame(const uint8_t *buffer_data) {
+  if (finished_)
+    throw std::logic_error("Frame pushed after the encoder was finished");
+
+  const size_t luma_size = static_cast<size_t>(width_) * height_;
+  const auto begin = std::chrono::steady_clock::now();
+
+  if (!planar_) {
+    // The encoder copies frames that aren't reference counted before returning
+    frame_->data[0] = const_cast<uint8_t*>(buffer_data);
+    frame_->data[1] = const_cast<uint8_t*>(buffer_data) + luma_size;
+    frame_->linesize[0] = static_cast<int>(width_);
+    frame_->linesize[1] = static_cast<int>(width_);
+  } else {
+    uint8_t *const y = planar_buffer_.get();
+    uint8_t *const u = y + luma_size;
+    uint8_t *const v = u + luma_size / 4;
+    std::memcpy(y, buffer_data, luma_size);
+    const uint8_t *uv = buffer_data + luma_size;
+    for (size_t i = 0; i != luma_size / 4; i++) {
+      u[i] = uv[2 * i];
+      v[i] = uv[2 * i + 1];
+    }
+    frame_->data[0] = y;
+    frame_->data[1] = u;
+    frame_->data[2] = v;
+    frame_->linesize[0] = static_cast<int>(width_);
+    frame_->linesize[1] = static_cast<int>(width_ / 2);
+    frame_->linesize[2] = static_cast<int>(width_ / 2);
+  }
+  frame_->pts = next_pts_++;
+  frame_->quality = quality_;
+
+  Encode(frame_);
+
+  const auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - begin);
+  std::lock_guard<std::mutex> lock(mutex_);
+  statistics_.frames++;
+  statistics_.total_encode_time += elapsed;
+  statistics_.max_encode_time = std::max(statistics_.max_encode_time, elapsed);
+}
+
+void EncodeOutput::Finish() {
+  if (finished_)
+    return;
+  finished_ = true;
+
+  Encode(nullptr);
+
+  const int ret = av_write_trailer(format_context_);
+  if (ret < 0)
+    ThrowAvError("Failed to write the container trailer", ret);
+}
+
+EncodeOutput::Statistics EncodeOutput::GetStatistics() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return statistics_;
+}
+
+bool EncodeOutput::ParseCodec(const std::string &name, Codec &codec) {
+  if (name == "h264")
+    codec = Codec::H264;
+  else if (name == "mjpeg")
+    codec = Codec::Mjpeg;
+  else
+    return false;
+  return true;
+}
+
+void EncodeOutput::Encode(AVFrame *frame) {
+  int ret = avcodec_send_frame(codec_context_, frame);
+  if (ret < 0)
+    ThrowAvError("Failed to send a frame to the encoder", ret);
+
+  for (;;) {
+    ret = avcodec_receive_packet(codec_context_, packet_);
+    if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
+      return;
+    if (ret < 0)
+      ThrowAvError("Failed to encode a frame", ret);
+
+    const uint64_t size = static_cast<uint64_t>(packet_->size);
+    av_packet_rescale_ts(packet_, codec_context_->time_base, stream_->time_base);
+    packet_->stream_index = stream_->index;
+    // Takes ownership of the packet's data and leaves it blank
+    ret = av_interleaved_write_frame(format_context_, packet_);
+    if (ret < 0)
+      ThrowAvError("Failed to write a packet", ret);
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    statistics_.packets++;
+    statistics_.bytes_written += size;
+  }
+}
@@ -0,0 +1,103 @@
+#pragma once
+/**
+ * @internal
+ * @file       encode_output.hpp
+ * @copyright  VCA Technology
+ * @~english
+ * @brief      Declaration of the @c EncodeOutput class.
+ */
+
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+}
+
+#include "video_output.hpp"
+
+/**
+ * Compresses frames with a libavcodec software encoder and muxes them into a
+ * file, instead of piping raw NV12 to an external process.
+ *
+ * Encoding is synchronous; wrap the output in an @c AsyncOutput to run it on
+ * its own thread. The container is chosen from the file extension.
+ */
+class EncodeOutput final : public VideoOutput {
+ public:
+  enum class Codec {
+    H264,
+    Mjpeg,
+  };
+
+  struct Options {
+    Options() :
+      codec(Codec::H264),
+      preset("veryfast"),
+      frame_rate{15, 1},
+      bit_rate(0),
+      quality(0),
+      gop_size(0),
+      thread_count(1) {
+    }
+
+    Codec codec;
+    std::string preset;       ///< x264 speed preset, ultrafast to veryslow; ignored by MJPEG
+    AVRational frame_rate;
+    int64_t bit_rate;         ///< Target bits per second, 0 to encode at constant quality
+    int quality;              ///< x264 CRF or MJPEG q-scale (2-31), 0 for the codec default
+    int gop_size;             ///< Frames between key frames, 0 for one per second
+    int thread_count;         ///< Encoder threads, 0 for one per core
+  };
+
+  struct Statistics {
+    uint64_t frames;
+    uint64_t packets;
+    uint64_t bytes_written;   ///< Compressed bytes handed to the muxer
+    std::chrono::nanoseconds total_encode_time;
+    std::chrono::nanoseconds max_encode_time;
+  };
+
+ public:
+  EncodeOutput(unsigned int width, unsigned int height, const std::string &path,
+      const Options &options = Options());
+
+  /// Calls @c Finish if it hasn't been called.
+  ~EncodeOutput();
+
+  void PushFrame(const uint8_t *buffer_data);
+
+  /// Drains the encoder and writes the trailer. Frames pushed afterwards are an error.
+  void Finish();
+
+  Statistics GetStatistics() const;
+
+  static bool ParseCodec(const std::string &name, Codec &codec);
+
+ private:
+  void Encode(AVFrame *frame);
+
+ private:
+  EncodeOutput(const EncodeOutput&) = delete;
+  EncodeOutput& operator=(const EncodeOutput&) = delete;
+
+ private:
+  const unsigned int width_, height_;
+  AVFormatContext *format_context_;
+  AVCodecContext *codec_context_;
+  AVStream *stream_;
+  AVFrame *frame_;
+  AVPacket *packet_;
+  bool planar_;               ///< The encoder doesn't take NV12, so chroma is deinterleaved
+  std::unique_ptr<uint8_t[]> planar_buffer_;
+  int quality_;
+  int64_t next_pts_;
+  bool finished_;
+
+  mutable std::mutex mutex_;
+  Statistics statistics_;
+};
@@ -25,23 +25,69 @@
 #include <opencv2/imgproc/imgproc.hpp>
 
 #ifdef WITH_FFMPEG
+#include "encode_output.hpp"
 #include "ffmpeg_common.hpp"
 #include "ffmpeg_input.hpp"
 #endif
 
+#include "async_output.hpp"
+#include "detection_cache.h"
+#include "detection_log_writer.hpp"
+#include "frame_store_writer.hpp"
+#include "metadata_sink.hpp"
+#include "metrics_server.hpp"
 #include "mtcnn.h"
+#include "nv12_overlay.hpp"
+#include "placement.hpp"
+#include "quality_controller.hpp"
+#include "replay_input.hpp"
+#include "shm_output.hpp"
 #include "stream_output.hpp"
 #include "subprocess_output.hpp"
+#include "synthetic_input.hpp"
 #include "test_input.hpp"
 
 static const constexpr char TestInputUri[] = "test://";
+static const constexpr char SyntheticInputUri[] = "synthetic://";
+static const constexpr char ReplayInputUri[] = "replay://";
 static const constexpr int max_frames_to_play = 180*30;
 
 static unsigned int width = 0, height = 0;
 static bool output_json = false;
 static bool output_xml = false;
+static bool output_binary = false;
+static std::string metadata_path;
+static std::string record_path;
+static std::string detection_log_path;
+static unsigned int stream_id = 0;
 static bool print_events = false;
+static bool quiet = false;
+static MetricsServer::Options metrics_options;
 static unsigned int frame_no = 0;
+static unsigned int output_queue_size = 4;
+static unsigned int min_face_size = 40;
+static unsigned int max_face_size = 0;
+static std::vector<FaceSizeRegion> face_size_regions;
+static std::vector<unsigned int> face_size_ramp;
+static float deadline_ms = 0.0f;
+static unsigned int cache_size_kb = 0;
+static DetectMode detect_mode = DETECT_FULL;
+static int cache_distance = -1;
+static unsigned int max_rnet_inputs = 0, max_onet_inputs = 0;
+static unsigned int pruning_window = 0, pruning_probe = 30;
+static bool pruning_reference = false;
+static bool full_res_onet = false;
+static double target_fps = 0.0;
+static double cpu_budget = 0.8;
+static unsigned int idle_after_s = 10;
+static std::string placement_policy = "none";
+static std::string pnet_cpus, refine_cpus, decode_cpus, output_cpus;
+static unsigned int stage_threads[3] = {0, 0, 0};
+static AsyncOutput::DropPolicy output_drop_policy = AsyncOutput::DropPolicy::DropOldest;
+#ifdef WITH_FFMPEG
+static FfmpegInput::DecoderOptions decoder_options;
+static EncodeOutput::Options encode_options;
+#endif
 
 static double get_current_time() {
   struct timeval tv;
@@ -54,16 +100,125 @@ static void Usage(std::ostream &o, const char *argv0) {
     "\n"
     "Test C++ test for VCA Core Embedded\n"
     "\n"
-    "  FILE               The path to a file to load, or test:// to generate a\n"
-    "                     test video stream\n"
+    "  FILE               The path to a file to load, test:// to generate a\n"
+    "                     test video stream, synthetic://OPTIONS to composite\n"
+    "                     face patches onto a background, where OPTIONS are\n"
+    "                     &-separated: faces=N, min=SIZE, max=SIZE,\n"
+    "                     motion={static,linear,circle}, patch=IMAGE,\n"
+    "                     crop=X,Y,W,H, background=IMAGE, seed=N, truth=CSV,\n"
+    "                     or replay://STORE?timing={fast,original}&loop=N to\n"
+    "                     replay frames saved with --record, without decoding\n"
     "\n"
     "Options:\n"
     "  -s,--size WxH      Specifies the size of the input image\n"
-    "  --json             Outputs VCA meta-data in VCA JSON format\n"
+    "  --json             Outputs VCA meta-data in VCA JSON format, one object\n"
+    "                     per line\n"
     "  --xml              Outputs VCA meta-data in VCA XML format\n"
+    "  --binary           Outputs meta-data in the compact length-prefixed binary\n"
+    "                     format\n"
+    "  --metadata-output FILE\n"
+    "                     Writes meta-data to FILE instead of stdout\n"
     "  --print-events     Prints events\n"
-    "  --video-output {ffplay,mplayer,stdout}\n"
-    "                     Show video using specified method.\n"
+    "  --quiet            Doesn't print the read and detection time of each frame\n"
+    "  --metrics-listen {PORT,ADDRESS:PORT,unix:PATH}\n"
+    "                     Serves metrics in the Prometheus text format on a TCP\n"
+    "                     port (on 127.0.0.1 unless ADDRESS is given) or a Unix\n"
+    "                     socket\n"
+    "  --metrics-file FILE\n"
+    "                     Rewrites FILE with a snapshot of the metrics\n"
+    "                     periodically and at exit\n"
+    "  --metrics-interval SECONDS\n"
+    "                     Period of the metrics snapshots (default: 10)\n"
+    "  --record STORE     Saves the analytics frames and their timestamps to\n"
+    "                     STORE, for replay://STORE\n"
+    "  --detection-log LOG\n"
+    "                     Appends the detections to the columnar log LOG, with\n"
+    "                     wall-clock timestamps, for mtcnn_log_query\n"
+    "  --stream-id N      Stream id recorded in the detection log (default: 0)\n"
+    "  --video-output {ffplay,mplayer,stdout,shm:NAME,encode:FILE}\n"
+    "                     Show video using specified method, publish clean\n"
+    "                     frames and their detections in the shared-memory ring\n"
+    "                     NAME (such as /mtcnn) for other processes to read, or\n"
+    "                     compress the annotated video into FILE, whose\n"
+    "                     extension picks the container (such as .mp4 or .mkv)\n"
+    "  --video-output-queue N\n"
+    "                     Number of frames buffered for the video output\n"
+    "                     writer thread, or 0 to write synchronously (default: 4)\n"
+    "  --video-output-policy {drop-newest,drop-oldest,block}\n"
+    "                     What to do when the video output falls behind\n"
+    "                     (default: drop-oldest)\n"
+    "  --min-face SIZE    Smallest face to detect in pixels (default: 40)\n"
+    "  --max-face SIZE    Largest face to detect in pixels, 0 for no limit\n"
+    "                     (default: 0)\n"
+    "  --face-size-region X1,Y1,X2,Y2,MIN,MAX\n"
+    "                     Only searches for faces of MIN to MAX pixels centred\n"
+    "                     in the region, and no smaller than --min-face; may be\n"
+    "                     repeated\n"
+    "  --face-size-ramp TOP_MIN,TOP_MAX,BOTTOM_MIN,BOTTOM_MAX\n"
+    "                     Face size range at the top and bottom rows of the\n"
+    "                     image, interpolated linearly in between\n"
+    "  --deadline MS      Returns the faces found so far once detection has taken\n"
+    "                     MS milliseconds, 0 for no deadline (default: 0)\n"
+    "  --max-candidates RNET,ONET\n"
+    "                     Best scoring candidates kept for R-Net and O-Net, 0\n"
+    "                     for no limit (default: 0,0)\n"
+    "  --detect-mode {pnet,rnet,full}\n"
+    "                     Stops the cascade after P-Net or R-Net, giving coarser\n"
+    "                     boxes without landmarks (default: full)\n"
+    "  --scale-pruning WINDOW[,PROBE]\n"
+    "                     Skips the pyramid levels that found no face in the\n"
+    "                     last WINDOW detected frames, running all of them every\n"
+    "                     PROBE frames (default: 0, disabled; PROBE 30)\n"
+    "  --pruning-reference\n"
+    "                     Also runs the full pyramid on every detected frame and\n"
+    "                     reports the faces --scale-pruning lost against it\n"
+    "  --full-res-onet    Runs P-Net and R-Net on the analytics image and O-Net\n"
+    "                     on crops of the decoded frame, for landmarks at the\n"
+    "                     input resolution; meta-data and the detection log\n"
+    "                     then use the decoded frame's coordinates\n"
+    "  --target-fps FPS   Raises the minimum face, coarsens the pyramid, skips\n"
+    "                     analytics frames and stops after R-Net as needed to\n"
+    "                     keep detecting at FPS, 0 to disable (default: 0)\n"
+    "  --cpu-budget FRACTION\n"
+    "                     Share of each frame interval detection may use with\n"
+    "                     --target-fps (default: 0.8)\n"
+    "  --idle-after SECONDS\n"
+    "                     Only scans occasional frames after SECONDS without a\n"
+    "                     face with --target-fps, 0 to never idle (default: 10)\n"
+    "  --placement {none,big,little,split}\n"
+    "                     Pins the pipeline to the detected CPU clusters: all on\n"
+    "                     the big or LITTLE cluster, or split with P-Net on the\n"
+    "                     big cluster and the rest on the LITTLE (default: none)\n"
+    "  --pnet-cpus CPUS   CPUs running P-Net, as big, little, all or a list such\n"
+    "                     as 0-1,4; overrides --placement\n"
+    "  --refine-cpus CPUS CPUs running R-Net and O-Net\n"
+    "  --decode-cpus CPUS CPUs running the decoder threads\n"
+    "  --output-cpus CPUS CPUs running the video and meta-data writer threads\n"
+    "  --stage-threads P,R,O\n"
+    "                     ncnn threads of P-Net, R-Net and O-Net, 0 for one per\n"
+    "                     pinned CPU or the ncnn default (default: 0,0,0)\n"
+    "  --cache KB         Reuses the detections of frames whose luma is identical\n"
+    "                     to a recent frame, keeping at most KB kilobytes of\n"
+    "                     results (default: 0, disabled)\n"
+    "  --cache-distance N Also reuses the detections of frames whose difference\n"
+    "                     hash is within N bits of a cached frame\n"
+    "  --decode-threads N Number of decoder threads, 0 for one per core\n"
+    "                     (default: 1)\n"
+    "  --decode-low-delay Use slice threading only, avoiding the extra frame of\n"
+    "                     latency per thread that frame threading adds\n"
+    "  --adaptive-decode  Discard non-reference frames in the decoder while\n"
+    "                     detection is slower than the analytics frame rate\n"
+    "  --encode-codec {h264,mjpeg}\n"
+    "                     Codec of --video-output encode:FILE (default: h264)\n"
+    "  --encode-preset NAME\n"
+    "                     x264 speed preset, ultrafast to veryslow\n"
+    "                     (default: veryfast)\n"
+    "  --encode-bitrate KBPS\n"
+    "                     Target bit rate, 0 to encode at constant quality\n"
+    "                     (default: 0)\n"
+    "  --encode-quality N H.264 CRF or MJPEG q-scale (2-31) at constant quality,\n"
+    "                     0 for the codec default (default: 0)\n"
+    "  --encode-threads N Encoder threads, 0 for one per core (default: 1)\n"
     "\n"
     "\n";
 }
@@ -71,8 +226,13 @@ static void Usage(std::ostream &o, const char *argv0) {
 static std::unique_ptr<VideoInput> CreateVideoInput(const std::string &path) {
   if (path == TestInputUri)
     return std::unique_ptr<VideoInput>(new TestInput(width, height));
+  if (path.compare(0, std::strlen(SyntheticInputUri), SyntheticInputUri) == 0)
+    return std::unique_ptr<VideoInput>(
+        new SyntheticInput(path.substr(std::strlen(SyntheticInputUri)), width, height));
+  if (path.compare(0, std::strlen(ReplayInputUri), ReplayInputUri) == 0)
+    return std::unique_ptr<VideoInput>(new ReplayInput(path.substr(std::strlen(ReplayInputUri))));
 #ifdef WITH_FFMPEG
-  return std::unique_ptr<VideoInput>(new FfmpegInput(path, width, height));
+  return std::unique_ptr<VideoInput>(new FfmpegInput(path, width, height, decoder_options));
 #else
   throw std::runtime_error("Unsupported input");
 #endif
@@ -92,6 +252,15 @@ static std::unique_ptr<VideoOutput> CreateVideoOutput(
         {"-demuxer", "rawvideo", "-rawvideo", rawvideo_arg_ss.str(), "-"}));
   } else if (method == "stdout") {
     return std::unique_ptr<VideoOutput>(new StreamOutput(format.width, format.height, std::cout));
+  } else if (method.compare(0, 4, "shm:") == 0) {
+    return std::unique_ptr<VideoOutput>(new ShmOutput(format.width, format.height, method.substr(4)));
+#ifdef WITH_FFMPEG
+  } else if (method.compare(0, 7, "encode:") == 0) {
+    EncodeOutput::Options options = encode_options;
+    if (format.frame_rate.num && format.frame_rate.den)
+      options.frame_rate = AVRational{static_cast<int>(format.frame_rate.num), static_cast<int>(format.frame_rate.den)};
+    return std::unique_ptr<VideoOutput>(new EncodeOutput(format.width, format.height, method.substr(7), options));
+#endif
   } else if (method == "none") {
     return std::unique_ptr<VideoOutput>();
   }
@@ -117,36 +286,177 @@ static void PrintFormats(const std::string &heading, const vca::core::video::For
   std::cerr << std::endl;
 }
 
-static void UnreferenceFrame(VideoInput::Frame& frame) {
-  for (int i = 0; i != static_cast<int>(frame.input_buffers.size()); i++) {
-    if (frame.input_buffers[i].unreference)
-      frame.input_buffers[i].unreference();
+static bool ParseDetectMode(const std::string &name, DetectMode &mode) {
+  if (name == "pnet")
+    mode = DETECT_PNET;
+  else if (name == "rnet")
+    mode = DETECT_RNET;
+  else if (name == "full")
+    mode = DETECT_FULL;
+  else
+    return false;
+  return true;
+}
+
+static bool ParseDropPolicy(const std::string &name, AsyncOutput::DropPolicy &policy) {
+  if (name == "drop-newest")
+    policy = AsyncOutput::DropPolicy::DropNewest;
+  else if (name == "drop-oldest")
+    policy = AsyncOutput::DropPolicy::DropOldest;
+  else if (name == "block")
+    policy = AsyncOutput::DropPolicy::Block;
+  else
+    return false;
+  return true;
+}
+
+static void PrintOutputStatistics(const AsyncOutput::Statistics &statistics) {
+  std::cerr << "Output frames pushed:  " << statistics.pushed_frames << std::endl <<
+      "Output frames written: " << statistics.written_frames << std::endl <<
+      "Output frames dropped: " << statistics.dropped_frames << std::endl <<
+      "Output blocked pushes: " << statistics.blocked_pushes << std::endl <<
+      "Output write stalls:   " << statistics.write_stalls << std::endl;
+}
+
+#ifdef WITH_FFMPEG
+static void PrintEncodeStatistics(const EncodeOutput::Statistics &statistics) {
+  const double total_ms = std::chrono::duration<double, std::milli>(statistics.total_encode_time).count();
+  const double max_ms = std::chrono::duration<double, std::milli>(statistics.max_encode_time).count();
+  std::cerr << "Encoded frames:     " << statistics.frames << " (" << statistics.packets << " packets)" << std::endl <<
+      "Encoded bytes:      " << statistics.bytes_written << std::endl;
+  if (statistics.frames)
+    std::cerr << "Encode time:        " << total_ms / statistics.frames << "ms/frame mean, " << max_ms << "ms max, " <<
+        statistics.bytes_written / statistics.frames << " bytes/frame" << std::endl;
+}
+#endif
+
+static void PrintMetadataStatistics(const MetadataSink::Statistics &statistics) {
+  const double total_ms = std::chrono::duration<double, std::milli>(statistics.total_serialize_time).count();
+  const double max_ms = std::chrono::duration<double, std::milli>(statistics.max_serialize_time).count();
+  std::cerr << "Meta-data frames:   " << statistics.frames << " (" << statistics.faces << " faces, " <<
+      statistics.truncated_faces << " truncated)" << std::endl <<
+      "Meta-data bytes:    " << statistics.bytes_written << std::endl <<
+      "Meta-data blocked:  " << statistics.blocked_pushes << std::endl;
+  if (statistics.frames)
+    std::cerr << "Meta-data serialize: " << total_ms / statistics.frames << "ms/frame mean, " <<
+        max_ms << "ms max";
+  if (statistics.faces)
+    std::cerr << ", " << (total_ms * 1000.0) / statistics.faces << "us/face";
+  std::cerr << std::endl;
+}
+
+// Scales boxes and their landmarks by scale_x and scale_y into scaled
+static void ScaleBoxes(const std::vector<Bbox> &boxes, float scale_x, float scale_y, std::vector<Bbox> &scaled) {
+  scaled = boxes;
+  for (auto &box : scaled) {
+    box.x1 = static_cast<int>(std::lround(box.x1 * scale_x));
+    box.y1 = static_cast<int>(std::lround(box.y1 * scale_y));
+    box.x2 = static_cast<int>(std::lround(box.x2 * scale_x));
+    box.y2 = static_cast<int>(std::lround(box.y2 * scale_y));
+    for (int j = 0; j != 5; j++) {
+      box.landmark.x[j] *= scale_x;
+      box.landmark.y[j] *= scale_y;
+    }
   }
-  for (int i = 0; i != static_cast<int>(frame.output_buffers.size()); i++) {
-    if (frame.output_buffers[i].unreference)
-      frame.output_buffers[i].unreference();
+}
+
+// Whether any of the boxes overlaps the rectangle with an IoU of at least min_iou
+static bool IsDetected(int x1, int y1, int x2, int y2, const std::vector<Bbox> &boxes, float min_iou) {
+  const float area = static_cast<float>(x2 - x1 + 1) * (y2 - y1 + 1);
+  for (const auto &box : boxes) {
+    const int w = std::min(x2, box.x2) - std::max(x1, box.x1) + 1;
+    const int h = std::min(y2, box.y2) - std::max(y1, box.y1) + 1;
+    if (w <= 0 || h <= 0)
+      continue;
+    const float intersection = static_cast<float>(w) * h;
+    const float box_area = static_cast<float>(box.x2 - box.x1 + 1) * (box.y2 - box.y1 + 1);
+    if (intersection >= min_iou * (area + box_area - intersection))
+      return true;
   }
+  return false;
 }
 
-static void swapYUV_I420toNV12(unsigned char* i420bytes, unsigned char* nv12bytes, int width, int height) {
-  int nLenY = width * height;
-  int nLenU = nLenY / 4;
+// Counts ground truth faces overlapped by a detection with an IoU of at least 0.3
+static size_t CountDetectedFaces(const std::vector<SyntheticInput::GroundTruth> &truths,
+    const std::vector<Bbox> &boxes) {
+  size_t detected = 0;
+  for (const auto &truth : truths)
+    detected += IsDetected(truth.x1, truth.y1, truth.x2, truth.y2, boxes, 0.3f);
+  return detected;
+}
 
-  memcpy(nv12bytes, i420bytes, width * height);
+// Counts the reference faces that a detection overlaps with an IoU of at least 0.5
+static size_t CountMatchedFaces(const std::vector<Bbox> &reference, const std::vector<Bbox> &boxes) {
+  size_t matched = 0;
+  for (const auto &face : reference)
+    matched += IsDetected(face.x1, face.y1, face.x2, face.y2, boxes, 0.5f);
+  return matched;
+}
 
-  for (int i = 0; i < nLenU; i++) {
-    nv12bytes[nLenY + 2 * i] = i420bytes[nLenY + i];             // U
-    nv12bytes[nLenY + 2 * i + 1] = i420bytes[nLenY + nLenU + i]; // V
+// Applies the detection options shared by the detector and its reference
+static void ConfigureDetector(MTCNN &mtcnn) {
+  mtcnn.SetMinFace(static_cast<int>(min_face_size));
+  mtcnn.SetMaxFace(static_cast<int>(max_face_size));
+  mtcnn.SetFaceSizeRegions(face_size_regions);
+  mtcnn.SetDetectMode(detect_mode);
+  mtcnn.SetCandidateLimits(static_cast<int>(max_rnet_inputs), static_cast<int>(max_onet_inputs));
+}
+
+static void PrintScalePruning(const ScalePruningStats &statistics, size_t reference_faces, size_t matched_faces) {
+  const uint64_t levels = statistics.levels_run + statistics.levels_skipped;
+  std::cerr << "Pyramid levels:   " << statistics.levels_run << " run, " << statistics.levels_skipped <<
+      " skipped (" << (levels ? (100.0 * statistics.levels_skipped) / levels : 0.0) << "%), " <<
+      statistics.probe_frames << '/' << statistics.frames << " probe frames" << std::endl;
+  if (reference_faces)
+    std::cerr << "Pruning recall:   " << matched_faces << '/' << reference_faces << " full pyramid faces (" <<
+        reference_faces - matched_faces << " lost, " << (100.0 * matched_faces) / reference_faces << "%)" <<
+        std::endl;
+}
+
+// Splits the image into horizontal bands, each covering the face sizes that the
+// ramp interpolates over its rows
+static std::vector<FaceSizeRegion> MakeFaceSizeBands(const std::vector<unsigned int> &ramp,
+    unsigned int width, unsigned int height) {
+  static const unsigned int band_count = 8;
+  std::vector<FaceSizeRegion> bands;
+  for (unsigned int i = 0; i != band_count; i++) {
+    const int y1 = static_cast<int>(height * i / band_count);
+    const int y2 = static_cast<int>(height * (i + 1) / band_count) - 1;
+    const auto interpolate = [&](unsigned int top, unsigned int bottom, int y) {
+      return static_cast<int>(top + (static_cast<double>(bottom) - top) * y / std::max(height - 1, 1u) + 0.5);
+    };
+    const int min_a = interpolate(ramp[0], ramp[2], y1), min_b = interpolate(ramp[0], ramp[2], y2);
+    const int max_a = interpolate(ramp[1], ramp[3], y1), max_b = interpolate(ramp[1], ramp[3], y2);
+    bands.push_back({0, y1, static_cast<int>(width) - 1, y2, std::min(min_a, min_b), std::max(max_a, max_b)});
   }
+  return bands;
 }
 
-static void BGR2YUV_nv12(cv::Mat src, cv::Mat &dst) {
-  int w_img = src.cols;
-  int h_img = src.rows;
-  dst = cv::Mat(h_img * 1.5, w_img, CV_8UC1, cv::Scalar(0));
-  cv::Mat src_YUV_I420(h_img * 1.5, w_img, CV_8UC1, cv::Scalar(0)); //YUV_I420
-  cv::cvtColor(src, src_YUV_I420, CV_BGR2YUV_I420);
-  swapYUV_I420toNV12(src_YUV_I420.data, dst.data, w_img, h_img);
+static void PrintLatencies(std::vector<double> latencies, size_t partial_frames) {
+  if (latencies.empty())
+    return;
+  std::sort(latencies.begin(), latencies.end());
+  const auto percentile = [&](double p) {
+    const size_t rank = static_cast<size_t>(std::ceil(p / 100.0 * latencies.size()));
+    return latencies[std::max<size_t>(rank, 1) - 1];
+  };
+  std::cerr << "Detect latency:   p50 " << percentile(50) << "ms, p99 " << percentile(99) << "ms, max " <<
+      latencies.back() << "ms" << std::endl <<
+      "Partial frames:   " << partial_frames << '/' << latencies.size() << std::endl;
+}
+
+static void PrintCacheStatistics(const DetectionCache::Statistics &statistics) {
+  std::cerr << "Cache hits:       " << statistics.hits << " exact, " << statistics.perceptual_hits <<
+      " perceptual" << std::endl <<
+      "Cache misses:     " << statistics.misses << std::endl <<
+      "Cache entries:    " << statistics.entries << " (" << statistics.bytes << " bytes, " <<
+      statistics.evictions << " evicted)" << std::endl;
+}
+
+static void PrintStatistics(const VideoInput::Statistics &statistics) {
+  std::cerr << "Decoded frames:   " << statistics.decoded_frames << std::endl <<
+      "Delivered frames: " << statistics.delivered_frames << std::endl <<
+      "Skipped frames:   " << statistics.skipped_frames << std::endl;
 }
 
 int main(int argc, const char *const *const argv) {
@@ -191,6 +501,34 @@ int main(int argc, const char *const *const argv) {
       output_json = true;
     } else if (std::strcmp(argv[arg], "--xml") == 0) {
       output_xml = true;
+    } else if (std::strcmp(argv[arg], "--binary") == 0) {
+      output_binary = true;
+    } else if (std::strcmp(argv[arg], "--metadata-output") == 0) {
+      if (arg + 1 == argc) {
+        std::cerr << "No meta-data output file specified";
+        return EXIT_FAILURE;
+      } else {
+        metadata_path = argv[++arg];
+      }
+    } else if (std::strcmp(argv[arg], "--record") == 0) {
+      if (arg + 1 == argc) {
+        std::cerr << "No frame store specified";
+        return EXIT_FAILURE;
+      } else {
+        record_path = argv[++arg];
+      }
+    } else if (std::strcmp(argv[arg], "--detection-log") == 0) {
+      if (arg + 1 == argc) {
+        std::cerr << "No detection log specified";
+        return EXIT_FAILURE;
+      } else {
+        detection_log_path = argv[++arg];
+      }
+    } else if (std::strcmp(argv[arg], "--stream-id") == 0) {
+      if (arg + 1 == argc || std::sscanf(argv[++arg], "%u", &stream_id) != 1) {
+        std::cerr << "Failed to parse stream id" << std::endl;
+        return EXIT_FAILURE;
+      }
     } else if (std::strcmp(argv[arg], "--video-output") == 0) {
       if (arg + 1 == argc) {
         std::cerr << "No video output method specified";
@@ -198,8 +536,309 @@ int main(int argc, const char *const *const argv) {
       } else {
         output_video_method = argv[++arg];
       }
+    } else if (std::strcmp(argv[arg], "--video-output-queue") == 0) {
+      if (arg + 1 == argc) {
+        std::cerr << "No video output queue size specified";
+        return EXIT_FAILURE;
+      } else {
+        const char *size = argv[++arg];
+        if (std::sscanf(size, "%u", &output_queue_size) != 1) {
+          std::cerr << "Failed to parse video output queue size: " << size << std::endl;
+          return EXIT_FAILURE;
+        }
+      }
+    } else if (std::strcmp(argv[arg], "--video-output-policy") == 0) {
+      if (arg + 1 == argc) {
+        std::cerr << "No video output policy specified";
+        return EXIT_FAILURE;
+      } else if (!ParseDropPolicy(argv[++arg], output_drop_policy)) {
+        std::cerr << "Unsupported video output policy: " << argv[arg] << std::endl;
+        return EXIT_FAILURE;
+      }
+    } else if (std::strcmp(argv[arg], "--min-face") == 0) {
+      if (arg + 1 == argc) {
+        std::cerr << "No minimum face size specified";
+        return EXIT_FAILURE;
+      } else {
+        const char *size = argv[++arg];
+        if (std::sscanf(size, "%u", &min_face_size) != 1) {
+          std::cerr << "Failed to parse minimum face size: " << size << std::endl;
+          return EXIT_FAILURE;
+        }
+      }
+    } else if (std::strcmp(argv[arg], "--max-face") == 0) {
+      if (arg + 1 == argc) {
+        std::cerr << "No maximum face size specified";
+        return EXIT_FAILURE;
+      } else {
+        const char *size = argv[++arg];
+        if (std::sscanf(size, "%u", &max_face_size) != 1) {
+          std::cerr << "Failed to parse maximum face size: " << size << std::endl;
+          return EXIT_FAILURE;
+        }
+      }
+    } else if (std::strcmp(argv[arg], "--face-size-region") == 0) {
+      if (arg + 1 == argc) {
+        std::cerr << "No face size region specified";
+        return EXIT_FAILURE;
+      } else {
+        FaceSizeRegion region;
+        const char *value = argv[++arg];
+        if (std::sscanf(value, "%d , %d , %d , %d , %d , %d", &region.x1, &region.y1, &region.x2, &region.y2,
+            &region.min_size, &region.max_size) == 6 && region.min_size >= 1 &&
+            region.max_size >= region.min_size) {
+          face_size_regions.push_back(region);
+        } else {
+          std::cerr << "Failed to parse face size region: " << value << std::endl;
+          return EXIT_FAILURE;
+        }
+      }
+    } else if (std::strcmp(argv[arg], "--face-size-ramp") == 0) {
+      if (arg + 1 == argc) {
+        std::cerr << "No face size ramp specified";
+        return EXIT_FAILURE;
+      } else {
+        face_size_ramp.resize(4);
+        const char *value = argv[++arg];
+        if (std::sscanf(value, "%u , %u , %u , %u", &face_size_ramp[0], &face_size_ramp[1], &face_size_ramp[2],
+            &face_size_ramp[3]) != 4 || face_size_ramp[0] < 1 || face_size_ramp[2] < 1 ||
+            face_size_ramp[1] < face_size_ramp[0] || face_size_ramp[3] < face_size_ramp[2]) {
+          std::cerr << "Failed to parse face size ramp: " << value << std::endl;
+          return EXIT_FAILURE;
+        }
+      }
+    } else if (std::strcmp(argv[arg], "--deadline") == 0) {
+      if (arg + 1 == argc) {
+        std::cerr << "No deadline specified";
+        return EXIT_FAILURE;
+      } else {
+        const char *deadline = argv[++arg];
+        if (std::sscanf(deadline, "%f", &deadline_ms) != 1 || deadline_ms < 0) {
+          std::cerr << "Failed to parse deadline: " << deadline << std::endl;
+          return EXIT_FAILURE;
+        }
+      }
+    } else if (std::strcmp(argv[arg], "--max-candidates") == 0) {
+      if (arg + 1 == argc) {
+        std::cerr << "No candidate limits specified";
+        return EXIT_FAILURE;
+      } else {
+        const char *limits = argv[++arg];
+        if (std::sscanf(limits, "%u , %u", &max_rnet_inputs, &max_onet_inputs) != 2) {
+          std::cerr << "Failed to parse candidate limits: " << limits << std::endl;
+          return EXIT_FAILURE;
+        }
+      }
+    } else if (std::strcmp(argv[arg], "--scale-pruning") == 0) {
+      if (arg + 1 == argc) {
+        std::cerr << "No scale pruning window specified";
+        return EXIT_FAILURE;
+      } else {
+        const char *pruning = argv[++arg];
+        if (std::sscanf(pruning, "%u , %u", &pruning_window, &pruning_probe) < 1) {
+          std::cerr << "Failed to parse scale pruning: " << pruning << std::endl;
+          return EXIT_FAILURE;
+        }
+      }
+    } else if (std::strcmp(argv[arg], "--pruning-reference") == 0) {
+      pruning_reference = true;
+    } else if (std::strcmp(argv[arg], "--full-res-onet") == 0) {
+      full_res_onet = true;
+    } else if (std::strcmp(argv[arg], "--detect-mode") == 0) {
+      if (arg + 1 == argc) {
+        std::cerr << "No detection mode specified";
+        return EXIT_FAILURE;
+      } else if (!ParseDetectMode(argv[++arg], detect_mode)) {
+        std::cerr << "Unsupported detection mode: " << argv[arg] << std::endl;
+        return EXIT_FAILURE;
+      }
+    } else if (std::strcmp(argv[arg], "--target-fps") == 0) {
+      if (arg + 1 == argc) {
+        std::cerr << "No target frame rate specified";
+        return EXIT_FAILURE;
+      } else {
+        const char *fps = argv[++arg];
+        if (std::sscanf(fps, "%lf", &target_fps) != 1 || target_fps < 0) {
+          std::cerr << "Failed to parse target frame rate: " << fps << std::endl;
+          return EXIT_FAILURE;
+        }
+      }
+    } else if (std::strcmp(argv[arg], "--cpu-budget") == 0) {
+      if (arg + 1 == argc) {
+        std::cerr << "No CPU budget specified";
+        return EXIT_FAILURE;
+      } else {
+        const char *budget = argv[++arg];
+        if (std::sscanf(budget, "%lf", &cpu_budget) != 1 || cpu_budget <= 0 || cpu_budget > 1) {
+          std::cerr << "Failed to parse CPU budget: " << budget << std::endl;
+          return EXIT_FAILURE;
+        }
+      }
+    } else if (std::strcmp(argv[arg], "--idle-after") == 0) {
+      if (arg + 1 == argc) {
+        std::cerr << "No idle time specified";
+        return EXIT_FAILURE;
+      } else {
+        const char *seconds = argv[++arg];
+        if (std::sscanf(seconds, "%u", &idle_after_s) != 1) {
+          std::cerr << "Failed to parse idle time: " << seconds << std::endl;
+          return EXIT_FAILURE;
+        }
+      }
+    } else if (std::strcmp(argv[arg], "--placement") == 0) {
+      if (arg + 1 == argc) {
+        std::cerr << "No placement policy specified";
+        return EXIT_FAILURE;
+      } else if (!Placement::IsPolicy(argv[++arg])) {
+        std::cerr << "Unsupported placement policy: " << argv[arg] << std::endl;
+        return EXIT_FAILURE;
+      }
+      placement_policy = argv[arg];
+    } else if (std::strcmp(argv[arg], "--pnet-cpus") == 0 || std::strcmp(argv[arg], "--refine-cpus") == 0 ||
+        std::strcmp(argv[arg], "--decode-cpus") == 0 || std::strcmp(argv[arg], "--output-cpus") == 0) {
+      if (arg + 1 == argc) {
+        std::cerr << "No CPUs specified";
+        return EXIT_FAILURE;
+      }
+      std::string &cpus = argv[arg][2] == 'p' ? pnet_cpus : argv[arg][2] == 'r' ? refine_cpus :
+          argv[arg][2] == 'd' ? decode_cpus : output_cpus;
+      cpus = argv[++arg];
+    } else if (std::strcmp(argv[arg], "--stage-threads") == 0) {
+      if (arg + 1 == argc) {
+        std::cerr << "No stage thread counts specified";
+        return EXIT_FAILURE;
+      } else {
+        const char *counts = argv[++arg];
+        if (std::sscanf(counts, "%u , %u , %u", &stage_threads[0], &stage_threads[1], &stage_threads[2]) != 3) {
+          std::cerr << "Failed to parse stage thread counts: " << counts << std::endl;
+          return EXIT_FAILURE;
+        }
+      }
+    } else if (std::strcmp(argv[arg], "--cache") == 0) {
+      if (arg + 1 == argc) {
+        std::cerr << "No cache size specified";
+        return EXIT_FAILURE;
+      } else {
+        const char *size = argv[++arg];
+        if (std::sscanf(size, "%u", &cache_size_kb) != 1) {
+          std::cerr << "Failed to parse cache size: " << size << std::endl;
+          return EXIT_FAILURE;
+        }
+      }
+    } else if (std::strcmp(argv[arg], "--cache-distance") == 0) {
+      if (arg + 1 == argc) {
+        std::cerr << "No cache distance specified";
+        return EXIT_FAILURE;
+      } else {
+        const char *distance = argv[++arg];
+        if (std::sscanf(distance, "%d", &cache_distance) != 1 || cache_distance < 0 || cache_distance > 64) {
+          std::cerr << "Failed to parse cache distance: " << distance << std::endl;
+          return EXIT_FAILURE;
+        }
+      }
+    } else if (std::strcmp(argv[arg], "--quiet") == 0) {
+      quiet = true;
+    } else if (std::strcmp(argv[arg], "--metrics-listen") == 0) {
+      if (arg + 1 == argc) {
+        std::cerr << "No metrics address specified";
+        return EXIT_FAILURE;
+      } else {
+        metrics_options.listen = argv[++arg];
+      }
+    } else if (std::strcmp(argv[arg], "--metrics-file") == 0) {
+      if (arg + 1 == argc) {
+        std::cerr << "No metrics file specified";
+        return EXIT_FAILURE;
+      } else {
+        metrics_options.snapshot_path = argv[++arg];
+      }
+    } else if (std::strcmp(argv[arg], "--metrics-interval") == 0) {
+      if (arg + 1 == argc) {
+        std::cerr << "No metrics interval specified";
+        return EXIT_FAILURE;
+      } else {
+        double seconds;
+        const char *interval = argv[++arg];
+        if (std::sscanf(interval, "%lf", &seconds) == 1 && seconds > 0.0) {
+          metrics_options.snapshot_interval = std::chrono::milliseconds(static_cast<long long>(seconds * 1000.0));
+        } else {
+          std::cerr << "Failed to parse metrics interval: " << interval << std::endl;
+          return EXIT_FAILURE;
+        }
+      }
     } else if (std::strcmp(argv[arg], "--print-events") == 0) {
           print_events = true;
+#ifdef WITH_FFMPEG
+    } else if (std::strcmp(argv[arg], "--decode-threads") == 0) {
+      if (arg + 1 == argc) {
+        std::cerr << "No decoder thread count specified";
+        return EXIT_FAILURE;
+      } else {
+        unsigned int thread_count;
+        const char *count = argv[++arg];
+        if (std::sscanf(count, "%u", &thread_count) == 1) {
+          decoder_options.thread_count = thread_count;
+        } else {
+          std::cerr << "Failed to parse decoder thread count: " << count << std::endl;
+          return EXIT_FAILURE;
+        }
+      }
+    } else if (std::strcmp(argv[arg], "--decode-low-delay") == 0) {
+      decoder_options.frame_threading = false;
+    } else if (std::strcmp(argv[arg], "--adaptive-decode") == 0) {
+      decoder_options.adaptive_discard = true;
+    } else if (std::strcmp(argv[arg], "--encode-codec") == 0) {
+      if (arg + 1 == argc) {
+        std::cerr << "No encoder codec specified";
+        return EXIT_FAILURE;
+      } else if (!EncodeOutput::ParseCodec(argv[++arg], encode_options.codec)) {
+        std::cerr << "Unsupported encoder codec: " << argv[arg] << std::endl;
+        return EXIT_FAILURE;
+      }
+    } else if (std::strcmp(argv[arg], "--encode-preset") == 0) {
+      if (arg + 1 == argc) {
+        std::cerr << "No encoder preset specified";
+        return EXIT_FAILURE;
+      } else {
+        encode_options.preset = argv[++arg];
+      }
+    } else if (std::strcmp(argv[arg], "--encode-bitrate") == 0) {
+      if (arg + 1 == argc) {
+        std::cerr << "No encoder bit rate specified";
+        return EXIT_FAILURE;
+      } else {
+        unsigned int kbps;
+        const char *rate = argv[++arg];
+        if (std::sscanf(rate, "%u", &kbps) == 1) {
+          encode_options.bit_rate = static_cast<int64_t>(kbps) * 1000;
+        } else {
+          std::cerr << "Failed to parse encoder bit rate: " << rate << std::endl;
+          return EXIT_FAILURE;
+        }
+      }
+    } else if (std::strcmp(argv[arg], "--encode-quality") == 0) {
+      if (arg + 1 == argc) {
+        std::cerr << "No encoder quality specified";
+        return EXIT_FAILURE;
+      } else {
+        const char *quality = argv[++arg];
+        if (std::sscanf(quality, "%d", &encode_options.quality) != 1 || encode_options.quality < 0) {
+          std::cerr << "Failed to parse encoder quality: " << quality << std::endl;
+          return EXIT_FAILURE;
+        }
+      }
+    } else if (std::strcmp(argv[arg], "--encode-threads") == 0) {
+      if (arg + 1 == argc) {
+        std::cerr << "No encoder thread count specified";
+        return EXIT_FAILURE;
+      } else {
+        const char *count = argv[++arg];
+        if (std::sscanf(count, "%d", &encode_options.thread_count) != 1 || encode_options.thread_count < 0) {
+          std::cerr << "Failed to parse encoder thread count: " << count << std::endl;
+          return EXIT_FAILURE;
+        }
+      }
+#endif
     } else {
       break;
     }
@@ -214,10 +853,55 @@ int main(int argc, const char *const *const argv) {
     return EXIT_FAILURE;
   }
 
-  // Load the video
+  if (output_json + output_xml + output_binary > 1) {
+    std::cerr << "Only one meta-data format can be selected" << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  const bool output_metadata = output_json || output_xml || output_binary;
+  if (output_metadata && metadata_path.empty() && output_video_method == "stdout") {
+    std::cerr << "Meta-data and video can't both be written to stdout" << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  // Publish the metrics, which every part of the pipeline records into as it goes
+  MetricsRegistry &metrics = MetricsRegistry::Global();
+  MetricCounter &faces_metric = metrics.Counter("mtcnn_faces_total", "Faces found in analytics frames");
+  MetricCounter &cached_metric = metrics.Counter("mtcnn_cached_detections_total",
+      "Analytics frames whose detections came from the cache");
+  MetricCounter &skipped_metric = metrics.Counter("mtcnn_skipped_detections_total",
+      "Analytics frames the quality controller skipped");
+  std::unique_ptr<MetricsServer> metrics_server;
+  if (!metrics_options.listen.empty() || !metrics_options.snapshot_path.empty()) {
+    try {
+      metrics_server.reset(new MetricsServer(metrics, metrics_options));
+    } catch (const std::exception &e) {
+      std::cerr << e.what() << std::endl;
+      return EXIT_FAILURE;
+    }
+  }
+
+  // Place the pipeline on the CPU clusters
+  const CpuTopology topology = CpuTopology::Detect();
+  Placement placement;
+  Placement::FromPolicy(placement_policy, topology, placement);
+  const std::pair<const std::string*, std::vector<int>*> cpu_options[] = {
+    {&pnet_cpus, &placement.pnet}, {&refine_cpus, &placement.refine},
+    {&decode_cpus, &placement.decode}, {&output_cpus, &placement.output}
+  };
+  for (const auto &option : cpu_options) {
+    if (!option.first->empty() && !topology.Parse(*option.first, *option.second)) {
+      std::cerr << "Failed to parse CPUs: " << *option.first << std::endl;
+      return EXIT_FAILURE;
+    }
+  }
+  std::cerr << "CPU topology:     " << topology.Describe() << std::endl <<
+      "Placement:        " << placement.Describe() << std::endl;
+
+  // Load the video; the decoder starts its threads when it opens
   std::shared_ptr<VideoInput> video_input;
   try {
-    video_input = CreateVideoInput(path);
+    CreateOn(placement.decode, [&]() { video_input = CreateVideoInput(path); });
   } catch (const std::exception &e) {
     std::cerr << e.what() << std::endl;
     return EXIT_FAILURE;
@@ -229,77 +913,317 @@ int main(int argc, const char *const *const argv) {
   // Set up the video output
   const auto &analytics_format = input_formats.back();
   std::unique_ptr<VideoOutput> video_output;
+  AsyncOutput *async_output = nullptr;
+  ShmOutput *shm_output = nullptr;
+#ifdef WITH_FFMPEG
+  EncodeOutput *encode_output = nullptr;
+#endif
 
   try {
     video_output = CreateVideoOutput(output_video_method, analytics_format);
+#ifdef WITH_FFMPEG
+    encode_output = dynamic_cast<EncodeOutput*>(video_output.get());
+#endif
+
+    // Write from a separate thread so a slow viewer can't stall detection; the
+    // shared-memory ring never waits for its readers
+    shm_output = dynamic_cast<ShmOutput*>(video_output.get());
+    if (video_output && !shm_output && output_queue_size != 0) {
+      CreateOn(placement.output, [&]() {
+        async_output = new AsyncOutput(analytics_format.width, analytics_format.height, std::move(video_output),
+            output_queue_size, output_drop_policy);
+      });
+      video_output.reset(async_output);
+    }
   } catch (const std::exception &e) {
     std::cerr << e.what() << std::endl;
     return EXIT_FAILURE;
   }
 
-  if (video_output)
+  if (video_output && !shm_output)
     bia_buffer.reset(new uint8_t[(3 * analytics_format.width * analytics_format.height) / 2]);
 
+  // Set up the frame recorder
+  std::unique_ptr<FrameStoreWriter> frame_store;
+  if (!record_path.empty()) {
+    try {
+      frame_store.reset(new FrameStoreWriter(record_path, analytics_format.width, analytics_format.height,
+          analytics_format.frame_rate));
+    } catch (const std::exception &e) {
+      std::cerr << e.what() << std::endl;
+      return EXIT_FAILURE;
+    }
+  }
+
+  // Set up the detection log
+  std::unique_ptr<DetectionLogWriter> detection_log;
+  int64_t detection_log_offset = 0;
+  if (!detection_log_path.empty()) {
+    try {
+      detection_log.reset(new DetectionLogWriter(detection_log_path));
+    } catch (const std::exception &e) {
+      std::cerr << e.what() << std::endl;
+      return EXIT_FAILURE;
+    }
+  }
+
+  // Set up the meta-data output
+  std::ofstream metadata_file;
+  std::unique_ptr<MetadataSink> metadata_sink;
+  if (output_metadata) {
+    std::ostream *metadata_stream = &std::cout;
+    if (!metadata_path.empty()) {
+      metadata_file.open(metadata_path, std::ios::binary);
+      if (!metadata_file) {
+        std::cerr << "Failed to open " << metadata_path << std::endl;
+        return EXIT_FAILURE;
+      }
+      metadata_stream = &metadata_file;
+    }
+
+    const MetadataSink::Format format = output_json ? MetadataSink::Format::Json :
+        output_xml ? MetadataSink::Format::Xml : MetadataSink::Format::Binary;
+    CreateOn(placement.output, [&]() { metadata_sink.reset(new MetadataSink(*metadata_stream, format)); });
+  }
+
   VideoInput::Frame frame;
+  size_t previous_face_count = 0;
+
+  // Synthetic input knows where the faces are, so recall can be reported
+  const SyntheticInput *const synthetic_input = dynamic_cast<const SyntheticInput*>(video_input.get());
+  size_t truth_faces = 0, detected_faces = 0;
 
   PrintFormats("Input formats", input_formats);
   PrintFormats("Output formats", output_formats);
 
   const char *model_path = "/mnt/shares/face/MTCNN-NCNN/models";
   MTCNN mtcnn(model_path);
+  if (!face_size_ramp.empty()) {
+    const auto bands = MakeFaceSizeBands(face_size_ramp, analytics_format.width, analytics_format.height);
+    face_size_regions.insert(face_size_regions.end(), bands.begin(), bands.end());
+  }
+  ConfigureDetector(mtcnn);
+  mtcnn.SetScalePruning(static_cast<int>(pruning_window), static_cast<int>(pruning_probe));
+  // The main thread also reads frames, on the CPUs of whichever stage ran last
+  mtcnn.SetStagePlacement(0, placement.pnet, static_cast<int>(stage_threads[0]));
+  mtcnn.SetStagePlacement(1, placement.refine, static_cast<int>(stage_threads[1]));
+  mtcnn.SetStagePlacement(2, placement.refine, static_cast<int>(stage_threads[2]));
   std::vector<Bbox> finalBbox;
+  std::vector<double> detect_latencies;
+  std::unique_ptr<DetectionCache> detection_cache;
+  if (cache_size_kb)
+    detection_cache.reset(new DetectionCache(size_t(cache_size_kb) * 1024, cache_distance));
+  size_t partial_frames = 0;
+
+  // The full pyramid, for what scale pruning misses
+  std::unique_ptr<MTCNN> reference_mtcnn;
+  if (pruning_window && pruning_reference) {
+    reference_mtcnn.reset(new MTCNN(model_path));
+    ConfigureDetector(*reference_mtcnn);
+  }
+  ncnn::Mat reference_img;
+  std::vector<Bbox> reference_boxes;
+  size_t reference_faces = 0, matched_faces = 0;
+
+  // Trades detection quality for speed to keep up with the target frame rate
+  std::unique_ptr<QualityController> quality_controller;
+  if (target_fps > 0) {
+    QualityController::Options options;
+    options.target_fps = target_fps;
+    options.cpu_budget = cpu_budget;
+    options.min_face = min_face_size;
+    options.mode = detect_mode;
+    options.idle_after = std::chrono::seconds(idle_after_s);
+    quality_controller.reset(new QualityController(options, std::cerr));
+  }
+  unsigned int analytics_index = 0, skipped_detections = 0;
+
+  // Detection only reads the analytics image, and the decoded frame for O-Net,
+  // and only frames that are detected, recorded or shown need scaling
+  video_input->SetRequiredBuffers(VideoInput::ScaledBuffer | VideoInput::LazyScaling |
+      (full_res_onet ? static_cast<unsigned int>(VideoInput::DecodedBuffer) : 0u));
+
+  // With --full-res-onet, finalBbox is in the decoded frame's coordinates and
+  // analytics_boxes a copy in the analytics image's, for drawing and comparing
+  std::vector<Bbox> analytics_boxes;
+  const std::vector<Bbox> &shown_boxes = full_res_onet ? analytics_boxes : finalBbox;
+  float full_res_scale_x = 1.0f, full_res_scale_y = 1.0f;
+  if (full_res_onet) {
+    if (input_formats.size() < 2) {
+      std::cerr << "--full-res-onet needs an input that delivers the decoded frame" << std::endl;
+      return EXIT_FAILURE;
+    }
+    full_res_scale_x = static_cast<float>(input_formats.front().width) / analytics_format.width;
+    full_res_scale_y = static_cast<float>(input_formats.front().height) / analytics_format.height;
+  }
 
   frame_no = 0;
   while (true) {
-    VideoInput::Frame frame;
+    const double read_begin = get_current_time();
+
+    // The frame is reused so its buffers go back to the input's pool on each read
     if (video_input->ReadFrame(frame)) {
-      // Keep a copy of the video for BIA
-      if (video_output) {
-        const auto &cif_buffer = frame.input_buffers.back();
-        std::memcpy(bia_buffer.get(), cif_buffer.data + cif_buffer.planes[0].offset, cif_buffer.planes[0].size);
-        std::memcpy(bia_buffer.get() + cif_buffer.planes[0].size, cif_buffer.data + cif_buffer.planes[1].offset, cif_buffer.planes[1].size);
+      // Frames between analytics frames carry no scaled image
+      if (frame.input_buffers.empty() || !frame.input_buffers.back().data) {
+        frame_no++;
+        continue;
       }
 
-      // Output the video
-      if (video_output) {
-        const auto &analytics_format = input_formats.back();
-        // convert NV12 to BGR
-        cv::Mat picYV12 = cv::Mat(analytics_format.height * 3/2, analytics_format.width, CV_8UC1, bia_buffer.get());
-        cv::Mat picBGR;
-        cv::cvtColor(picYV12, picBGR, CV_YUV2BGR_NV12);
+      // Frames the controller skips keep the previous detections, and are only
+      // scaled when they are recorded or shown
+      const bool detect = !quality_controller || quality_controller->ShouldDetect(analytics_index++);
+      if (detect || frame_store || video_output)
+        frame.Materialize();
+      const double read_end = get_current_time();
 
-        ncnn::Mat ncnn_img = ncnn::Mat::from_pixels(picBGR.data, ncnn::Mat::PIXEL_BGR2RGB, picBGR.cols, picBGR.rows);
+      const auto &analytics_buffer = frame.input_buffers.back();
 
+      if (frame_store)
+        frame_store->WriteFrame(analytics_buffer.data + analytics_buffer.planes[0].offset,
+            analytics_buffer.planes[0].stride, frame.timestamp, frame_no);
+
+      if (detect) {
+        finalBbox.clear();
+        bool partial = false, cached = false;
         double begin = get_current_time();
-        #if(MAXFACEOPEN==1)
-        mtcnn.detectMaxFace(ncnn_img, finalBbox);
-        #else
-        mtcnn.detect(ncnn_img, finalBbox);
-        #endif
-        double end = get_current_time();
 
-        std::cerr << " " << picBGR.cols << "x" << picBGR.rows << " took: " << end - begin << "ms" << std::endl;
+        // Frozen feeds repeat frames; the luma plane alone identifies them
+        DetectionCache::Key cache_key;
+        if (detection_cache) {
+          cache_key = detection_cache->MakeKey(analytics_buffer.data + analytics_buffer.planes[0].offset,
+              analytics_format.width, analytics_format.height,
+              static_cast<int>(analytics_buffer.planes[0].stride), 1);
+          cached = detection_cache->Lookup(cache_key, finalBbox);
+        }
 
-        const int num_box = finalBbox.size();
-        std::vector<cv::Rect> bbox;
-        bbox.resize(num_box);
-        for (int i = 0; i < num_box; i++) {
-          bbox[i] = cv::Rect(finalBbox[i].x1, finalBbox[i].y1, finalBbox[i].x2 - finalBbox[i].x1 + 1, finalBbox[i].y2 - finalBbox[i].y1 + 1);
+        if (!cached) {
+          // convert NV12 to BGR
+          cv::Mat picYV12 = cv::Mat(analytics_format.height * 3/2, analytics_format.width, CV_8UC1,
+              analytics_buffer.data + analytics_buffer.planes[0].offset);
+          cv::Mat picBGR;
+          cv::cvtColor(picYV12, picBGR, CV_YUV2BGR_NV12);
 
-          for (int j = 0; j<5; j = j + 1) {
-            //cv::circle(image, cvPoint(finalBbox[i].ppoint[j], finalBbox[i].ppoint[j + 5]), 2, CV_RGB(0, 255, 0), CV_FILLED);
-            cv::circle(picBGR, cvPoint(finalBbox[i].landmark.x[j], finalBbox[i].landmark.y[j]), 2, CV_RGB(0, 255, 0), CV_FILLED);
+          ncnn::Mat ncnn_img = ncnn::Mat::from_pixels(picBGR.data, ncnn::Mat::PIXEL_BGR2RGB, picBGR.cols, picBGR.rows);
+          // detect() normalizes its image in place
+          if (reference_mtcnn)
+            reference_img = ncnn::Mat::from_pixels(picBGR.data, ncnn::Mat::PIXEL_BGR2RGB, picBGR.cols, picBGR.rows);
+
+          #if(MAXFACEOPEN==1)
+          mtcnn.detectMaxFace(ncnn_img, finalBbox);
+          #else
+          // The decoded frame is YUV 4:2:0; a frame without it is detected at
+          // the analytics resolution
+          const auto &decoded_buffer = frame.input_buffers.front();
+          if (full_res_onet && decoded_buffer.data && decoded_buffer.plane_count >= 3) {
+            const Yuv420Image full_image = {
+              decoded_buffer.data + decoded_buffer.planes[0].offset,
+              decoded_buffer.data + decoded_buffer.planes[1].offset,
+              decoded_buffer.data + decoded_buffer.planes[2].offset,
+              static_cast<int>(decoded_buffer.planes[0].stride),
+              static_cast<int>(decoded_buffer.planes[1].stride),
+              static_cast<int>(input_formats.front().width),
+              static_cast<int>(input_formats.front().height)
+            };
+            mtcnn.detect(ncnn_img, full_image, finalBbox, deadline_ms, partial);
+          } else {
+            mtcnn.detect(ncnn_img, finalBbox, deadline_ms, partial);
+            if (full_res_onet)
+              ScaleBoxes(finalBbox, full_res_scale_x, full_res_scale_y, finalBbox);
           }
+          #endif
+
+          // A partial result would be served again after the load has gone
+          if (detection_cache && !partial)
+            detection_cache->Insert(cache_key, finalBbox);
         }
+        double end = get_current_time();
+        detect_latencies.push_back(end - begin);
+        partial_frames += partial;
+        if (full_res_onet)
+          ScaleBoxes(finalBbox, 1.0f / full_res_scale_x, 1.0f / full_res_scale_y, analytics_boxes);
+
+        if (reference_mtcnn && !cached) {
+          reference_boxes.clear();
+          reference_mtcnn->detect(reference_img, reference_boxes);
+          reference_faces += reference_boxes.size();
+          matched_faces += CountMatchedFaces(reference_boxes, shown_boxes);
+        }
+
+        if (quality_controller && quality_controller->Update(std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::duration<double, std::milli>(end - begin)), finalBbox.size(), std::chrono::steady_clock::now())) {
+          quality_controller->Apply(mtcnn);
+          if (reference_mtcnn)
+            quality_controller->Apply(*reference_mtcnn);
+          // Cached results were found with the old settings
+          if (detection_cache)
+            detection_cache->Clear();
+        }
+
+        video_input->ReportConsumerLatency(std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::duration<double, std::milli>(end - begin)));
+
+        if (detection_log) {
+          // Input timestamps are anchored to the wall clock at the first frame, so logs cover weeks
+          if (!detection_log_offset)
+            detection_log_offset = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::system_clock::now().time_since_epoch()).count() - static_cast<int64_t>(frame.timestamp);
+          detection_log->Append(stream_id, static_cast<uint64_t>(detection_log_offset + frame.timestamp), finalBbox);
+        }
+
+        if (cached)
+          cached_metric.Add();
+        faces_metric.Add(finalBbox.size());
+
+        if (!quiet)
+          std::cerr << " " << analytics_format.width << "x" << analytics_format.height << " read: " <<
+              read_end - read_begin << "ms took: " << end - begin << "ms" << (partial ? " (partial)" : "") <<
+              (cached ? " (cached)" : "") << std::endl;
+      } else {
+        skipped_detections++;
+        skipped_metric.Add();
+      }
 
-        for (vector<cv::Rect>::iterator it = bbox.begin(); it != bbox.end(); it++) {
-          cv::rectangle(picBGR, (*it), cv::Scalar(0, 0, 255), 2, 8, 0);
+      if (metadata_sink)
+        metadata_sink->PushFrame(frame_no, frame.timestamp, finalBbox);
+
+      if (synthetic_input) {
+        truth_faces += synthetic_input->GetGroundTruth().size();
+        detected_faces += CountDetectedFaces(synthetic_input->GetGroundTruth(), shown_boxes);
+      }
+
+      if (print_events && finalBbox.size() != previous_face_count) {
+        std::cerr << "Event: frame " << frame_no << " faces " << previous_face_count << " -> " <<
+            finalBbox.size() << std::endl;
+      }
+      previous_face_count = finalBbox.size();
+
+      // Readers of the shared-memory ring get the detections alongside the
+      // frame, which is copied straight into the ring without an overlay
+      if (shm_output) {
+        uint8_t *const slot = shm_output->BeginFrame();
+        std::memcpy(slot, analytics_buffer.data + analytics_buffer.planes[0].offset, analytics_buffer.planes[0].size);
+        std::memcpy(slot + analytics_buffer.planes[0].size, analytics_buffer.data + analytics_buffer.planes[1].offset,
+            analytics_buffer.planes[1].size);
+        shm_output->CommitFrame(frame_no, frame.timestamp, shown_boxes);
+      } else if (video_output) {
+        // Output the video, drawing the detections straight onto a copy of the NV12 image
+        std::memcpy(bia_buffer.get(), analytics_buffer.data + analytics_buffer.planes[0].offset,
+            analytics_buffer.planes[0].size);
+        std::memcpy(bia_buffer.get() + analytics_buffer.planes[0].size,
+            analytics_buffer.data + analytics_buffer.planes[1].offset, analytics_buffer.planes[1].size);
+
+        static const Nv12Overlay::Color box_color = Nv12Overlay::FromRgb(255, 0, 0);
+        static const Nv12Overlay::Color landmark_color = Nv12Overlay::FromRgb(0, 255, 0);
+
+        Nv12Overlay overlay(bia_buffer.get(), analytics_format.width, analytics_format.height);
+        for (const auto &box : shown_boxes) {
+          overlay.DrawRectangle(box.x1, box.y1, box.x2, box.y2, 2, box_color);
+          // Faces O-Net didn't reach before the deadline have no landmarks
+          for (int j = 0; j < 5 && (box.landmark.x[j] != 0 || box.landmark.y[j] != 0); j++)
+            overlay.DrawDot(static_cast<int>(box.landmark.x[j]), static_cast<int>(box.landmark.y[j]), 2, landmark_color);
         }
 
-        // convert BGR to NV12
-        cv::Mat nv12;
-        BGR2YUV_nv12(picBGR, nv12);
-        video_output->PushFrame(nv12.data);
+        video_output->PushFrame(bia_buffer.get());
       }
     } else {
       break;
@@ -312,5 +1236,53 @@ int main(int argc, const char *const *const argv) {
     }
   }
 
+  PrintStatistics(video_input->GetStatistics());
+  PrintLatencies(detect_latencies, partial_frames);
+  if (quality_controller)
+    std::cerr << "Quality level:    " << quality_controller->GetLevel() <<
+        (quality_controller->IsIdle() ? " (idle)" : "") << ", " << skipped_detections << " frames skipped" <<
+        std::endl;
+  if (detection_cache)
+    PrintCacheStatistics(detection_cache->GetStatistics());
+  if (pruning_window)
+    PrintScalePruning(mtcnn.GetScalePruningStats(), reference_faces, matched_faces);
+  if (truth_faces)
+    std::cerr << "Recall:           " << detected_faces << '/' << truth_faces << " (" <<
+        (100.0 * detected_faces) / truth_faces << "%)" << std::endl;
+  if (frame_store) {
+    frame_store->Close();
+    std::cerr << "Recorded frames:  " << frame_store->GetFrameCount() << " to " << record_path << std::endl;
+  }
+  if (detection_log) {
+    try {
+      detection_log->Close();
+    } catch (const std::exception &e) {
+      std::cerr << e.what() << std::endl;
+    }
+    const DetectionLogWriter::Statistics statistics = detection_log->GetStatistics();
+    std::cerr << "Detection log:    " << statistics.rows << " faces in " << statistics.blocks << " blocks, " <<
+        statistics.bytes_written << " bytes to " << detection_log_path << std::endl;
+  }
+  if (metadata_sink) {
+    if (!metadata_sink->Flush())
+      std::cerr << "Failed to write the meta-data" << std::endl;
+    PrintMetadataStatistics(metadata_sink->GetStatistics());
+  }
+  if (async_output) {
+    async_output->Flush();
+    PrintOutputStatistics(async_output->GetStatistics());
+  }
+#ifdef WITH_FFMPEG
+  if (encode_output) {
+    // The writer thread is idle after the flush
+    try {
+      encode_output->Finish();
+    } catch (const std::exception &e) {
+      std::cerr << e.what() << std::endl;
+    }
+    PrintEncodeStatistics(encode_output->GetStatistics());
+  }
+#endif
+
   return EXIT_SUCCESS;
 }
\ No newline at end of file
@@ -18,8 +18,33 @@ extern "C" {
 
 #include "ffmpeg_common.hpp"
 #include "ffmpeg_input.hpp"
+#include "metrics.h"
+
+// Bounds the packets kept for frames that never come out, such as those
+// discarded by skip_frame when timestamps are missing
+static const size_t MaxSentPackets = 64;
+
+struct InputMetrics {
+  MetricHistogram *decode, *scale;
+  MetricCounter *decoded, *delivered, *dropped, *withheld;
+};
+
+static InputMetrics& GetInputMetrics() {
+  static MetricsRegistry &r = MetricsRegistry::Global();
+  static const char *const help = "Frames by what the input did with them";
+  static InputMetrics metrics = {
+    &r.Histogram("mtcnn_input_decode_seconds", "Time spent reading and decoding each frame"),
+    &r.Histogram("mtcnn_input_scale_seconds", "Time spent scaling each analytics frame"),
+    &r.Counter("mtcnn_input_frames_total", help, "state=\"decoded\""),
+    &r.Counter("mtcnn_input_frames_total", help, "state=\"delivered\""),
+    &r.Counter("mtcnn_input_frames_total", help, "state=\"dropped\""),
+    &r.Counter("mtcnn_input_frames_total", help, "state=\"withheld\""),
+  };
+  return metrics;
+}
 
-FfmpegInput::FfmpegInput(const std::string &path, unsigned scaled_width, unsigned scaled_height) :
+FfmpegInput::FfmpegInput(const std::string &path, unsigned scaled_width, unsigned scaled_height,
+    const DecoderOptions &decoder_options) :
   format_context_(nullptr),
   have_frame_(false),
   prev_scaled_frame_time_offset_(0),
@@ -27,7 +52,16 @@ FfmpegInput::FfmpegInput(const std::string &path, unsigned scaled_width, unsigne
   scaled_height_(scaled_height),
   input_formats_(),
   output_formats_(),
-  timestamp_(0) {
+  timestamp_(0),
+  adaptive_discard_(decoder_options.adaptive_discard),
+  consumer_latency_(0),
+  discard_level_(AVDISCARD_DEFAULT),
+  wait_for_key_frame_(false),
+  packets_sent_(0),
+  packets_withheld_(0),
+  decoded_frames_(0),
+  delivered_frames_(0),
+  dropped_frames_(0) {
   int ret;
 
 #if 0
@@ -71,6 +105,9 @@ FfmpegInput::FfmpegInput(const std::string &path, unsigned scaled_width, unsigne
     throw std::runtime_error("Failed to copy video codec parameters to decoder context");
   const uint32_t codec_tag = codec_context_->codec_tag ? codec_context_->codec_tag : MKTAG('A', 'V', 'C', '1');
 
+  codec_context_->thread_count = static_cast<int>(decoder_options.thread_count);
+  codec_context_->thread_type = decoder_options.frame_threading ? (FF_THREAD_FRAME | FF_THREAD_SLICE) : FF_THREAD_SLICE;
+
   if (avcodec_open2(codec_context_, codec_, NULL) < 0)
     throw std::runtime_error("Failed to open codec");
 
@@ -113,6 +150,23 @@ FfmpegInput::FfmpegInput(const std::string &path, unsigned scaled_width, unsigne
     throw std::runtime_error(ss.str());
   }
 
+  scaled_pool_.reset(new BufferPool((scaled_width_ * scaled_height_ * 3) / 2, FramePoolSize));
+
+  // A frame can hold two decoded frame references: the decoded buffer and the
+  // source of a deferred scale
+  for (unsigned int i = 0; i != 2 * FramePoolSize; i++) {
+    frame_refs_.push_back(av_frame_alloc());
+    if (!frame_refs_.back())
+      throw std::runtime_error("Failed to allocate frame references");
+  }
+  for (unsigned int i = 0; i != FramePoolSize; i++) {
+    packet_refs_.push_back(av_packet_alloc());
+    if (!packet_refs_.back())
+      throw std::runtime_error("Failed to allocate packet references");
+  }
+  free_frame_refs_ = frame_refs_;
+  free_packet_refs_ = packet_refs_;
+
   scale_context_ = sws_getContext(codec_context_->width, codec_context_->height, codec_context_->pix_fmt,
       scaled_width_, scaled_height_, AV_PIX_FMT_NV12, SWS_BILINEAR, NULL, NULL, NULL);
 
@@ -136,6 +190,14 @@ FfmpegInput::~FfmpegInput() {
   if (packet_.data)
     av_packet_unref(&packet_);
   sws_freeContext(scale_context_);
+  for (AVFrame *frame : frame_refs_)
+    av_frame_free(&frame);
+  for (AVPacket *packet : packet_refs_)
+    av_packet_free(&packet);
+  for (AVPacket *packet : sent_packets_)
+    av_packet_free(&packet);
+  for (AVPacket *packet : free_sent_packets_)
+    av_packet_free(&packet);
 }
 
 vca::core::video::Formats FfmpegInput::GetInputFormats() const {
@@ -147,6 +209,8 @@ vca::core::video::Formats FfmpegInput::GetOutputFormats() const {
 }
 
 bool FfmpegInput::ReadFrame(Frame &frame) {
+  frame.Release();
+
   if (!have_frame_ && !FindNextFrame())
     return false;
 
@@ -173,100 +237,287 @@ bool FfmpegInput::ReadFrame(Frame &frame) {
   const unsigned int scaled_frame_time_offset =
       av_rescale_q(frame_->pts, stream->time_base, scaled_time_base) % 65536;
 
-  // Make the coded buffer
-  AVPacket *const packet = av_packet_clone(&packet_);
-  vca::core::video::Buffer coded_buffer{
-      static_cast<size_t>(packet->size),
-      packet->data,
-      1,
-      { vca::core::video::Buffer::Plane{static_cast<size_t>(packet->size), 0, 0} },
-      [packet]() {
-        AVPacket *ptr = packet;
-        av_packet_free(&ptr);
-      }};
+  const unsigned int required_buffers = required_buffers_;
+
+  // Make the coded buffer from the packet the frame was decoded from. With frame
+  // threading or reordering the decoder lags behind, so it isn't the last one sent.
+  vca::core::video::Buffer coded_buffer{0, nullptr, 0, {}, {}};
+  AVPacket *const sent_packet = TakeSentPacket(frame_->pts);
+  AVPacket *const packet = (required_buffers & CodedBuffer) && sent_packet ? AcquirePacketRef() : nullptr;
+  if (packet && av_packet_ref(packet, sent_packet) >= 0) {
+    coded_buffer = vca::core::video::Buffer{
+        static_cast<size_t>(packet->size),
+        packet->data,
+        1,
+        { vca::core::video::Buffer::Plane{static_cast<size_t>(packet->size), 0, 0} },
+        [this, packet]() { ReleasePacketRef(packet); }};
+  } else if (packet) {
+    ReleasePacketRef(packet);
+  }
+  if (sent_packet)
+    RecycleSentPacket(sent_packet);
 
   // Make the decoded buffer
-  AVFrame *const frame_ref = av_frame_clone(frame_);
-
-  vca::core::video::Buffer::Planes planes = {};
-  size_t plane_count = 0;
-  uint8_t *base = reinterpret_cast<uint8_t*>(~0ULL), *end = 0;
-
-  for (int i = 0; frame_ref->buf[i] && i != AV_NUM_DATA_POINTERS; i++) {
-    const auto size = frame_ref->buf[i]->size;
-    const auto data = frame_ref->data[i];
-    if (size && data) {
-      base = std::min(base, data);
-      end = std::max(end, data + size);
+  vca::core::video::Buffer decoded_buffer{0, nullptr, 0, {}, {}};
+  AVFrame *const frame_ref = (required_buffers & DecodedBuffer) ? AcquireFrameRef() : nullptr;
+  if (frame_ref && av_frame_ref(frame_ref, frame_) >= 0) {
+    vca::core::video::Buffer::Planes planes = {};
+    size_t plane_count = 0;
+    uint8_t *base = reinterpret_cast<uint8_t*>(~0ULL), *end = 0;
+
+    for (int i = 0; frame_ref->buf[i] && i != AV_NUM_DATA_POINTERS; i++) {
+      const auto size = frame_ref->buf[i]->size;
+      const auto data = frame_ref->data[i];
+      if (size && data) {
+        base = std::min(base, data);
+        end = std::max(end, data + size);
+      }
     }
-  }
 
-  for (int i = 0; frame_ref->buf[i] && i != AV_NUM_DATA_POINTERS; i++) {
-    const auto size = frame_ref->buf[i]->size;
-    const auto data = frame_ref->data[i];
-    if (size && data)
-      planes[plane_count++] = {static_cast<size_t>(size), static_cast<size_t>(data - base), frame_ref->linesize[i]};
-  }
+    for (int i = 0; frame_ref->buf[i] && i != AV_NUM_DATA_POINTERS; i++) {
+      const auto size = frame_ref->buf[i]->size;
+      const auto data = frame_ref->data[i];
+      if (size && data)
+        planes[plane_count++] = {static_cast<size_t>(size), static_cast<size_t>(data - base), frame_ref->linesize[i]};
+    }
 
-  vca::core::video::Buffer decoded_buffer{static_cast<size_t>(end - base), base, plane_count, std::move(planes),
-      [frame_ref]() {
-        AVFrame *ptr = frame_ref;
-        av_frame_free(&ptr);
-      }};
+    decoded_buffer = vca::core::video::Buffer{static_cast<size_t>(end - base), base, plane_count, std::move(planes),
+        [this, frame_ref]() { ReleaseFrameRef(frame_ref); }};
+  } else if (frame_ref) {
+    ReleaseFrameRef(frame_ref);
+  }
 
   // Make the scaled image
   vca::core::video::Buffer scaled_buffer{0, nullptr, 0, {}, {}};
-  if (!drop_scaled_frames || scaled_frame_time_offset < prev_scaled_frame_time_offset_) {
-    const size_t scaled_y_plane_size = scaled_width_ * scaled_height_;
-    const size_t scaled_image_size = (scaled_y_plane_size * 3) / 2;
-    uint8_t *const scaled_data = new uint8_t[scaled_image_size];
-    uint8_t *const dst_planes[] = {scaled_data, scaled_data + scaled_y_plane_size};
-    const int dst_strides[] = {static_cast<int>(scaled_width_), static_cast<int>(scaled_width_)};
-    sws_scale(scale_context_, frame_->data, frame_->linesize, 0, frame_->height, dst_planes, dst_strides);
-
-    scaled_buffer = vca::core::video::Buffer{scaled_image_size, scaled_data, 2, {
-        vca::core::video::Buffer::Plane{scaled_y_plane_size, 0, static_cast<std::ptrdiff_t>(scaled_width_)},
-        vca::core::video::Buffer::Plane{
-          scaled_y_plane_size / 2, scaled_y_plane_size, static_cast<std::ptrdiff_t>(scaled_width_)}
-      },
-      [scaled_data]() { delete[] scaled_data; }};
+  if ((required_buffers & ScaledBuffer) &&
+      (!drop_scaled_frames || scaled_frame_time_offset < prev_scaled_frame_time_offset_)) {
+    uint8_t *const scaled_data = scaled_pool_->Acquire();
+    if (scaled_data) {
+      const size_t scaled_y_plane_size = scaled_width_ * scaled_height_;
+
+      // With lazy scaling keep a reference to the decoded frame and only convert it
+      // if the consumer materializes the frame
+      AVFrame *const source = (required_buffers & LazyScaling) ? AcquireFrameRef() : nullptr;
+      if (source && av_frame_ref(source, frame_) >= 0) {
+        DeferMaterialization(frame, [this, source, scaled_data](bool materialize) {
+          if (materialize)
+            ScaleFrame(source, scaled_data);
+          ReleaseFrameRef(source);
+        });
+      } else {
+        if (source)
+          ReleaseFrameRef(source);
+        ScaleFrame(frame_, scaled_data);
+      }
+
+      scaled_buffer = scaled_pool_->MakeBuffer(scaled_data, 2, {
+          vca::core::video::Buffer::Plane{scaled_y_plane_size, 0, static_cast<std::ptrdiff_t>(scaled_width_)},
+          vca::core::video::Buffer::Plane{
+            scaled_y_plane_size / 2, scaled_y_plane_size, static_cast<std::ptrdiff_t>(scaled_width_)}
+        });
+      delivered_frames_++;
+      GetInputMetrics().delivered->Add();
+    } else {
+      // Every scaled buffer is still held by a consumer
+      dropped_frames_++;
+      GetInputMetrics().dropped->Add();
+    }
   }
 
   prev_scaled_frame_time_offset_ = scaled_frame_time_offset;
 
   have_frame_ = false;
 
-  frame.input_buffers = vca::core::video::Buffers{std::move(decoded_buffer), std::move(scaled_buffer)};
-  frame.output_buffers = vca::core::video::Buffers{std::move(coded_buffer)};
+  // Released frames keep their capacity, so this doesn't allocate in steady state
+  frame.input_buffers.push_back(std::move(decoded_buffer));
+  frame.input_buffers.push_back(std::move(scaled_buffer));
+  frame.output_buffers.push_back(std::move(coded_buffer));
 
   return true;
 }
 
+void FfmpegInput::ReportConsumerLatency(std::chrono::nanoseconds latency) {
+  // Smooth over a few frames so a single slow detection doesn't flip the discard level
+  consumer_latency_ += (latency - consumer_latency_) / 4;
+  UpdateDiscardLevel();
+}
+
+VideoInput::Statistics FfmpegInput::GetStatistics() const {
+  // Packets given to the decoder that never came out as frames were discarded by
+  // skip_frame. With frame threading this includes up to thread_count frames that
+  // are still in flight.
+  const uint64_t discarded_frames = packets_sent_ > decoded_frames_ ? packets_sent_ - decoded_frames_ : 0;
+  return Statistics{decoded_frames_, delivered_frames_, packets_withheld_ + discarded_frames + dropped_frames_};
+}
+
 bool FfmpegInput::FindNextFrame() {
+  InputMetrics &metrics = GetInputMetrics();
+  MetricTimer timer(*metrics.decode);
   int ret;
 
   for (;;) {
+    // Collect any frame the decoder already holds before feeding it more input
+    ret = avcodec_receive_frame(codec_context_, frame_);
+    if (ret >= 0) {
+      decoded_frames_++;
+      metrics.decoded->Add();
+      have_frame_ = true;
+      return true;
+    } else if (ret != AVERROR(EAGAIN)) {
+      return false;
+    }
+
     if (packet_.data)
       av_packet_unref(&packet_);
 
-    if (av_read_frame(format_context_, &packet_) < 0)
+    if (av_read_frame(format_context_, &packet_) < 0) {
+      // End of input: flush the frames still queued in the decoder threads
+      if (avcodec_send_packet(codec_context_, NULL) < 0)
+        return false;
+      continue;
+    }
+
+    if (packet_.stream_index != stream_index_)
+      continue;
+
+    if (!ShouldSendPacket()) {
+      packets_withheld_++;
+      metrics.withheld->Add();
+      continue;
+    }
+
+    ret = avcodec_send_packet(codec_context_, &packet_);
+    if (ret < 0 && ret != AVERROR(EAGAIN))
       return false;
+    packets_sent_++;
+    if (required_buffers_ & CodedBuffer)
+      KeepSentPacket();
+  }
+}
 
-    if (packet_.stream_index == stream_index_) {
-      ret = avcodec_send_packet(codec_context_, &packet_);
-      if (ret >= 0) {
-        ret = avcodec_receive_frame(codec_context_, frame_);
-        if (ret >= 0) {
-          have_frame_ = true;
-          return true;
-        } else if (ret != AVERROR(EAGAIN)) {
-          return false;
-        }
-      } if (ret != AVERROR(EAGAIN)) {
-        return false;
-      }
+bool FfmpegInput::ShouldSendPacket() {
+  if (packet_.flags & AV_PKT_FLAG_KEY) {
+    wait_for_key_frame_ = false;
+    return true;
+  }
+
+  // Non-key packets are dropped before the decoder at the NONKEY level, and after
+  // leaving it until the next key frame restores the reference chain
+  return !wait_for_key_frame_ && discard_level_ < AVDISCARD_NONKEY;
+}
+
+void FfmpegInput::UpdateDiscardLevel() {
+  if (!adaptive_discard_)
+    return;
+
+  const std::chrono::nanoseconds interval =
+      std::chrono::nanoseconds(std::chrono::seconds(ScaledFrameRate.den)) / ScaledFrameRate.num;
+  const std::chrono::nanoseconds latency = consumer_latency_;
+
+  // Step up as soon as a threshold is crossed, step down only once the latency is
+  // 20% below it
+  AVDiscard level = discard_level_;
+  if (latency > interval * 2)
+    level = AVDISCARD_NONKEY;
+  else if (latency > interval && level < AVDISCARD_NONREF)
+    level = AVDISCARD_NONREF;
+  else if (level == AVDISCARD_NONKEY && latency < (interval * 8) / 5)
+    level = AVDISCARD_NONREF;
+
+  if (level == AVDISCARD_NONREF && latency < (interval * 4) / 5)
+    level = AVDISCARD_DEFAULT;
+
+  if (level == discard_level_)
+    return;
+
+  if (discard_level_ == AVDISCARD_NONKEY)
+    wait_for_key_frame_ = true;
+
+  discard_level_ = level;
+  codec_context_->skip_frame = level;
+}
+
+void FfmpegInput::ScaleFrame(const AVFrame *source, uint8_t *scaled_data) {
+  MetricTimer timer(*GetInputMetrics().scale);
+  uint8_t *const dst_planes[] = {scaled_data, scaled_data + scaled_width_ * scaled_height_};
+  const int dst_strides[] = {static_cast<int>(scaled_width_), static_cast<int>(scaled_width_)};
+  sws_scale(scale_context_, source->data, source->linesize, 0, source->height, dst_planes, dst_strides);
+}
+
+AVFrame* FfmpegInput::AcquireFrameRef() {
+  std::lock_guard<std::mutex> lock(ref_pool_mutex_);
+  if (free_frame_refs_.empty())
+    return nullptr;
+  AVFrame *const frame = free_frame_refs_.back();
+  free_frame_refs_.pop_back();
+  return frame;
+}
+
+void FfmpegInput::ReleaseFrameRef(AVFrame *frame) {
+  av_frame_unref(frame);
+  std::lock_guard<std::mutex> lock(ref_pool_mutex_);
+  free_frame_refs_.push_back(frame);
+}
+
+AVPacket* FfmpegInput::AcquirePacketRef() {
+  std::lock_guard<std::mutex> lock(ref_pool_mutex_);
+  if (free_packet_refs_.empty())
+    return nullptr;
+  AVPacket *const packet = free_packet_refs_.back();
+  free_packet_refs_.pop_back();
+  return packet;
+}
+
+void FfmpegInput::ReleasePacketRef(AVPacket *packet) {
+  av_packet_unref(packet);
+  std::lock_guard<std::mutex> lock(ref_pool_mutex_);
+  free_packet_refs_.push_back(packet);
+}
+
+void FfmpegInput::KeepSentPacket() {
+  AVPacket *sent;
+  if (free_sent_packets_.empty()) {
+    sent = av_packet_alloc();
+    if (!sent)
+      return;
+  } else {
+    sent = free_sent_packets_.back();
+    free_sent_packets_.pop_back();
+  }
+  if (av_packet_ref(sent, &packet_) < 0) {
+    free_sent_packets_.push_back(sent);
+    return;
+  }
+
+  if (sent_packets_.size() == MaxSentPackets) {
+    RecycleSentPacket(sent_packets_.front());
+    sent_packets_.erase(sent_packets_.begin());
+  }
+  sent_packets_.push_back(sent);
+}
+
+AVPacket* FfmpegInput::TakeSentPacket(int64_t pts) {
+  // Frames come out in presentation order, so packets up to pts won't be
+  // matched by a later frame
+  AVPacket *match = nullptr;
+  for (auto it = sent_packets_.begin(); it != sent_packets_.end();) {
+    AVPacket *const sent = *it;
+    if (sent->pts > pts) {
+      ++it;
+      continue;
     }
+    if (sent->pts == pts && pts != AV_NOPTS_VALUE && !match)
+      match = sent;
+    else
+      RecycleSentPacket(sent);
+    it = sent_packets_.erase(it);
   }
+  return match;
+}
+
+void FfmpegInput::RecycleSentPacket(AVPacket *packet) {
+  av_packet_unref(packet);
+  free_sent_packets_.push_back(packet);
 }
 
 size_t FfmpegInput::GetImageSize() const {
@@ -10,6 +10,8 @@
 #include <cstdint>
 #include <string>
 #include <memory>
+#include <mutex>
+#include <vector>
 
 extern "C" {
 #include <libavcodec/avcodec.h>
@@ -19,11 +21,27 @@ extern "C" {
 
 #include <vca/media/four_cc.hpp>
 
+#include "buffer_pool.hpp"
 #include "video_input.hpp"
 
 class FfmpegInput final : public VideoInput {
  public:
-  FfmpegInput(const std::string &path, unsigned scaled_width, unsigned scaled_height);
+  struct DecoderOptions {
+    DecoderOptions() : thread_count(1), frame_threading(true), adaptive_discard(false) {}
+
+    /// Number of decoder threads, or 0 to let libavcodec pick one per core.
+    unsigned int thread_count;
+    /// Allow frame threading. Frame threading adds one frame of latency per
+    /// thread; without it only slice threading is used.
+    bool frame_threading;
+    /// Discard non-reference (and, when far behind, non-key) frames while the
+    /// reported consumer latency exceeds the analytics frame interval.
+    bool adaptive_discard;
+  };
+
+ public:
+  FfmpegInput(const std::string &path, unsigned scaled_width, unsigned scaled_height,
+      const DecoderOptions &decoder_options = DecoderOptions());
 
   ~FfmpegInput();
 
@@ -33,9 +51,33 @@ class FfmpegInput final : public VideoInput {
 
   bool ReadFrame(Frame &frame);
 
+  void ReportConsumerLatency(std::chrono::nanoseconds latency);
+
+  Statistics GetStatistics() const;
+
  private:
   bool FindNextFrame();
 
+  bool ShouldSendPacket();
+
+  void UpdateDiscardLevel();
+
+  void ScaleFrame(const AVFrame *source, uint8_t *scaled_data);
+
+  AVFrame* AcquireFrameRef();
+
+  void ReleaseFrameRef(AVFrame *frame);
+
+  AVPacket* AcquirePacketRef();
+
+  void ReleasePacketRef(AVPacket *packet);
+
+  void KeepSentPacket();
+
+  AVPacket* TakeSentPacket(int64_t pts);
+
+  void RecycleSentPacket(AVPacket *packet);
+
   size_t GetImageSize() const;
 
  private:
@@ -59,4 +101,23 @@ class FfmpegInput final : public VideoInput {
   vca::core::video::Formats input_formats_, output_formats_;
 
   uint64_t timestamp_;
+
+  const bool adaptive_discard_;
+  std::chrono::nanoseconds consumer_latency_;
+  AVDiscard discard_level_;
+  bool wait_for_key_frame_;
+
+  uint64_t packets_sent_, packets_withheld_;
+  uint64_t decoded_frames_, delivered_frames_, dropped_frames_;
+
+  // Frames handed out by ReadFrame reference these, and must be released before
+  // the input is destroyed
+  std::unique_ptr<BufferPool> scaled_pool_;
+  std::mutex ref_pool_mutex_;
+  std::vector<AVFrame*> frame_refs_, free_frame_refs_;
+  std::vector<AVPacket*> packet_refs_, free_packet_refs_;
+
+  // References to the packets sent to the decoder while the coded buffer is
+  // required, in decode order, until the frame decoded from each comes out
+  std::vector<AVPacket*> sent_packets_, free_sent_packets_;
 };
@@ -0,0 +1,46 @@
+#pragma once
+/**
+ * @internal
+ * @file       frame_store.hpp
+ * @copyright  VCA Technology
+ * @~english
+ * @brief      Layout of the recorded frame store file.
+ */
+
+#include <cstdint>
+
+/*
+ * A file of NV12 analytics frames written by @c FrameStoreWriter and replayed
+ * by @c ReplayInput. It starts with a @c FrameStoreHeader padded to a page,
+ * then @c frame_count frames of @c frame_size bytes, each starting on a page
+ * @c frame_stride bytes after the previous one from @c data_offset, so they
+ * can be mapped and handed out in place. The index, one @c FrameStoreEntry per
+ * frame, follows the last frame at @c index_offset.
+ *
+ * The header is rewritten when the recording is closed; a file whose
+ * @c index_offset is still 0 was never finished. Fields are little-endian.
+ */
+
+static constexpr uint32_t FrameStoreMagic = 0x5346544d;  // "MTFS"
+static constexpr uint32_t FrameStoreVersion = 1;
+static constexpr uint32_t FrameStorePageSize = 4096;
+
+struct FrameStoreHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t width;
+  uint32_t height;
+  uint32_t frame_size;        ///< Bytes of one NV12 frame
+  uint32_t frame_stride;      ///< Bytes between frames, a multiple of the page size
+  uint32_t frame_rate_num;    ///< Nominal rate of the recorded input
+  uint32_t frame_rate_den;
+  uint64_t frame_count;
+  uint64_t data_offset;
+  uint64_t index_offset;      ///< 0 until the recording is closed
+};
+
+struct FrameStoreEntry {
+  uint64_t timestamp;         ///< Nanoseconds, as reported by the recorded input
+  uint32_t frame_no;          ///< Frame number in the recorded input
+  uint32_t reserved;
+};
@@ -0,0 +1,85 @@
+/**
+ * @internal
+ * @file       frame_store_writer.cpp
+ * @copyright  VCA Technology
+ * @~english
+ * @brief      Implementation of the @c FrameStoreWriter class.
+ */
+
+#include <stdexcept>
+
+#include "frame_store_writer.hpp"
+
+FrameStoreWriter::FrameStoreWriter(const std::string &path, unsigned int width, unsigned int height,
+    vca::media::FrameRate frame_rate) :
+  path_(path),
+  file_(path, std::ios::binary | std::ios::trunc),
+  header_(),
+  index_(),
+  padding_() {
+  if (!file_)
+    throw std::runtime_error("Failed to create " + path_);
+
+  header_.magic = FrameStoreMagic;
+  header_.version = FrameStoreVersion;
+  header_.width = width;
+  header_.height = height;
+  header_.frame_size = (width * height * 3) / 2;
+  header_.frame_stride = (header_.frame_size + FrameStorePageSize - 1) / FrameStorePageSize * FrameStorePageSize;
+  header_.frame_rate_num = frame_rate.num;
+  header_.frame_rate_den = frame_rate.den;
+  header_.frame_count = 0;
+  header_.data_offset = FrameStorePageSize;
+  header_.index_offset = 0;
+
+  // The header is written again with the frame count once the index is known
+  padding_.resize(FrameStorePageSize);
+  file_.write(reinterpret_cast<const char*>(&header_), sizeof(header_));
+  file_.write(padding_.data(), FrameStorePageSize - sizeof(header_));
+  if (!file_)
+    throw std::runtime_error("Failed to write " + path_);
+}
+
+FrameStoreWriter::~FrameStoreWriter() {
+  try {
+    Close();
+  } catch (const std::exception&) {
+    // The file is left unfinished
+  }
+}
+
+void FrameStoreWriter::WriteFrame(const uint8_t *data, std::ptrdiff_t stride, uint64_t timestamp,
+    unsigned int frame_no) {
+  if (!file_.is_open())
+    throw std::logic_error("Frame written after the frame store was closed");
+
+  if (stride == static_cast<std::ptrdiff_t>(header_.width)) {
+    file_.write(reinterpret_cast<const char*>(data), header_.frame_size);
+  } else {
+    for (unsigned int y = 0; y != (header_.height * 3) / 2; y++)
+      file_.write(reinterpret_cast<const char*>(data + y * stride), header_.width);
+  }
+  file_.write(padding_.data(), header_.frame_stride - header_.frame_size);
+  if (!file_)
+    throw std::runtime_error("Failed to write " + path_);
+
+  index_.push_back(FrameStoreEntry{timestamp, frame_no, 0});
+  header_.frame_count++;
+}
+
+void FrameStoreWriter::Close() {
+  if (!file_.is_open())
+    return;
+
+  header_.index_offset = header_.data_offset + header_.frame_count * header_.frame_stride;
+  file_.write(reinterpret_cast<const char*>(index_.data()), index_.size() * sizeof(FrameStoreEntry));
+  file_.seekp(0);
+  file_.write(reinterpret_cast<const char*>(&header_), sizeof(header_));
+  file_.close();
+  if (!file_)
+    throw std::runtime_error("Failed to write " + path_);
+}
+
+uint64_t FrameStoreWriter::GetFrameCount() const {
+  return header_.frame_count;
+}
@@ -0,0 +1,50 @@
+#pragma once
+/**
+ * @internal
+ * @file       frame_store_writer.hpp
+ * @copyright  VCA Technology
+ * @~english
+ * @brief      Declaration of the @c FrameStoreWriter class.
+ */
+
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include <vca/media/frame_rate.hpp>
+
+#include "frame_store.hpp"
+
+/**
+ * Records analytics frames into a frame store file, so detection can later be
+ * benchmarked on the same frames without decoding them again.
+ */
+class FrameStoreWriter final {
+ public:
+  FrameStoreWriter(const std::string &path, unsigned int width, unsigned int height,
+      vca::media::FrameRate frame_rate);
+
+  /// Calls @c Close if it hasn't been called.
+  ~FrameStoreWriter();
+
+  /// Appends one NV12 frame with rows of @p stride bytes.
+  void WriteFrame(const uint8_t *data, std::ptrdiff_t stride, uint64_t timestamp, unsigned int frame_no);
+
+  /// Writes the index and the final header.
+  void Close();
+
+  uint64_t GetFrameCount() const;
+
+ private:
+  FrameStoreWriter(const FrameStoreWriter&) = delete;
+  FrameStoreWriter& operator=(const FrameStoreWriter&) = delete;
+
+ private:
+  const std::string path_;
+  std::ofstream file_;
+  FrameStoreHeader header_;
+  std::vector<FrameStoreEntry> index_;
+  std::vector<char> padding_;
+};
@@ -0,0 +1,269 @@
+/**
+ * @file      kernel_bench.cpp
+ * @copyright UDP Technology Ltd.
+ * @~english
+ * @brief     Compares the fixed-geometry kernels with the generic ncnn path
+ *
+ * Times cropping candidates to the 24x24 and 48x48 network inputs with
+ * copy_cut_border and resize_bilinear against @c ResizeCropBilinear, and
+ * turning a P-Net output into candidates with a generic loop against
+ * @c GenerateCandidates, and checks that both give the same results. The
+ * candidates are also compared at every level of the pyramids detect() builds
+ * for the frame, as the rounding of corners depends on the scale.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <vector>
+
+#include "fixed_kernels.h"
+
+using Clock = std::chrono::steady_clock;
+
+struct Crop {
+  int x, y, w, h;
+};
+
+static double ElapsedUs(Clock::time_point begin, size_t count) {
+  return std::chrono::duration<double, std::micro>(Clock::now() - begin).count() / count;
+}
+
+static float MaxDifference(const ncnn::Mat &a, const ncnn::Mat &b) {
+  float difference = 0.f;
+  for (int q = 0; q < a.c; q++) {
+    const float *pa = a.channel(q);
+    const float *pb = b.channel(q);
+    for (int i = 0; i < a.w * a.h; i++)
+      difference = std::max(difference, std::fabs(pa[i] - pb[i]));
+  }
+  return difference;
+}
+
+template <int SIZE>
+static void BenchCrop(const ncnn::Mat &image, const std::vector<Crop> &crops, int repeat) {
+  ncnn::Mat generic, fixed;
+
+  auto begin = Clock::now();
+  for (int r = 0; r < repeat; r++) {
+    for (const Crop &c : crops) {
+      ncnn::Mat cut;
+      ncnn::copy_cut_border(image, cut, c.y, image.h - c.y - c.h, c.x, image.w - c.x - c.w);
+      ncnn::resize_bilinear(cut, generic, SIZE, SIZE);
+    }
+  }
+  const double generic_us = ElapsedUs(begin, crops.size() * repeat);
+
+  begin = Clock::now();
+  for (int r = 0; r < repeat; r++) {
+    for (const Crop &c : crops)
+      ResizeCropBilinear<SIZE, SIZE>(image, c.x, c.y, c.w, c.h, fixed);
+  }
+  const double fixed_us = ElapsedUs(begin, crops.size() * repeat);
+
+  float difference = 0.f;
+  for (const Crop &c : crops) {
+    ncnn::Mat cut;
+    ncnn::copy_cut_border(image, cut, c.y, image.h - c.y - c.h, c.x, image.w - c.x - c.w);
+    ncnn::resize_bilinear(cut, generic, SIZE, SIZE);
+    ResizeCropBilinear<SIZE, SIZE>(image, c.x, c.y, c.w, c.h, fixed);
+    difference = std::max(difference, MaxDifference(generic, fixed));
+  }
+
+  std::cout << "crop " << std::setw(2) << SIZE << 'x' << std::setw(2) << SIZE << std::fixed <<
+      std::setprecision(2) << std::setw(12) << generic_us << std::setw(12) << fixed_us << std::setw(10) <<
+      generic_us / fixed_us << 'x' << std::scientific << std::setprecision(1) << std::setw(12) << difference <<
+      std::endl;
+}
+
+// The candidate loop as it was before GenerateCandidates
+static void GenerateGeneric(ncnn::Mat score, ncnn::Mat location, float threshold, float scale,
+                            std::vector<Bbox> &boxes) {
+  const int stride = 2;
+  const int cellsize = 12;
+  float *p = score.channel(1);
+  Bbox bbox;
+  float inv_scale = 1.0f / scale;
+  for (int row = 0; row < score.h; row++) {
+    for (int col = 0; col < score.w; col++) {
+      if (*p > threshold) {
+        bbox.score = *p;
+        bbox.x1 = round((stride * col + 1) * inv_scale);
+        bbox.y1 = round((stride * row + 1) * inv_scale);
+        bbox.x2 = round((stride * col + 1 + cellsize) * inv_scale);
+        bbox.y2 = round((stride * row + 1 + cellsize) * inv_scale);
+        bbox.area = (bbox.x2 - bbox.x1) * (bbox.y2 - bbox.y1);
+        const int index = row * score.w + col;
+        for (int channel = 0; channel < 4; channel++)
+          bbox.regreCoord[channel] = location.channel(channel)[index];
+        boxes.push_back(bbox);
+      }
+      p++;
+    }
+  }
+}
+
+static bool SameCandidates(const std::vector<Bbox> &generic, const std::vector<Bbox> &fixed) {
+  bool same = generic.size() == fixed.size();
+  for (size_t i = 0; same && i < generic.size(); i++) {
+    same = generic[i].x1 == fixed[i].x1 && generic[i].y1 == fixed[i].y1 && generic[i].x2 == fixed[i].x2 &&
+        generic[i].y2 == fixed[i].y2 && generic[i].score == fixed[i].score &&
+        std::memcmp(generic[i].regreCoord, fixed[i].regreCoord, sizeof(generic[i].regreCoord)) == 0;
+  }
+  return same;
+}
+
+static void BenchCandidates(int width, int height, float pass_rate, int repeat, std::mt19937 &random) {
+  // P-Net output for the largest pyramid level of the frame
+  const float scale = 0.5f;
+  const int w = ((int)(width * scale) - 12) / 2 + 1;
+  const int h = ((int)(height * scale) - 12) / 2 + 1;
+  ncnn::Mat score(w, h, 2), location(w, h, 4);
+  std::uniform_real_distribution<float> uniform(0.f, 1.f);
+  for (int q = 0; q < 2; q++) {
+    float *p = score.channel(q);
+    for (int i = 0; i < w * h; i++)
+      p[i] = uniform(random);
+  }
+  for (int q = 0; q < 4; q++) {
+    float *p = location.channel(q);
+    for (int i = 0; i < w * h; i++)
+      p[i] = uniform(random) - 0.5f;
+  }
+  const float threshold = 1.f - pass_rate;
+
+  std::vector<Bbox> generic, fixed;
+  auto begin = Clock::now();
+  for (int r = 0; r < repeat; r++) {
+    generic.clear();
+    GenerateGeneric(score, location, threshold, scale, generic);
+  }
+  const double generic_us = ElapsedUs(begin, repeat);
+
+  begin = Clock::now();
+  for (int r = 0; r < repeat; r++) {
+    fixed.clear();
+    GenerateCandidates<PNET_STRIDE, PNET_CELL>(score, location, threshold, scale, 0, 0, fixed);
+  }
+  const double fixed_us = ElapsedUs(begin, repeat);
+
+  const bool same = SameCandidates(generic, fixed);
+
+  std::cout << "pnet " << std::setw(3) << w << 'x' << std::setw(3) << h << std::fixed << std::setprecision(2) <<
+      std::setw(10) << generic_us << std::setw(12) << fixed_us << std::setw(10) << generic_us / fixed_us << 'x' <<
+      std::setw(12) << (same ? "same" : "DIFFERENT") << "  (" << fixed.size() << " candidates)" << std::endl;
+}
+
+// Every cell of every level is a candidate, for minimum faces from the
+// smallest P-Net finds up, with the default factor between levels
+static bool CheckCandidateScales(int width, int height) {
+  static const int min_faces[] = {12, 20, 40, 80};
+  const float factor = 0.709f;
+  size_t levels = 0, candidates = 0;
+  bool same = true;
+  for (int min_face : min_faces) {
+    float m = 12.f / min_face;
+    for (float minl = std::min(width, height) * m; minl > 12.f; minl *= factor, m *= factor) {
+      const int w = ((int)std::ceil(width * m) - 12) / 2 + 1;
+      const int h = ((int)std::ceil(height * m) - 12) / 2 + 1;
+      if (w < 1 || h < 1)
+        continue;
+      ncnn::Mat score(w, h, 2), location(w, h, 4);
+      for (int q = 0; q < 2; q++) {
+        float *p = score.channel(q);
+        for (int i = 0; i < w * h; i++)
+          p[i] = 1.f;
+      }
+      for (int q = 0; q < 4; q++) {
+        float *p = location.channel(q);
+        for (int i = 0; i < w * h; i++)
+          p[i] = 0.f;
+      }
+
+      std::vector<Bbox> generic, fixed;
+      GenerateGeneric(score, location, 0.f, m, generic);
+      GenerateCandidates<PNET_STRIDE, PNET_CELL>(score, location, 0.f, m, 0, 0, fixed);
+      same = SameCandidates(generic, fixed) && same;
+      levels++;
+      candidates += fixed.size();
+    }
+  }
+
+  std::cout << "pnet levels " << std::setw(34) << (same ? "same" : "DIFFERENT") << "  (" << levels <<
+      " levels, " << candidates << " candidates)" << std::endl;
+  return same;
+}
+
+static void Usage(std::ostream &o, const char *argv0) {
+  o << "Usage: " << argv0 << " [OPTIONS...]\n"
+    "\n"
+    "Compares the fixed-geometry crop and candidate kernels with the generic\n"
+    "ncnn path\n"
+    "\n"
+    "Options:\n"
+    "  -s,--size WxH      Frame size (default: 960x540)\n"
+    "  --crops N          Random candidate crops (default: 1000)\n"
+    "  --repeat N         Passes over the crops (default: 10)\n"
+    "\n";
+}
+
+int main(int argc, const char *const *const argv) {
+  int width = 960, height = 540, crop_count = 1000, repeat = 10;
+  for (int arg = 1; arg != argc; arg++) {
+    if (std::strcmp(argv[arg], "-h") == 0 || std::strcmp(argv[arg], "--help") == 0) {
+      Usage(std::cout, argv[0]);
+      return EXIT_SUCCESS;
+    } else if ((std::strcmp(argv[arg], "-s") == 0 || std::strcmp(argv[arg], "--size") == 0) && arg + 1 != argc) {
+      if (std::sscanf(argv[++arg], "%dx%d", &width, &height) != 2 || width < 48 || height < 48) {
+        std::cerr << "Failed to parse size: " << argv[arg] << std::endl;
+        return EXIT_FAILURE;
+      }
+    } else if (std::strcmp(argv[arg], "--crops") == 0 && arg + 1 != argc) {
+      if (std::sscanf(argv[++arg], "%d", &crop_count) != 1 || crop_count <= 0) {
+        std::cerr << "Failed to parse crop count: " << argv[arg] << std::endl;
+        return EXIT_FAILURE;
+      }
+    } else if (std::strcmp(argv[arg], "--repeat") == 0 && arg + 1 != argc) {
+      if (std::sscanf(argv[++arg], "%d", &repeat) != 1 || repeat <= 0) {
+        std::cerr << "Failed to parse repeat count: " << argv[arg] << std::endl;
+        return EXIT_FAILURE;
+      }
+    } else {
+      std::cerr << "Unexpected option: " << argv[arg] << std::endl;
+      Usage(std::cerr, argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  std::mt19937 random(1);
+  ncnn::Mat image(width, height, 3);
+  std::uniform_real_distribution<float> pixel(0.f, 255.f);
+  for (int q = 0; q < 3; q++) {
+    float *p = image.channel(q);
+    for (int i = 0; i < width * height; i++)
+      p[i] = pixel(random);
+  }
+
+  // Candidates from the smallest face to a third of the frame, inside it
+  std::vector<Crop> crops(crop_count);
+  const int largest = std::min(width, height) / 3;
+  for (Crop &c : crops) {
+    c.w = std::uniform_int_distribution<int>(12, std::max(12, largest))(random);
+    c.h = c.w;
+    c.x = std::uniform_int_distribution<int>(0, width - c.w)(random);
+    c.y = std::uniform_int_distribution<int>(0, height - c.h)(random);
+  }
+
+  std::cout << width << 'x' << height << ", " << crop_count << " crops, " << repeat << " passes" << std::endl <<
+      "Kernel     generic     fixed       speedup   max diff" << std::endl <<
+      "           (us)        (us)" << std::endl;
+  BenchCrop<RNET_SIZE>(image, crops, repeat);
+  BenchCrop<ONET_SIZE>(image, crops, repeat);
+  BenchCandidates(width, height, 0.02f, repeat * 10, random);
+  return CheckCandidateScales(width, height) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
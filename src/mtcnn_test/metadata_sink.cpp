@@ -0,0 +1,359 @@
+/**
+ * @internal
+ * @file       metadata_sink.cpp
+ * @copyright  VCA Technology
+ * @~english
+ * @brief      Implementation of the @c MetadataSink class.
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+#include <type_traits>
+
+#include "metadata_sink.hpp"
+
+// Widest output of AppendInt, and of AppendFixed: a sign, the digits of the
+// 1e15 it clamps to, the point and the decimals
+static constexpr const size_t MaxIntChars = 11;
+static constexpr size_t MaxFixedChars(unsigned int decimals) { return 1 + 16 + 1 + decimals; }
+
+// Upper bounds on the serialized size of one face, from the widest values
+// each format can print
+static constexpr const size_t MaxJsonFaceBytes =
+    sizeof(",{\"score\":") - 1 + MaxFixedChars(4) + sizeof(",\"box\":[") - 1 + 4 * (MaxIntChars + 1) +
+    sizeof(",\"landmarks\":[") - 1 + 5 * (sizeof(",[") - 1 + 2 * (MaxFixedChars(1) + 1)) + sizeof("]}") - 1;
+static constexpr const size_t MaxXmlFaceBytes =
+    sizeof("<face score=\"") - 1 + MaxFixedChars(4) + 4 * (sizeof("\" x1=\"") - 1 + MaxIntChars) +
+    sizeof("\">") - 1 + 5 * (sizeof("<landmark x=\"") - 1 + MaxFixedChars(1) + sizeof("\" y=\"") - 1 +
+    MaxFixedChars(1) + sizeof("\"/>") - 1) + sizeof("</face>") - 1;
+static constexpr const size_t MaxBinaryFaceBytes = sizeof(uint16_t) + 14 * sizeof(int16_t);
+
+// Upper bounds on the serialized size of one frame, in any format
+static constexpr const size_t MaxFrameHeaderBytes = 256;
+static constexpr const size_t MaxFaceBytes = MaxXmlFaceBytes > MaxJsonFaceBytes ?
+    (MaxXmlFaceBytes > MaxBinaryFaceBytes ? MaxXmlFaceBytes : MaxBinaryFaceBytes) :
+    (MaxJsonFaceBytes > MaxBinaryFaceBytes ? MaxJsonFaceBytes : MaxBinaryFaceBytes);
+static constexpr const size_t BufferSize =
+    MaxFrameHeaderBytes + MetadataSink::MaxFacesPerFrame * MaxFaceBytes;
+
+static const uint16_t BinaryVersion = 1;
+
+static char* AppendString(char *p, const char *s) {
+  const size_t length = std::strlen(s);
+  std::memcpy(p, s, length);
+  return p + length;
+}
+
+static char* AppendUInt(char *p, uint64_t value) {
+  char digits[20];
+  int n = 0;
+  do {
+    digits[n++] = static_cast<char>('0' + value % 10);
+    value /= 10;
+  } while (value);
+  while (n)
+    *p++ = digits[--n];
+  return p;
+}
+
+static char* AppendInt(char *p, int64_t value) {
+  if (value < 0) {
+    *p++ = '-';
+    return AppendUInt(p, static_cast<uint64_t>(-(value + 1)) + 1);
+  }
+  return AppendUInt(p, static_cast<uint64_t>(value));
+}
+
+static char* AppendFixed(char *p, float value, unsigned int decimals) {
+  static const uint32_t scales[] = {1, 10, 100, 1000, 10000};
+  decimals = std::min(decimals, 4u);
+
+  if (!std::isfinite(value))
+    value = 0.0f;
+  const bool negative = value < 0;
+
+  const uint64_t scaled = static_cast<uint64_t>(std::min(std::fabs(value) * scales[decimals] + 0.5f, 1e15f));
+  if (negative && scaled)
+    *p++ = '-';
+  p = AppendUInt(p, scaled / scales[decimals]);
+  if (decimals) {
+    *p++ = '.';
+    uint64_t fraction = scaled % scales[decimals];
+    for (unsigned int d = decimals; d != 0; d--) {
+      p[d - 1] = static_cast<char>('0' + fraction % 10);
+      fraction /= 10;
+    }
+    p += decimals;
+  }
+  return p;
+}
+
+template<typename T>
+static char* AppendLittleEndian(char *p, T value) {
+  typedef typename std::make_unsigned<T>::type Unsigned;
+  Unsigned bits = static_cast<Unsigned>(value);
+  for (size_t i = 0; i != sizeof(T); i++, bits >>= 8)
+    *p++ = static_cast<char>(bits & 0xff);
+  return p;
+}
+
+static int16_t ClampToInt16(float value) {
+  return static_cast<int16_t>(std::max(-32768.0f, std::min(32767.0f, std::round(value))));
+}
+
+MetadataSink::MetadataSink(std::ostream &stream, Format format, unsigned int slot_count) :
+  stream_(stream),
+  format_(format),
+  slot_count_(slot_count),
+  slots_(),
+  buffer_(new char[BufferSize]),
+  free_slots_(),
+  queue_(slot_count),
+  queue_head_(0),
+  queue_count_(0),
+  stopping_(false),
+  pushed_frames_(0),
+  written_frames_(0),
+  flushed_frames_(0),
+  statistics_{0, 0, 0, 0, 0, std::chrono::nanoseconds(0), std::chrono::nanoseconds(0), false},
+  thread_() {
+  if (slot_count_ == 0)
+    throw std::invalid_argument("Metadata sink needs at least one slot");
+
+  slots_.reset(new Slot[slot_count_]);
+  free_slots_.reserve(slot_count_);
+  for (unsigned int i = 0; i != slot_count_; i++)
+    free_slots_.push_back(i);
+
+  char *const end = SerializeHeader(buffer_.get());
+  stream_.write(buffer_.get(), end - buffer_.get());
+  if (stream_)
+    statistics_.bytes_written += end - buffer_.get();
+  else
+    statistics_.failed = true;
+
+  thread_ = std::thread(&MetadataSink::Run, this);
+}
+
+MetadataSink::~MetadataSink() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  queued_condition_.notify_one();
+  thread_.join();
+
+  char *const end = SerializeFooter(buffer_.get());
+  stream_.write(buffer_.get(), end - buffer_.get());
+  stream_.flush();
+}
+
+void MetadataSink::PushFrame(unsigned int frame_no, uint64_t timestamp, const std::vector<Bbox> &boxes) {
+  unsigned int slot;
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (free_slots_.empty()) {
+      // Metadata is never dropped; wait for the writer instead
+      statistics_.blocked_pushes++;
+      free_condition_.wait(lock, [this]() { return !free_slots_.empty(); });
+    }
+    slot = free_slots_.back();
+    free_slots_.pop_back();
+  }
+
+  Slot &s = slots_[slot];
+  s.frame_no = frame_no;
+  s.timestamp = timestamp;
+  s.face_count = static_cast<unsigned int>(std::min<size_t>(boxes.size(), MaxFacesPerFrame));
+  std::copy(boxes.begin(), boxes.begin() + s.face_count, s.faces);
+
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    statistics_.truncated_faces += boxes.size() - s.face_count;
+    queue_[(queue_head_ + queue_count_) % slot_count_] = slot;
+    queue_count_++;
+    pushed_frames_++;
+  }
+  queued_condition_.notify_one();
+}
+
+bool MetadataSink::Flush() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  flushed_condition_.wait(lock, [this]() { return flushed_frames_ == pushed_frames_; });
+  return !statistics_.failed;
+}
+
+MetadataSink::Statistics MetadataSink::GetStatistics() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return statistics_;
+}
+
+void MetadataSink::Run() {
+  for (;;) {
+    unsigned int slot;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      if (queue_count_ == 0 && flushed_frames_ != written_frames_) {
+        // Flush only when idle, so bursts are written with as few calls as possible
+        const uint64_t written_frames = written_frames_;
+        lock.unlock();
+        const bool flushed = static_cast<bool>(stream_.flush());
+        lock.lock();
+        statistics_.failed |= !flushed;
+        flushed_frames_ = written_frames;
+        flushed_condition_.notify_all();
+      }
+      queued_condition_.wait(lock, [this]() { return queue_count_ != 0 || stopping_; });
+      if (queue_count_ == 0)
+        return;
+      slot = queue_[queue_head_];
+      queue_head_ = (queue_head_ + 1) % slot_count_;
+      queue_count_--;
+    }
+
+    const Slot &s = slots_[slot];
+    const auto begin = std::chrono::steady_clock::now();
+    char *const end = SerializeFrame(buffer_.get(), s);
+    const std::chrono::nanoseconds elapsed = std::chrono::steady_clock::now() - begin;
+    const unsigned int face_count = s.face_count;
+
+    stream_.write(buffer_.get(), end - buffer_.get());
+    const bool written = static_cast<bool>(stream_);
+
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      free_slots_.push_back(slot);
+      written_frames_++;
+      statistics_.frames++;
+      statistics_.faces += face_count;
+      if (written)
+        statistics_.bytes_written += end - buffer_.get();
+      else
+        statistics_.failed = true;
+      statistics_.total_serialize_time += elapsed;
+      statistics_.max_serialize_time = std::max(statistics_.max_serialize_time, elapsed);
+    }
+    free_condition_.notify_all();
+  }
+}
+
+char* MetadataSink::SerializeHeader(char *p) const {
+  switch (format_) {
+   case Format::Json:
+    return p;
+   case Format::Xml:
+    return AppendString(p, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<frames>\n");
+   case Format::Binary:
+    p = AppendString(p, "MTMD");
+    return AppendLittleEndian<uint16_t>(p, BinaryVersion);
+  }
+  return p;
+}
+
+char* MetadataSink::SerializeFooter(char *p) const {
+  return format_ == Format::Xml ? AppendString(p, "</frames>\n") : p;
+}
+
+char* MetadataSink::SerializeFrame(char *p, const Slot &slot) const {
+  switch (format_) {
+   case Format::Json:
+    return SerializeJson(p, slot);
+   case Format::Xml:
+    return SerializeXml(p, slot);
+   case Format::Binary:
+    return SerializeBinary(p, slot);
+  }
+  return p;
+}
+
+char* MetadataSink::SerializeJson(char *p, const Slot &slot) const {
+  p = AppendString(p, "{\"frame\":");
+  p = AppendUInt(p, slot.frame_no);
+  p = AppendString(p, ",\"timestamp\":");
+  p = AppendUInt(p, slot.timestamp);
+  p = AppendString(p, ",\"faces\":[");
+  for (unsigned int i = 0; i != slot.face_count; i++) {
+    const Bbox &face = slot.faces[i];
+    if (i)
+      *p++ = ',';
+    p = AppendString(p, "{\"score\":");
+    p = AppendFixed(p, face.score, 4);
+    p = AppendString(p, ",\"box\":[");
+    p = AppendInt(p, face.x1);
+    *p++ = ',';
+    p = AppendInt(p, face.y1);
+    *p++ = ',';
+    p = AppendInt(p, face.x2);
+    *p++ = ',';
+    p = AppendInt(p, face.y2);
+    p = AppendString(p, "],\"landmarks\":[");
+    for (int j = 0; j != 5; j++) {
+      p = AppendString(p, j ? ",[" : "[");
+      p = AppendFixed(p, face.landmark.x[j], 1);
+      *p++ = ',';
+      p = AppendFixed(p, face.landmark.y[j], 1);
+      *p++ = ']';
+    }
+    p = AppendString(p, "]}");
+  }
+  return AppendString(p, "]}\n");
+}
+
+char* MetadataSink::SerializeXml(char *p, const Slot &slot) const {
+  p = AppendString(p, "<frame no=\"");
+  p = AppendUInt(p, slot.frame_no);
+  p = AppendString(p, "\" timestamp=\"");
+  p = AppendUInt(p, slot.timestamp);
+  p = AppendString(p, "\">");
+  for (unsigned int i = 0; i != slot.face_count; i++) {
+    const Bbox &face = slot.faces[i];
+    p = AppendString(p, "<face score=\"");
+    p = AppendFixed(p, face.score, 4);
+    p = AppendString(p, "\" x1=\"");
+    p = AppendInt(p, face.x1);
+    p = AppendString(p, "\" y1=\"");
+    p = AppendInt(p, face.y1);
+    p = AppendString(p, "\" x2=\"");
+    p = AppendInt(p, face.x2);
+    p = AppendString(p, "\" y2=\"");
+    p = AppendInt(p, face.y2);
+    p = AppendString(p, "\">");
+    for (int j = 0; j != 5; j++) {
+      p = AppendString(p, "<landmark x=\"");
+      p = AppendFixed(p, face.landmark.x[j], 1);
+      p = AppendString(p, "\" y=\"");
+      p = AppendFixed(p, face.landmark.y[j], 1);
+      p = AppendString(p, "\"/>");
+    }
+    p = AppendString(p, "</face>");
+  }
+  return AppendString(p, "</frame>\n");
+}
+
+char* MetadataSink::SerializeBinary(char *p, const Slot &slot) const {
+  // The length is filled in once the record is complete
+  char *const length = p;
+  p += sizeof(uint32_t);
+
+  p = AppendLittleEndian<uint64_t>(p, slot.timestamp);
+  p = AppendLittleEndian<uint32_t>(p, slot.frame_no);
+  p = AppendLittleEndian<uint16_t>(p, static_cast<uint16_t>(slot.face_count));
+  for (unsigned int i = 0; i != slot.face_count; i++) {
+    const Bbox &face = slot.faces[i];
+    const float score = std::max(0.0f, std::min(1.0f, face.score));
+    p = AppendLittleEndian<uint16_t>(p, static_cast<uint16_t>(score * 65535.0f + 0.5f));
+    p = AppendLittleEndian<int16_t>(p, ClampToInt16(face.x1));
+    p = AppendLittleEndian<int16_t>(p, ClampToInt16(face.y1));
+    p = AppendLittleEndian<int16_t>(p, ClampToInt16(face.x2));
+    p = AppendLittleEndian<int16_t>(p, ClampToInt16(face.y2));
+    for (int j = 0; j != 5; j++)
+      p = AppendLittleEndian<int16_t>(p, ClampToInt16(face.landmark.x[j]));
+    for (int j = 0; j != 5; j++)
+      p = AppendLittleEndian<int16_t>(p, ClampToInt16(face.landmark.y[j]));
+  }
+
+  AppendLittleEndian<uint32_t>(length, static_cast<uint32_t>(p - length - sizeof(uint32_t)));
+  return p;
+}
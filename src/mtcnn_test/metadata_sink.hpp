@@ -0,0 +1,114 @@
+#pragma once
+/**
+ * @internal
+ * @file       metadata_sink.hpp
+ * @copyright  VCA Technology
+ * @~english
+ * @brief      Declaration of the @c MetadataSink class.
+ */
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <thread>
+#include <vector>
+
+#include "mtcnn.h"
+
+/**
+ * Streams per-frame detections to an output stream from a dedicated writer
+ * thread. The caller only copies the boxes into a preallocated slot; the
+ * writer serializes them into a preallocated buffer, so nothing is allocated
+ * per frame.
+ *
+ * Formats:
+ *  - Json: one JSON object per line.
+ *  - Xml: a @c frames document with one @c frame element per frame.
+ *  - Binary: the magic "MTMD", a little-endian uint16 version, then one record
+ *    per frame: uint32 length of the rest of the record, uint64 timestamp (ns),
+ *    uint32 frame number, uint16 face count, and per face a uint16 score scaled
+ *    to 0-65535, int16 x1, y1, x2, y2 and int16 landmark x[5], y[5].
+ */
+class MetadataSink {
+ public:
+  enum class Format {
+    Json,
+    Xml,
+    Binary,
+  };
+
+  /// Faces beyond this are left out of a frame's record and counted as truncated.
+  static constexpr const unsigned int MaxFacesPerFrame = 1024;
+
+  struct Statistics {
+    uint64_t frames;
+    uint64_t faces;
+    uint64_t truncated_faces;
+    uint64_t blocked_pushes;  ///< Pushes that waited for the writer to free a slot
+    uint64_t bytes_written;   ///< Only of writes the stream accepted
+    std::chrono::nanoseconds total_serialize_time;
+    std::chrono::nanoseconds max_serialize_time;
+    bool failed;              ///< The stream failed a write or flush
+  };
+
+ public:
+  MetadataSink(std::ostream &stream, Format format, unsigned int slot_count = 4);
+
+  /// Writes out the frames still queued and closes the document.
+  ~MetadataSink();
+
+  void PushFrame(unsigned int frame_no, uint64_t timestamp, const std::vector<Bbox> &boxes);
+
+  /// Waits until every pushed frame has been written and the stream flushed.
+  /// Returns false if the stream has failed.
+  bool Flush();
+
+  Statistics GetStatistics() const;
+
+ private:
+  struct Slot {
+    unsigned int frame_no;
+    uint64_t timestamp;
+    unsigned int face_count;
+    Bbox faces[MaxFacesPerFrame];
+  };
+
+ private:
+  MetadataSink(const MetadataSink&) = delete;
+  MetadataSink& operator=(const MetadataSink&) = delete;
+
+  void Run();
+
+  char* SerializeHeader(char *p) const;
+
+  char* SerializeFooter(char *p) const;
+
+  char* SerializeFrame(char *p, const Slot &slot) const;
+
+  char* SerializeJson(char *p, const Slot &slot) const;
+
+  char* SerializeXml(char *p, const Slot &slot) const;
+
+  char* SerializeBinary(char *p, const Slot &slot) const;
+
+ private:
+  std::ostream &stream_;
+  const Format format_;
+  const unsigned int slot_count_;
+  std::unique_ptr<Slot[]> slots_;
+  std::unique_ptr<char[]> buffer_;
+
+  mutable std::mutex mutex_;
+  std::condition_variable queued_condition_, free_condition_, flushed_condition_;
+  std::vector<unsigned int> free_slots_;
+  std::vector<unsigned int> queue_;  // ring of queued slot indices
+  unsigned int queue_head_, queue_count_;
+  bool stopping_;
+  uint64_t pushed_frames_, written_frames_, flushed_frames_;
+  Statistics statistics_;
+
+  std::thread thread_;
+};
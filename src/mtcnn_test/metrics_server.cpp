@@ -0,0 +1,196 @@
+/**
+ * @internal
+ * @file       metrics_server.cpp
+ * @copyright  VCA Technology
+ * @~english
+ * @brief      Implementation of the @c MetricsServer class.
+ */
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "metrics_server.hpp"
+
+static std::runtime_error SocketError(const std::string &message, const std::string &listen) {
+  std::ostringstream ss;
+  ss << message << ' ' << listen << ": " << std::strerror(errno);
+  return std::runtime_error(ss.str());
+}
+
+MetricsServer::MetricsServer(const MetricsRegistry &registry, const Options &options) :
+  registry_(registry),
+  options_(options),
+  unix_path_(),
+  listen_fd_(-1),
+  wake_fds_{-1, -1},
+  thread_() {
+  if (!options_.listen.empty()) {
+    if (options_.listen.compare(0, 5, "unix:") == 0) {
+      unix_path_ = options_.listen.substr(5);
+      sockaddr_un address = {};
+      address.sun_family = AF_UNIX;
+      if (unix_path_.empty() || unix_path_.size() >= sizeof(address.sun_path))
+        throw std::runtime_error("Invalid metrics socket path: " + unix_path_);
+      std::strcpy(address.sun_path, unix_path_.c_str());
+
+      listen_fd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+      unlink(unix_path_.c_str());
+      if (listen_fd_ < 0 || bind(listen_fd_, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) != 0) {
+        const auto error = SocketError("Failed to bind metrics socket", options_.listen);
+        if (listen_fd_ >= 0)
+          close(listen_fd_);
+        throw error;
+      }
+    } else {
+      // Scrapes are meant for the local agent, so only loopback unless told otherwise
+      std::string host = "127.0.0.1";
+      std::string port = options_.listen;
+      const size_t colon = port.rfind(':');
+      if (colon != std::string::npos) {
+        host = port.substr(0, colon);
+        port = port.substr(colon + 1);
+      }
+      sockaddr_in address = {};
+      address.sin_family = AF_INET;
+      unsigned int port_number;
+      if (std::sscanf(port.c_str(), "%u", &port_number) != 1 || port_number > 65535 ||
+          inet_pton(AF_INET, host.c_str(), &address.sin_addr) != 1)
+        throw std::runtime_error("Invalid metrics address: " + options_.listen);
+      address.sin_port = htons(static_cast<uint16_t>(port_number));
+
+      listen_fd_ = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+      const int reuse = 1;
+      if (listen_fd_ >= 0)
+        setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+      if (listen_fd_ < 0 || bind(listen_fd_, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) != 0) {
+        const auto error = SocketError("Failed to bind metrics socket", options_.listen);
+        if (listen_fd_ >= 0)
+          close(listen_fd_);
+        throw error;
+      }
+    }
+
+    if (listen(listen_fd_, 8) != 0) {
+      const auto error = SocketError("Failed to listen on", options_.listen);
+      close(listen_fd_);
+      throw error;
+    }
+  }
+
+  if (pipe2(wake_fds_, O_CLOEXEC) != 0) {
+    if (listen_fd_ >= 0)
+      close(listen_fd_);
+    throw std::runtime_error("Failed to create the metrics server pipe");
+  }
+
+  thread_ = std::thread(&MetricsServer::Run, this);
+}
+
+MetricsServer::~MetricsServer() {
+  const char stop = 0;
+  if (write(wake_fds_[1], &stop, 1) != 1)
+    std::cerr << "Failed to stop the metrics server" << std::endl;
+  thread_.join();
+
+  close(wake_fds_[0]);
+  close(wake_fds_[1]);
+  if (listen_fd_ >= 0) {
+    close(listen_fd_);
+    if (!unix_path_.empty())
+      unlink(unix_path_.c_str());
+  }
+
+  if (!options_.snapshot_path.empty())
+    WriteSnapshot();
+}
+
+void MetricsServer::Run() {
+  auto next_snapshot = std::chrono::steady_clock::now() + options_.snapshot_interval;
+
+  for (;;) {
+    int timeout = -1;
+    if (!options_.snapshot_path.empty()) {
+      const auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(
+          next_snapshot - std::chrono::steady_clock::now());
+      timeout = static_cast<int>(std::max<long long>(0, remaining.count()));
+    }
+
+    pollfd fds[2] = {{wake_fds_[0], POLLIN, 0}, {listen_fd_, POLLIN, 0}};
+    const int ready = poll(fds, listen_fd_ >= 0 ? 2 : 1, timeout);
+    if (ready < 0 && errno != EINTR)
+      return;
+
+    if (fds[0].revents)
+      return;
+
+    if (listen_fd_ >= 0 && (fds[1].revents & POLLIN)) {
+      const int fd = accept4(listen_fd_, nullptr, nullptr, SOCK_CLOEXEC);
+      if (fd >= 0) {
+        Serve(fd);
+        close(fd);
+      }
+    }
+
+    if (!options_.snapshot_path.empty() && std::chrono::steady_clock::now() >= next_snapshot) {
+      WriteSnapshot();
+      next_snapshot += options_.snapshot_interval;
+    }
+  }
+}
+
+void MetricsServer::Serve(int fd) const {
+  // Wait briefly for the request, which is never looked at; a client that sends
+  // nothing still gets the metrics
+  char request[1024];
+  pollfd request_fd = {fd, POLLIN, 0};
+  if (poll(&request_fd, 1, 100) > 0 && recv(fd, request, sizeof(request), MSG_DONTWAIT) < 0)
+    return;
+
+  std::ostringstream body;
+  registry_.WritePrometheus(body);
+  const std::string content = body.str();
+
+  std::ostringstream response;
+  response << "HTTP/1.0 200 OK\r\n"
+      "Content-Type: text/plain; version=0.0.4\r\n"
+      "Content-Length: " << content.size() << "\r\n"
+      "Connection: close\r\n"
+      "\r\n" << content;
+  const std::string data = response.str();
+
+  size_t sent = 0;
+  while (sent != data.size()) {
+    const ssize_t n = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+    if (n <= 0)
+      return;
+    sent += static_cast<size_t>(n);
+  }
+}
+
+void MetricsServer::WriteSnapshot() const {
+  const std::string temporary_path = options_.snapshot_path + ".tmp";
+  {
+    std::ofstream file(temporary_path, std::ios::trunc);
+    registry_.WritePrometheus(file);
+    if (!file) {
+      std::cerr << "Failed to write " << temporary_path << std::endl;
+      return;
+    }
+  }
+  if (std::rename(temporary_path.c_str(), options_.snapshot_path.c_str()) != 0)
+    std::cerr << "Failed to replace " << options_.snapshot_path << std::endl;
+}
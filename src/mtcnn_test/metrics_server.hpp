@@ -0,0 +1,65 @@
+#pragma once
+/**
+ * @internal
+ * @file       metrics_server.hpp
+ * @copyright  VCA Technology
+ * @~english
+ * @brief      Declaration of the @c MetricsServer class.
+ */
+
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+
+#include "metrics.h"
+
+/**
+ * Publishes a @c MetricsRegistry in the Prometheus text format from a thread
+ * of its own: to scrapers connecting to a local socket, and as a snapshot file
+ * rewritten periodically.
+ *
+ * Any connection is answered with an HTTP response holding the current metrics
+ * and closed, so both Prometheus and curl --unix-socket work. The snapshot is
+ * written to a temporary file and renamed, so readers never see half of one.
+ */
+class MetricsServer final {
+ public:
+  struct Options {
+    Options() :
+      listen(),
+      snapshot_path(),
+      snapshot_interval(std::chrono::seconds(10)) {
+    }
+
+    std::string listen;          ///< PORT or ADDRESS:PORT (default 127.0.0.1), unix:PATH, or empty
+    std::string snapshot_path;   ///< Empty for no snapshots
+    std::chrono::milliseconds snapshot_interval;
+  };
+
+ public:
+  /// Throws if the socket can't be set up.
+  MetricsServer(const MetricsRegistry &registry, const Options &options);
+
+  /// Writes a final snapshot.
+  ~MetricsServer();
+
+ private:
+  void Run();
+
+  void Serve(int fd) const;
+
+  void WriteSnapshot() const;
+
+ private:
+  MetricsServer(const MetricsServer&) = delete;
+  MetricsServer& operator=(const MetricsServer&) = delete;
+
+ private:
+  const MetricsRegistry &registry_;
+  const Options options_;
+  std::string unix_path_;
+  int listen_fd_;
+  int wake_fds_[2];            ///< Pipe that interrupts the server thread's poll
+  std::thread thread_;
+};
@@ -0,0 +1,134 @@
+/**
+ * @internal
+ * @file       nv12_overlay.cpp
+ * @copyright  VCA Technology
+ * @~english
+ * @brief      Implementation of the @c Nv12Overlay class.
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
+#include "nv12_overlay.hpp"
+
+static uint8_t ClampToByte(int value) {
+  return static_cast<uint8_t>(std::min(255, std::max(0, value)));
+}
+
+Nv12Overlay::Color Nv12Overlay::FromRgb(uint8_t r, uint8_t g, uint8_t b) {
+  return Color{
+      ClampToByte(((66 * r + 129 * g + 25 * b + 128) >> 8) + 16),
+      ClampToByte(((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128),
+      ClampToByte(((112 * r - 94 * g - 18 * b + 128) >> 8) + 128)};
+}
+
+Nv12Overlay::Nv12Overlay(uint8_t *data, unsigned int width, unsigned int height) :
+  Nv12Overlay(data, width, data + width * height, width, width, height) {}
+
+Nv12Overlay::Nv12Overlay(uint8_t *y_plane, std::ptrdiff_t y_stride, uint8_t *uv_plane, std::ptrdiff_t uv_stride,
+    unsigned int width, unsigned int height) :
+  y_plane_(y_plane),
+  y_stride_(y_stride),
+  uv_plane_(uv_plane),
+  uv_stride_(uv_stride),
+  width_(static_cast<int>(width)),
+  height_(static_cast<int>(height)) {}
+
+void Nv12Overlay::FillRect(int x, int y, int w, int h, Color color) {
+  const int x0 = std::max(0, x), x1 = std::min(width_, x + w);
+  const int y0 = std::max(0, y), y1 = std::min(height_, y + h);
+  if (x0 >= x1 || y0 >= y1)
+    return;
+
+  for (int row = y0; row != y1; row++)
+    FillLumaRow(y_plane_ + row * y_stride_, x0, x1, color.y);
+
+  // Cover every chroma sample the luma rectangle touches
+  for (int row = y0 / 2; row <= (y1 - 1) / 2; row++)
+    FillChromaRow(uv_plane_ + row * uv_stride_, x0 / 2, (x1 + 1) / 2, color.u, color.v);
+}
+
+void Nv12Overlay::DrawRectangle(int x1, int y1, int x2, int y2, int thickness, Color color) {
+  if (x1 > x2)
+    std::swap(x1, x2);
+  if (y1 > y2)
+    std::swap(y1, y2);
+
+  const int w = x2 - x1 + 1, h = y2 - y1 + 1;
+  const int t = std::max(1, std::min(thickness, std::min(w, h) / 2 + 1));
+
+  FillRect(x1, y1, w, t, color);
+  FillRect(x1, y2 - t + 1, w, t, color);
+  FillRect(x1, y1 + t, t, h - 2 * t, color);
+  FillRect(x2 - t + 1, y1 + t, t, h - 2 * t, color);
+}
+
+void Nv12Overlay::DrawLine(int x1, int y1, int x2, int y2, int thickness, Color color) {
+  const int t = std::max(1, thickness);
+  const int half = t / 2;
+
+  // Axis-aligned lines are plain fills
+  if (y1 == y2) {
+    FillRect(std::min(x1, x2), y1 - half, std::abs(x2 - x1) + 1, t, color);
+    return;
+  } else if (x1 == x2) {
+    FillRect(x1 - half, std::min(y1, y2), t, std::abs(y2 - y1) + 1, color);
+    return;
+  }
+
+  // Bresenham, stamping a t x t square at each step
+  const int dx = std::abs(x2 - x1), sx = x1 < x2 ? 1 : -1;
+  const int dy = -std::abs(y2 - y1), sy = y1 < y2 ? 1 : -1;
+  int err = dx + dy;
+  for (;;) {
+    FillRect(x1 - half, y1 - half, t, t, color);
+    if (x1 == x2 && y1 == y2)
+      break;
+    const int e2 = 2 * err;
+    if (e2 >= dy) {
+      err += dy;
+      x1 += sx;
+    }
+    if (e2 <= dx) {
+      err += dx;
+      y1 += sy;
+    }
+  }
+}
+
+void Nv12Overlay::DrawDot(int cx, int cy, int radius, Color color) {
+  const int r = std::max(0, radius);
+  for (int dy = -r; dy <= r; dy++) {
+    const int span = static_cast<int>(std::sqrt(static_cast<float>(r * r - dy * dy)) + 0.5f);
+    FillRect(cx - span, cy + dy, 2 * span + 1, 1, color);
+  }
+}
+
+void Nv12Overlay::FillLumaRow(uint8_t *row, int x0, int x1, uint8_t y) {
+  std::memset(row + x0, y, x1 - x0);
+}
+
+void Nv12Overlay::FillChromaRow(uint8_t *row, int x0, int x1, uint8_t u, uint8_t v) {
+  uint8_t *p = row + 2 * x0;
+  int count = x1 - x0;
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+  uint8x16x2_t uv;
+  uv.val[0] = vdupq_n_u8(u);
+  uv.val[1] = vdupq_n_u8(v);
+  for (; count >= 16; count -= 16, p += 32)
+    vst2q_u8(p, uv);
+#endif
+
+  // Interleaved pair stores; the compiler vectorizes this on other targets
+  for (int i = 0; i != count; i++) {
+    p[2 * i] = u;
+    p[2 * i + 1] = v;
+  }
+}
@@ -0,0 +1,55 @@
+#pragma once
+/**
+ * @internal
+ * @file       nv12_overlay.hpp
+ * @copyright  VCA Technology
+ * @~english
+ * @brief      Declaration of the @c Nv12Overlay class.
+ */
+
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * Draws solid shapes straight into an NV12 image. Each chroma sample covers a
+ * 2x2 block of luma, so shapes colour every chroma sample they touch and may
+ * bleed colour by up to one pixel at odd edges.
+ */
+class Nv12Overlay {
+ public:
+  struct Color {
+    uint8_t y, u, v;
+  };
+
+  /// Converts with BT.601 limited-range coefficients, as the NV12 players expect.
+  static Color FromRgb(uint8_t r, uint8_t g, uint8_t b);
+
+ public:
+  /// Wraps a contiguous NV12 image whose stride equals its width.
+  Nv12Overlay(uint8_t *data, unsigned int width, unsigned int height);
+
+  Nv12Overlay(uint8_t *y_plane, std::ptrdiff_t y_stride, uint8_t *uv_plane, std::ptrdiff_t uv_stride,
+      unsigned int width, unsigned int height);
+
+  /// Fills the rectangle [x, x + w) x [y, y + h), clipped to the image.
+  void FillRect(int x, int y, int w, int h, Color color);
+
+  /// Outlines the inclusive rectangle (x1, y1)-(x2, y2) with edges drawn inwards.
+  void DrawRectangle(int x1, int y1, int x2, int y2, int thickness, Color color);
+
+  void DrawLine(int x1, int y1, int x2, int y2, int thickness, Color color);
+
+  void DrawDot(int cx, int cy, int radius, Color color);
+
+ private:
+  void FillLumaRow(uint8_t *row, int x0, int x1, uint8_t y);
+
+  void FillChromaRow(uint8_t *row, int x0, int x1, uint8_t u, uint8_t v);
+
+ private:
+  uint8_t *const y_plane_;
+  const std::ptrdiff_t y_stride_;
+  uint8_t *const uv_plane_;
+  const std::ptrdiff_t uv_stride_;
+  const int width_, height_;
+};
@@ -0,0 +1,362 @@
+/**
+ * @file      offline_face.cpp
+ * @copyright UDP Technology Ltd.
+ * @~english
+ * @brief     Face detection over recorded video files, in parallel segments
+ *
+ * The file is split into keyframe-aligned segments, which a pool of workers
+ * decode and detect on independently, each with its own decoder and @c MTCNN
+ * detector. The main thread writes the per-frame results in timestamp order as
+ * consecutive segments complete, so the output is the same as a single serial
+ * pass while every core is kept busy.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <time.h>
+
+#include "ffmpeg_common.hpp"
+#include "metadata_sink.hpp"
+#include "mtcnn.h"
+#include "segment_decoder.hpp"
+
+using Clock = std::chrono::steady_clock;
+
+struct FrameResult {
+  uint64_t timestamp;
+  std::vector<Bbox> boxes;
+};
+
+struct SegmentResult {
+  std::vector<FrameResult> frames;
+  unsigned int decoded_frames = 0;
+  bool done = false;
+  std::string error;
+};
+
+struct WorkerStatistics {
+  unsigned int segments = 0;
+  std::chrono::nanoseconds busy_time{0};
+  std::chrono::nanoseconds cpu_time{0};
+};
+
+static std::chrono::nanoseconds GetCpuTime(clockid_t clock) {
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+  return std::chrono::seconds(ts.tv_sec) + std::chrono::nanoseconds(ts.tv_nsec);
+}
+
+// With a frame rate cap only the first frame of each 1/fps period is detected,
+// judged from the frame's own timestamp so that segments agree at their edges
+static bool IsFirstInPeriod(uint64_t timestamp, uint64_t frame_interval, unsigned int fps) {
+  if (!fps || !frame_interval || timestamp < frame_interval)
+    return true;
+  return (timestamp * fps) / 1000000000 != ((timestamp - frame_interval) * fps) / 1000000000;
+}
+
+static void Usage(std::ostream &o, const char *argv0) {
+  o << "Usage: " << argv0 << " [OPTIONS...] FILE\n"
+    "\n"
+    "Detects faces in a recorded video file, decoding and detecting on\n"
+    "keyframe-aligned segments in parallel\n"
+    "\n"
+    "  FILE               The video file to process\n"
+    "\n"
+    "Options:\n"
+    "  -o,--output FILE   Writes the detections of every frame to FILE, or to\n"
+    "                     stdout if FILE is - (default: -)\n"
+    "  --format {json,xml,binary}\n"
+    "                     Meta-data format of the output (default: json)\n"
+    "  -m,--models DIR    Directory holding the MTCNN models (default: ../models)\n"
+    "  -s,--size WxH      Size frames are scaled to before detection (default:\n"
+    "                     the decoded size)\n"
+    "  --workers N        Segments decoded and detected at once, each with its\n"
+    "                     own decoder and detector (default: one per core)\n"
+    "  --segments N       Segments the file is split into; more than the\n"
+    "                     workers evens out their load (default: 4 per worker)\n"
+    "  --fps N            Detects on at most N frames per second of video, 0 for\n"
+    "                     every frame (default: 0)\n"
+    "  --min-face SIZE    Smallest face to detect in pixels (default: 40)\n"
+    "  --detect-mode {pnet,rnet,full}\n"
+    "                     Stops the cascade after P-Net or R-Net, giving coarser\n"
+    "                     boxes without landmarks (default: full)\n"
+    "\n";
+}
+
+static bool ParseDetectMode(const std::string &name, DetectMode &mode) {
+  if (name == "pnet")
+    mode = DETECT_PNET;
+  else if (name == "rnet")
+    mode = DETECT_RNET;
+  else if (name == "full")
+    mode = DETECT_FULL;
+  else
+    return false;
+  return true;
+}
+
+static bool ParseCount(const char *name, int argc, const char *const *argv, int &arg, unsigned int &value) {
+  if (arg + 1 == argc) {
+    std::cerr << "No " << name << " specified" << std::endl;
+    return false;
+  }
+  const char *s = argv[++arg];
+  if (std::sscanf(s, "%u", &value) != 1) {
+    std::cerr << "Failed to parse " << name << ": " << s << std::endl;
+    return false;
+  }
+  return true;
+}
+
+int main(int argc, const char *const *const argv) {
+  std::string path;
+  std::string output_path = "-";
+  std::string model_path = "../models";
+  MetadataSink::Format format = MetadataSink::Format::Json;
+  unsigned int width = 0, height = 0;
+  unsigned int worker_count = std::max(1u, std::thread::hardware_concurrency());
+  unsigned int segment_count = 0;
+  unsigned int fps = 0;
+  unsigned int min_face = 40;
+  DetectMode detect_mode = DETECT_FULL;
+
+  for (int arg = 1; arg != argc; arg++) {
+    if (std::strcmp(argv[arg], "-h") == 0 || std::strcmp(argv[arg], "--help") == 0) {
+      Usage(std::cout, argv[0]);
+      return EXIT_SUCCESS;
+    } else if (std::strcmp(argv[arg], "-o") == 0 || std::strcmp(argv[arg], "--output") == 0) {
+      if (arg + 1 == argc) {
+        std::cerr << "No output file specified" << std::endl;
+        return EXIT_FAILURE;
+      }
+      output_path = argv[++arg];
+    } else if (std::strcmp(argv[arg], "--format") == 0) {
+      if (arg + 1 == argc) {
+        std::cerr << "No output format specified" << std::endl;
+        return EXIT_FAILURE;
+      }
+      const std::string name = argv[++arg];
+      if (name == "json") {
+        format = MetadataSink::Format::Json;
+      } else if (name == "xml") {
+        format = MetadataSink::Format::Xml;
+      } else if (name == "binary") {
+        format = MetadataSink::Format::Binary;
+      } else {
+        std::cerr << "Unsupported output format: " << name << std::endl;
+        return EXIT_FAILURE;
+      }
+    } else if (std::strcmp(argv[arg], "-m") == 0 || std::strcmp(argv[arg], "--models") == 0) {
+      if (arg + 1 == argc) {
+        std::cerr << "No model directory specified" << std::endl;
+        return EXIT_FAILURE;
+      }
+      model_path = argv[++arg];
+    } else if ((std::strcmp(argv[arg], "-s") == 0 || std::strcmp(argv[arg], "--size") == 0) && arg + 1 != argc) {
+      if (std::sscanf(argv[++arg], "%ux%u", &width, &height) != 2) {
+        std::cerr << "Failed to parse size: " << argv[arg] << std::endl;
+        return EXIT_FAILURE;
+      }
+    } else if (std::strcmp(argv[arg], "--workers") == 0) {
+      if (!ParseCount("worker count", argc, argv, arg, worker_count))
+        return EXIT_FAILURE;
+    } else if (std::strcmp(argv[arg], "--segments") == 0) {
+      if (!ParseCount("segment count", argc, argv, arg, segment_count))
+        return EXIT_FAILURE;
+    } else if (std::strcmp(argv[arg], "--fps") == 0) {
+      if (!ParseCount("frame rate", argc, argv, arg, fps))
+        return EXIT_FAILURE;
+    } else if (std::strcmp(argv[arg], "--min-face") == 0) {
+      if (!ParseCount("minimum face size", argc, argv, arg, min_face))
+        return EXIT_FAILURE;
+    } else if (std::strcmp(argv[arg], "--detect-mode") == 0) {
+      if (arg + 1 == argc) {
+        std::cerr << "No detection mode specified" << std::endl;
+        return EXIT_FAILURE;
+      } else if (!ParseDetectMode(argv[++arg], detect_mode)) {
+        std::cerr << "Unsupported detection mode: " << argv[arg] << std::endl;
+        return EXIT_FAILURE;
+      }
+    } else if (argv[arg][0] == '-' && argv[arg][1]) {
+      std::cerr << "Unexpected option: " << argv[arg] << std::endl;
+      Usage(std::cerr, argv[0]);
+      return EXIT_FAILURE;
+    } else if (path.empty()) {
+      path = argv[arg];
+    } else {
+      std::cerr << "Only one file can be processed" << std::endl;
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (path.empty()) {
+    std::cerr << "No file to process" << std::endl;
+    Usage(std::cerr, argv[0]);
+    return EXIT_FAILURE;
+  }
+  if (!worker_count) {
+    std::cerr << "Worker count must be at least 1" << std::endl;
+    return EXIT_FAILURE;
+  }
+  if (!segment_count)
+    segment_count = 4 * worker_count;
+
+  FfmpegInit();
+
+  // Each worker opens the file itself; the first decoder also finds the segments
+  std::vector<std::unique_ptr<SegmentDecoder>> decoders;
+  std::vector<std::unique_ptr<MTCNN>> detectors;
+  std::vector<SegmentDecoder::Segment> segments;
+  try {
+    for (unsigned int i = 0; i != worker_count; i++) {
+      decoders.emplace_back(new SegmentDecoder(path, width, height));
+      detectors.emplace_back(new MTCNN(model_path));
+      detectors.back()->SetMinFace(static_cast<int>(min_face));
+      detectors.back()->SetDetectMode(detect_mode);
+      // The workers already fill the cores
+      detectors.back()->SetNumThreads(1);
+    }
+    segments = decoders.front()->FindSegments(segment_count);
+  } catch (const std::exception &e) {
+    std::cerr << e.what() << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  std::ofstream output_file;
+  if (output_path != "-") {
+    output_file.open(output_path, std::ios::binary);
+    if (!output_file) {
+      std::cerr << "Failed to open output file: " << output_path << std::endl;
+      return EXIT_FAILURE;
+    }
+  }
+  std::ostream &output = output_path == "-" ? std::cout : output_file;
+
+  const unsigned int frame_width = decoders.front()->GetWidth();
+  const unsigned int frame_height = decoders.front()->GetHeight();
+  const uint64_t frame_interval = decoders.front()->GetFrameInterval();
+  std::cerr << path << ": " << segments.size() << " segments, " << worker_count << " workers, " <<
+      frame_width << 'x' << frame_height << std::endl;
+
+  std::vector<SegmentResult> results(segments.size());
+  std::vector<WorkerStatistics> worker_statistics(worker_count);
+  std::atomic<size_t> next_segment(0);
+  std::mutex result_mutex;
+  std::condition_variable result_condition;
+
+  const auto process_cpu_start = GetCpuTime(CLOCK_PROCESS_CPUTIME_ID);
+  const auto start = Clock::now();
+
+  // Segments are taken in file order, so the ones the writer waits for finish first
+  std::vector<std::thread> workers;
+  for (unsigned int i = 0; i != worker_count; i++) {
+    workers.emplace_back([&, i]() {
+      SegmentDecoder &decoder = *decoders[i];
+      MTCNN &mtcnn = *detectors[i];
+      WorkerStatistics &statistics = worker_statistics[i];
+
+      for (size_t index; (index = next_segment++) < segments.size(); ) {
+        const auto segment_start = Clock::now();
+        SegmentResult result;
+        try {
+          result.decoded_frames = decoder.Decode(segments[index], [&](uint64_t timestamp, const uint8_t *rgb) {
+            if (!IsFirstInPeriod(timestamp, frame_interval, fps))
+              return;
+            ncnn::Mat image = ncnn::Mat::from_pixels(rgb, ncnn::Mat::PIXEL_RGB, static_cast<int>(frame_width),
+                static_cast<int>(frame_height));
+            result.frames.push_back(FrameResult{timestamp, {}});
+            mtcnn.detect(image, result.frames.back().boxes);
+          });
+          // Decoders deliver frames in presentation order, but nothing relies on it
+          std::stable_sort(result.frames.begin(), result.frames.end(),
+              [](const FrameResult &a, const FrameResult &b) { return a.timestamp < b.timestamp; });
+        } catch (const std::exception &e) {
+          result.error = e.what();
+        }
+        statistics.segments++;
+        statistics.busy_time += Clock::now() - segment_start;
+
+        std::lock_guard<std::mutex> lock(result_mutex);
+        results[index] = std::move(result);
+        results[index].done = true;
+        result_condition.notify_one();
+      }
+
+      statistics.cpu_time = GetCpuTime(CLOCK_THREAD_CPUTIME_ID);
+    });
+  }
+
+  // Merge: write each segment once it and every segment before it are done
+  size_t frame_count = 0, decoded_count = 0, face_count = 0;
+  std::string error;
+  bool output_failed = false;
+  {
+    MetadataSink sink(output, format);
+    for (size_t index = 0; index != results.size(); index++) {
+      SegmentResult result;
+      {
+        std::unique_lock<std::mutex> lock(result_mutex);
+        result_condition.wait(lock, [&]() { return results[index].done; });
+        result = std::move(results[index]);
+      }
+      if (!result.error.empty() && error.empty())
+        error = result.error;
+      decoded_count += result.decoded_frames;
+      for (const auto &frame : result.frames) {
+        sink.PushFrame(static_cast<unsigned int>(frame_count++), frame.timestamp, frame.boxes);
+        face_count += frame.boxes.size();
+      }
+    }
+    output_failed = !sink.Flush();
+  }
+
+  for (auto &worker : workers)
+    worker.join();
+
+  const double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+  const auto process_cpu_time = GetCpuTime(CLOCK_PROCESS_CPUTIME_ID) - process_cpu_start;
+  output.flush();
+
+  if (!error.empty()) {
+    std::cerr << "Failed to process a segment: " << error << std::endl;
+    return EXIT_FAILURE;
+  }
+  if (output_failed || !output) {
+    std::cerr << "Failed to write the output" << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  // Busy time summed over the workers is about what one serial pass would take
+  std::chrono::nanoseconds busy_time(0);
+  for (const auto &statistics : worker_statistics)
+    busy_time += statistics.busy_time;
+  const double busy_seconds = std::chrono::duration<double>(busy_time).count();
+
+  std::cerr << "Frames:    " << decoded_count << " decoded, " << frame_count << " detected, " << face_count <<
+      " faces" << std::endl <<
+      "Elapsed:   " << std::fixed << std::setprecision(2) << seconds << "s, " <<
+      (seconds > 0 ? decoded_count / seconds : 0.0) << " frames/s" << std::endl <<
+      "Workers:   " << busy_seconds << "s busy in total, " << (seconds > 0 ? busy_seconds / seconds : 0.0) <<
+      "x parallel, " << std::chrono::duration<double>(process_cpu_time).count() << "s CPU" << std::endl;
+  for (unsigned int i = 0; i != worker_count; i++) {
+    std::cerr << "  worker " << std::left << std::setw(4) << i << std::right << std::setw(4) <<
+        worker_statistics[i].segments << " segments" << std::setw(10) <<
+        std::chrono::duration<double>(worker_statistics[i].busy_time).count() << "s busy" << std::setw(10) <<
+        std::chrono::duration<double>(worker_statistics[i].cpu_time).count() << "s CPU" << std::endl;
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,306 @@
+/**
+ * @file      output_bench.cpp
+ * @copyright UDP Technology Ltd.
+ * @~english
+ * @brief     Compares the pipe and shared-memory video outputs
+ *
+ * Pushes paced NV12 frames to a consumer process through @c SubprocessOutput
+ * and through @c ShmOutput, and reports the producer's cost per push, the
+ * consumer's CPU time per frame and the latency from push to the consumer
+ * having touched every cache line of the luma plane. The consumer is this
+ * program, started again in a consumer mode.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "shm_output.hpp"
+#include "shm_reader.hpp"
+#include "subprocess_output.hpp"
+
+using Clock = std::chrono::steady_clock;
+
+static const char SelfPath[] = "/proc/self/exe";
+
+struct Result {
+  std::string transport;
+  unsigned long frames;
+  double push_p50_us, push_p99_us;
+  double push_cpu_us;
+  unsigned long consumer_frames;
+  double consumer_cpu_us;
+  double latency_p50_ms, latency_p99_ms, latency_max_ms;
+};
+
+static uint64_t NowNs() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now().time_since_epoch()).count();
+}
+
+static double CpuUs(clockid_t clock) {
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+  return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static double Percentile(std::vector<double> values, double p) {
+  if (values.empty())
+    return 0.0;
+  std::sort(values.begin(), values.end());
+  const size_t rank = static_cast<size_t>(p / 100.0 * values.size() + 0.5);
+  return values[std::min(std::max<size_t>(rank, 1), values.size()) - 1];
+}
+
+// Reads every cache line of the luma plane, as any real consumer would
+static unsigned int Touch(const uint8_t *data, size_t size) {
+  unsigned int sum = 0;
+  for (size_t i = 0; i < size; i += 64)
+    sum += data[i];
+  return sum;
+}
+
+static void WriteConsumerResult(const std::string &path, const std::vector<double> &latencies_ms) {
+  std::ofstream file(path);
+  file << latencies_ms.size() << ' ' << CpuUs(CLOCK_PROCESS_CPUTIME_ID) << ' ' << Percentile(latencies_ms, 50) <<
+      ' ' << Percentile(latencies_ms, 99) << ' ' << Percentile(latencies_ms, 100) << std::endl;
+}
+
+static void ReadConsumerResult(const std::string &path, Result &result) {
+  std::ifstream file(path);
+  double cpu_us = 0;
+  result.consumer_frames = 0;
+  file >> result.consumer_frames >> cpu_us >> result.latency_p50_ms >> result.latency_p99_ms >> result.latency_max_ms;
+  result.consumer_cpu_us = result.consumer_frames ? cpu_us / result.consumer_frames : 0.0;
+  std::remove(path.c_str());
+}
+
+static int ConsumePipe(size_t frame_size, const std::string &result_path) {
+  std::vector<uint8_t> frame(frame_size);
+  std::vector<double> latencies_ms;
+  volatile unsigned int sink = 0;
+  while (true) {
+    size_t filled = 0;
+    while (filled < frame_size) {
+      const ssize_t n = read(STDIN_FILENO, frame.data() + filled, frame_size - filled);
+      if (n <= 0)
+        break;
+      filled += static_cast<size_t>(n);
+    }
+    if (filled < frame_size)
+      break;
+
+    sink += Touch(frame.data(), frame_size * 2 / 3);
+    uint64_t stamp;
+    std::memcpy(&stamp, frame.data(), sizeof(stamp));
+    latencies_ms.push_back((NowNs() - stamp) / 1e6);
+  }
+  WriteConsumerResult(result_path, latencies_ms);
+  return EXIT_SUCCESS;
+}
+
+static int ConsumeShm(const std::string &name, const std::string &result_path) {
+  ShmReader reader(name);
+  std::vector<double> latencies_ms;
+  volatile unsigned int sink = 0;
+  ShmReader::Frame frame;
+  while (true) {
+    const ShmReader::Result status = reader.Acquire(frame, std::chrono::seconds(5));
+    if (status != ShmReader::Result::Frame)
+      break;
+    sink += Touch(frame.data, reader.GetFrameSize() * 2 / 3);
+    if (reader.Release(frame))
+      latencies_ms.push_back((NowNs() - frame.timestamp) / 1e6);
+  }
+  WriteConsumerResult(result_path, latencies_ms);
+  return EXIT_SUCCESS;
+}
+
+static std::vector<std::vector<uint8_t>> MakeFrames(unsigned int width, unsigned int height) {
+  std::vector<std::vector<uint8_t>> frames(2, std::vector<uint8_t>(3 * width * height / 2));
+  for (size_t f = 0; f != frames.size(); f++) {
+    for (size_t i = 0; i != frames[f].size(); i++)
+      frames[f][i] = static_cast<uint8_t>(i * 7 + f * 31);
+  }
+  return frames;
+}
+
+static Result RunPipe(unsigned int width, unsigned int height, double fps, unsigned long frame_count) {
+  auto frames = MakeFrames(width, height);
+  const std::string result_path = "/tmp/mtcnn_output_bench_pipe." + std::to_string(getpid());
+
+  Result result;
+  result.transport = "pipe";
+  result.frames = frame_count;
+  std::vector<double> push_us;
+  double push_cpu_us = 0;
+  {
+    SubprocessOutput output(width, height, SelfPath,
+        {"--consume-pipe", std::to_string(frames[0].size()), result_path});
+    const auto period = std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(1.0 / fps));
+    const auto start = Clock::now();
+    for (unsigned long i = 0; i != frame_count; i++) {
+      std::this_thread::sleep_until(start + i * period);
+      std::vector<uint8_t> &frame = frames[i % frames.size()];
+      const uint64_t stamp = NowNs();
+      std::memcpy(frame.data(), &stamp, sizeof(stamp));
+
+      const double cpu_begin = CpuUs(CLOCK_THREAD_CPUTIME_ID);
+      const auto begin = Clock::now();
+      output.PushFrame(frame.data());
+      push_us.push_back(std::chrono::duration<double, std::micro>(Clock::now() - begin).count());
+      push_cpu_us += CpuUs(CLOCK_THREAD_CPUTIME_ID) - cpu_begin;
+    }
+  }
+
+  result.push_p50_us = Percentile(push_us, 50);
+  result.push_p99_us = Percentile(push_us, 99);
+  result.push_cpu_us = push_cpu_us / frame_count;
+  ReadConsumerResult(result_path, result);
+  return result;
+}
+
+static Result RunShm(unsigned int width, unsigned int height, double fps, unsigned long frame_count,
+    unsigned int slots) {
+  const auto frames = MakeFrames(width, height);
+  const std::string name = "/mtcnn_output_bench." + std::to_string(getpid());
+  const std::string result_path = "/tmp/mtcnn_output_bench_shm." + std::to_string(getpid());
+
+  Result result;
+  result.transport = "shm";
+  result.frames = frame_count;
+  std::vector<double> push_us;
+  double push_cpu_us = 0;
+  int pid;
+  {
+    ShmOutput output(width, height, name, slots);
+    pid = fork();
+    if (pid == 0) {
+      execl(SelfPath, SelfPath, "--consume-shm", name.c_str(), result_path.c_str(), static_cast<char*>(nullptr));
+      _exit(EXIT_FAILURE);
+    }
+
+    // Frames pushed before the consumer attaches would be missed
+    const auto attach_deadline = Clock::now() + std::chrono::seconds(5);
+    while (output.GetReaderCount() == 0 && Clock::now() < attach_deadline)
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+    const auto period = std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(1.0 / fps));
+    const auto start = Clock::now();
+    const std::vector<Bbox> no_faces;
+    for (unsigned long i = 0; i != frame_count; i++) {
+      std::this_thread::sleep_until(start + i * period);
+      const std::vector<uint8_t> &frame = frames[i % frames.size()];
+      const uint64_t stamp = NowNs();
+
+      // The copy into the slot is the push, as the pipe's copy into the kernel is
+      const double cpu_begin = CpuUs(CLOCK_THREAD_CPUTIME_ID);
+      const auto begin = Clock::now();
+      std::memcpy(output.BeginFrame(), frame.data(), frame.size());
+      output.CommitFrame(static_cast<unsigned int>(i), stamp, no_faces);
+      push_us.push_back(std::chrono::duration<double, std::micro>(Clock::now() - begin).count());
+      push_cpu_us += CpuUs(CLOCK_THREAD_CPUTIME_ID) - cpu_begin;
+    }
+  }
+  int status;
+  waitpid(pid, &status, 0);
+
+  result.push_p50_us = Percentile(push_us, 50);
+  result.push_p99_us = Percentile(push_us, 99);
+  result.push_cpu_us = push_cpu_us / frame_count;
+  ReadConsumerResult(result_path, result);
+  return result;
+}
+
+static void Usage(std::ostream &o, const char *argv0) {
+  o << "Usage: " << argv0 << " [OPTIONS...]\n"
+    "\n"
+    "Compares pushing NV12 frames to another process through a pipe and\n"
+    "through the shared-memory frame ring\n"
+    "\n"
+    "Options:\n"
+    "  -s,--size WxH      Frame size (default: 1920x1080)\n"
+    "  --fps N            Frames pushed per second (default: 30)\n"
+    "  --frames N         Frames pushed per transport (default: 300)\n"
+    "  --slots N          Slots of the shared-memory ring (default: 8)\n"
+    "\n";
+}
+
+int main(int argc, const char *const *const argv) {
+  // Consumer modes, started by the benchmark itself
+  if (argc == 4 && std::strcmp(argv[1], "--consume-pipe") == 0)
+    return ConsumePipe(std::stoul(argv[2]), argv[3]);
+  if (argc == 4 && std::strcmp(argv[1], "--consume-shm") == 0) {
+    try {
+      return ConsumeShm(argv[2], argv[3]);
+    } catch (const std::exception &e) {
+      std::cerr << e.what() << std::endl;
+      return EXIT_FAILURE;
+    }
+  }
+
+  unsigned int width = 1920, height = 1080, slots = 8;
+  double fps = 30.0;
+  unsigned long frame_count = 300;
+  for (int arg = 1; arg != argc; arg++) {
+    if (std::strcmp(argv[arg], "-h") == 0 || std::strcmp(argv[arg], "--help") == 0) {
+      Usage(std::cout, argv[0]);
+      return EXIT_SUCCESS;
+    } else if ((std::strcmp(argv[arg], "-s") == 0 || std::strcmp(argv[arg], "--size") == 0) && arg + 1 != argc) {
+      if (std::sscanf(argv[++arg], "%ux%u", &width, &height) != 2) {
+        std::cerr << "Failed to parse size: " << argv[arg] << std::endl;
+        return EXIT_FAILURE;
+      }
+    } else if (std::strcmp(argv[arg], "--fps") == 0 && arg + 1 != argc) {
+      if (std::sscanf(argv[++arg], "%lf", &fps) != 1 || fps <= 0) {
+        std::cerr << "Failed to parse frame rate: " << argv[arg] << std::endl;
+        return EXIT_FAILURE;
+      }
+    } else if (std::strcmp(argv[arg], "--frames") == 0 && arg + 1 != argc) {
+      if (std::sscanf(argv[++arg], "%lu", &frame_count) != 1 || frame_count == 0) {
+        std::cerr << "Failed to parse frame count: " << argv[arg] << std::endl;
+        return EXIT_FAILURE;
+      }
+    } else if (std::strcmp(argv[arg], "--slots") == 0 && arg + 1 != argc) {
+      if (std::sscanf(argv[++arg], "%u", &slots) != 1) {
+        std::cerr << "Failed to parse slot count: " << argv[arg] << std::endl;
+        return EXIT_FAILURE;
+      }
+    } else {
+      std::cerr << "Unexpected option: " << argv[arg] << std::endl;
+      Usage(std::cerr, argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  std::vector<Result> results;
+  try {
+    results.push_back(RunPipe(width, height, fps, frame_count));
+    results.push_back(RunShm(width, height, fps, frame_count, slots));
+  } catch (const std::exception &e) {
+    std::cerr << e.what() << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  std::cout << width << 'x' << height << " at " << fps << " fps, " << frame_count << " frames" << std::endl <<
+      "Transport  push p50  push p99  push CPU  read CPU  latency p50  p99      max      received" << std::endl <<
+      "           (us)      (us)      (us/fr)   (us/fr)   (ms)" << std::endl;
+  for (const Result &r : results) {
+    std::cout << std::left << std::setw(9) << r.transport << std::right << std::fixed << std::setprecision(1) <<
+        std::setw(10) << r.push_p50_us << std::setw(10) << r.push_p99_us << std::setw(10) << r.push_cpu_us <<
+        std::setw(10) << r.consumer_cpu_us << std::setprecision(2) << std::setw(13) << r.latency_p50_ms <<
+        std::setw(9) << r.latency_p99_ms << std::setw(9) << r.latency_max_ms << std::setw(10) <<
+        r.consumer_frames << std::endl;
+  }
+  return EXIT_SUCCESS;
+}
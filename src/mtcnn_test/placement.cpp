@@ -0,0 +1,58 @@
+/**
+ * @internal
+ * @file       placement.cpp
+ * @copyright  VCA Technology
+ * @~english
+ * @brief      Implementation of the @c Placement struct.
+ */
+
+#include <sstream>
+
+#include "placement.hpp"
+
+bool Placement::IsPolicy(const std::string &policy) {
+  return policy == "none" || policy == "big" || policy == "little" || policy == "split";
+}
+
+bool Placement::FromPolicy(const std::string &policy, const CpuTopology &topology, Placement &placement) {
+  if (!IsPolicy(policy))
+    return false;
+
+  placement = Placement();
+  if (policy == "big") {
+    placement.pnet = placement.refine = placement.decode = placement.output = topology.Big();
+  } else if (policy == "little") {
+    placement.pnet = placement.refine = placement.decode = placement.output = topology.Little();
+  } else if (policy == "split") {
+    placement.pnet = topology.Big();
+    placement.refine = placement.decode = placement.output = topology.Little();
+  }
+  return true;
+}
+
+std::string Placement::Describe() const {
+  const auto format = [](const std::vector<int> &cpus) {
+    return cpus.empty() ? std::string("any") : FormatCpuList(cpus);
+  };
+  std::ostringstream ss;
+  ss << "pnet " << format(pnet) << ", refine " << format(refine) << ", decode " << format(decode) <<
+      ", output " << format(output);
+  return ss.str();
+}
+
+void CreateOn(const std::vector<int> &cpus, const std::function<void()> &create) {
+  if (cpus.empty()) {
+    create();
+    return;
+  }
+
+  const std::vector<int> previous = GetThreadAffinity();
+  SetThreadAffinity(cpus);
+  try {
+    create();
+  } catch (...) {
+    SetThreadAffinity(previous);
+    throw;
+  }
+  SetThreadAffinity(previous);
+}
@@ -0,0 +1,47 @@
+#pragma once
+/**
+ * @internal
+ * @file       placement.hpp
+ * @copyright  VCA Technology
+ * @~english
+ * @brief      Declaration of the @c Placement struct.
+ */
+
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "cpu_topology.h"
+
+/**
+ * The CPUs each part of the pipeline runs on; an empty set runs anywhere.
+ *
+ * The named policies cover the usual choices on a big.LITTLE board:
+ *  - none: leave everything to the scheduler.
+ *  - big, little: run everything on one cluster.
+ *  - split: P-Net, whose large feature maps gain most from the wide cores, on
+ *    the big cluster; the many small R-Net and O-Net passes, decoding and the
+ *    output writers on the LITTLE cluster.
+ */
+struct Placement {
+  std::vector<int> pnet;
+  std::vector<int> refine;  ///< R-Net and O-Net
+  std::vector<int> decode;
+  std::vector<int> output;
+
+  /// Returns false if the policy name is unknown.
+  static bool FromPolicy(const std::string &policy, const CpuTopology &topology, Placement &placement);
+
+  /// Whether the policy name is known.
+  static bool IsPolicy(const std::string &policy);
+
+  /// For example "pnet 4-5, refine 0-3, decode 0-3, output 0-3".
+  std::string Describe() const;
+};
+
+/**
+ * Runs @p create on @p cpus and moves the calling thread back afterwards.
+ * Threads inherit the affinity of the thread that starts them, so this places
+ * the worker threads of decoders and writers started by @p create.
+ */
+void CreateOn(const std::vector<int> &cpus, const std::function<void()> &create);
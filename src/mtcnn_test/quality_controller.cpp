@@ -0,0 +1,152 @@
+/**
+ * @internal
+ * @file       quality_controller.cpp
+ * @copyright  VCA Technology
+ * @~english
+ * @brief      Implementation of the @c QualityController class.
+ */
+
+#include <algorithm>
+
+#include "quality_controller.hpp"
+
+// Consecutive detections over budget before stepping down, and well under
+// budget before stepping back up; stepping up is slower so a level that only
+// just fits isn't left and re-entered every few frames
+static const unsigned int DegradeAfter = 5;
+static const unsigned int UpgradeAfter = 30;
+static const double UpgradeLoad = 0.6;
+
+// Weight of the newest latency in the moving average
+static const double AverageWeight = 0.2;
+
+static const char* ModeName(DetectMode mode) {
+  switch (mode) {
+  case DETECT_PNET:
+    return "pnet";
+  case DETECT_RNET:
+    return "rnet";
+  default:
+    return "full";
+  }
+}
+
+QualityController::Options::Options() :
+  target_fps(15.0),
+  cpu_budget(0.8),
+  min_face(40),
+  mode(DETECT_FULL),
+  idle_after(std::chrono::seconds(10)),
+  idle_stride(5) {
+}
+
+QualityController::QualityController(const Options &options, std::ostream &log) :
+  options_(options),
+  log_(log),
+  budget_ms_(1000.0 * options.cpu_budget / options.target_fps),
+  level_(0),
+  idle_(false),
+  average_ms_(-1.0),
+  over_count_(0),
+  under_count_(0),
+  started_(false) {
+  // Each level is cheaper than the one before; the minimum face goes first
+  // since it prunes the largest, most expensive pyramid levels
+  struct Level {
+    float min_face;
+    float scale_factor;
+    unsigned int frame_stride;
+    DetectMode mode;
+  };
+  static const Level levels[] = {
+    {1.0f, 0.709f, 1, DETECT_FULL},
+    {1.5f, 0.709f, 1, DETECT_FULL},
+    {1.5f, 0.6f, 1, DETECT_FULL},
+    {2.0f, 0.6f, 1, DETECT_RNET},
+    {2.0f, 0.6f, 2, DETECT_RNET},
+    {2.5f, 0.5f, 2, DETECT_RNET},
+    {3.0f, 0.5f, 3, DETECT_RNET},
+  };
+  for (const Level &level : levels) {
+    Settings settings;
+    settings.min_face = static_cast<unsigned int>(options_.min_face * level.min_face);
+    settings.scale_factor = level.scale_factor;
+    settings.frame_stride = level.frame_stride;
+    settings.mode = std::min(options_.mode, level.mode);
+    ladder_.push_back(settings);
+  }
+  settings_ = ladder_[0];
+}
+
+bool QualityController::ShouldDetect(unsigned int frame_index) const {
+  return frame_index % settings_.frame_stride == 0;
+}
+
+bool QualityController::Update(std::chrono::nanoseconds detect_time, size_t face_count,
+    std::chrono::steady_clock::time_point now) {
+  if (!started_) {
+    last_face_ = now;
+    started_ = true;
+  }
+
+  const double ms = std::chrono::duration<double, std::milli>(detect_time).count();
+  average_ms_ = average_ms_ < 0 ? ms : AverageWeight * ms + (1.0 - AverageWeight) * average_ms_;
+
+  if (face_count != 0) {
+    last_face_ = now;
+    if (idle_) {
+      idle_ = false;
+      settings_ = ladder_[level_];
+      Change("face seen, leaving idle");
+      return true;
+    }
+  } else if (!idle_ && options_.idle_after.count() != 0 && now - last_face_ >= options_.idle_after) {
+    idle_ = true;
+    settings_.frame_stride = std::max(settings_.frame_stride, options_.idle_stride);
+    settings_.mode = std::min(settings_.mode, DETECT_RNET);
+    Change("no faces seen, idling");
+    return true;
+  }
+
+  // Idle latency says little about what a busy scene would cost
+  if (idle_)
+    return false;
+
+  // Skipped frames leave their share of the budget to the detected ones
+  const double load = average_ms_ / (budget_ms_ * settings_.frame_stride);
+  if (load > 1.0) {
+    under_count_ = 0;
+    if (++over_count_ >= DegradeAfter && level_ + 1 < ladder_.size()) {
+      settings_ = ladder_[++level_];
+      Change("over budget");
+      return true;
+    }
+  } else if (load < UpgradeLoad) {
+    over_count_ = 0;
+    if (++under_count_ >= UpgradeAfter && level_ != 0) {
+      settings_ = ladder_[--level_];
+      Change("under budget");
+      return true;
+    }
+  } else {
+    over_count_ = under_count_ = 0;
+  }
+  return false;
+}
+
+void QualityController::Apply(MTCNN &mtcnn) const {
+  mtcnn.SetMinFace(static_cast<int>(settings_.min_face));
+  mtcnn.SetScaleFactor(settings_.scale_factor);
+  mtcnn.SetDetectMode(settings_.mode);
+}
+
+void QualityController::Change(const char *reason) {
+  log_ << "Quality: level " << level_ << (idle_ ? " idle" : "") << " (" << reason << ", detect " <<
+      average_ms_ << "ms, budget " << budget_ms_ << "ms): min face " << settings_.min_face << ", scale factor " <<
+      settings_.scale_factor << ", stride " << settings_.frame_stride << ", mode " << ModeName(settings_.mode) <<
+      std::endl;
+
+  // Latencies measured under the old settings don't count towards the new ones
+  over_count_ = under_count_ = 0;
+  average_ms_ = -1.0;
+}
@@ -0,0 +1,86 @@
+#pragma once
+/**
+ * @internal
+ * @file       quality_controller.hpp
+ * @copyright  VCA Technology
+ * @~english
+ * @brief      Declaration of the @c QualityController class.
+ */
+
+#include <chrono>
+#include <cstddef>
+#include <ostream>
+#include <vector>
+
+#include "mtcnn.h"
+
+/**
+ * Holds detection within a per-frame time budget by trading quality for speed.
+ *
+ * The controller keeps a smoothed detect() latency and steps along a fixed
+ * ladder of settings, each cheaper than the last: a larger minimum face, a
+ * coarser pyramid, detecting only every Nth analytics frame, and stopping
+ * after R-Net. It steps down after the budget has been exceeded for several
+ * frames in a row and back up only after a long run well under budget, so it
+ * doesn't oscillate around the threshold. When no face has been seen for a
+ * while it drops into an idle mode that only scans occasional frames, and
+ * leaves it as soon as a face appears. Every change is logged.
+ */
+class QualityController final {
+ public:
+  struct Settings {
+    unsigned int min_face;
+    float scale_factor;
+    unsigned int frame_stride;  ///< Detect on one analytics frame in this many
+    DetectMode mode;
+  };
+
+  struct Options {
+    Options();
+
+    double target_fps;                      ///< Analytics frames to keep up with
+    double cpu_budget;                      ///< Fraction of each frame interval detection may use
+    unsigned int min_face;                  ///< Minimum face size at full quality
+    DetectMode mode;                        ///< Detection mode at full quality
+    std::chrono::milliseconds idle_after;   ///< Time without faces before idling, 0 to never idle
+    unsigned int idle_stride;               ///< Frame stride while idle
+  };
+
+ public:
+  QualityController(const Options &options, std::ostream &log);
+
+  /// Whether the analytics frame with this index should be detected on.
+  bool ShouldDetect(unsigned int frame_index) const;
+
+  /**
+   * Records one detection. Returns true if the settings changed, in which case
+   * they must be applied to the detector before the next frame.
+   */
+  bool Update(std::chrono::nanoseconds detect_time, size_t face_count,
+      std::chrono::steady_clock::time_point now);
+
+  const Settings& GetSettings() const { return settings_; }
+
+  /// Applies the current settings to a detector.
+  void Apply(MTCNN &mtcnn) const;
+
+  unsigned int GetLevel() const { return level_; }
+  bool IsIdle() const { return idle_; }
+
+ private:
+  void Change(const char *reason);
+
+ private:
+  const Options options_;
+  std::ostream &log_;
+  const double budget_ms_;
+  std::vector<Settings> ladder_;
+
+  Settings settings_;
+  unsigned int level_;
+  bool idle_;
+  double average_ms_;
+  unsigned int over_count_, under_count_;
+  std::chrono::steady_clock::time_point last_face_;
+  bool started_;
+};
@@ -0,0 +1,151 @@
+/**
+ * @internal
+ * @file       replay_input.cpp
+ * @copyright  VCA Technology
+ * @~english
+ * @brief      Implementation of the @c ReplayInput class.
+ */
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <vca/media/four_cc.hpp>
+
+#include "replay_input.hpp"
+
+ReplayInput::ReplayInput(const std::string &uri) :
+  path_(),
+  original_timing_(false),
+  loop_count_(1),
+  mapping_size_(0),
+  mapping_(nullptr),
+  header_(nullptr),
+  index_(nullptr),
+  next_(0),
+  loop_duration_(0),
+  start_time_() {
+  const size_t query = uri.find('?');
+  path_ = uri.substr(0, query);
+  if (query != std::string::npos)
+    ParseOptions(uri.substr(query + 1));
+
+  const int fd = open(path_.c_str(), O_RDONLY);
+  if (fd < 0) {
+    std::ostringstream ss;
+    ss << "Could not open '" << path_ << "': " << std::strerror(errno);
+    throw std::runtime_error(ss.str());
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(FrameStoreHeader)) {
+    close(fd);
+    throw std::runtime_error("'" + path_ + "' is not a frame store");
+  }
+  mapping_size_ = static_cast<size_t>(st.st_size);
+
+  // Private and writable, so a consumer drawing on a frame gets its own copy of the page
+  void *const mapping = mmap(nullptr, mapping_size_, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED)
+    throw std::runtime_error("Failed to map '" + path_ + "'");
+  mapping_ = static_cast<uint8_t*>(mapping);
+  header_ = reinterpret_cast<const FrameStoreHeader*>(mapping_);
+
+  const bool valid = header_->magic == FrameStoreMagic && header_->version == FrameStoreVersion &&
+      header_->index_offset != 0 && header_->frame_count != 0 &&
+      header_->data_offset + header_->frame_count * header_->frame_stride <= header_->index_offset &&
+      header_->index_offset + header_->frame_count * sizeof(FrameStoreEntry) <= mapping_size_ &&
+      header_->frame_size == (header_->width * header_->height * 3) / 2 &&
+      header_->frame_size <= header_->frame_stride;
+  if (!valid) {
+    munmap(mapping_, mapping_size_);
+    throw std::runtime_error("'" + path_ + "' is not a complete frame store of this version");
+  }
+  index_ = reinterpret_cast<const FrameStoreEntry*>(mapping_ + header_->index_offset);
+
+  // Each loop continues one frame interval after the last recorded frame
+  const uint64_t frame_interval = header_->frame_rate_num ?
+      1000000000ULL * header_->frame_rate_den / header_->frame_rate_num : 0;
+  loop_duration_ = index_[header_->frame_count - 1].timestamp - index_[0].timestamp + frame_interval;
+
+  madvise(mapping_ + header_->data_offset, header_->frame_count * header_->frame_stride, MADV_SEQUENTIAL);
+}
+
+ReplayInput::~ReplayInput() {
+  munmap(mapping_, mapping_size_);
+}
+
+vca::core::video::Formats ReplayInput::GetInputFormats() const {
+  const vca::media::FrameRate frame_rate = {header_->frame_rate_num, header_->frame_rate_den};
+  return vca::core::video::Formats{
+      vca::core::video::Format{vca::media::four_cc::FourCcs::NV12, frame_rate, header_->width, header_->height}
+    };
+}
+
+vca::core::video::Formats ReplayInput::GetOutputFormats() const {
+  return vca::core::video::Formats{};
+}
+
+bool ReplayInput::ReadFrame(Frame &frame) {
+  frame.Release();
+
+  if (loop_count_ && next_ == loop_count_ * header_->frame_count)
+    return false;
+
+  const uint64_t loop = next_ / header_->frame_count;
+  const uint64_t n = next_ % header_->frame_count;
+  const FrameStoreEntry &entry = index_[n];
+  frame.timestamp = entry.timestamp + loop * loop_duration_;
+
+  if (original_timing_) {
+    if (next_ == 0)
+      start_time_ = std::chrono::steady_clock::now();
+    std::this_thread::sleep_until(start_time_ + std::chrono::nanoseconds(frame.timestamp - index_[0].timestamp));
+  }
+
+  // Frames stay mapped for the life of the input, so there is nothing to release
+  uint8_t *const data = mapping_ + header_->data_offset + n * header_->frame_stride;
+  frame.input_buffers.push_back(vca::core::video::Buffer{header_->frame_size, data, 1,
+      {vca::core::video::Buffer::Plane{header_->frame_size, 0, static_cast<ptrdiff_t>(header_->width)}}, {}});
+
+  next_++;
+  return true;
+}
+
+VideoInput::Statistics ReplayInput::GetStatistics() const {
+  return Statistics{next_, next_, 0};
+}
+
+void ReplayInput::ParseOptions(const std::string &options) {
+  std::istringstream ss(options);
+  std::string option;
+  while (std::getline(ss, option, '&')) {
+    if (option.empty())
+      continue;
+
+    const size_t equals = option.find('=');
+    const std::string key = option.substr(0, equals);
+    const std::string value = equals == std::string::npos ? std::string() : option.substr(equals + 1);
+
+    if (key == "timing" && (value == "fast" || value == "original")) {
+      original_timing_ = value == "original";
+    } else if (key == "loop") {
+      char *end;
+      const unsigned long count = std::strtoul(value.c_str(), &end, 10);
+      if (value.empty() || *end)
+        throw std::runtime_error("Failed to parse replay option: " + option);
+      loop_count_ = static_cast<unsigned int>(count);
+    } else {
+      throw std::runtime_error("Unsupported replay option: " + option);
+    }
+  }
+}
@@ -0,0 +1,63 @@
+#pragma once
+/**
+ * @internal
+ * @file       replay_input.hpp
+ * @copyright  VCA Technology
+ * @~english
+ * @brief      Declaration of the @c ReplayInput class.
+ */
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include "frame_store.hpp"
+#include "video_input.hpp"
+
+/**
+ * Replays the analytics frames of a frame store recorded with
+ * @c FrameStoreWriter. The file is mapped and frames are handed out in place,
+ * so reading a frame costs no decode and no copy.
+ *
+ * Configured with a URI of the form replay://FILE?timing={fast,original}&loop=N
+ * where the query is optional. By default frames are delivered as fast as they
+ * are read, once; original timing paces them by their recorded timestamps and
+ * loop=0 repeats the recording until the consumer stops.
+ * Buffers are mapped copy-on-write, so consumers may draw on them.
+ */
+class ReplayInput final : public VideoInput {
+ public:
+  ReplayInput(const std::string &uri);
+
+  ~ReplayInput();
+
+  vca::core::video::Formats GetInputFormats() const;
+
+  vca::core::video::Formats GetOutputFormats() const;
+
+  bool ReadFrame(Frame &frame);
+
+  Statistics GetStatistics() const;
+
+ private:
+  void ParseOptions(const std::string &options);
+
+ private:
+  ReplayInput(const ReplayInput&) = delete;
+  ReplayInput& operator=(const ReplayInput&) = delete;
+
+ private:
+  std::string path_;
+  bool original_timing_;
+  unsigned int loop_count_;
+
+  size_t mapping_size_;
+  uint8_t *mapping_;
+  const FrameStoreHeader *header_;
+  const FrameStoreEntry *index_;
+
+  uint64_t next_;                 ///< Frames read so far, across loops
+  uint64_t loop_duration_;        ///< Added to timestamps on each loop
+  std::chrono::steady_clock::time_point start_time_;
+};
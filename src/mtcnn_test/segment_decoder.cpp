@@ -0,0 +1,237 @@
+/**
+ * @internal
+ * @file       segment_decoder.cpp
+ * @copyright  VCA Technology
+ * @~english
+ * @brief      Implementation of the @c SegmentDecoder class.
+ */
+
+#include <algorithm>
+#include <limits>
+#include <sstream>
+#include <stdexcept>
+
+#include "ffmpeg_common.hpp"
+#include "segment_decoder.hpp"
+
+SegmentDecoder::SegmentDecoder(const std::string &path, unsigned int scaled_width, unsigned int scaled_height) :
+  format_context_(nullptr),
+  stream_index_(-1),
+  codec_context_(nullptr),
+  frame_(nullptr),
+  scaled_width_(scaled_width),
+  scaled_height_(scaled_height),
+  scale_context_(nullptr),
+  rgb_() {
+  int ret = avformat_open_input(&format_context_, path.c_str(), NULL, NULL);
+  if (ret < 0) {
+    std::ostringstream ss;
+    ss << "Could not open '" << path << "'" << std::endl << AvErrorAsString(ret) << std::endl;
+    throw std::runtime_error(ss.str());
+  }
+
+  if (avformat_find_stream_info(format_context_, NULL) < 0)
+    throw std::runtime_error("Could not find stream information");
+
+  stream_index_ = av_find_best_stream(format_context_, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+  if (stream_index_ < 0) {
+    std::ostringstream ss;
+    ss << "Could not find video stream in input file '" << path << "'" << std::endl;
+    throw std::runtime_error(ss.str());
+  }
+
+  const AVStream *const stream = format_context_->streams[stream_index_];
+  const AVCodec *const codec = avcodec_find_decoder(stream->codecpar->codec_id);
+  if (!codec)
+    throw std::runtime_error("Codec not found");
+
+  codec_context_ = avcodec_alloc_context3(codec);
+  if (!codec_context_)
+    throw std::runtime_error("Failed to allocate video codec context");
+
+  if (avcodec_parameters_to_context(codec_context_, stream->codecpar) < 0)
+    throw std::runtime_error("Failed to copy video codec parameters to decoder context");
+
+  // Segments are decoded side by side, so each decoder keeps to one thread
+  codec_context_->thread_count = 1;
+
+  if (avcodec_open2(codec_context_, codec, NULL) < 0)
+    throw std::runtime_error("Failed to open codec");
+
+  frame_ = av_frame_alloc();
+  if (!frame_)
+    throw std::runtime_error("Failed to allocate video frame");
+
+  av_init_packet(&packet_);
+  packet_.data = nullptr;
+  packet_.size = 0;
+
+  if (scaled_width_ == 0 || scaled_height_ == 0) {
+    scaled_width_ = static_cast<unsigned int>(codec_context_->width);
+    scaled_height_ = static_cast<unsigned int>(codec_context_->height);
+  }
+  if (scaled_width_ == 0 || scaled_height_ == 0)
+    throw std::runtime_error("Unknown video size");
+  rgb_.resize(static_cast<size_t>(scaled_width_) * scaled_height_ * 3);
+}
+
+SegmentDecoder::~SegmentDecoder() {
+  av_frame_free(&frame_);
+  avcodec_free_context(&codec_context_);
+  avformat_close_input(&format_context_);
+  if (packet_.data)
+    av_packet_unref(&packet_);
+  sws_freeContext(scale_context_);
+}
+
+std::vector<SegmentDecoder::Segment> SegmentDecoder::FindSegments(unsigned int segment_count) {
+  AVStream *const stream = format_context_->streams[stream_index_];
+
+  // The index fields of AVStream are private since libavformat 58.78
+  std::vector<int64_t> key_frames;
+#if LIBAVFORMAT_VERSION_INT >= AV_VERSION_INT(58, 78, 100)
+  const int index_entries = avformat_index_get_entries_count(stream);
+  for (int i = 0; i < index_entries; i++) {
+    const AVIndexEntry *const entry = avformat_index_get_entry(stream, i);
+    if (entry->flags & AVINDEX_KEYFRAME)
+      key_frames.push_back(entry->timestamp);
+  }
+#else
+  for (int i = 0; i < stream->nb_index_entries; i++) {
+    if (stream->index_entries[i].flags & AVINDEX_KEYFRAME)
+      key_frames.push_back(stream->index_entries[i].timestamp);
+  }
+#endif
+  // Streams such as MPEG-TS have no index, and Matroska only reads its cues on
+  // the first seek
+  if (key_frames.size() < 2)
+    key_frames = ScanKeyFrames();
+  std::sort(key_frames.begin(), key_frames.end());
+  key_frames.erase(std::unique(key_frames.begin(), key_frames.end()), key_frames.end());
+
+  if (key_frames.empty())
+    return std::vector<Segment>{Segment{AV_NOPTS_VALUE, std::numeric_limits<int64_t>::max(), true, true}};
+
+  // Cut at the first key frame after each equal share of the duration
+  int64_t end = key_frames.back();
+  if (stream->duration != AV_NOPTS_VALUE)
+    end = std::max(end, (stream->start_time != AV_NOPTS_VALUE ? stream->start_time : 0) + stream->duration);
+  const double span = static_cast<double>(end - key_frames.front());
+
+  std::vector<int64_t> starts = {key_frames.front()};
+  for (unsigned int i = 1; i < std::max(segment_count, 1u); i++) {
+    const int64_t target = key_frames.front() + static_cast<int64_t>(span * i / segment_count);
+    const auto key_frame = std::lower_bound(key_frames.begin(), key_frames.end(), target);
+    if (key_frame != key_frames.end() && *key_frame > starts.back())
+      starts.push_back(*key_frame);
+  }
+
+  std::vector<Segment> segments;
+  for (size_t i = 0; i != starts.size(); i++) {
+    segments.push_back(Segment{starts[i],
+        i + 1 != starts.size() ? starts[i + 1] : std::numeric_limits<int64_t>::max(),
+        i == 0, i + 1 == starts.size()});
+  }
+  return segments;
+}
+
+unsigned int SegmentDecoder::Decode(const Segment &segment, const FrameCallback &on_frame) {
+  avcodec_flush_buffers(codec_context_);
+  const AVStream *const stream = format_context_->streams[stream_index_];
+  const int64_t seek_time = segment.start != AV_NOPTS_VALUE ? segment.start :
+      stream->start_time != AV_NOPTS_VALUE ? stream->start_time : 0;
+  // The first segment reads from the start of the file even if it can't seek
+  if (av_seek_frame(format_context_, stream_index_, seek_time, AVSEEK_FLAG_BACKWARD) < 0 && !segment.first)
+    throw std::runtime_error("Failed to seek to a segment");
+
+  bool started = segment.first, ending = false;
+  int64_t begin_pts = std::numeric_limits<int64_t>::min(), end_pts = std::numeric_limits<int64_t>::max();
+  unsigned int count = 0;
+
+  while (av_read_frame(format_context_, &packet_) >= 0) {
+    if (packet_.stream_index != stream_index_) {
+      av_packet_unref(&packet_);
+      continue;
+    }
+
+    const bool key = (packet_.flags & AV_PKT_FLAG_KEY) != 0;
+    const int64_t time = PacketTime(packet_);
+    const int64_t pts = packet_.pts != AV_NOPTS_VALUE ? packet_.pts : time;
+    if (!started) {
+      // The seek may land on an earlier key frame
+      if (!key || time < segment.start) {
+        av_packet_unref(&packet_);
+        continue;
+      }
+      started = true;
+      if (!segment.first)
+        begin_pts = pts;
+    } else if (!segment.last && !ending && key && time >= segment.end) {
+      // The next segment's key frame is decoded for the leading frames that
+      // follow it but belong here; its own frame is left to that segment
+      ending = true;
+      end_pts = pts;
+    } else if (ending && (key || pts > end_pts)) {
+      av_packet_unref(&packet_);
+      break;
+    }
+
+    // Damaged packets are skipped, as a player would
+    avcodec_send_packet(codec_context_, &packet_);
+    av_packet_unref(&packet_);
+    ReceiveFrames(begin_pts, end_pts, on_frame, count);
+  }
+
+  // Flush the frames still held for reordering
+  avcodec_send_packet(codec_context_, NULL);
+  ReceiveFrames(begin_pts, end_pts, on_frame, count);
+  return count;
+}
+
+uint64_t SegmentDecoder::GetFrameInterval() const {
+  const AVRational rate = format_context_->streams[stream_index_]->avg_frame_rate;
+  return rate.num > 0 && rate.den > 0 ? (UINT64_C(1000000000) * rate.den) / rate.num : 0;
+}
+
+std::vector<int64_t> SegmentDecoder::ScanKeyFrames() {
+  std::vector<int64_t> key_frames;
+  while (av_read_frame(format_context_, &packet_) >= 0) {
+    if (packet_.stream_index == stream_index_ && (packet_.flags & AV_PKT_FLAG_KEY))
+      key_frames.push_back(PacketTime(packet_));
+    av_packet_unref(&packet_);
+  }
+  return key_frames;
+}
+
+void SegmentDecoder::ReceiveFrames(int64_t begin_pts, int64_t end_pts, const FrameCallback &on_frame,
+    unsigned int &count) {
+  const AVStream *const stream = format_context_->streams[stream_index_];
+  const AVRational nano_second_time_base = {1, 1000000000};
+
+  for (;;) {
+    const int ret = avcodec_receive_frame(codec_context_, frame_);
+    if (ret < 0)
+      return;
+
+    const int64_t pts = frame_->best_effort_timestamp;
+    if (pts == AV_NOPTS_VALUE || pts < begin_pts || pts >= end_pts)
+      continue;
+
+    scale_context_ = sws_getCachedContext(scale_context_, frame_->width, frame_->height,
+        static_cast<AVPixelFormat>(frame_->format), static_cast<int>(scaled_width_),
+        static_cast<int>(scaled_height_), AV_PIX_FMT_RGB24, SWS_BILINEAR, NULL, NULL, NULL);
+    if (!scale_context_)
+      throw std::runtime_error("Failed to set up the scaler");
+    uint8_t *const dst_planes[] = {rgb_.data()};
+    const int dst_strides[] = {static_cast<int>(scaled_width_ * 3)};
+    sws_scale(scale_context_, frame_->data, frame_->linesize, 0, frame_->height, dst_planes, dst_strides);
+
+    on_frame(static_cast<uint64_t>(av_rescale_q(pts, stream->time_base, nano_second_time_base)), rgb_.data());
+    count++;
+  }
+}
+
+int64_t SegmentDecoder::PacketTime(const AVPacket &packet) {
+  // Demuxer indexes hold decode times where the container has them
+  return packet.dts != AV_NOPTS_VALUE ? packet.dts : packet.pts;
+}
@@ -0,0 +1,82 @@
+#pragma once
+/**
+ * @internal
+ * @file       segment_decoder.hpp
+ * @copyright  VCA Technology
+ * @~english
+ * @brief      Declaration of the @c SegmentDecoder class.
+ */
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libswscale/swscale.h>
+}
+
+/**
+ * Decodes a video file one keyframe-aligned segment at a time, so that
+ * independent decoders can process the segments of one file side by side.
+ *
+ * Segments start at key frames taken from the demuxer's index, or from a scan
+ * of the packets when the container has no index. Each segment owns the frames
+ * presented from its key frame up to the next segment's key frame: the decoder
+ * also decodes that next key frame and any leading frames that depend on it
+ * but are presented before it, so with open GOPs no frame is lost or delivered
+ * twice. The first segment also owns any frames before the first key frame.
+ */
+class SegmentDecoder final {
+ public:
+  struct Segment {
+    int64_t start;  ///< Packet time of the first key frame, in the stream time base
+    int64_t end;    ///< Packet time of the next segment's key frame
+    bool first;
+    bool last;
+  };
+
+  /// Called with the presentation time in nanoseconds and the packed RGB image.
+  typedef std::function<void(uint64_t timestamp, const uint8_t *rgb)> FrameCallback;
+
+ public:
+  /// Scales frames to scaled_width x scaled_height, or keeps the decoded size if either is 0.
+  SegmentDecoder(const std::string &path, unsigned int scaled_width, unsigned int scaled_height);
+
+  ~SegmentDecoder();
+
+  /// Splits the file into at most segment_count segments of about equal duration.
+  std::vector<Segment> FindSegments(unsigned int segment_count);
+
+  /// Decodes the frames of a segment in presentation order, returning their number.
+  unsigned int Decode(const Segment &segment, const FrameCallback &on_frame);
+
+  unsigned int GetWidth() const { return scaled_width_; }
+
+  unsigned int GetHeight() const { return scaled_height_; }
+
+  /// Nominal frame interval in nanoseconds, 0 if the stream doesn't say.
+  uint64_t GetFrameInterval() const;
+
+ private:
+  SegmentDecoder(const SegmentDecoder&) = delete;
+  SegmentDecoder& operator=(const SegmentDecoder&) = delete;
+
+  std::vector<int64_t> ScanKeyFrames();
+
+  void ReceiveFrames(int64_t begin_pts, int64_t end_pts, const FrameCallback &on_frame, unsigned int &count);
+
+  static int64_t PacketTime(const AVPacket &packet);
+
+ private:
+  AVFormatContext *format_context_;
+  int stream_index_;
+  AVCodecContext *codec_context_;
+  AVFrame *frame_;
+  AVPacket packet_;
+  unsigned int scaled_width_, scaled_height_;
+  SwsContext *scale_context_;
+  std::vector<uint8_t> rgb_;
+};
@@ -0,0 +1,122 @@
+/**
+ * @file      shm_consumer.cpp
+ * @copyright UDP Technology Ltd.
+ * @~english
+ * @brief     Example consumer of the shared-memory frame ring
+ *
+ * Attaches to the ring that mtcnn_test writes with --video-output shm:NAME and
+ * prints the detections of every frame, optionally saving frames as raw NV12.
+ */
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+
+#include "shm_reader.hpp"
+
+static void Usage(std::ostream &o, const char *argv0) {
+  o << "Usage: " << argv0 << " [OPTIONS...] NAME\n"
+    "\n"
+    "Prints the faces published in the shared-memory frame ring NAME\n"
+    "\n"
+    "Options:\n"
+    "  --frames N         Stops after N frames (default: until the producer\n"
+    "                     stops)\n"
+    "  --save FILE        Appends every frame to FILE as raw NV12\n"
+    "  --quiet            Prints only the summary\n"
+    "\n";
+}
+
+int main(int argc, const char *const *const argv) {
+  std::string name, save_path;
+  unsigned long frame_limit = 0;
+  bool quiet = false;
+
+  for (int arg = 1; arg != argc; arg++) {
+    if (std::strcmp(argv[arg], "-h") == 0 || std::strcmp(argv[arg], "--help") == 0) {
+      Usage(std::cout, argv[0]);
+      return EXIT_SUCCESS;
+    } else if (std::strcmp(argv[arg], "--frames") == 0) {
+      if (arg + 1 == argc || std::sscanf(argv[++arg], "%lu", &frame_limit) != 1) {
+        std::cerr << "Failed to parse frame count" << std::endl;
+        return EXIT_FAILURE;
+      }
+    } else if (std::strcmp(argv[arg], "--save") == 0) {
+      if (arg + 1 == argc) {
+        std::cerr << "No output file specified" << std::endl;
+        return EXIT_FAILURE;
+      }
+      save_path = argv[++arg];
+    } else if (std::strcmp(argv[arg], "--quiet") == 0) {
+      quiet = true;
+    } else if (argv[arg][0] == '-') {
+      std::cerr << "Unexpected option: " << argv[arg] << std::endl;
+      Usage(std::cerr, argv[0]);
+      return EXIT_FAILURE;
+    } else {
+      name = argv[arg];
+    }
+  }
+
+  if (name.empty()) {
+    Usage(std::cerr, argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  try {
+    ShmReader reader(name);
+    std::cerr << "Attached to " << name << ": " << reader.GetWidth() << 'x' << reader.GetHeight() << std::endl;
+
+    std::ofstream save_file;
+    if (!save_path.empty()) {
+      save_file.open(save_path, std::ios::binary);
+      if (!save_file) {
+        std::cerr << "Failed to open " << save_path << std::endl;
+        return EXIT_FAILURE;
+      }
+    }
+
+    unsigned long frames = 0, torn_frames = 0, faces = 0;
+    ShmReader::Frame frame;
+    while (!frame_limit || frames < frame_limit) {
+      const ShmReader::Result result = reader.Acquire(frame, std::chrono::seconds(1));
+      if (result == ShmReader::Result::Closed)
+        break;
+      if (result == ShmReader::Result::Timeout)
+        continue;
+
+      if (save_file)
+        save_file.write(reinterpret_cast<const char*>(frame.data), reader.GetFrameSize());
+
+      // Format first, print only once the frame is known to be intact
+      std::string line;
+      if (!quiet) {
+        line = "frame " + std::to_string(frame.frame_no) + " faces " + std::to_string(frame.face_count);
+        for (unsigned int i = 0; i != frame.face_count; i++) {
+          const ShmRingFace &face = frame.faces[i];
+          line += " [" + std::to_string(face.x1) + ',' + std::to_string(face.y1) + ',' + std::to_string(face.x2) +
+              ',' + std::to_string(face.y2) + ' ' + std::to_string(face.score) + ']';
+        }
+      }
+
+      if (!reader.Release(frame)) {
+        torn_frames++;
+        continue;
+      }
+      frames++;
+      faces += frame.face_count;
+      if (!quiet)
+        std::cout << line << std::endl;
+    }
+
+    std::cerr << "Frames: " << frames << ", faces " << faces << ", dropped " << reader.GetDroppedFrames() <<
+        ", overwritten while read " << torn_frames << std::endl;
+  } catch (const std::exception &e) {
+    std::cerr << e.what() << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,165 @@
+/**
+ * @internal
+ * @file       shm_output.cpp
+ * @copyright  VCA Technology
+ * @~english
+ * @brief      Implementation of the @c ShmOutput class.
+ */
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstring>
+#include <new>
+#include <sstream>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "shm_output.hpp"
+
+static size_t AlignUp(size_t size, size_t alignment) {
+  return (size + alignment - 1) / alignment * alignment;
+}
+
+static int16_t ToInt16(float value) {
+  return static_cast<int16_t>(std::max(-32768.0f, std::min(32767.0f, std::round(value))));
+}
+
+ShmOutput::ShmOutput(unsigned int width, unsigned int height, const std::string &name, unsigned int slot_count,
+    unsigned int max_faces) :
+  VideoOutput(width, height),
+  name_(name),
+  mapping_size_(0),
+  mapping_(nullptr),
+  header_(nullptr),
+  sequence_(0),
+  writing_(false) {
+  if (slot_count < 2)
+    throw std::invalid_argument("The shared memory ring needs at least 2 slots");
+
+  // Frames start on a cache line so readers can process them in place
+  const size_t frame_offset = AlignUp(sizeof(ShmRingSlot) + max_faces * sizeof(ShmRingFace), 64);
+  const size_t slot_size = AlignUp(frame_offset + buffer_size_, 64);
+  const size_t slots_offset = AlignUp(sizeof(ShmRingHeader), 64);
+  mapping_size_ = slots_offset + slot_count * slot_size;
+
+  // A stale object from a crashed run would have the wrong layout
+  shm_unlink(name_.c_str());
+  const int fd = shm_open(name_.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+  if (fd < 0) {
+    std::ostringstream ss;
+    ss << "Failed to create shared memory " << name_ << ": " << std::strerror(errno);
+    throw std::runtime_error(ss.str());
+  }
+  if (ftruncate(fd, static_cast<off_t>(mapping_size_)) != 0) {
+    const int error = errno;
+    close(fd);
+    shm_unlink(name_.c_str());
+    std::ostringstream ss;
+    ss << "Failed to size shared memory " << name_ << ": " << std::strerror(error);
+    throw std::runtime_error(ss.str());
+  }
+  void *const mapping = mmap(nullptr, mapping_size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED) {
+    shm_unlink(name_.c_str());
+    throw std::runtime_error("Failed to map shared memory " + name_);
+  }
+
+  // A new object is zero filled, which leaves every slot empty
+  mapping_ = static_cast<uint8_t*>(mapping);
+  header_ = new (mapping_) ShmRingHeader();
+  header_->version = ShmRingVersion;
+  header_->width = width;
+  header_->height = height;
+  header_->frame_size = static_cast<uint32_t>(buffer_size_);
+  header_->slot_count = slot_count;
+  header_->slot_size = static_cast<uint32_t>(slot_size);
+  header_->slots_offset = static_cast<uint32_t>(slots_offset);
+  header_->frame_offset = static_cast<uint32_t>(frame_offset);
+  header_->max_faces = max_faces;
+  header_->producer_pid = static_cast<uint32_t>(getpid());
+  header_->closed = 0;
+  header_->notify = 0;
+  header_->waiters = 0;
+  header_->readers = 0;
+  header_->committed = 0;
+  for (unsigned int i = 0; i != slot_count; i++)
+    new (mapping_ + slots_offset + i * slot_size) ShmRingSlot();
+  header_->magic.store(ShmRingMagic, std::memory_order_release);
+}
+
+ShmOutput::~ShmOutput() {
+  header_->closed.store(1);
+  header_->notify.fetch_add(1);
+  ShmRingWake(header_->notify);
+
+  // Attached readers keep their mapping until they detach
+  munmap(mapping_, mapping_size_);
+  shm_unlink(name_.c_str());
+}
+
+void ShmOutput::PushFrame(const uint8_t *buffer_data) {
+  std::memcpy(BeginFrame(), buffer_data, buffer_size_);
+  CommitFrame(0, 0, std::vector<Bbox>());
+}
+
+uint8_t* ShmOutput::BeginFrame() {
+  ShmRingSlot &slot = SlotOf(sequence_);
+  if (!writing_) {
+    slot.sequence.store(2 * sequence_ + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    writing_ = true;
+  }
+  return reinterpret_cast<uint8_t*>(&slot) + header_->frame_offset;
+}
+
+void ShmOutput::CommitFrame(unsigned int frame_no, uint64_t timestamp, const std::vector<Bbox> &boxes) {
+  BeginFrame();
+  ShmRingSlot &slot = SlotOf(sequence_);
+  slot.timestamp = timestamp;
+  slot.frame_no = frame_no;
+  slot.face_count = static_cast<uint32_t>(std::min<size_t>(boxes.size(), header_->max_faces));
+
+  ShmRingFace *const faces = reinterpret_cast<ShmRingFace*>(&slot + 1);
+  for (uint32_t i = 0; i != slot.face_count; i++) {
+    const Bbox &box = boxes[i];
+    ShmRingFace &face = faces[i];
+    face.score = box.score;
+    face.x1 = ToInt16(static_cast<float>(box.x1));
+    face.y1 = ToInt16(static_cast<float>(box.y1));
+    face.x2 = ToInt16(static_cast<float>(box.x2));
+    face.y2 = ToInt16(static_cast<float>(box.y2));
+    for (int j = 0; j != 5; j++) {
+      face.landmark_x[j] = ToInt16(box.landmark.x[j]);
+      face.landmark_y[j] = ToInt16(box.landmark.y[j]);
+    }
+  }
+
+  slot.sequence.store(2 * sequence_ + 2, std::memory_order_release);
+  header_->committed.store(++sequence_, std::memory_order_release);
+  writing_ = false;
+
+  // Readers register as waiters before checking for new frames, so one that
+  // missed this commit sees notify change and doesn't sleep
+  header_->notify.fetch_add(1);
+  if (header_->waiters.load() != 0)
+    ShmRingWake(header_->notify);
+}
+
+unsigned int ShmOutput::GetReaderCount() const {
+  return header_->readers.load(std::memory_order_relaxed);
+}
+
+uint64_t ShmOutput::GetFrameCount() const {
+  return sequence_;
+}
+
+ShmRingSlot& ShmOutput::SlotOf(uint64_t sequence) const {
+  return *reinterpret_cast<ShmRingSlot*>(mapping_ + header_->slots_offset +
+      (sequence % header_->slot_count) * header_->slot_size);
+}
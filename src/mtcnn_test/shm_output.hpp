@@ -0,0 +1,64 @@
+#pragma once
+/**
+ * @internal
+ * @file       shm_output.hpp
+ * @copyright  VCA Technology
+ * @~english
+ * @brief      Declaration of the @c ShmOutput class.
+ */
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "mtcnn.h"
+#include "shm_ring.hpp"
+#include "video_output.hpp"
+
+/**
+ * Publishes frames and their detections through a ring of slots in POSIX
+ * shared memory, laid out as described in shm_ring.hpp, for other processes
+ * to read with @c ShmReader.
+ *
+ * Frames can be drawn straight into a slot between @c BeginFrame and
+ * @c CommitFrame, so the only copy is the one filling the slot. Committing
+ * never waits for readers, so the output needs no writer thread of its own.
+ * The shared memory object is created under @p name, replacing one left by an
+ * earlier run, and removed again on destruction.
+ */
+class ShmOutput final : public VideoOutput {
+ public:
+  ShmOutput(unsigned int width, unsigned int height, const std::string &name, unsigned int slot_count = 8,
+      unsigned int max_faces = 64);
+
+  virtual ~ShmOutput();
+
+  /// Copies a frame into the next slot and commits it without detections.
+  void PushFrame(const uint8_t *buffer_data);
+
+  /// Returns the NV12 buffer of the next slot, to fill before @c CommitFrame.
+  uint8_t* BeginFrame();
+
+  /// Publishes the slot returned by @c BeginFrame with its detections.
+  void CommitFrame(unsigned int frame_no, uint64_t timestamp, const std::vector<Bbox> &boxes);
+
+  /// Readers currently attached.
+  unsigned int GetReaderCount() const;
+
+  uint64_t GetFrameCount() const;
+
+ private:
+  ShmRingSlot& SlotOf(uint64_t sequence) const;
+
+ private:
+  ShmOutput(const ShmOutput&) = delete;
+  ShmOutput& operator=(const ShmOutput&) = delete;
+
+ private:
+  const std::string name_;
+  size_t mapping_size_;
+  uint8_t *mapping_;
+  ShmRingHeader *header_;
+  uint64_t sequence_;  ///< Of the frame being written
+  bool writing_;
+};
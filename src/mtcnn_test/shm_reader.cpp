@@ -0,0 +1,134 @@
+/**
+ * @internal
+ * @file       shm_reader.cpp
+ * @copyright  VCA Technology
+ * @~english
+ * @brief      Implementation of the @c ShmReader class.
+ */
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "shm_reader.hpp"
+
+ShmReader::ShmReader(const std::string &name) :
+  mapping_size_(0),
+  mapping_(nullptr),
+  header_(nullptr),
+  next_(0),
+  dropped_(0) {
+  const int fd = shm_open(name.c_str(), O_RDWR, 0);
+  if (fd < 0) {
+    std::ostringstream ss;
+    ss << "Failed to open shared memory " << name << ": " << std::strerror(errno);
+    throw std::runtime_error(ss.str());
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(ShmRingHeader)) {
+    close(fd);
+    throw std::runtime_error("Shared memory " + name + " is not ready");
+  }
+  mapping_size_ = static_cast<size_t>(st.st_size);
+
+  // Waiting registers this reader in the header, so the mapping is writable
+  void *const mapping = mmap(nullptr, mapping_size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED)
+    throw std::runtime_error("Failed to map shared memory " + name);
+  mapping_ = static_cast<uint8_t*>(mapping);
+  header_ = reinterpret_cast<ShmRingHeader*>(mapping_);
+
+  if (header_->magic.load(std::memory_order_acquire) != ShmRingMagic || header_->version != ShmRingVersion ||
+      header_->slots_offset + static_cast<size_t>(header_->slot_count) * header_->slot_size > mapping_size_) {
+    munmap(mapping_, mapping_size_);
+    throw std::runtime_error("Shared memory " + name + " is not a frame ring of this version");
+  }
+
+  header_->readers.fetch_add(1);
+  // Start from the oldest frame that can't be overwritten straight away
+  const uint64_t committed = header_->committed.load(std::memory_order_acquire);
+  next_ = committed >= header_->slot_count ? committed - header_->slot_count + 1 : 0;
+}
+
+ShmReader::~ShmReader() {
+  header_->readers.fetch_sub(1);
+  munmap(mapping_, mapping_size_);
+}
+
+unsigned int ShmReader::GetWidth() const {
+  return header_->width;
+}
+
+unsigned int ShmReader::GetHeight() const {
+  return header_->height;
+}
+
+size_t ShmReader::GetFrameSize() const {
+  return header_->frame_size;
+}
+
+ShmReader::Result ShmReader::Acquire(Frame &frame, std::chrono::nanoseconds timeout) {
+  const auto deadline = std::chrono::steady_clock::now() + timeout;
+  while (true) {
+    const uint64_t committed = header_->committed.load(std::memory_order_acquire);
+    if (committed <= next_) {
+      if (header_->closed.load())
+        return Result::Closed;
+      const auto remaining = deadline - std::chrono::steady_clock::now();
+      if (remaining <= std::chrono::nanoseconds(0))
+        return Result::Timeout;
+
+      header_->waiters.fetch_add(1);
+      const uint32_t notify = header_->notify.load();
+      if (header_->committed.load() <= next_ && !header_->closed.load())
+        ShmRingWait(header_->notify, notify, remaining);
+      header_->waiters.fetch_sub(1);
+      continue;
+    }
+
+    // The slot of the oldest frame held may already be taking the next one
+    const uint64_t oldest = committed >= header_->slot_count ? committed - header_->slot_count + 1 : 0;
+    if (next_ < oldest) {
+      dropped_ += oldest - next_;
+      next_ = oldest;
+    }
+
+    const ShmRingSlot &slot = SlotOf(next_);
+    if (slot.sequence.load(std::memory_order_acquire) != 2 * next_ + 2) {
+      // Overwritten since committed was read
+      continue;
+    }
+
+    frame.sequence = next_;
+    frame.frame_no = slot.frame_no;
+    frame.timestamp = slot.timestamp;
+    frame.face_count = std::min(slot.face_count, header_->max_faces);
+    frame.faces = reinterpret_cast<const ShmRingFace*>(&slot + 1);
+    frame.data = reinterpret_cast<const uint8_t*>(&slot) + header_->frame_offset;
+    next_++;
+    return Result::Frame;
+  }
+}
+
+bool ShmReader::Release(const Frame &frame) const {
+  std::atomic_thread_fence(std::memory_order_acquire);
+  return SlotOf(frame.sequence).sequence.load(std::memory_order_relaxed) == 2 * frame.sequence + 2;
+}
+
+uint64_t ShmReader::GetDroppedFrames() const {
+  return dropped_;
+}
+
+const ShmRingSlot& ShmReader::SlotOf(uint64_t sequence) const {
+  return *reinterpret_cast<const ShmRingSlot*>(mapping_ + header_->slots_offset +
+      (sequence % header_->slot_count) * header_->slot_size);
+}
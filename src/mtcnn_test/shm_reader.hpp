@@ -0,0 +1,77 @@
+#pragma once
+/**
+ * @internal
+ * @file       shm_reader.hpp
+ * @copyright  VCA Technology
+ * @~english
+ * @brief      Declaration of the @c ShmReader class.
+ */
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include "shm_ring.hpp"
+
+/**
+ * Reads the frames and detections that a @c ShmOutput publishes in shared
+ * memory, without copying them.
+ *
+ * Frames are acquired in order and used in place. The producer doesn't wait
+ * for readers, so a reader more than the ring behind skips to the oldest frame
+ * still held, and @c Release reports whether the frame was overwritten while
+ * it was in use. Only depends on shm_ring.hpp, so other processes can link it
+ * without the detector.
+ */
+class ShmReader final {
+ public:
+  struct Frame {
+    uint64_t sequence;         ///< Position in the ring's stream of frames
+    unsigned int frame_no;
+    uint64_t timestamp;
+    const uint8_t *data;       ///< NV12, width x height
+    unsigned int face_count;
+    const ShmRingFace *faces;
+  };
+
+  enum class Result {
+    Frame,
+    Timeout,
+    Closed,    ///< The producer stopped and every frame has been read
+  };
+
+ public:
+  /// Attaches to the ring named @p name. Throws if it doesn't exist or isn't ready.
+  explicit ShmReader(const std::string &name);
+
+  ~ShmReader();
+
+  unsigned int GetWidth() const;
+  unsigned int GetHeight() const;
+  size_t GetFrameSize() const;
+
+  /// Waits up to @p timeout for the next frame.
+  Result Acquire(Frame &frame, std::chrono::nanoseconds timeout);
+
+  /// Returns false if the frame was overwritten while in use; what was read
+  /// from it must then be discarded.
+  bool Release(const Frame &frame) const;
+
+  /// Frames the producer overwrote before this reader got to them.
+  uint64_t GetDroppedFrames() const;
+
+ private:
+  const ShmRingSlot& SlotOf(uint64_t sequence) const;
+
+ private:
+  ShmReader(const ShmReader&) = delete;
+  ShmReader& operator=(const ShmReader&) = delete;
+
+ private:
+  size_t mapping_size_;
+  uint8_t *mapping_;
+  ShmRingHeader *header_;
+  uint64_t next_;
+  uint64_t dropped_;
+};
@@ -0,0 +1,88 @@
+#pragma once
+/**
+ * @internal
+ * @file       shm_ring.hpp
+ * @copyright  VCA Technology
+ * @~english
+ * @brief      Layout of the shared-memory frame ring and its futex signalling.
+ */
+
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <cstdint>
+
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * A POSIX shared memory object written by @c ShmOutput and read by any number
+ * of @c ShmReader processes. It holds a @c ShmRingHeader, then @c slot_count
+ * slots of @c slot_size bytes from @c slots_offset. Each slot is a
+ * @c ShmRingSlot, then @c max_faces @c ShmRingFace records, then the NV12
+ * frame at @c frame_offset within the slot.
+ *
+ * Frame n goes to slot n % slot_count. Each slot's sequence is a seqlock: 2n+1
+ * while frame n is being written and 2n+2 once it is committed, so a reader
+ * can tell that the frame it is using was overwritten. The producer never
+ * waits for readers; one that falls more than the ring behind loses frames.
+ * After each commit the producer bumps @c notify, the futex word that readers
+ * sleep on, and wakes them if any are waiting.
+ *
+ * The atomics are lock-free, so they work across processes.
+ */
+
+static constexpr uint32_t ShmRingMagic = 0x5253544d;  // "MTSR"
+static constexpr uint32_t ShmRingVersion = 1;
+
+static_assert(ATOMIC_INT_LOCK_FREE == 2 && ATOMIC_LLONG_LOCK_FREE == 2,
+    "The ring needs lock-free atomics to be shared between processes");
+
+struct ShmRingHeader {
+  std::atomic<uint32_t> magic;      ///< Set last, once the rest of the header is valid
+  uint32_t version;
+  uint32_t width;
+  uint32_t height;
+  uint32_t frame_size;              ///< Bytes of one NV12 frame
+  uint32_t slot_count;
+  uint32_t slot_size;
+  uint32_t slots_offset;
+  uint32_t frame_offset;            ///< Of the pixels within a slot
+  uint32_t max_faces;
+  uint32_t producer_pid;
+  std::atomic<uint32_t> closed;     ///< Set when the producer stops
+  std::atomic<uint32_t> notify;     ///< Futex word, bumped after every commit
+  std::atomic<uint32_t> waiters;    ///< Readers sleeping on @c notify
+  std::atomic<uint32_t> readers;    ///< Readers attached
+  uint32_t reserved;
+  std::atomic<uint64_t> committed;  ///< Frames committed so far
+};
+
+struct ShmRingSlot {
+  std::atomic<uint64_t> sequence;
+  uint64_t timestamp;
+  uint32_t frame_no;
+  uint32_t face_count;
+};
+
+struct ShmRingFace {
+  float score;
+  int16_t x1, y1, x2, y2;
+  int16_t landmark_x[5];
+  int16_t landmark_y[5];             ///< All zero without landmarks
+};
+
+/// Sleeps while @p word still holds @p value, for at most @p timeout.
+inline void ShmRingWait(std::atomic<uint32_t> &word, uint32_t value, std::chrono::nanoseconds timeout) {
+  struct timespec ts;
+  ts.tv_sec = static_cast<time_t>(timeout.count() / 1000000000);
+  ts.tv_nsec = static_cast<long>(timeout.count() % 1000000000);
+  syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), FUTEX_WAIT, value, &ts, nullptr, 0);
+}
+
+/// Wakes every process sleeping on @p word.
+inline void ShmRingWake(std::atomic<uint32_t> &word) {
+  syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+}
@@ -7,21 +7,46 @@
  */
 
 #include <algorithm>
+#include <cerrno>
 #include <cstring>
 #include <iostream>
 #include <sstream>
 #include <stdexcept>
 
 #ifndef _WIN32
+#include <climits>
+#include <fstream>
+
 #include <fcntl.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
 #include <unistd.h>
 #endif
 
 #include "subprocess_output.hpp"
 
-static SubprocessOutput::Process Spawn(const std::string app, const std::vector<std::string> &args) {
+#ifndef _WIN32
+static void GrowPipe(int fd, size_t frame_size) {
+#ifdef F_SETPIPE_SZ
+  // Room for a couple of frames lets the viewer fall behind briefly without
+  // blocking the writer. Unprivileged processes are capped at pipe-max-size.
+  int size = static_cast<int>(std::min<size_t>(2 * frame_size, INT_MAX));
+  if (fcntl(fd, F_SETPIPE_SZ, size) >= 0)
+    return;
+
+  std::ifstream max_size_file("/proc/sys/fs/pipe-max-size");
+  if (max_size_file >> size)
+    fcntl(fd, F_SETPIPE_SZ, size);
+#else
+  (void)fd;
+  (void)frame_size;
+#endif
+}
+#endif
+
+static SubprocessOutput::Process Spawn(const std::string app, const std::vector<std::string> &args,
+    size_t frame_size) {
 #ifdef _WIN32
   throw std::logic_error("Subprocess-based outputs are not yet supported in Windows");
 #else
@@ -30,6 +55,8 @@ static SubprocessOutput::Process Spawn(const std::string app, const std::vector<
   if (pipe(in_pipe) < 0)
     throw std::runtime_error("Pipe error");
 
+  GrowPipe(in_pipe[1], frame_size);
+
   const int pid = fork();
   if (pid < 0) {
     throw std::runtime_error("Fork error");
@@ -76,7 +103,7 @@ static SubprocessOutput::Process Spawn(const std::string app, const std::vector<
 SubprocessOutput::SubprocessOutput(unsigned int width, unsigned int height,
     const std::string &app, const std::vector<std::string> &args) :
   VideoOutput(width, height),
-  process_(Spawn(app, args)) {}
+  process_(Spawn(app, args, buffer_size_)) {}
 
 SubprocessOutput::~SubprocessOutput() {
 #ifndef _WIN32
@@ -88,8 +115,45 @@ SubprocessOutput::~SubprocessOutput() {
 }
 
 void SubprocessOutput::PushFrame(const uint8_t *buffer_data) {
+  PushFrames(&buffer_data, 1);
+}
+
+void SubprocessOutput::PushFrames(const uint8_t *const *buffers, size_t count) {
 #ifndef _WIN32
-  if (write(process_.in_fd, buffer_data, buffer_size_) != static_cast<int>(buffer_size_))
-    throw std::runtime_error("Failed to push output frame");
+  // Write all the frames with as few system calls as possible, resuming after
+  // partial writes and signals
+  static const size_t MaxVectors = IOV_MAX < 64 ? IOV_MAX : 64;
+  struct iovec vectors[MaxVectors];
+
+  while (count != 0) {
+    const size_t vector_count = std::min(count, MaxVectors);
+    for (size_t i = 0; i != vector_count; i++)
+      vectors[i] = iovec{const_cast<uint8_t*>(buffers[i]), buffer_size_};
+
+    struct iovec *next = vectors;
+    size_t remaining = vector_count;
+    while (remaining != 0) {
+      const ssize_t written = writev(process_.in_fd, next, static_cast<int>(remaining));
+      if (written < 0) {
+        if (errno == EINTR)
+          continue;
+        throw std::runtime_error("Failed to push output frame");
+      }
+
+      size_t advance = static_cast<size_t>(written);
+      while (remaining != 0 && advance >= next->iov_len) {
+        advance -= next->iov_len;
+        next++;
+        remaining--;
+      }
+      if (remaining != 0) {
+        next->iov_base = static_cast<uint8_t*>(next->iov_base) + advance;
+        next->iov_len -= advance;
+      }
+    }
+
+    buffers += vector_count;
+    count -= vector_count;
+  }
 #endif
 }
@@ -35,6 +35,8 @@ class SubprocessOutput final : public VideoOutput {
 
   void PushFrame(const uint8_t *buffer_data);
 
+  void PushFrames(const uint8_t *const *buffers, size_t count);
+
  private:
   Process process_;
 };
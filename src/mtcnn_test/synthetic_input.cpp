@@ -0,0 +1,328 @@
+/**
+ * @internal
+ * @file       synthetic_input.cpp
+ * @copyright  VCA Technology
+ * @~english
+ * @brief      Implementation of the @c SyntheticInput class.
+ */
+
+#define _USE_MATH_DEFINES
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+
+#include <limits.h>
+#include <unistd.h>
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/highgui/highgui.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+
+#include <vca/media/four_cc.hpp>
+
+#include "synthetic_input.hpp"
+
+// Converts a BGR image to NV12, with width and height already even
+static std::vector<uint8_t> BgrToNv12(const cv::Mat &bgr) {
+  cv::Mat i420;
+  cv::cvtColor(bgr, i420, CV_BGR2YUV_I420);
+
+  const size_t y_size = bgr.cols * bgr.rows, c_size = y_size / 4;
+  std::vector<uint8_t> nv12((y_size * 3) / 2);
+  std::memcpy(nv12.data(), i420.data, y_size);
+  for (size_t i = 0; i != c_size; i++) {
+    nv12[y_size + 2 * i] = i420.data[y_size + i];
+    nv12[y_size + 2 * i + 1] = i420.data[y_size + c_size + i];
+  }
+  return nv12;
+}
+
+// A front-row face in the repository's sample image, with some margin around it
+static const char DefaultPatchPath[] = "../sample.jpg";
+static const char DefaultPatchCrop[] = "1431,371,72,72";
+
+// The sample image next to the bin directory the executables are built into,
+// wherever they are run from
+static std::string ResolveDefaultPatchPath() {
+  char self[PATH_MAX];
+  const ssize_t length = readlink("/proc/self/exe", self, sizeof(self) - 1);
+  if (length <= 0)
+    return DefaultPatchPath;
+  const std::string exe(self, static_cast<size_t>(length));
+  return exe.substr(0, exe.rfind('/') + 1) + DefaultPatchPath;
+}
+
+static unsigned int ParseUnsigned(const std::string &key, const std::string &value) {
+  unsigned int result;
+  if (std::sscanf(value.c_str(), "%u", &result) != 1) {
+    std::ostringstream ss;
+    ss << "Invalid value for synthetic input option " << key << ": " << value;
+    throw std::runtime_error(ss.str());
+  }
+  return result;
+}
+
+SyntheticInput::SyntheticInput(const std::string &options, unsigned int width, unsigned int height) :
+  width_(width & ~0x01),
+  height_(height & ~0x01),
+  face_count_(10),
+  min_size_(48),
+  max_size_(96),
+  motion_(Motion::Linear),
+  seed_(123),
+  patch_path_(),
+  crop_(),
+  background_path_(),
+  background_(),
+  patches_(),
+  faces_(),
+  ground_truth_(),
+  truth_file_(),
+  frame_num_(0),
+  dropped_frames_(0),
+  pool_() {
+  if (width_ == 0 || height_ == 0) {
+    width_ = ScaledWidth;
+    height_ = ScaledHeight;
+  }
+
+  ParseOptions(options);
+  if (patch_path_.empty()) {
+    patch_path_ = ResolveDefaultPatchPath();
+    if (crop_.empty())
+      crop_ = DefaultPatchCrop;
+  }
+
+  min_size_ = std::max(12u, std::min(min_size_, std::min(width_, height_))) & ~0x01;
+  max_size_ = std::max(min_size_, std::min(max_size_, std::min(width_, height_)) & ~0x01);
+
+  LoadBackground(background_path_);
+
+  // Place the faces and give each a fixed size and velocity
+  std::mt19937 random(seed_);
+  std::uniform_int_distribution<unsigned int> size_distribution(min_size_ / 2, max_size_ / 2);
+  std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+
+  faces_.resize(face_count_);
+  for (auto &face : faces_) {
+    face.size = 2 * size_distribution(random);
+    face.x = face.cx = unit(random) * (width_ - face.size);
+    face.y = face.cy = unit(random) * (height_ - face.size);
+    switch (motion_) {
+     case Motion::Static:
+      face.vx = face.vy = 0.0f;
+      break;
+     case Motion::Linear: {
+        const float angle = unit(random) * 2.0f * static_cast<float>(M_PI);
+        const float speed = 1.0f + unit(random) * 4.0f;
+        face.vx = speed * std::cos(angle);
+        face.vy = speed * std::sin(angle);
+        break;
+      }
+     case Motion::Circle:
+      face.vx = 8.0f + unit(random) * 32.0f;
+      face.vy = (0.01f + unit(random) * 0.05f) * (unit(random) < 0.5f ? -1.0f : 1.0f);
+      break;
+    }
+    patches_[face.size];
+  }
+
+  LoadPatches(patch_path_, crop_);
+  for (auto &face : faces_)
+    face.patch = &patches_[face.size];
+
+  ground_truth_.resize(face_count_);
+  pool_.reset(new BufferPool((width_ * height_ * 3) / 2, FramePoolSize));
+}
+
+SyntheticInput::~SyntheticInput() {}
+
+vca::core::video::Formats SyntheticInput::GetInputFormats() const {
+  return vca::core::video::Formats{
+      vca::core::video::Format{vca::media::four_cc::FourCcs::NV12, ScaledFrameRate, width_, height_}
+    };
+}
+
+vca::core::video::Formats SyntheticInput::GetOutputFormats() const {
+  return vca::core::video::Formats{};
+}
+
+bool SyntheticInput::ReadFrame(Frame &frame) {
+  frame.Release();
+  frame.timestamp = static_cast<uint64_t>(frame_num_) * (1000000000UL * ScaledFrameRate.den) / ScaledFrameRate.num;
+
+  const size_t buffer_size = (width_ * height_ * 3) / 2;
+  uint8_t *const data = pool_->Acquire();
+  if (!data) {
+    frame.input_buffers.push_back(vca::core::video::Buffer{0, nullptr, 0, {}, {}});
+    dropped_frames_++;
+    frame_num_++;
+    return true;
+  }
+
+  std::memcpy(data, background_.data(), buffer_size);
+  for (size_t i = 0; i != faces_.size(); i++)
+    DrawFace(data, faces_[i], ground_truth_[i]);
+
+  if (truth_file_.is_open()) {
+    for (const auto &truth : ground_truth_)
+      truth_file_ << frame_num_ << ',' << frame.timestamp << ',' << truth.x1 << ',' << truth.y1 << ',' <<
+          truth.x2 << ',' << truth.y2 << '\n';
+  }
+
+  const size_t y_plane_size = width_ * height_;
+  frame.input_buffers.push_back(pool_->MakeBuffer(data, 2, {
+      vca::core::video::Buffer::Plane{y_plane_size, 0, static_cast<std::ptrdiff_t>(width_)},
+      vca::core::video::Buffer::Plane{y_plane_size / 2, y_plane_size, static_cast<std::ptrdiff_t>(width_)}}));
+
+  MoveFaces();
+  frame_num_++;
+
+  return true;
+}
+
+VideoInput::Statistics SyntheticInput::GetStatistics() const {
+  return Statistics{frame_num_, frame_num_ - dropped_frames_, dropped_frames_};
+}
+
+const std::vector<SyntheticInput::GroundTruth>& SyntheticInput::GetGroundTruth() const {
+  return ground_truth_;
+}
+
+void SyntheticInput::ParseOptions(const std::string &options) {
+  std::istringstream ss(options);
+  std::string option;
+  while (std::getline(ss, option, '&')) {
+    if (option.empty())
+      continue;
+
+    const size_t equals = option.find('=');
+    const std::string key = option.substr(0, equals);
+    const std::string value = equals == std::string::npos ? std::string() : option.substr(equals + 1);
+
+    if (key == "faces") {
+      face_count_ = ParseUnsigned(key, value);
+    } else if (key == "min") {
+      min_size_ = ParseUnsigned(key, value);
+    } else if (key == "max") {
+      max_size_ = ParseUnsigned(key, value);
+    } else if (key == "seed") {
+      seed_ = ParseUnsigned(key, value);
+    } else if (key == "motion") {
+      if (value == "static")
+        motion_ = Motion::Static;
+      else if (value == "linear")
+        motion_ = Motion::Linear;
+      else if (value == "circle")
+        motion_ = Motion::Circle;
+      else
+        throw std::runtime_error("Unsupported synthetic input motion: " + value);
+    } else if (key == "patch") {
+      patch_path_ = value;
+    } else if (key == "crop") {
+      crop_ = value;
+    } else if (key == "background") {
+      background_path_ = value;
+    } else if (key == "truth") {
+      truth_file_.open(value);
+      if (!truth_file_)
+        throw std::runtime_error("Failed to open " + value);
+      truth_file_ << "frame,timestamp,x1,y1,x2,y2\n";
+    } else {
+      throw std::runtime_error("Unknown synthetic input option: " + key);
+    }
+  }
+}
+
+void SyntheticInput::LoadBackground(const std::string &path) {
+  cv::Mat bgr;
+  if (!path.empty()) {
+    const cv::Mat image = cv::imread(path);
+    if (image.empty())
+      throw std::runtime_error("Failed to load synthetic input background " + path);
+    cv::resize(image, bgr, cv::Size(width_, height_), 0, 0, cv::INTER_AREA);
+    background_ = BgrToNv12(bgr);
+    return;
+  }
+
+  // A soft gradient with neutral chroma, with no texture to trigger false detections
+  background_.assign((width_ * height_ * 3) / 2, 128);
+  for (unsigned int y = 0; y != height_; y++)
+    for (unsigned int x = 0; x != width_; x++)
+      background_[y * width_ + x] = static_cast<uint8_t>(64 + (96 * x) / width_ + (64 * y) / height_);
+}
+
+void SyntheticInput::LoadPatches(const std::string &path, const std::string &crop) {
+  const cv::Mat image = cv::imread(path);
+  if (image.empty())
+    throw std::runtime_error("Failed to load synthetic input face patch " + path + "; set one with patch=FILE");
+
+  cv::Rect rect(0, 0, image.cols, image.rows);
+  if (!crop.empty() &&
+      std::sscanf(crop.c_str(), "%d,%d,%d,%d", &rect.x, &rect.y, &rect.width, &rect.height) != 4)
+    throw std::runtime_error("Invalid synthetic input crop: " + crop);
+  rect.x = std::max(0, std::min(rect.x, image.cols - 1));
+  rect.y = std::max(0, std::min(rect.y, image.rows - 1));
+  rect.width = std::max(1, std::min(rect.width, image.cols - rect.x));
+  rect.height = std::max(1, std::min(rect.height, image.rows - rect.y));
+
+  // Convert the patch once for every size in use
+  const cv::Mat face_image(image, rect);
+  for (auto &patch : patches_) {
+    cv::Mat scaled;
+    cv::resize(face_image, scaled, cv::Size(patch.first, patch.first), 0, 0, cv::INTER_AREA);
+    patch.second = BgrToNv12(scaled);
+  }
+}
+
+void SyntheticInput::MoveFaces() {
+  for (auto &face : faces_) {
+    const float max_x = static_cast<float>(width_ - face.size), max_y = static_cast<float>(height_ - face.size);
+    switch (motion_) {
+     case Motion::Static:
+      break;
+     case Motion::Linear:
+      face.x += face.vx;
+      face.y += face.vy;
+      if (face.x < 0.0f || face.x > max_x) {
+        face.vx = -face.vx;
+        face.x = std::max(0.0f, std::min(face.x, max_x));
+      }
+      if (face.y < 0.0f || face.y > max_y) {
+        face.vy = -face.vy;
+        face.y = std::max(0.0f, std::min(face.y, max_y));
+      }
+      break;
+     case Motion::Circle: {
+        const float angle = face.vy * static_cast<float>(frame_num_ + 1);
+        face.x = std::max(0.0f, std::min(face.cx + face.vx * std::cos(angle), max_x));
+        face.y = std::max(0.0f, std::min(face.cy + face.vx * std::sin(angle), max_y));
+        break;
+      }
+    }
+  }
+}
+
+void SyntheticInput::DrawFace(uint8_t *data, const Face &face, GroundTruth &truth) const {
+  // Keep the patch on chroma sample boundaries
+  const unsigned int size = face.size;
+  const unsigned int x = std::min(static_cast<unsigned int>(face.x) & ~0x01u, width_ - size);
+  const unsigned int y = std::min(static_cast<unsigned int>(face.y) & ~0x01u, height_ - size);
+
+  const uint8_t *const patch = face.patch->data();
+  for (unsigned int row = 0; row != size; row++)
+    std::memcpy(data + (y + row) * width_ + x, patch + row * size, size);
+
+  uint8_t *const uv_plane = data + width_ * height_;
+  const uint8_t *const patch_uv = patch + size * size;
+  for (unsigned int row = 0; row != size / 2; row++)
+    std::memcpy(uv_plane + (y / 2 + row) * width_ + x, patch_uv + row * size, size);
+
+  truth = GroundTruth{static_cast<int>(x), static_cast<int>(y),
+      static_cast<int>(x + size - 1), static_cast<int>(y + size - 1)};
+}
@@ -0,0 +1,98 @@
+#pragma once
+/**
+ * @internal
+ * @file       synthetic_input.hpp
+ * @copyright  VCA Technology
+ * @~english
+ * @brief      Declaration of the @c SyntheticInput class.
+ */
+
+#include <cstdint>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "buffer_pool.hpp"
+#include "video_input.hpp"
+
+/**
+ * Generates NV12 frames by compositing a real face patch, at a configurable
+ * count, range of sizes and motion, over a cached background. Patches are
+ * scaled and converted once up front, so each frame costs a background copy
+ * plus one small copy per face.
+ *
+ * Configured with the query part of a URI of the form
+ * synthetic://faces=N&min=S&max=S&motion={static,linear,circle}&patch=FILE
+ *     &crop=X,Y,W,H&background=FILE&seed=N&truth=FILE
+ * where every key is optional. The default patch is a face cropped from the
+ * sample.jpg above the executable's directory; for other patches without crop
+ * the whole image is used as the face. Without background a smooth gradient is
+ * generated.
+ */
+class SyntheticInput final : public VideoInput {
+ public:
+  enum class Motion {
+    Static,
+    Linear,  ///< Straight lines, bouncing off the frame edges
+    Circle,  ///< Orbits around each face's starting point
+  };
+
+  /// Where each face was drawn in the last frame; later faces cover earlier ones.
+  struct GroundTruth {
+    int x1, y1, x2, y2;
+  };
+
+ public:
+  SyntheticInput(const std::string &options, unsigned int width, unsigned int height);
+
+  ~SyntheticInput();
+
+  vca::core::video::Formats GetInputFormats() const;
+
+  vca::core::video::Formats GetOutputFormats() const;
+
+  bool ReadFrame(Frame &frame);
+
+  Statistics GetStatistics() const;
+
+  const std::vector<GroundTruth>& GetGroundTruth() const;
+
+ private:
+  struct Face {
+    float x, y;    // top-left corner
+    float vx, vy;  // pixels per frame, or radius and angular speed when circling
+    float cx, cy;  // orbit centre
+    unsigned int size;
+    const std::vector<uint8_t> *patch;
+  };
+
+ private:
+  void ParseOptions(const std::string &options);
+
+  void LoadBackground(const std::string &path);
+
+  void LoadPatches(const std::string &path, const std::string &crop);
+
+  void MoveFaces();
+
+  void DrawFace(uint8_t *data, const Face &face, GroundTruth &truth) const;
+
+ private:
+  unsigned int width_, height_;
+  unsigned int face_count_, min_size_, max_size_;
+  Motion motion_;
+  unsigned int seed_;
+  std::string patch_path_, crop_, background_path_;
+
+  std::vector<uint8_t> background_;
+  std::map<unsigned int, std::vector<uint8_t>> patches_;  // NV12 patch per face size
+  std::vector<Face> faces_;
+  std::vector<GroundTruth> ground_truth_;
+  std::ofstream truth_file_;
+
+  unsigned int frame_num_;
+  uint64_t dropped_frames_;
+  std::unique_ptr<BufferPool> pool_;
+};
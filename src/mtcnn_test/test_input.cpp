@@ -43,11 +43,15 @@ static void GenerateFrameData(uint8_t *buffer, unsigned int width, unsigned int
 TestInput::TestInput(unsigned int width, unsigned int height) :
   frame_num_(0),
   width_(width),
-  height_(height) {
+  height_(height),
+  pool_(),
+  dropped_frames_(0) {
   if (width_ == 0 || height_ == 0) {
     width_ = ScaledWidth;
     height_ = ScaledHeight;
   }
+
+  pool_.reset(new BufferPool((width_ * height_ * 3) / 2, FramePoolSize));
 }
 
 TestInput::~TestInput() {}
@@ -64,24 +68,34 @@ vca::core::video::Formats TestInput::GetOutputFormats() const {
 }
 
 bool TestInput::ReadFrame(Frame &frame) {
+  frame.Release();
   frame.timestamp = static_cast<uint64_t>(frame_num_) * (1000000000UL * ScaledFrameRate.den) / ScaledFrameRate.num;
 
   const unsigned int buffer_size = (width_ * height_ * 3) / 2;
 
   // Create an image with object moving in a looping pattern in the foreground
-  uint8_t *const data = new uint8_t[buffer_size];
+  uint8_t *const data = pool_->Acquire();
+  if (!data) {
+    frame.input_buffers.push_back(vca::core::video::Buffer{0, nullptr, 0, {}, {}});
+    dropped_frames_++;
+    frame_num_++;
+    return true;
+  }
+
   const int object_size = 64;
   GenerateFrameData(data, width_, height_, width_, {
       static_cast<int>(cosf(M_PI * frame_num_ / 200.0f) * width_ * 0.25f + width_ / 2 - object_size / 2),
       static_cast<int>(sinf(M_PI * frame_num_ / 100.0f) * height_ * 0.25f + height_ / 2 - object_size / 2),
       object_size});
 
-  frame.input_buffers = vca::core::video::Buffers{vca::core::video::Buffer{buffer_size, data, 1,
-      {vca::core::video::Buffer::Plane{buffer_size, 0, static_cast<ptrdiff_t>(width_)}},
-      [data]() { delete[] data; }}};
-  frame.output_buffers = vca::core::video::Buffers{};
+  frame.input_buffers.push_back(pool_->MakeBuffer(data, 1,
+      {vca::core::video::Buffer::Plane{buffer_size, 0, static_cast<ptrdiff_t>(width_)}}));
 
   frame_num_++;
 
   return true;
 }
+
+VideoInput::Statistics TestInput::GetStatistics() const {
+  return Statistics{frame_num_, frame_num_ - dropped_frames_, dropped_frames_};
+}
@@ -9,6 +9,7 @@
 
 #include <memory>
 
+#include "buffer_pool.hpp"
 #include "video_input.hpp"
 
 class TestInput final : public VideoInput {
@@ -28,7 +29,11 @@ class TestInput final : public VideoInput {
 
   bool ReadFrame(Frame &frame);
 
+  Statistics GetStatistics() const;
+
  private:
   unsigned int frame_num_;
   unsigned int width_, height_;
+  std::unique_ptr<BufferPool> pool_;
+  uint64_t dropped_frames_;
 };
@@ -8,6 +8,79 @@
 
 #include "video_input.hpp"
 
-VideoInput::VideoInput() {}
+static void ReleaseBuffers(vca::core::video::Buffers &buffers) {
+  for (auto &buffer : buffers) {
+    if (buffer.unreference)
+      buffer.unreference();
+  }
+  buffers.clear();
+}
+
+VideoInput::Frame::Frame() :
+  input_buffers(),
+  output_buffers(),
+  timestamp(0),
+  materialize_() {}
+
+VideoInput::Frame::Frame(Frame &&src) :
+  input_buffers(std::move(src.input_buffers)),
+  output_buffers(std::move(src.output_buffers)),
+  timestamp(src.timestamp),
+  materialize_(std::move(src.materialize_)) {
+  src.materialize_ = nullptr;
+  src.input_buffers.clear();
+  src.output_buffers.clear();
+}
+
+VideoInput::Frame::~Frame() {
+  Release();
+}
+
+VideoInput::Frame& VideoInput::Frame::operator=(Frame &&src) {
+  if (this != &src) {
+    Release();
+    input_buffers = std::move(src.input_buffers);
+    output_buffers = std::move(src.output_buffers);
+    timestamp = src.timestamp;
+    materialize_ = std::move(src.materialize_);
+    src.materialize_ = nullptr;
+    src.input_buffers.clear();
+    src.output_buffers.clear();
+  }
+  return *this;
+}
+
+void VideoInput::Frame::Release() {
+  // Deferred work may still reference the buffers, so drop it first
+  if (materialize_) {
+    const std::function<void(bool)> materialize = std::move(materialize_);
+    materialize_ = nullptr;
+    materialize(false);
+  }
+
+  ReleaseBuffers(input_buffers);
+  ReleaseBuffers(output_buffers);
+}
+
+void VideoInput::Frame::Materialize() {
+  if (materialize_) {
+    const std::function<void(bool)> materialize = std::move(materialize_);
+    materialize_ = nullptr;
+    materialize(true);
+  }
+}
+
+VideoInput::VideoInput() :
+  required_buffers_(AllBuffers) {}
 
 VideoInput::~VideoInput() {}
+
+void VideoInput::ReportConsumerLatency(std::chrono::nanoseconds) {}
+
+void VideoInput::SetRequiredBuffers(unsigned int buffers) {
+  required_buffers_ = buffers;
+}
+
+void VideoInput::DeferMaterialization(Frame &frame, std::function<void(bool)> materialize) {
+  frame.materialize_ = std::move(materialize);
+}
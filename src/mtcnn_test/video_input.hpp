@@ -7,8 +7,10 @@
  * @brief      Declaration of the @c VideoInput class.
  */
 
+#include <chrono>
 #include <cstddef>
 #include <cstdint>
+#include <functional>
 #include <utility>
 
 #include <vca/core_sdk/video/buffers.hpp>
@@ -19,6 +21,18 @@ class VideoInput {
  public:
   static constexpr const unsigned int BufferTypeCount = 3;
 
+  /// Number of frames an input can have outstanding at once. Once all are held
+  /// by consumers the input drops frames rather than allocating more.
+  static constexpr const unsigned int FramePoolSize = 4;
+
+  enum BufferFlags : unsigned int {
+    CodedBuffer = 0x1,    ///< The compressed input in @c Frame::output_buffers
+    DecodedBuffer = 0x2,  ///< The full-size decoded image in @c Frame::input_buffers
+    ScaledBuffer = 0x4,   ///< The NV12 analytics image, last in @c Frame::input_buffers
+    AllBuffers = CodedBuffer | DecodedBuffer | ScaledBuffer,
+    LazyScaling = 0x8,    ///< Defer scaling until @c Frame::Materialize is called
+  };
+
   static constexpr const vca::media::FrameRate ScaledFrameRate = {15, 1}; // fps
   #if 0
   static constexpr const unsigned int ScaledWidth = 360;
@@ -38,9 +52,45 @@ class VideoInput {
   #endif
 
  public:
+  /**
+   * A frame owns references to the buffers the input handed out and releases
+   * them when it is destroyed, reused by @c ReadFrame or explicitly released.
+   * Reusing one frame across reads also keeps its buffer lists allocated.
+   */
   struct Frame {
+    Frame();
+
+    Frame(Frame &&src);
+
+    ~Frame();
+
+    Frame& operator=(Frame &&src);
+
+    /// Returns all buffers to the input that produced them.
+    void Release();
+
+    /// Fills any buffers whose contents the input deferred. Must be called on the
+    /// thread that reads frames, before the deferred contents are accessed.
+    void Materialize();
+
     vca::core::video::Buffers input_buffers, output_buffers;
     uint64_t timestamp;
+
+   private:
+    Frame(const Frame&) = delete;
+    Frame& operator=(const Frame&) = delete;
+
+   private:
+    friend class VideoInput;
+
+    /// Called with true to fill the deferred buffers, or false to drop them.
+    std::function<void(bool)> materialize_;
+  };
+
+  struct Statistics {
+    uint64_t decoded_frames;    ///< Frames produced by the decoder
+    uint64_t delivered_frames;  ///< Frames delivered with an analytics (scaled) image
+    uint64_t skipped_frames;    ///< Frames discarded by the decoder or for lack of a free buffer
   };
 
  protected:
@@ -60,6 +110,27 @@ class VideoInput {
 
   virtual bool ReadFrame(Frame &frame) = 0;
 
+  /**
+   * Reports how long the consumer took to process the last analytics frame, so
+   * inputs that can shed decode work while the consumer is behind can do so.
+   */
+  virtual void ReportConsumerLatency(std::chrono::nanoseconds latency);
+
+  virtual Statistics GetStatistics() const = 0;
+
+  /**
+   * Declares which buffers the consumer reads, as @c BufferFlags. Buffers that
+   * aren't required are left empty in each frame and are never referenced or
+   * converted. Inputs that can't skip a buffer may still fill it.
+   */
+  virtual void SetRequiredBuffers(unsigned int buffers);
+
+ protected:
+  static void DeferMaterialization(Frame &frame, std::function<void(bool)> materialize);
+
+ protected:
+  unsigned int required_buffers_;
+
  private:
   VideoInput& operator=(const VideoInput&) = delete;
   VideoInput& operator=(VideoInput&&) = delete;
@@ -12,3 +12,8 @@ VideoOutput::VideoOutput(unsigned int width, unsigned int height) :
   buffer_size_((3 * width * height) / 2) {}
 
 VideoOutput::~VideoOutput() {}
+
+void VideoOutput::PushFrames(const uint8_t *const *buffers, size_t count) {
+  for (size_t i = 0; i != count; i++)
+    PushFrame(buffers[i]);
+}
@@ -18,6 +18,9 @@ class VideoOutput {
 
   virtual void PushFrame(const uint8_t *buffer_data) = 0;
 
+  /// Pushes several frames in order. Outputs that can write them together override this.
+  virtual void PushFrames(const uint8_t *const *buffers, size_t count);
+
  protected:
   size_t buffer_size_;
 };